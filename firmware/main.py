@@ -1,11 +1,19 @@
 import argparse
 import asyncio
 import datetime
+import hashlib
 import json
 import netrc
+import os
 import ssl
+import struct
 import subprocess
+import sys
+import time
+import zlib
 from collections import defaultdict
+from dataclasses import dataclass, field
+from pathlib import Path
 
 import aiomqtt
 import toml
@@ -35,6 +43,194 @@ def create_client(args):
     )
 
 
+def decode_cbor(data):
+    """
+    Decode the subset of CBOR produced by the firmware's encoder (cbor.c).
+    Decimal fractions are decoded as floats.
+    """
+
+    def item(k):
+        major, info = data[k] >> 5, data[k] & 0x1F
+        k += 1
+        if info < 24:
+            arg = info
+        elif info <= 27:
+            n = 1 << (info - 24)
+            arg = int.from_bytes(data[k : k + n], "big")
+            k += n
+        else:
+            raise ValueError(f"unsupported CBOR item 0x{data[k - 1]:02x}")
+
+        if major == 0:
+            return arg, k
+        elif major == 1:
+            return -1 - arg, k
+        elif major == 2:
+            return data[k : k + arg], k + arg
+        elif major == 3:
+            return data[k : k + arg].decode(), k + arg
+        elif major == 4:
+            value = []
+            for _ in range(arg):
+                v, k = item(k)
+                value.append(v)
+            return value, k
+        elif major == 5:
+            value = {}
+            for _ in range(arg):
+                key, k = item(k)
+                value[key], k = item(k)
+            return value, k
+        elif major == 6:
+            value, k = item(k)
+            if arg == 4:
+                exponent, mantissa = value
+                value = mantissa * 10.0**exponent
+            return value, k
+        elif info == 27:
+            return struct.unpack(">d", arg.to_bytes(8, "big"))[0], k
+        else:
+            return {20: False, 21: True, 22: None}[arg], k
+
+    return item(0)[0]
+
+
+def decode_payload(payload):
+    """Decode a JSON or CBOR payload, as selected by the device's config."""
+    if payload[:1] in (b"{", b"["):
+        return json.loads(payload)
+    else:
+        return decode_cbor(payload)
+
+
+class Inbox:
+    """
+    Dispatches messages received on device topics to a queue per device and
+    topic, e.g. `inbox.get(mac, "metrics")`.
+    """
+
+    def __init__(self):
+        self.queues = defaultdict(asyncio.Queue)
+
+    def get(self, mac, topic):
+        return self.queues[mac, topic]
+
+    async def run(self, messages):
+        async for message in messages:
+            _, _, mac, *rest = str(message.topic).split("/")
+            self.queues[mac, "/".join(rest)].put_nowait(message.payload)
+
+
+async def wait_for(queue, predicate, timeout, decode=decode_payload):
+    """
+    Wait for a message on the queue that satisfies the predicate, returning
+    the decoded message. Messages that cannot be decoded are skipped.
+    """
+    async with asyncio.timeout(timeout):
+        while True:
+            try:
+                value = decode(await queue.get())
+            except (ValueError, IndexError, KeyError):
+                continue
+            if predicate(value):
+                return value
+
+
+@dataclass
+class Row:
+    status: str = "pending"
+    start: float | None = None
+    end: float | None = None
+
+    def elapsed(self):
+        if self.start is None:
+            return ""
+        return f"{(self.end or time.monotonic()) - self.start:.1f}s"
+
+
+class ProgressTable:
+    """
+    Live status of a rollout, one row per device. When stdout is a terminal
+    the table is redrawn in place, otherwise status changes are printed as
+    they happen.
+    """
+
+    def __init__(self, devices):
+        self.rows = {mac: Row() for mac in devices}
+        self.tty = sys.stdout.isatty()
+        self.drawn = 0
+
+    def update(self, mac, status):
+        row = self.rows[mac]
+        if row.start is None:
+            row.start = time.monotonic()
+        row.status = status
+        if not self.tty:
+            print(f"{mac}: {status}")
+
+    def finish(self, mac, status):
+        self.update(mac, status)
+        self.rows[mac].end = time.monotonic()
+
+    def draw(self):
+        if not self.tty:
+            return
+        if self.drawn:
+            sys.stdout.write(f"\x1b[{self.drawn}F")
+        for mac, row in self.rows.items():
+            sys.stdout.write(f"\x1b[2K{mac}  {row.status:<40} {row.elapsed():>8}\n")
+        sys.stdout.flush()
+        self.drawn = len(self.rows)
+
+    async def run(self):
+        while True:
+            self.draw()
+            await asyncio.sleep(0.5)
+
+
+async def rollout(devices, action, parallel, canary):
+    """
+    Run `action(mac, report)` on every device, at most `parallel` at a time.
+    The first `canary` devices go first, and the rest of the fleet is only
+    touched if all of them succeed. Returns whether all devices succeeded.
+    """
+    devices = list(devices)
+    table = ProgressTable(devices)
+    semaphore = asyncio.Semaphore(parallel)
+
+    async def run(mac):
+        async with semaphore:
+            table.update(mac, "starting")
+            try:
+                status = await action(mac, lambda status: table.update(mac, status))
+            except Exception as e:
+                table.finish(mac, f"failed: {e or type(e).__name__}")
+                return False
+            table.finish(mac, status)
+            return True
+
+    drawer = asyncio.create_task(table.run())
+    try:
+        canaries, rest = devices[:canary], devices[canary:]
+        ok = all(await asyncio.gather(*map(run, canaries)))
+        if ok:
+            ok = all(await asyncio.gather(*map(run, rest)))
+        else:
+            for mac in rest:
+                table.update(mac, "skipped, canary failed")
+    finally:
+        drawer.cancel()
+        table.draw()
+    return ok
+
+
+def select_devices(args, config):
+    if args.mac:
+        return args.mac
+    else:
+        return config["devices"].keys()
+
+
 async def send_config(args):
     with open(args.config) as f:
         config = toml.load(f)
@@ -43,17 +239,49 @@ async def send_config(args):
     defaults = config.get("defaults", {})
 
     async with create_client(args) as client:
-        if args.mac:
-            devices = args.mac
-        else:
-            devices = config["devices"].keys()
+        async with client.messages() as messages:
+            inbox = Inbox()
+            dispatcher = asyncio.create_task(inbox.run(messages))
+            await client.subscribe("calan-mai/lights/+/config")
+            await client.subscribe("calan-mai/lights/+/peers")
+
+            async def configure(mac, report):
+                device_config = defaults | config["devices"][mac]
+                await client.publish(
+                    f"calan-mai/lights/{mac}/config/set",
+                    json.dumps(device_config),
+                )
+                await client.publish(
+                    f"calan-mai/lights/{mac}/peers/set", json.dumps(peers)
+                )
+                # Only devices with Ruuvi support use the tag registry, so
+                # it is not waited for.
+                if "tags" in config:
+                    await client.publish(
+                        f"calan-mai/lights/{mac}/ruuvi/tags/set",
+                        json.dumps(config["tags"]),
+                    )
+
+                # Devices republish their config and peers once applied.
+                report("waiting for config")
+                await wait_for(
+                    inbox.get(mac, "config"), lambda c: c == device_config, args.timeout
+                )
+                report("waiting for peers")
+                await wait_for(
+                    inbox.get(mac, "peers"),
+                    lambda p: sorted(p) == sorted(peers),
+                    args.timeout,
+                )
+                return "configured"
 
-        for mac in devices:
-            await client.publish(
-                f"calan-mai/lights/{mac}/config/set",
-                json.dumps(defaults | config["devices"][mac]),
-            )
-            await client.publish(f"calan-mai/lights/{mac}/peers/set", json.dumps(peers))
+            try:
+                ok = await rollout(
+                    select_devices(args, config), configure, args.parallel, args.canary
+                )
+            finally:
+                dispatcher.cancel()
+    sys.exit(0 if ok else 1)
 
 
 async def send_firmware(args):
@@ -81,54 +309,517 @@ async def send_firmware(args):
     with open(args.firmware, "rb") as f:
         firmware = f.read()
 
-    if args.mac:
-        devices = args.mac
-    else:
-        devices = config["devices"].keys()
+    archive_image(firmware)
+    version = image_version(firmware)
+    devices = select_devices(args, config)
 
     async with create_client(args) as client:
-        for mac in devices:
-            await client.publish(f"calan-mai/lights/{mac}/ota/firmware", firmware)
+        if args.whole:
+            for mac in devices:
+                await client.publish(f"calan-mai/lights/{mac}/ota/firmware", firmware)
+            return
+
+        async with client.messages() as messages:
+            inbox = Inbox()
+            dispatcher = asyncio.create_task(inbox.run(messages))
+            await client.subscribe("calan-mai/lights/+/firmware/progress", qos=1)
+            await client.subscribe("calan-mai/lights/+/metrics")
+
+            async def update(mac, report):
+                sent = await send_firmware_chunked(
+                    client,
+                    inbox.get(mac, "firmware/progress"),
+                    mac,
+                    firmware,
+                    args.encoding,
+                    report,
+                )
+                if not sent:
+                    return "up to date"
+
+                # Devices publish their metrics as soon as they reconnect.
+                report("restarting")
+                await wait_for(
+                    inbox.get(mac, "metrics"),
+                    lambda m: m.get("firmware", {}).get("version") == version,
+                    args.timeout,
+                )
+                return f"running {version}"
+
+            try:
+                ok = await rollout(devices, update, args.parallel, args.canary)
+            finally:
+                dispatcher.cancel()
+    sys.exit(0 if ok else 1)
+
+
+# How long to wait for a progress report before resynchronising with the
+# device, and how many times to do so before giving up.
+OTA_TIMEOUT = 5
+OTA_RETRIES = 10
+
+
+# Every image sent is kept here, named after its digest, so that later
+# updates can be sent as a delta against it.
+IMAGES = Path("images")
+
+# Length of the blocks used to find matches between the base and target
+# images of a delta.
+DELTA_BLOCK = 16
+
+
+def image_digest(firmware):
+    # The image's SHA-256 is appended to it by esptool. This is also what the
+    # device reports for its running partition.
+    return firmware[-32:].hex()
+
+
+def image_version(firmware):
+    # The app description follows the image and first segment headers.
+    magic, version = struct.unpack_from("<I12x32s", firmware, 32)
+    if magic != 0xABCD5432:
+        raise ValueError("cannot find app description in firmware image")
+    return version.split(b"\0")[0].decode()
+
+
+def archive_image(firmware):
+    IMAGES.mkdir(exist_ok=True)
+    (IMAGES / f"{image_digest(firmware)}.bin").write_bytes(firmware)
+
+
+def make_delta(base, target):
+    """
+    Compute a delta from base to target, in the format described in
+    image_decoder.c. Builds usually only differ in a few places, with most of
+    the image merely shifted around, so greedily matching blocks of the
+    target against an index of the base is good enough.
+    """
+    index = {}
+    for i in range(0, len(base) - DELTA_BLOCK + 1, 4):
+        index.setdefault(base[i : i + DELTA_BLOCK], i)
+
+    out = bytearray()
+
+    def insert(data):
+        if data:
+            out.extend(struct.pack("<BI", 1, len(data)))
+            out.extend(data)
+
+    literal = j = 0
+    while j + DELTA_BLOCK <= len(target):
+        i = index.get(target[j : j + DELTA_BLOCK])
+        if i is None:
+            j += 1
+            continue
+
+        while i > 0 and j > literal and base[i - 1] == target[j - 1]:
+            i -= 1
+            j -= 1
+        n = 0
+        while i + n < len(base) and j + n < len(target) and base[i + n] == target[j + n]:
+            n += 1
+
+        insert(target[literal:j])
+        out.extend(struct.pack("<BII", 0, i, n))
+        j += n
+        literal = j
+
+    insert(target[literal:])
+    return zlib.compress(bytes(out), 9)
+
+
+def encode_image(firmware, running, encoding):
+    """
+    Pick how to send the image to a device running the given image. Devices
+    that do not advertise their running image predate compressed images.
+    """
+    if running is None:
+        return firmware, {}
+
+    base = IMAGES / f"{running}.bin"
+    if encoding in ("auto", "delta") and base.exists():
+        delta = make_delta(base.read_bytes(), firmware)
+        return delta, {"encoding": "delta", "base": running}
+    elif encoding == "delta":
+        print(f"{running} is not in {IMAGES}, falling back to zlib")
+
+    if encoding in ("auto", "zlib", "delta"):
+        return zlib.compress(firmware, 9), {"encoding": "zlib"}
+    else:
+        return firmware, {}
+
+
+async def send_firmware_chunked(client, progress, mac, firmware, encoding, report):
+    """
+    Send a firmware image in chunks, following the protocol described in
+    chunked_ota.c. The device acknowledges every chunk with the offset it has
+    written up to, which is used to resume after a drop and to limit the
+    amount of data in flight. Returns False if the device was already
+    running the image.
+    """
+    prefix = f"calan-mai/lights/{mac}/firmware"
+
+    # Idle devices advertise their running image in a retained message.
+    running = None
+    try:
+        async with asyncio.timeout(OTA_TIMEOUT):
+            while running is None:
+                running = json.loads(await progress.get()).get("running")
+    except TimeoutError:
+        pass
+
+    if running == image_digest(firmware):
+        return False
+
+    image, params = encode_image(firmware, running, encoding)
+    encoding = params.get("encoding", "raw")
+
+    image_id = hashlib.sha256(image).hexdigest()
+    begin = json.dumps({"id": image_id, "size": len(image)} | params)
+
+    chunk_size = None
+    window = 0
+    acked = sent = 0
+    rewound = False
+    ended = False
+    retries = 0
+
+    await client.publish(f"{prefix}/begin", begin, qos=1)
+    while True:
+        while chunk_size is not None and sent < len(image) and sent - acked < window:
+            data = image[sent : sent + chunk_size]
+            header = struct.pack("<II", sent, zlib.crc32(data))
+            await client.publish(f"{prefix}/chunk", header + data, qos=1)
+            sent += len(data)
+
+        try:
+            async with asyncio.timeout(OTA_TIMEOUT):
+                p = json.loads(await progress.get())
+        except TimeoutError:
+            if ended:
+                # The device restarts shortly after finalizing the image, and
+                # the last progress report may not make it out.
+                return True
+            retries += 1
+            if retries > OTA_RETRIES:
+                raise RuntimeError("OTA timed out")
+            report(f"no progress, resuming from {acked}")
+            sent = acked
+            await client.publish(f"{prefix}/begin", begin, qos=1)
+            continue
+
+        if p["status"] == "error":
+            raise RuntimeError(p["error"])
+        elif p["status"] == "done":
+            return True
+        elif p.get("id") != image_id:
+            continue
+
+        retries = 0
+        chunk_size = p["chunk_size"]
+        window = p["window"]
+        if p["offset"] > acked:
+            acked = p["offset"]
+            rewound = False
+            report(f"sending {encoding}, {100 * acked // len(image)}% of {len(image)}")
+        elif sent > acked and not rewound:
+            # A chunk got dropped or corrupted, and the device is rejecting
+            # everything after it. Start again from what it has written.
+            sent = acked
+            rewound = True
+
+        if acked == len(image) and not ended:
+            await client.publish(f"{prefix}/end", qos=1)
+            ended = True
+
+
+def channel_topic(channel, topic):
+    """
+    Device topic of a light channel. The first channel keeps the topics of
+    single-channel boards.
+    """
+    return topic if channel == 0 else f"{channel}/{topic}"
+
+
+def group_key(channel):
+    """Config key of the group of a light channel, as in light.c."""
+    return "group" if channel == 0 else f"group{channel}"
 
 
 async def send_command(args):
     with open(args.config) as f:
         config = toml.load(f)
 
-    if args.mac:
-        devices = args.mac
+    state_topic = channel_topic(args.channel, "state")
+    command_topic = channel_topic(args.channel, "command")
+
+    if args.group is not None:
+        # Devices belong to a group through any of their channels.
+        defaults = config.get("defaults", {})
+        devices = [
+            mac
+            for mac, device in config["devices"].items()
+            if any(
+                key == "group" or (key.startswith("group") and key[5:].isdigit())
+                for key, value in (defaults | device).items()
+                if value == args.group
+            )
+        ]
     else:
-        devices = config["devices"].keys()
+        devices = select_devices(args, config)
 
     async with create_client(args) as client:
-        for mac in devices:
-            await client.publish(f"calan-mai/lights/{mac}/command", args.value)
+        async with client.messages() as messages:
+            inbox = Inbox()
+            dispatcher = asyncio.create_task(inbox.run(messages))
+            await client.subscribe(f"calan-mai/lights/+/{state_topic}")
+            await client.subscribe("calan-mai/lights/+/metrics")
+
+            async def command(mac, report):
+                sent_at = time.monotonic()
+                if args.group is None:
+                    await client.publish(
+                        f"calan-mai/lights/{mac}/{command_topic}", args.value
+                    )
+
+                if args.value == "restart":
+                    # Metrics are published on connection, with an uptime
+                    # more recent than the command.
+                    report("restarting")
+                    await wait_for(
+                        inbox.get(mac, "metrics"),
+                        lambda m: m["millis"] / 1000 < time.monotonic() - sent_at,
+                        args.timeout,
+                    )
+                    return "restarted"
+                else:
+                    report("waiting for state")
+                    await wait_for(
+                        inbox.get(mac, state_topic),
+                        lambda s: s == args.value,
+                        args.timeout,
+                        decode=bytes.decode,
+                    )
+                    return args.value
+
+            if args.group is not None:
+                # A single message switches the whole group. Every member is
+                # then watched for its new state.
+                await client.publish(
+                    f"calan-mai/groups/{args.group}/command", args.value, qos=1
+                )
+                args.canary = 0
 
+            try:
+                ok = await rollout(devices, command, args.parallel, args.canary)
+            finally:
+                dispatcher.cancel()
+    sys.exit(0 if ok else 1)
 
-async def cleanup(args):
+
+async def dump(args):
+    """
+    Ask a device for one of its on-demand reports, and print it.
+    """
+    topic = f"calan-mai/lights/{args.mac}/{args.report}"
     async with create_client(args) as client:
-        offline = set()
-        topics = defaultdict(list)
         async with client.messages() as messages:
-            await client.subscribe("calan-mai/lights/+/#")
+            await client.subscribe(topic)
+            await client.publish(f"{topic}/dump")
+            async with asyncio.timeout(args.timeout):
+                async for message in messages:
+                    if args.report == "heap":
+                        print(json.dumps(json.loads(message.payload), indent=2))
+                    else:
+                        sys.stdout.write(message.payload.decode())
+                    break
+
+
+@dataclass
+class Device:
+    """
+    What the broker knows of a device: its retained topics, and whatever it
+    published live while the fleet was observed.
+    """
+
+    status: str | None = None
+    # Light state by channel.
+    states: dict = field(default_factory=dict)
+    config: dict | None = None
+    peers: list | None = None
+    # Firmware report, retained and refreshed with every metrics publication.
+    firmware: dict | None = None
+    metrics: dict | None = None
+    retained: list = field(default_factory=list)
+    last_seen: float | None = None
+
+    def version(self):
+        if self.metrics is not None:
+            return self.metrics.get("firmware", {}).get("version")
+        if self.firmware is not None:
+            return self.firmware.get("version")
+        return None
+
+    def groups(self):
+        """Group of each channel, as far as the config names them."""
+        config = self.config or {}
+        channels = max(self.states, default=0) + 1
+        return [
+            config.get(group_key(channel), "-") for channel in range(channels)
+        ]
+
+    def staleness(self):
+        if self.last_seen is not None:
+            return f"{time.monotonic() - self.last_seen:.0f}s ago"
+        # The time is only reported once the device's clock is set.
+        if self.firmware is not None and "time" in self.firmware:
+            return f"{time.time() - self.firmware['time']:.0f}s ago"
+        return "retained only"
+
+
+class Fleet:
+    """Per-device model of the fleet, indexed by MAC address."""
+
+    def __init__(self):
+        self.devices = defaultdict(Device)
+
+    def add(self, message):
+        _, _, mac, *rest = str(message.topic).split("/")
+        device = self.devices[mac]
+        if message.retain:
+            device.retained.append(str(message.topic))
+        else:
+            device.last_seen = time.monotonic()
+
+        # State topics are prefixed with their channel, but for the first's.
+        channel = 0
+        if len(rest) == 2 and rest[0].isdigit() and rest[1] == "state":
+            channel = int(rest.pop(0))
+        topic = "/".join(rest)
+
+        try:
+            if topic == "state":
+                device.states[channel] = message.payload.decode()
+            elif topic == "status":
+                device.status = message.payload.decode()
+            elif topic == "config":
+                device.config = decode_payload(message.payload)
+            elif topic == "peers":
+                device.peers = decode_payload(message.payload)
+            elif topic == "firmware":
+                device.firmware = decode_payload(message.payload)
+            elif topic == "metrics":
+                device.metrics = decode_payload(message.payload)
+        except (ValueError, IndexError, KeyError):
+            pass
+
+
+async def snapshot(client, messages, idle, listen=0):
+    """
+    Collect the retained messages of every device into a Fleet, returning it
+    and how long the retained burst took to arrive.
+
+    MQTT doesn't mark the end of the retained messages sent on subscribing,
+    so a marker is published right after subscribing: the broker delivers it
+    after them. Should it get lost, the burst is also considered over once
+    nothing arrived for `idle` seconds. Live messages are then collected for
+    another `listen` seconds, e.g. to hear metrics.
+    """
+    fleet = Fleet()
+    marker = f"calan-mai/lights/_snapshot/{os.urandom(8).hex()}"
+    queue = asyncio.Queue()
+
+    async def receive():
+        async for message in messages:
+            queue.put_nowait(message)
+
+    receiver = asyncio.create_task(receive())
+    try:
+        start = time.monotonic()
+        await client.subscribe("calan-mai/lights/+/#", qos=1)
+        await client.publish(marker, qos=1)
+        while True:
             try:
-                async with asyncio.timeout(0.5):
-                    async for message in messages:
-                        mac = str(message.topic).split("/")[2]
-                        trailing = str(message.topic).split("/")[3:]
-                        topics[mac].append(str(message.topic))
-                        if trailing == ["status"] and message.payload == b"Offline":
-                            mac = str(message.topic).split("/")[2]
-                            offline.add(mac)
-
+                message = await asyncio.wait_for(queue.get(), idle)
+            except TimeoutError:
+                print("snapshot: end of retained messages not seen, timed out")
+                break
+            if str(message.topic) == marker:
+                break
+            fleet.add(message)
+        elapsed = time.monotonic() - start
+
+        if listen > 0:
+            try:
+                async with asyncio.timeout(listen):
+                    while True:
+                        message = await queue.get()
+                        if str(message.topic) != marker:
+                            fleet.add(message)
             except TimeoutError:
                 pass
+    finally:
+        receiver.cancel()
 
-            for mac in offline:
-                for t in topics[mac]:
-                    await client.publish(t, None, retain=True)
+    return fleet, elapsed
 
-        pass
+
+async def inventory(args):
+    async with create_client(args) as client:
+        async with client.messages() as messages:
+            fleet, elapsed = await snapshot(client, messages, args.idle, args.listen)
+
+    retained = sum(len(device.retained) for device in fleet.devices.values())
+    print(
+        f"{len(fleet.devices)} devices, {retained} retained messages,"
+        f" snapshot in {elapsed:.2f}s"
+    )
+    for mac, device in sorted(fleet.devices.items()):
+        states = "/".join(
+            device.states.get(channel, "?")
+            for channel in range(max(device.states, default=0) + 1)
+        )
+        groups = "/".join(map(str, device.groups()))
+        peers = len(device.peers) if device.peers is not None else "?"
+        print(
+            f"{mac}  {device.status or '?':<8}{states:<8}"
+            f" version {device.version() or '?':<20}"
+            f" group {groups:<6} peers {peers:<4}"
+            f" {device.staleness()}"
+        )
+
+
+async def cleanup(args):
+    """
+    Clear the retained topics of offline devices, so that they disappear
+    from the fleet.
+    """
+    async with create_client(args) as client:
+        async with client.messages() as messages:
+            fleet, elapsed = await snapshot(client, messages, args.idle)
+
+        offline = [
+            mac for mac, device in fleet.devices.items() if device.status == "Offline"
+        ]
+        topics = [topic for mac in offline for topic in fleet.devices[mac].retained]
+        print(
+            f"snapshot of {len(fleet.devices)} devices in {elapsed:.2f}s,"
+            f" {len(offline)} offline with {len(topics)} retained topics"
+        )
+        for mac in sorted(offline):
+            print(f"  {mac}")
+        if args.dry_run:
+            return
+
+        semaphore = asyncio.Semaphore(args.parallel)
+
+        async def clear(topic):
+            async with semaphore:
+                await client.publish(topic, None, qos=1, retain=True)
+
+        start = time.monotonic()
+        await asyncio.gather(*map(clear, topics))
+        print(f"cleared {len(topics)} topics in {time.monotonic() - start:.2f}s")
 
 
 async def main():
@@ -141,35 +832,100 @@ async def main():
 
     subparsers = parser.add_subparsers(required=True)
 
+    def add_rollout_arguments(p):
+        p.add_argument("--config", default="config.toml")
+        p.add_argument(
+            "--parallel", type=int, default=8, help="devices to update concurrently"
+        )
+        p.add_argument(
+            "--canary",
+            type=int,
+            default=1,
+            help="devices to update first, before the rest of the fleet",
+        )
+        p.add_argument(
+            "--timeout",
+            type=float,
+            default=90,
+            help="how long to wait for a device to confirm the change",
+        )
+        p.add_argument("mac", nargs="*")
+
     p = subparsers.add_parser("ota")
     p.set_defaults(func=send_firmware)
     p.add_argument("--no-build", action="store_true")
-    p.add_argument("--config", default="config.toml")
+    p.add_argument(
+        "--encoding",
+        choices=["auto", "raw", "zlib", "delta"],
+        default="auto",
+        help="delta is only used if the device's running image is in images/",
+    )
+    p.add_argument(
+        "--whole",
+        action="store_true",
+        help="send the image as a single message, for devices without chunked OTA",
+    )
     p.add_argument("--firmware", default="build/light-control.bin")
-    p.add_argument("mac", nargs="*")
+    add_rollout_arguments(p)
 
     p = subparsers.add_parser("config")
     p.set_defaults(func=send_config)
-    p.add_argument("--config", default="config.toml")
-    p.add_argument("mac", nargs="*")
+    add_rollout_arguments(p)
 
     p = subparsers.add_parser("restart")
-    p.set_defaults(func=send_command, value="restart")
-    p.add_argument("--config", default="config.toml")
-    p.add_argument("mac", nargs="*")
+    p.set_defaults(func=send_command, value="restart", group=None, channel=0)
+    add_rollout_arguments(p)
 
     p = subparsers.add_parser("on")
     p.set_defaults(func=send_command, value="ON")
-    p.add_argument("--config", default="config.toml")
-    p.add_argument("mac", nargs="*")
+    p.add_argument("--group", type=int, help="switch a whole group at once")
+    p.add_argument("--channel", type=int, default=0, help="light channel")
+    add_rollout_arguments(p)
 
     p = subparsers.add_parser("off")
     p.set_defaults(func=send_command, value="OFF")
-    p.add_argument("--config", default="config.toml")
-    p.add_argument("mac", nargs="*")
+    p.add_argument("--group", type=int, help="switch a whole group at once")
+    p.add_argument("--channel", type=int, default=0, help="light channel")
+    add_rollout_arguments(p)
+
+    p = subparsers.add_parser("log", help="print a device's deferred log buffer")
+    p.set_defaults(func=dump, report="log")
+    p.add_argument("--timeout", type=float, default=10)
+    p.add_argument("mac")
+
+    p = subparsers.add_parser("heap", help="print a device's heap report")
+    p.set_defaults(func=dump, report="heap")
+    p.add_argument("--timeout", type=float, default=10)
+    p.add_argument("mac")
+
+    def add_snapshot_arguments(p):
+        p.add_argument(
+            "--idle",
+            type=float,
+            default=2,
+            help="seconds without messages after which the snapshot is complete,"
+            " should the broker not confirm it",
+        )
 
-    p = subparsers.add_parser("cleanup")
+    p = subparsers.add_parser(
+        "inventory", help="list the fleet as known from its retained topics"
+    )
+    p.set_defaults(func=inventory)
+    add_snapshot_arguments(p)
+    p.add_argument(
+        "--listen",
+        type=float,
+        default=0,
+        help="also wait for live metrics, e.g. to tell which devices are up",
+    )
+
+    p = subparsers.add_parser(
+        "cleanup", help="clear the retained topics of offline devices"
+    )
     p.set_defaults(func=cleanup)
+    add_snapshot_arguments(p)
+    p.add_argument("--parallel", type=int, default=32)
+    p.add_argument("--dry-run", action="store_true")
     args = parser.parse_args()
     await args.func(args)
 
@@ -3,15 +3,23 @@
 
 #if CONFIG_RUUVI_ENABLE
 
-#include <esp_gap_ble_api.h>
 #include <esp_event.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Legacy advertisements carry up to 31 bytes of data, extended ones more:
+// manufacturer data up to this length, with the manufacturer ID, is passed
+// on, which takes in Ruuvi format E1 frames.
+#define BLE_MANUFACTURER_DATA_LEN_MAX 64
 
 ESP_EVENT_DECLARE_BASE(BLE_EVENT);
 
 typedef struct ble_event_advertisment_manufacturer_data {
+  uint8_t address[6]; // Most significant byte first
   uint16_t manufacturer_id;
-  uint8_t payload[ESP_BLE_ADV_DATA_LEN_MAX];
+  uint8_t payload[BLE_MANUFACTURER_DATA_LEN_MAX];
   size_t length;
+  int8_t rssi;
 } ble_event_advertisment_manufacturer_data;
 
 enum {
@@ -21,5 +29,15 @@ enum {
 void ble_init();
 void ble_filter_set(uint16_t manufacturer_id);
 void ble_scan_start();
+// Changes the time spent scanning in every scan interval, in units of
+// 0.625ms, restarting the scan if needed.
+void ble_scan_set_window(uint16_t window);
+
+// Called by the scanner backend with the data of every advertisement, and the
+// address of the advertiser, most significant byte first.
+void ble_on_advertisement(const uint8_t *address, const uint8_t *data,
+                          size_t data_len, int8_t rssi);
+// Name of the host stack used by the scanner backend.
+extern const char ble_backend[];
 
 #endif // CONFIG_RUUVI_ENABLE
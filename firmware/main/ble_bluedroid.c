@@ -0,0 +1,115 @@
+#define LOG_LOCAL_LEVEL CONFIG_BLE_LOG_LEVEL
+
+#include "ble.h"
+#include "deferred_log.h"
+#include "esp_gap_ble_api.h"
+#include "heap_accounting.h"
+#include "indicator.h"
+#include <esp_bt.h>
+#include <esp_bt_main.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "ble"
+
+// Scanner backend based on the Bluedroid host stack.
+
+static esp_ble_scan_params_t ble_scan_params = {
+    .scan_type = BLE_SCAN_TYPE_PASSIVE,
+    .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
+    .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
+    .scan_interval = CONFIG_BLE_SCAN_INTERVAL,
+    .scan_window = CONFIG_BLE_SCAN_INTERVAL,
+    .scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE};
+
+static bool ble_scanning = false;
+
+const char ble_backend[] = "bluedroid";
+
+static void on_scan_result(struct ble_scan_result_evt_param *result) {
+  if (result->search_evt == ESP_GAP_SEARCH_INQ_RES_EVT) {
+    ble_on_advertisement(result->bda, result->ble_adv, result->adv_data_len,
+                         result->rssi);
+  }
+}
+
+static void gap_event_handler(esp_gap_ble_cb_event_t event,
+                              esp_ble_gap_cb_param_t *param) {
+  HEAP_SUBSYSTEM(BLE);
+  // metrics_gap_event_handler(event, param);
+
+  esp_err_t err;
+
+  switch (event) {
+  case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
+    ESP_LOGI(TAG, "Parameters set. Start scanning...");
+    // The unit of the duration is second, 0 means scan permanently
+    esp_ble_gap_start_scanning(0);
+    break;
+
+  case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+    // scan start complete event to indicate scan start successfully or failed
+    if ((err = param->scan_start_cmpl.status) != ESP_BT_STATUS_SUCCESS) {
+      ESP_LOGE(TAG, "Scan start failed: %s", esp_err_to_name(err));
+    } else {
+      ESP_LOGI(TAG, "Scan started successfully");
+    }
+    break;
+
+  case ESP_GAP_BLE_SCAN_RESULT_EVT: {
+    int64_t start = esp_timer_get_time();
+    on_scan_result(&param->scan_rst);
+    dlog_callback_time(DLOG_CALLBACK_BLE_SCAN, start);
+    break;
+  }
+
+  case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+    if ((err = param->scan_stop_cmpl.status) != ESP_BT_STATUS_SUCCESS) {
+      ESP_LOGE(TAG, "Scan stop failed: %s", esp_err_to_name(err));
+    } else {
+      ESP_LOGI(TAG, "Stop scan successfully");
+    }
+    // Scanning is only ever stopped to change its parameters. Scanning
+    // restarts once they are set.
+    esp_ble_gap_set_scan_params(&ble_scan_params);
+    break;
+
+  default:
+    break;
+  }
+}
+
+void ble_init() {
+  HEAP_SUBSYSTEM(BLE);
+  ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
+
+  esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(esp_bt_controller_init(&bt_cfg));
+  ESP_ERROR_CHECK(esp_bt_controller_enable(ESP_BT_MODE_BLE));
+
+  ESP_ERROR_CHECK(esp_bluedroid_init());
+  ESP_ERROR_CHECK(esp_bluedroid_enable());
+
+  ESP_ERROR_CHECK(esp_ble_gap_register_callback(gap_event_handler));
+}
+
+void ble_scan_start() {
+  ble_scanning = true;
+  esp_ble_gap_set_scan_params(&ble_scan_params);
+}
+
+void ble_scan_set_window(uint16_t window) {
+  if (window > ble_scan_params.scan_interval) {
+    window = ble_scan_params.scan_interval;
+  }
+  if (window == ble_scan_params.scan_window) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Scan window set to %d/%d", window,
+           ble_scan_params.scan_interval);
+  ble_scan_params.scan_window = window;
+  if (ble_scanning) {
+    esp_ble_gap_stop_scanning();
+  }
+}
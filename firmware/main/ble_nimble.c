@@ -0,0 +1,166 @@
+#define LOG_LOCAL_LEVEL CONFIG_BLE_LOG_LEVEL
+
+#include "ble.h"
+#include "deferred_log.h"
+#include "heap_accounting.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <host/ble_gap.h>
+#include <host/ble_hs.h>
+#include <host/util/util.h>
+#include <nimble/nimble_port.h>
+#include <nimble/nimble_port_freertos.h>
+
+#define TAG "ble"
+
+// Scanner backend based on the NimBLE host stack, using only its observer
+// role. NimBLE is lighter than Bluedroid in both RAM and flash.
+//
+// Scanning can only start once the host and controller are synced. A scan
+// requested before that starts from the sync callback.
+//
+// With CONFIG_BT_NIMBLE_EXT_ADV, the scan is an extended one, which reports
+// both legacy and extended advertisements.
+
+#if CONFIG_BT_NIMBLE_EXT_ADV
+static struct ble_gap_ext_disc_params disc_params = {
+    .itvl = CONFIG_BLE_SCAN_INTERVAL,
+    .window = CONFIG_BLE_SCAN_INTERVAL,
+    .passive = 1,
+};
+#else
+static struct ble_gap_disc_params disc_params = {
+    .itvl = CONFIG_BLE_SCAN_INTERVAL,
+    .window = CONFIG_BLE_SCAN_INTERVAL,
+    .filter_policy = BLE_HCI_SCAN_FILT_NO_WL,
+    .limited = 0,
+    .passive = 1,
+    .filter_duplicates = 0,
+};
+#endif
+
+static uint8_t own_addr_type;
+static bool ble_synced = false;
+static bool ble_scanning = false;
+
+const char ble_backend[] = "nimble";
+
+// NimBLE addresses are least significant byte first.
+static void on_advertisement(const ble_addr_t *addr, const uint8_t *data,
+                             size_t data_len, int8_t rssi) {
+  uint8_t address[6];
+  for (size_t i = 0; i < 6; i++) {
+    address[i] = addr->val[5 - i];
+  }
+  ble_on_advertisement(address, data, data_len, rssi);
+}
+
+static int gap_event_handler(struct ble_gap_event *event, void *arg) {
+  HEAP_SUBSYSTEM(BLE);
+
+  switch (event->type) {
+#if CONFIG_BT_NIMBLE_EXT_ADV
+  case BLE_GAP_EVENT_EXT_DISC: {
+    // Data split over several reports is dropped rather than reassembled;
+    // the Ruuvi formats fit in one.
+    if (event->ext_disc.data_status != BLE_GAP_EXT_ADV_DATA_STATUS_COMPLETE) {
+      break;
+    }
+    int64_t start = esp_timer_get_time();
+    on_advertisement(&event->ext_disc.addr, event->ext_disc.data,
+                     event->ext_disc.length_data, event->ext_disc.rssi);
+    dlog_callback_time(DLOG_CALLBACK_BLE_SCAN, start);
+    break;
+  }
+#endif
+
+  case BLE_GAP_EVENT_DISC: {
+    int64_t start = esp_timer_get_time();
+    on_advertisement(&event->disc.addr, event->disc.data,
+                     event->disc.length_data, event->disc.rssi);
+    dlog_callback_time(DLOG_CALLBACK_BLE_SCAN, start);
+    break;
+  }
+
+  case BLE_GAP_EVENT_DISC_COMPLETE:
+    ESP_LOGI(TAG, "Scan complete, reason %d", event->disc_complete.reason);
+    break;
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+static void start_discovery() {
+#if CONFIG_BT_NIMBLE_EXT_ADV
+  int rc = ble_gap_ext_disc(own_addr_type, /* duration */ 0, /* period */ 0,
+                            /* filter_duplicates */ 0, BLE_HCI_SCAN_FILT_NO_WL,
+                            /* limited */ 0, &disc_params, NULL,
+                            gap_event_handler, NULL);
+#else
+  int rc = ble_gap_disc(own_addr_type, BLE_HS_FOREVER, &disc_params,
+                        gap_event_handler, NULL);
+#endif
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Scan start failed: %d", rc);
+  } else {
+    ESP_LOGI(TAG, "Scan started successfully");
+  }
+}
+
+static void on_sync() {
+  ble_hs_util_ensure_addr(0);
+  if (ble_hs_id_infer_auto(0, &own_addr_type) != 0) {
+    ESP_LOGE(TAG, "cannot determine address type");
+    return;
+  }
+
+  ble_synced = true;
+  if (ble_scanning) {
+    start_discovery();
+  }
+}
+
+static void on_reset(int reason) {
+  ESP_LOGW(TAG, "Host reset, reason %d", reason);
+  ble_synced = false;
+}
+
+static void host_task(void *param) {
+  nimble_port_run();
+  nimble_port_freertos_deinit();
+}
+
+void ble_init() {
+  HEAP_SUBSYSTEM(BLE);
+  ESP_ERROR_CHECK(nimble_port_init());
+
+  ble_hs_cfg.sync_cb = on_sync;
+  ble_hs_cfg.reset_cb = on_reset;
+
+  nimble_port_freertos_init(host_task);
+}
+
+void ble_scan_start() {
+  ble_scanning = true;
+  if (ble_synced) {
+    start_discovery();
+  }
+}
+
+void ble_scan_set_window(uint16_t window) {
+  if (window > disc_params.itvl) {
+    window = disc_params.itvl;
+  }
+  if (window == disc_params.window) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Scan window set to %d/%d", window, disc_params.itvl);
+  disc_params.window = window;
+  if (ble_scanning && ble_synced) {
+    ble_gap_disc_cancel();
+    start_discovery();
+  }
+}
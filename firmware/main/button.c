@@ -1,5 +1,7 @@
 // https://github.com/craftmetrics/esp32-button
 
+#define LOG_LOCAL_LEVEL CONFIG_BUTTON_LOG_LEVEL
+
 #include "button.h"
 
 #include <stdbool.h>
@@ -7,10 +9,12 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "deferred_log.h"
 #include "driver/gpio.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "event_loops.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
@@ -67,14 +71,14 @@ static void button_task(void *pvParameter) {
       update_button(&debounce[idx]);
       if (button_up(&debounce[idx])) {
         debounce[idx].down_time = 0;
-        ESP_LOGI(TAG, "%d UP", debounce[idx].pin);
-        esp_event_post(BUTTON_EVENT, BUTTON_UP, &debounce[idx].pin, 1,
-                       portMAX_DELAY);
+        DLOGI(TAG, "%d UP", debounce[idx].pin);
+        control_event_post(BUTTON_EVENT, BUTTON_UP, &debounce[idx].pin, 1,
+                           portMAX_DELAY);
       } else if (button_down(&debounce[idx]) && debounce[idx].down_time == 0) {
         debounce[idx].down_time = millis();
-        ESP_LOGI(TAG, "%d DOWN", debounce[idx].pin);
-        esp_event_post(BUTTON_EVENT, BUTTON_DOWN, &debounce[idx].pin, 1,
-                       portMAX_DELAY);
+        DLOGI(TAG, "%d DOWN", debounce[idx].pin);
+        control_event_post(BUTTON_EVENT, BUTTON_DOWN, &debounce[idx].pin, 1,
+                           portMAX_DELAY);
       }
     }
     vTaskDelay(10 / portTICK_PERIOD_MS);
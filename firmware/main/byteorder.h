@@ -8,3 +8,19 @@ static inline uint16_t read_16le(const uint8_t *data) {
 static inline uint16_t read_16be(const uint8_t *data) {
   return data[0] << 8 | data[1];
 }
+
+static inline uint32_t read_32le(const uint8_t *data) {
+  return (uint32_t)data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0];
+}
+
+static inline void write_16le(uint8_t *data, uint16_t value) {
+  data[0] = value;
+  data[1] = value >> 8;
+}
+
+static inline void write_32le(uint8_t *data, uint32_t value) {
+  data[0] = value;
+  data[1] = value >> 8;
+  data[2] = value >> 16;
+  data[3] = value >> 24;
+}
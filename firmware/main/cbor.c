@@ -0,0 +1,126 @@
+#include "cbor.h"
+#include <string.h>
+
+enum {
+  CBOR_MAJOR_UINT = 0,
+  CBOR_MAJOR_NINT = 1,
+  CBOR_MAJOR_BYTES = 2,
+  CBOR_MAJOR_TEXT = 3,
+  CBOR_MAJOR_ARRAY = 4,
+  CBOR_MAJOR_MAP = 5,
+  CBOR_MAJOR_TAG = 6,
+  CBOR_MAJOR_SIMPLE = 7,
+};
+
+#define CBOR_SIMPLE_FALSE 20
+#define CBOR_SIMPLE_TRUE 21
+#define CBOR_SIMPLE_NULL 22
+#define CBOR_SIMPLE_FLOAT64 27
+#define CBOR_TAG_DECIMAL_FRACTION 4
+
+void cbor_writer_init(struct cbor_writer *w, uint8_t *data, size_t capacity) {
+  w->data = data;
+  w->capacity = capacity;
+  w->length = 0;
+  w->overflow = false;
+}
+
+static void write_raw(struct cbor_writer *w, const void *data, size_t len) {
+  if (w->data == NULL) {
+    w->length += len;
+    return;
+  }
+  if (w->overflow || w->capacity - w->length < len) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->data + w->length, data, len);
+  w->length += len;
+}
+
+static void write_head(struct cbor_writer *w, uint8_t major, uint64_t value) {
+  uint8_t head[9];
+  size_t len;
+  if (value < 24) {
+    head[0] = major << 5 | value;
+    len = 1;
+  } else if (value <= UINT8_MAX) {
+    head[0] = major << 5 | 24;
+    len = 2;
+  } else if (value <= UINT16_MAX) {
+    head[0] = major << 5 | 25;
+    len = 3;
+  } else if (value <= UINT32_MAX) {
+    head[0] = major << 5 | 26;
+    len = 5;
+  } else {
+    head[0] = major << 5 | 27;
+    len = 9;
+  }
+
+  // Argument is big-endian, following the initial byte.
+  for (size_t i = len - 1; i > 0; i--, value >>= 8) {
+    head[i] = value & 0xff;
+  }
+  write_raw(w, head, len);
+}
+
+void cbor_write_uint(struct cbor_writer *w, uint64_t value) {
+  write_head(w, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_write_int(struct cbor_writer *w, int64_t value) {
+  if (value >= 0) {
+    write_head(w, CBOR_MAJOR_UINT, value);
+  } else {
+    write_head(w, CBOR_MAJOR_NINT, -1 - value);
+  }
+}
+
+void cbor_write_bytes(struct cbor_writer *w, const uint8_t *data, size_t len) {
+  write_head(w, CBOR_MAJOR_BYTES, len);
+  write_raw(w, data, len);
+}
+
+void cbor_write_text(struct cbor_writer *w, const char *text) {
+  size_t len = strlen(text);
+  write_head(w, CBOR_MAJOR_TEXT, len);
+  write_raw(w, text, len);
+}
+
+void cbor_write_array(struct cbor_writer *w, size_t count) {
+  write_head(w, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_write_map(struct cbor_writer *w, size_t count) {
+  write_head(w, CBOR_MAJOR_MAP, count);
+}
+
+void cbor_write_bool(struct cbor_writer *w, bool value) {
+  write_head(w, CBOR_MAJOR_SIMPLE,
+             value ? CBOR_SIMPLE_TRUE : CBOR_SIMPLE_FALSE);
+}
+
+void cbor_write_null(struct cbor_writer *w) {
+  write_head(w, CBOR_MAJOR_SIMPLE, CBOR_SIMPLE_NULL);
+}
+
+void cbor_write_double(struct cbor_writer *w, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  uint8_t item[9];
+  item[0] = CBOR_MAJOR_SIMPLE << 5 | CBOR_SIMPLE_FLOAT64;
+  for (size_t i = 8; i > 0; i--, bits >>= 8) {
+    item[i] = bits & 0xff;
+  }
+  write_raw(w, item, sizeof(item));
+}
+
+void cbor_write_decimal(struct cbor_writer *w, int64_t exponent,
+                        int64_t mantissa) {
+  write_head(w, CBOR_MAJOR_TAG, CBOR_TAG_DECIMAL_FRACTION);
+  cbor_write_array(w, 2);
+  cbor_write_int(w, exponent);
+  cbor_write_int(w, mantissa);
+}
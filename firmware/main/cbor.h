@@ -0,0 +1,38 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal streaming CBOR (RFC 8949) encoder. Items are written directly into
+// a caller-provided buffer; no allocation is ever performed. If the buffer is
+// too small, the writer is marked as overflowed and subsequent writes are
+// ignored. A writer initialised without a buffer only measures the length of
+// what is written to it.
+struct cbor_writer {
+  uint8_t *data;
+  size_t capacity;
+  size_t length;
+  bool overflow;
+};
+
+void cbor_writer_init(struct cbor_writer *w, uint8_t *data, size_t capacity);
+
+static inline bool cbor_writer_ok(const struct cbor_writer *w) {
+  return !w->overflow;
+}
+
+void cbor_write_uint(struct cbor_writer *w, uint64_t value);
+void cbor_write_int(struct cbor_writer *w, int64_t value);
+void cbor_write_bytes(struct cbor_writer *w, const uint8_t *data, size_t len);
+void cbor_write_text(struct cbor_writer *w, const char *text);
+void cbor_write_array(struct cbor_writer *w, size_t count);
+void cbor_write_map(struct cbor_writer *w, size_t count);
+void cbor_write_bool(struct cbor_writer *w, bool value);
+void cbor_write_null(struct cbor_writer *w);
+void cbor_write_double(struct cbor_writer *w, double value);
+
+// Writes `mantissa * 10^exponent` as a decimal fraction (tag 4). This allows
+// fixed-point sensor values to be encoded exactly without any floating-point
+// arithmetic.
+void cbor_write_decimal(struct cbor_writer *w, int64_t exponent,
+                        int64_t mantissa);
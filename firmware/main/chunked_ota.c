@@ -0,0 +1,416 @@
+#include "chunked_ota.h"
+#include "byteorder.h"
+#include "heap_accounting.h"
+#include "image_decoder.h"
+#include <cJSON.h>
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <string.h>
+
+#define TAG "chunked_ota"
+
+// Firmware is sent in chunks, each written straight to the inactive OTA
+// partition as it arrives. This lives alongside the whole-image transfer of
+// mqtt_ota, under a separate `firmware` topic.
+//
+// - `firmware/begin` starts or resumes a session. The payload is a JSON
+//   object with the image's `id` (its SHA-256, in hex) and `size`. If a
+//   session with the same id is already in progress it is resumed from its
+//   current offset. An optional `encoding` of "zlib" or "delta" selects a
+//   compressed image, or a compressed delta against the running image, whose
+//   digest must then be given as `base`. Offsets and sizes always refer to
+//   the encoded image.
+// - `firmware/chunk` carries the image data. The payload is a little-endian
+//   u32 offset, a little-endian u32 CRC-32 of the data, followed by the data.
+//   Chunks at the wrong offset or with a bad checksum are dropped.
+// - `firmware/end` finalizes the image and switches the boot partition.
+// - `firmware/abort` cancels the session.
+//
+// Every message is answered on `firmware/progress` with the offset up to
+// which the image has been received. The sender uses this to resume after a
+// drop, and should not have more than `window` bytes in flight beyond this
+// offset. When idle, a retained progress message advertises the digest of
+// the running image, allowing the sender to pick a base for delta images.
+
+#define CHUNK_HEADER_SIZE 8
+#define CHUNK_BUFFER_SIZE (CONFIG_CHUNKED_OTA_CHUNK_SIZE + CHUNK_HEADER_SIZE)
+#define ID_SIZE 65
+#define DIGEST_SIZE 32
+
+ESP_EVENT_DEFINE_BASE(CHUNKED_OTA_EVENT);
+
+struct ota_topics {
+  char *begin;
+  char *chunk;
+  char *end;
+  char *abort;
+  char *progress;
+};
+
+struct ota_session {
+  bool active;
+  char id[ID_SIZE];
+  uint32_t size;
+  uint32_t offset;
+
+  const esp_partition_t *partition;
+  esp_ota_handle_t handle;
+  struct image_decoder *decoder;
+  uint32_t written;
+
+  // Chunks may be delivered by the MQTT client in several fragments. They
+  // are reassembled in this buffer before being written.
+  uint8_t *buffer;
+  bool receiving;
+
+  int64_t started_at;
+  int64_t write_time_us;
+};
+
+static struct ota_topics topics;
+static struct ota_session session;
+static char running_digest[2 * DIGEST_SIZE + 1];
+
+// The window is sized so that the data in flight can be written to flash in
+// about CONFIG_CHUNKED_OTA_WINDOW_MS, based on the write speed measured so
+// far.
+static uint32_t session_window() {
+  uint32_t window = CONFIG_CHUNKED_OTA_CHUNK_SIZE;
+  if (session.write_time_us > 0) {
+    window = (uint64_t)session.offset * CONFIG_CHUNKED_OTA_WINDOW_MS * 1000 /
+             session.write_time_us;
+  }
+  if (window < CONFIG_CHUNKED_OTA_CHUNK_SIZE) {
+    window = CONFIG_CHUNKED_OTA_CHUNK_SIZE;
+  } else if (window > 8 * CONFIG_CHUNKED_OTA_CHUNK_SIZE) {
+    window = 8 * CONFIG_CHUNKED_OTA_CHUNK_SIZE;
+  }
+  return window;
+}
+
+static esp_err_t ota_write(const uint8_t *data, size_t length) {
+  esp_err_t err = esp_ota_write(session.handle, data, length);
+  if (err == ESP_OK) {
+    session.written += length;
+  }
+  return err;
+}
+
+static void publish_progress(esp_mqtt_client_handle_t client,
+                             const char *status, const char *error) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddStringToObject(root, "status", status);
+  cJSON_AddStringToObject(root, "running", running_digest);
+  if (error != NULL) {
+    cJSON_AddStringToObject(root, "error", error);
+  }
+  if (session.active) {
+    cJSON_AddStringToObject(root, "id", session.id);
+    cJSON_AddNumberToObject(root, "offset", session.offset);
+    cJSON_AddNumberToObject(root, "size", session.size);
+    cJSON_AddNumberToObject(root, "written", session.written);
+    cJSON_AddNumberToObject(root, "window", session_window());
+    cJSON_AddNumberToObject(root, "chunk_size", CONFIG_CHUNKED_OTA_CHUNK_SIZE);
+    cJSON_AddNumberToObject(root, "write_ms", session.write_time_us / 1000);
+    cJSON_AddNumberToObject(root, "elapsed_ms",
+                            (esp_timer_get_time() - session.started_at) / 1000);
+  }
+
+  char *payload = cJSON_PrintUnformatted(root);
+  esp_mqtt_client_enqueue(client, topics.progress, payload, 0,
+                          /* QOS */ 1, /* retain */ strcmp(status, "idle") == 0,
+                          true);
+
+  free(payload);
+  cJSON_Delete(root);
+}
+
+static void session_close() {
+  if (session.decoder != NULL) {
+    image_decoder_free(session.decoder);
+  }
+  free(session.buffer);
+  memset(&session, 0, sizeof(session));
+}
+
+static void session_fail(esp_mqtt_client_handle_t client, const char *error) {
+  ESP_LOGE(TAG, "OTA failed: %s", error);
+  if (session.active) {
+    esp_ota_abort(session.handle);
+  }
+  publish_progress(client, "error", error);
+  session_close();
+  esp_event_post(CHUNKED_OTA_EVENT, CHUNKED_OTA_EVENT_FAILED, NULL, 0, 0);
+}
+
+static bool parse_encoding(const char *name, enum image_encoding *encoding) {
+  if (name == NULL || strcmp(name, "raw") == 0) {
+    *encoding = IMAGE_ENCODING_RAW;
+  } else if (strcmp(name, "zlib") == 0) {
+    *encoding = IMAGE_ENCODING_ZLIB;
+  } else if (strcmp(name, "delta") == 0) {
+    *encoding = IMAGE_ENCODING_DELTA;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void on_begin(esp_mqtt_client_handle_t client, const char *payload,
+                     size_t payload_len) {
+  cJSON *root = cJSON_ParseWithLength(payload, payload_len);
+  const char *id = cJSON_GetStringValue(cJSON_GetObjectItem(root, "id"));
+  cJSON *size = cJSON_GetObjectItem(root, "size");
+  const char *base = cJSON_GetStringValue(cJSON_GetObjectItem(root, "base"));
+  enum image_encoding encoding;
+  if (id == NULL || strlen(id) >= ID_SIZE || !cJSON_IsNumber(size) ||
+      !parse_encoding(
+          cJSON_GetStringValue(cJSON_GetObjectItem(root, "encoding")),
+          &encoding)) {
+    ESP_LOGE(TAG, "invalid OTA begin request");
+    publish_progress(client, "error", "invalid begin request");
+    cJSON_Delete(root);
+    return;
+  }
+
+  if (session.active && strcmp(session.id, id) == 0 &&
+      session.size == size->valuedouble) {
+    ESP_LOGI(TAG, "resuming OTA %s at offset %" PRIu32, id, session.offset);
+    publish_progress(client, "receiving", NULL);
+    cJSON_Delete(root);
+    return;
+  }
+
+  if (session.active) {
+    ESP_LOGW(TAG, "abandoning OTA %s", session.id);
+    esp_ota_abort(session.handle);
+    session_close();
+  }
+
+  session.partition = esp_ota_get_next_update_partition(NULL);
+  if (session.partition == NULL) {
+    session_fail(client, "no update partition");
+    cJSON_Delete(root);
+    return;
+  }
+  if (size->valuedouble <= 0 || size->valuedouble > session.partition->size) {
+    session_fail(client, "image does not fit in partition");
+    cJSON_Delete(root);
+    return;
+  }
+  if (encoding == IMAGE_ENCODING_DELTA &&
+      (base == NULL || strcmp(base, running_digest) != 0)) {
+    session_fail(client, "delta base is not the running image");
+    cJSON_Delete(root);
+    return;
+  }
+  session.buffer = malloc(CHUNK_BUFFER_SIZE);
+  if (session.buffer == NULL) {
+    session_fail(client, "cannot allocate chunk buffer");
+    cJSON_Delete(root);
+    return;
+  }
+  if (encoding != IMAGE_ENCODING_RAW) {
+    session.decoder = image_decoder_create(
+        encoding, esp_ota_get_running_partition(), ota_write);
+    if (session.decoder == NULL) {
+      session_fail(client, "cannot allocate decoder");
+      cJSON_Delete(root);
+      return;
+    }
+  }
+
+  // Sequential writes erase flash as the image gets written, rather than
+  // erasing the entire partition upfront.
+  esp_err_t err = esp_ota_begin(session.partition, OTA_WITH_SEQUENTIAL_WRITES,
+                                &session.handle);
+  if (err != ESP_OK) {
+    session_fail(client, esp_err_to_name(err));
+    cJSON_Delete(root);
+    return;
+  }
+
+  session.active = true;
+  strcpy(session.id, id);
+  session.size = size->valuedouble;
+  session.started_at = esp_timer_get_time();
+
+  ESP_LOGI(TAG, "starting OTA %s, %" PRIu32 " bytes to %s", session.id,
+           session.size, session.partition->label);
+  esp_event_post(CHUNKED_OTA_EVENT, CHUNKED_OTA_EVENT_STARTED, NULL, 0, 0);
+  publish_progress(client, "receiving", NULL);
+  cJSON_Delete(root);
+}
+
+static esp_err_t session_write(const uint8_t *data, size_t length) {
+  int64_t start = esp_timer_get_time();
+  esp_err_t err;
+  if (session.decoder != NULL) {
+    err = image_decoder_write(session.decoder, data, length);
+  } else {
+    err = ota_write(data, length);
+  }
+  session.write_time_us += esp_timer_get_time() - start;
+  return err;
+}
+
+static void on_chunk(esp_mqtt_client_handle_t client, const uint8_t *payload,
+                     size_t payload_len) {
+  if (payload_len <= CHUNK_HEADER_SIZE) {
+    return;
+  }
+
+  uint32_t offset = read_32le(payload);
+  uint32_t crc = read_32le(payload + 4);
+  const uint8_t *data = payload + CHUNK_HEADER_SIZE;
+  size_t length = payload_len - CHUNK_HEADER_SIZE;
+
+  if (offset != session.offset) {
+    // Most likely a retransmission, or a chunk sent after one was lost.
+    // Either way, tell the sender where we are at.
+    ESP_LOGW(TAG, "unexpected chunk at offset %" PRIu32 ", expected %" PRIu32,
+             offset, session.offset);
+    publish_progress(client, "receiving", NULL);
+    return;
+  }
+  if (length > session.size - session.offset) {
+    session_fail(client, "chunk exceeds image size");
+    return;
+  }
+  if (esp_rom_crc32_le(0, data, length) != crc) {
+    ESP_LOGW(TAG, "bad checksum for chunk at offset %" PRIu32, offset);
+    publish_progress(client, "receiving", "bad checksum");
+    return;
+  }
+
+  esp_err_t err = session_write(data, length);
+  if (err != ESP_OK) {
+    session_fail(client, esp_err_to_name(err));
+    return;
+  }
+
+  session.offset += length;
+  publish_progress(client, "receiving", NULL);
+}
+
+static void on_end(esp_mqtt_client_handle_t client) {
+  if (session.offset != session.size) {
+    publish_progress(client, "receiving", "image incomplete");
+    return;
+  }
+
+  esp_err_t err;
+  if (session.decoder != NULL &&
+      (err = image_decoder_finish(session.decoder)) != ESP_OK) {
+    session_fail(client, esp_err_to_name(err));
+    return;
+  }
+
+  err = esp_ota_end(session.handle);
+  if (err != ESP_OK) {
+    // esp_ota_end releases the handle even on failure.
+    session.active = false;
+    session_fail(client, esp_err_to_name(err));
+    return;
+  }
+
+  err = esp_ota_set_boot_partition(session.partition);
+  if (err != ESP_OK) {
+    session.active = false;
+    session_fail(client, esp_err_to_name(err));
+    return;
+  }
+
+  ESP_LOGI(TAG, "OTA %s done in %" PRId64 " ms", session.id,
+           (esp_timer_get_time() - session.started_at) / 1000);
+  publish_progress(client, "done", NULL);
+  session_close();
+  esp_event_post(CHUNKED_OTA_EVENT, CHUNKED_OTA_EVENT_FINISHED, NULL, 0, 0);
+}
+
+static bool topic_matches(esp_mqtt_event_handle_t event, const char *topic) {
+  return event->topic_len == strlen(topic) &&
+         strncmp(event->topic, topic, event->topic_len) == 0;
+}
+
+// Reassembles chunks that the MQTT client delivers in several fragments.
+// Only the first fragment of a message carries the topic.
+static void on_chunk_data(esp_mqtt_event_handle_t event) {
+  if (event->topic_len > 0) {
+    session.receiving = topic_matches(event, topics.chunk);
+  }
+  if (!session.receiving) {
+    return;
+  }
+
+  // Chunks left over from a session lost to a restart are dropped quietly:
+  // the sender resumes with a new begin request once it hears no progress.
+  if (!session.active) {
+    ESP_LOGW(TAG, "dropping chunk of %d bytes", event->total_data_len);
+    session.receiving = false;
+    return;
+  }
+  if (event->total_data_len > CHUNK_BUFFER_SIZE) {
+    session.receiving = false;
+    session_fail(event->client, "chunk too large");
+    return;
+  }
+
+  memcpy(session.buffer + event->current_data_offset, event->data,
+         event->data_len);
+  if (event->current_data_offset + event->data_len == event->total_data_len) {
+    session.receiving = false;
+    on_chunk(event->client, session.buffer, event->total_data_len);
+  }
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(OTA);
+  esp_mqtt_event_handle_t event = event_data;
+  if (event_id == MQTT_EVENT_CONNECTED) {
+    esp_mqtt_client_subscribe(event->client, topics.begin, 1);
+    esp_mqtt_client_subscribe(event->client, topics.chunk, 1);
+    esp_mqtt_client_subscribe(event->client, topics.end, 1);
+    esp_mqtt_client_subscribe(event->client, topics.abort, 1);
+    if (!session.active) {
+      publish_progress(event->client, "idle", NULL);
+    }
+  } else if (event_id == MQTT_EVENT_DATA) {
+    if (event->topic_len > 0 && topic_matches(event, topics.begin)) {
+      on_begin(event->client, event->data, event->data_len);
+    } else if (event->topic_len > 0 && topic_matches(event, topics.end)) {
+      if (session.active) {
+        on_end(event->client);
+      }
+    } else if (event->topic_len > 0 && topic_matches(event, topics.abort)) {
+      if (session.active) {
+        session_fail(event->client, "aborted");
+      }
+    } else {
+      on_chunk_data(event);
+    }
+  }
+}
+
+void chunked_ota_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  HEAP_SUBSYSTEM(OTA);
+  asprintf(&topics.begin, "%s/firmware/begin", prefix);
+  asprintf(&topics.chunk, "%s/firmware/chunk", prefix);
+  asprintf(&topics.end, "%s/firmware/end", prefix);
+  asprintf(&topics.abort, "%s/firmware/abort", prefix);
+  asprintf(&topics.progress, "%s/firmware/progress", prefix);
+
+  uint8_t digest[DIGEST_SIZE];
+  if (esp_partition_get_sha256(esp_ota_get_running_partition(), digest) ==
+      ESP_OK) {
+    for (size_t i = 0; i < DIGEST_SIZE; i++) {
+      sprintf(running_digest + 2 * i, "%02x", digest[i]);
+    }
+  }
+
+  ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
+                                                 mqtt_event_handler, NULL));
+}
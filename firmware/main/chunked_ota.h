@@ -0,0 +1,13 @@
+#pragma once
+#include <esp_event.h>
+#include <mqtt_client.h>
+
+ESP_EVENT_DECLARE_BASE(CHUNKED_OTA_EVENT);
+
+enum {
+  CHUNKED_OTA_EVENT_STARTED = 0,
+  CHUNKED_OTA_EVENT_FINISHED,
+  CHUNKED_OTA_EVENT_FAILED,
+};
+
+void chunked_ota_init(esp_mqtt_client_handle_t client, const char *prefix);
@@ -1,56 +1,297 @@
+#include "config.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
 #include "light.h"
 #include "local_control.h"
+#include "payload.h"
 #include <cJSON.h>
 #include <esp_log.h>
 #include <esp_mac.h>
 #include <esp_now.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <nvs_flash.h>
 
 #define TAG "config"
 
+ESP_EVENT_DEFINE_BASE(CONFIG_EVENT);
+
 static char *config_topic;
 static char *config_set_topic;
+static char *config_patch_topic;
 
 static nvs_handle_t handle;
+// Held while an update is written and while the config is read, so that
+// readers see it either before or after an update, never part of it.
+static SemaphoreHandle_t lock;
+
+static struct {
+  uint32_t updates;
+  uint32_t writes;
+  uint32_t erases;
+  uint32_t last_writes;
+  uint32_t errors;
+} apply_stats;
+
+// A config value as it is stored in NVS. Booleans are u8, integers i32, or
+// i64 if they don't fit, and anything else is kept as its JSON text.
+struct config_value {
+  nvs_type_t type;
+  union {
+    uint8_t u8;
+    int32_t i32;
+    int64_t i64;
+  };
+  char *str;
+};
+
+static bool to_config_value(const cJSON *element, struct config_value *out) {
+  out->str = NULL;
+  if (cJSON_IsBool(element)) {
+    out->type = NVS_TYPE_U8;
+    out->u8 = cJSON_IsTrue(element);
+  } else if (cJSON_IsNumber(element) && element->valuedouble >= INT32_MIN &&
+             element->valuedouble <= INT32_MAX &&
+             element->valuedouble == (int32_t)element->valuedouble) {
+    out->type = NVS_TYPE_I32;
+    out->i32 = element->valuedouble;
+  } else if (cJSON_IsNumber(element) && element->valuedouble >= INT64_MIN &&
+             element->valuedouble < (double)INT64_MAX &&
+             element->valuedouble == (int64_t)element->valuedouble) {
+    out->type = NVS_TYPE_I64;
+    out->i64 = element->valuedouble;
+  } else if (cJSON_IsNumber(element) || cJSON_IsString(element) ||
+             cJSON_IsArray(element) || cJSON_IsObject(element)) {
+    out->type = NVS_TYPE_STR;
+    out->str = cJSON_PrintUnformatted(element);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Whether the key already holds exactly this value.
+static bool config_value_stored(const char *key,
+                                const struct config_value *value) {
+  switch (value->type) {
+  case NVS_TYPE_U8: {
+    uint8_t stored;
+    return nvs_get_u8(handle, key, &stored) == ESP_OK && stored == value->u8;
+  }
+  case NVS_TYPE_I32: {
+    int32_t stored;
+    return nvs_get_i32(handle, key, &stored) == ESP_OK &&
+           stored == value->i32;
+  }
+  case NVS_TYPE_I64: {
+    int64_t stored;
+    return nvs_get_i64(handle, key, &stored) == ESP_OK &&
+           stored == value->i64;
+  }
+  case NVS_TYPE_STR: {
+    size_t length;
+    if (nvs_get_str(handle, key, NULL, &length) != ESP_OK ||
+        length != strlen(value->str) + 1) {
+      return false;
+    }
+    char *stored = malloc(length);
+    bool same = nvs_get_str(handle, key, stored, &length) == ESP_OK &&
+                strcmp(stored, value->str) == 0;
+    free(stored);
+    return same;
+  }
+  default:
+    return false;
+  }
+}
 
-static void save_config(const char *payload, size_t payload_len) {
+static esp_err_t config_value_write(const char *key,
+                                    const struct config_value *value) {
+  switch (value->type) {
+  case NVS_TYPE_U8:
+    return nvs_set_u8(handle, key, value->u8);
+  case NVS_TYPE_I32:
+    return nvs_set_i32(handle, key, value->i32);
+  case NVS_TYPE_I64:
+    return nvs_set_i64(handle, key, value->i64);
+  case NVS_TYPE_STR:
+    return nvs_set_str(handle, key, value->str);
+  default:
+    return ESP_ERR_INVALID_ARG;
+  }
+}
+
+static bool erase_entry(const char *key) {
+  esp_err_t err = nvs_erase_key(handle, key);
+  if (err == ESP_ERR_NVS_NOT_FOUND) {
+    return false;
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "cannot erase config entry %s", key);
+    apply_stats.errors += 1;
+    return false;
+  }
+  apply_stats.erases += 1;
+  apply_stats.last_writes += 1;
+  return true;
+}
+
+static bool valid_entry(const cJSON *element) {
+  if (strlen(element->string) >= NVS_KEY_NAME_MAX_SIZE) {
+    ESP_LOGW(TAG, "config key too long: %s", element->string);
+    return false;
+  }
+  if (cJSON_IsInvalid(element) || cJSON_IsRaw(element)) {
+    ESP_LOGW(TAG, "unknown config entry type: %d", element->type);
+    return false;
+  }
+  return true;
+}
+
+// Stores a config entry, touching flash only if its value changed. A null
+// value removes the entry. Returns whether anything was written.
+static bool apply_entry(const cJSON *element) {
+  const char *key = element->string;
+  if (cJSON_IsNull(element)) {
+    return erase_entry(key);
+  }
+
+  struct config_value value;
+  if (!to_config_value(element, &value)) {
+    return false;
+  }
+
+  bool written = false;
+  nvs_type_t stored_type;
+  esp_err_t err = nvs_find_key(handle, key, &stored_type);
+  if (err != ESP_OK || stored_type != value.type ||
+      !config_value_stored(key, &value)) {
+    // NVS does not replace an entry of another type, so the old one has to
+    // go first.
+    if (err == ESP_OK && stored_type != value.type) {
+      erase_entry(key);
+    }
+    if (config_value_write(key, &value) == ESP_OK) {
+      apply_stats.writes += 1;
+      apply_stats.last_writes += 1;
+      written = true;
+    } else {
+      ESP_LOGW(TAG, "cannot save config entry %s", key);
+      apply_stats.errors += 1;
+    }
+  }
+
+  free(value.str);
+  return written;
+}
+
+// Removes the entries which the new config doesn't have.
+static bool erase_missing(const cJSON *root) {
+  cJSON *stale = cJSON_CreateArray();
+  nvs_iterator_t it = NULL;
+  for (esp_err_t res = nvs_entry_find_in_handle(handle, NVS_TYPE_ANY, &it);
+       res == ESP_OK; res = nvs_entry_next(&it)) {
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    if (cJSON_GetObjectItemCaseSensitive(root, info.key) == NULL) {
+      cJSON_AddItemToArray(stale, cJSON_CreateString(info.key));
+    }
+  }
+  nvs_release_iterator(it);
+
+  bool erased = false;
+  cJSON *key;
+  cJSON_ArrayForEach(key, stale) {
+    erased |= erase_entry(cJSON_GetStringValue(key));
+  }
+  cJSON_Delete(stale);
+  return erased;
+}
+
+// Applies a new config, either replacing the whole of it or, for a patch,
+// only the keys it mentions. The update is checked as a whole before
+// anything is written, and only the entries which changed are written or
+// erased, under the lock. NVS writes each entry on its own though: a reset
+// in the middle of an update leaves it partly applied, and a key which
+// changed type erased. The config published on the next connection shows
+// what was kept, and setting it again completes the update. Returns whether
+// anything changed.
+static bool apply_config(const char *payload, size_t payload_len,
+                         bool patch) {
   cJSON *root = cJSON_ParseWithLength(payload, payload_len);
   if (!cJSON_IsObject(root)) {
+    ESP_LOGW(TAG, "config is not an object");
     cJSON_Delete(root);
-    return;
+    return false;
   }
 
-  nvs_erase_all(handle);
-
   cJSON *element;
   cJSON_ArrayForEach(element, root) {
-    switch (element->type) {
-    case cJSON_True:
-      nvs_set_u8(handle, element->string, 1);
-      break;
-    case cJSON_False:
-      nvs_set_u8(handle, element->string, 0);
-      break;
-    case cJSON_Number:
-      nvs_set_i32(handle, element->string, element->valuedouble);
-      break;
-    default:
-      ESP_LOGW(TAG, "unknown config entry type: %d", element->type);
+    if (!valid_entry(element)) {
+      apply_stats.errors += 1;
+      cJSON_Delete(root);
+      return false;
     }
   }
 
-  if (nvs_commit(handle) != ESP_OK) {
+  apply_stats.updates += 1;
+  apply_stats.last_writes = 0;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  bool changed = false;
+  cJSON_ArrayForEach(element, root) { changed |= apply_entry(element); }
+  if (!patch) {
+    changed |= erase_missing(root);
+  }
+
+  if (changed && nvs_commit(handle) != ESP_OK) {
     ESP_LOGE(TAG, "cannot commit nvs");
   }
+  xSemaphoreGive(lock);
+  ESP_LOGI(TAG, "config %s: %" PRIu32 " writes", patch ? "patched" : "set",
+           apply_stats.last_writes);
   cJSON_Delete(root);
+  return changed;
+}
+
+void config_add_metrics(cJSON *root) {
+  cJSON *config = cJSON_AddObjectToObject(root, "config");
+  cJSON_AddNumberToObject(config, "updates", apply_stats.updates);
+  cJSON_AddNumberToObject(config, "writes", apply_stats.writes);
+  cJSON_AddNumberToObject(config, "erases", apply_stats.erases);
+  cJSON_AddNumberToObject(config, "last_writes", apply_stats.last_writes);
+  cJSON_AddNumberToObject(config, "errors", apply_stats.errors);
+}
+
+// Strings, arrays, objects and fractional numbers are saved as JSON text.
+// Must be called with the lock held.
+static cJSON *read_json(const char *key) {
+  size_t length;
+  if (nvs_get_str(handle, key, NULL, &length) != ESP_OK) {
+    return NULL;
+  }
+  char *value = malloc(length);
+  cJSON *root = NULL;
+  if (nvs_get_str(handle, key, value, &length) == ESP_OK) {
+    root = cJSON_ParseWithLength(value, length);
+  }
+  free(value);
+  return root;
+}
+
+cJSON *config_get_json(const char *key) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  cJSON *root = read_json(key);
+  xSemaphoreGive(lock);
+  return root;
 }
 
 static void publish_config(esp_mqtt_client_handle_t client) {
   cJSON *root = cJSON_CreateObject();
 
+  xSemaphoreTake(lock, portMAX_DELAY);
   nvs_iterator_t it = NULL;
-  // TODO: use nvs_entry_find_in_handle in next IDF version
-  for (esp_err_t res = nvs_entry_find("nvs", "config", NVS_TYPE_ANY, &it);
+  for (esp_err_t res = nvs_entry_find_in_handle(handle, NVS_TYPE_ANY, &it);
        res == ESP_OK; res = nvs_entry_next(&it)) {
     nvs_entry_info_t info;
     nvs_entry_info(it, &info);
@@ -71,23 +312,41 @@ static void publish_config(esp_mqtt_client_handle_t client) {
       }
       break;
     }
+    case NVS_TYPE_I64: {
+      int64_t value;
+      esp_err_t err = nvs_get_i64(handle, info.key, &value);
+      if (err == ESP_OK) {
+        cJSON_AddNumberToObject(root, info.key, value);
+      }
+      break;
+    }
+    case NVS_TYPE_STR: {
+      cJSON *value = read_json(info.key);
+      if (value != NULL) {
+        cJSON_AddItemToObject(root, info.key, value);
+      }
+      break;
+    }
     default:
       break;
     }
   }
   nvs_release_iterator(it);
+  xSemaphoreGive(lock);
 
-  char *payload = cJSON_PrintUnformatted(root);
-  esp_mqtt_client_enqueue(client, config_topic, payload, 0,
-                          /* QOS */ 2, /* retain */ 1, true);
+  payload_enqueue(
+      client, config_topic, root, "cbor_config",
+      /* QOS */ config_get_qos("qos_config", CONFIG_MQTT_QOS_CONFIG),
+      /* retain */ 1);
 
   cJSON_Delete(root);
-  free(payload);
 }
 
 esp_err_t config_get_bool(const char *key, bool *out) {
   uint8_t v;
+  xSemaphoreTake(lock, portMAX_DELAY);
   esp_err_t err = nvs_get_u8(handle, key, &v);
+  xSemaphoreGive(lock);
   if (err == ESP_OK) {
     *out = v;
   }
@@ -105,7 +364,10 @@ bool config_get_bool_or(const char *key, bool default_value) {
 }
 
 esp_err_t config_get_i32(const char *key, int32_t *out) {
-  return nvs_get_i32(handle, key, out);
+  xSemaphoreTake(lock, portMAX_DELAY);
+  esp_err_t err = nvs_get_i32(handle, key, out);
+  xSemaphoreGive(lock);
+  return err;
 }
 
 int32_t config_get_i32_or(const char *key, int32_t default_value) {
@@ -118,25 +380,48 @@ int32_t config_get_i32_or(const char *key, int32_t default_value) {
   }
 }
 
+// QoS of each class of topic can be overridden at runtime through the
+// `qos_state`, `qos_ruuvi`, `qos_metrics` and `qos_config` keys.
+int config_get_qos(const char *key, int default_value) {
+  int32_t qos = config_get_i32_or(key, default_value);
+  if (qos < 0 || qos > 2) {
+    ESP_LOGW(TAG, "invalid QoS for %s: %" PRIi32, key, qos);
+    return default_value;
+  }
+  return qos;
+}
+
 static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(CONFIG);
   esp_mqtt_event_handle_t event = event_data;
   if (event_id == MQTT_EVENT_CONNECTED) {
     esp_mqtt_client_subscribe(event->client, config_set_topic, 2);
+    esp_mqtt_client_subscribe(event->client, config_patch_topic, 2);
     publish_config(event->client);
   } else if (event_id == MQTT_EVENT_DATA) {
-    if (event->topic_len == strlen(config_set_topic) &&
-        strncmp(event->topic, config_set_topic, event->topic_len) == 0) {
-      save_config(event->data, event->data_len);
+    bool set = event->topic_len == strlen(config_set_topic) &&
+               strncmp(event->topic, config_set_topic, event->topic_len) == 0;
+    bool patch =
+        event->topic_len == strlen(config_patch_topic) &&
+        strncmp(event->topic, config_patch_topic, event->topic_len) == 0;
+    if (set || patch) {
+      bool changed = apply_config(event->data, event->data_len, patch);
       publish_config(event->client);
+      if (changed) {
+        control_event_post(CONFIG_EVENT, CONFIG_EVENT_CHANGED, NULL, 0, 0);
+      }
     }
   }
 }
 
 void config_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  HEAP_SUBSYSTEM(CONFIG);
   asprintf(&config_topic, "%s/config", prefix);
   asprintf(&config_set_topic, "%s/config/set", prefix);
+  asprintf(&config_patch_topic, "%s/config/patch", prefix);
 
+  lock = xSemaphoreCreateMutex();
   ESP_ERROR_CHECK(nvs_open("config", NVS_READWRITE, &handle));
 
   ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
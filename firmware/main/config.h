@@ -1,8 +1,21 @@
 #pragma once
+#include <cJSON.h>
+#include <esp_event.h>
 #include <mqtt_client.h>
 
+ESP_EVENT_DECLARE_BASE(CONFIG_EVENT);
+
+enum {
+  CONFIG_EVENT_CHANGED = 0,
+};
+
 void config_init(esp_mqtt_client_handle_t client, const char *prefix);
 esp_err_t config_get_bool(const char *key, bool *out);
 bool config_get_bool_or(const char *key, bool default_value);
 esp_err_t config_get_i32(const char *key, int32_t *out);
 int32_t config_get_i32_or(const char *key, int32_t default_value);
+// Returns the value saved under the key as JSON text (a string, array,
+// object or fractional number), to be freed by the caller, or NULL.
+cJSON *config_get_json(const char *key);
+int config_get_qos(const char *key, int default_value);
+void config_add_metrics(cJSON *root);
@@ -0,0 +1,221 @@
+#include "deferred_log.h"
+#include "heap_accounting.h"
+#include "hot_path.h"
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TAG "dlog"
+
+#define LINE_SIZE 128
+#define CONSOLE_INTERVAL_MS 100
+
+struct dlog_record {
+  uint32_t timestamp;
+  const struct dlog_format *format;
+  uint32_t args[DLOG_MAX_ARGS];
+};
+
+// `head` counts every record ever written; the record it designates lives at
+// `head % CONFIG_DLOG_BUFFER_SIZE`. Once the buffer is full, the oldest
+// records get overwritten.
+static struct {
+  portMUX_TYPE lock;
+  struct dlog_record records[CONFIG_DLOG_BUFFER_SIZE];
+  uint32_t head;
+  uint32_t console_tail;
+  uint32_t dropped;
+} ring = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+struct callback_stats {
+  const char *name;
+  uint32_t count;
+  uint64_t total_us;
+  uint32_t max_us;
+};
+
+static portMUX_TYPE callback_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct callback_stats callback_stats[DLOG_CALLBACK_COUNT] = {
+    [DLOG_CALLBACK_BLE_SCAN] = {.name = "ble_scan"},
+    [DLOG_CALLBACK_ESPNOW_RECV] = {.name = "espnow_recv"},
+};
+
+static char *dump_topic;
+static char *log_topic;
+
+HOT_PATH void dlog_write(const struct dlog_format *format,
+                         const uint32_t *args, size_t nargs) {
+  uint32_t timestamp = esp_log_timestamp();
+
+  portENTER_CRITICAL(&ring.lock);
+  struct dlog_record *record =
+      &ring.records[ring.head % CONFIG_DLOG_BUFFER_SIZE];
+  record->timestamp = timestamp;
+  record->format = format;
+  memcpy(record->args, args, nargs * sizeof(uint32_t));
+  ring.head += 1;
+#if CONFIG_DLOG_CONSOLE
+  if (ring.head - ring.console_tail > CONFIG_DLOG_BUFFER_SIZE) {
+    ring.console_tail = ring.head - CONFIG_DLOG_BUFFER_SIZE;
+    ring.dropped += 1;
+  }
+#endif
+  portEXIT_CRITICAL(&ring.lock);
+}
+
+// Copies the record at position `index`, unless it has been overwritten
+// since.
+static bool read_record(uint32_t index, struct dlog_record *record) {
+  bool ok = false;
+  portENTER_CRITICAL(&ring.lock);
+  if (ring.head - index <= CONFIG_DLOG_BUFFER_SIZE) {
+    *record = ring.records[index % CONFIG_DLOG_BUFFER_SIZE];
+    ok = true;
+  }
+  portEXIT_CRITICAL(&ring.lock);
+  return ok;
+}
+
+static int format_record(const struct dlog_record *record, char *buffer,
+                         size_t size) {
+  const struct dlog_format *format = record->format;
+  const uint32_t *args = record->args;
+  int n = snprintf(buffer, size, "%c (%" PRIu32 ") %s: ",
+                   "NEWIDV"[format->level], record->timestamp, format->tag);
+  if (n < 0 || n >= size) {
+    return size - 1;
+  }
+  int m = snprintf(buffer + n, size - n, format->format, args[0], args[1],
+                   args[2], args[3], args[4], args[5], args[6], args[7]);
+  if (m < 0 || m >= size - n) {
+    return size - 1;
+  }
+  return n + m;
+}
+
+#if CONFIG_DLOG_CONSOLE
+static void console_task(void *arg) {
+  char line[LINE_SIZE];
+  while (true) {
+    vTaskDelay(CONSOLE_INTERVAL_MS / portTICK_PERIOD_MS);
+
+    while (true) {
+      struct dlog_record record;
+      portENTER_CRITICAL(&ring.lock);
+      bool empty = ring.console_tail == ring.head;
+      if (!empty) {
+        record = ring.records[ring.console_tail % CONFIG_DLOG_BUFFER_SIZE];
+        ring.console_tail += 1;
+      }
+      portEXIT_CRITICAL(&ring.lock);
+      if (empty) {
+        break;
+      }
+
+      format_record(&record, line, sizeof(line));
+      esp_log_write(record.format->level, record.format->tag, "%s\n", line);
+    }
+  }
+}
+#endif
+
+static void publish_dump(esp_mqtt_client_handle_t client) {
+  portENTER_CRITICAL(&ring.lock);
+  uint32_t head = ring.head;
+  portEXIT_CRITICAL(&ring.lock);
+
+  uint32_t start =
+      head > CONFIG_DLOG_BUFFER_SIZE ? head - CONFIG_DLOG_BUFFER_SIZE : 0;
+  char *buffer = malloc((head - start) * LINE_SIZE + 1);
+  if (buffer == NULL) {
+    ESP_LOGE(TAG, "cannot allocate log dump");
+    return;
+  }
+
+  size_t length = 0;
+  for (uint32_t index = start; index < head; index++) {
+    struct dlog_record record;
+    if (read_record(index, &record)) {
+      length += format_record(&record, buffer + length, LINE_SIZE);
+      buffer[length++] = '\n';
+    }
+  }
+
+  esp_mqtt_client_enqueue(client, log_topic, buffer, length, 0, 0, true);
+  free(buffer);
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(LOG);
+  esp_mqtt_event_handle_t event = event_data;
+  if (event_id == MQTT_EVENT_CONNECTED) {
+    esp_mqtt_client_subscribe(event->client, dump_topic, 0);
+  } else if (event_id == MQTT_EVENT_DATA) {
+    if (event->topic_len == strlen(dump_topic) &&
+        strncmp(event->topic, dump_topic, event->topic_len) == 0) {
+      publish_dump(event->client);
+    }
+  }
+}
+
+HOT_PATH void dlog_callback_time(enum dlog_callback callback,
+                                 int64_t start) {
+  uint32_t elapsed = esp_timer_get_time() - start;
+  struct callback_stats *stats = &callback_stats[callback];
+
+  portENTER_CRITICAL(&callback_stats_lock);
+  stats->count += 1;
+  stats->total_us += elapsed;
+  if (elapsed > stats->max_us) {
+    stats->max_us = elapsed;
+  }
+  portEXIT_CRITICAL(&callback_stats_lock);
+}
+
+void dlog_add_metrics(cJSON *root) {
+  cJSON *log = cJSON_AddObjectToObject(root, "log");
+#if CONFIG_DLOG_ENABLE
+  cJSON_AddBoolToObject(log, "deferred", true);
+#else
+  cJSON_AddBoolToObject(log, "deferred", false);
+#endif
+
+  portENTER_CRITICAL(&ring.lock);
+  uint32_t records = ring.head;
+  uint32_t dropped = ring.dropped;
+  portEXIT_CRITICAL(&ring.lock);
+  cJSON_AddNumberToObject(log, "records", records);
+  cJSON_AddNumberToObject(log, "dropped", dropped);
+
+  cJSON *callbacks = cJSON_AddObjectToObject(log, "callbacks");
+  for (size_t i = 0; i < DLOG_CALLBACK_COUNT; i++) {
+    portENTER_CRITICAL(&callback_stats_lock);
+    struct callback_stats stats = callback_stats[i];
+    portEXIT_CRITICAL(&callback_stats_lock);
+
+    cJSON *obj = cJSON_AddObjectToObject(callbacks, stats.name);
+    cJSON_AddNumberToObject(obj, "count", stats.count);
+    cJSON_AddNumberToObject(obj, "avg_us",
+                            stats.count ? stats.total_us / stats.count : 0);
+    cJSON_AddNumberToObject(obj, "max_us", stats.max_us);
+  }
+}
+
+void dlog_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  HEAP_SUBSYSTEM(LOG);
+  asprintf(&dump_topic, "%s/log/dump", prefix);
+  asprintf(&log_topic, "%s/log", prefix);
+
+#if CONFIG_DLOG_CONSOLE
+  xTaskCreate(console_task, "dlog", 3072, NULL, tskIDLE_PRIORITY + 1, NULL);
+#endif
+
+  ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
+                                                 mqtt_event_handler, NULL));
+}
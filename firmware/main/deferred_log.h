@@ -0,0 +1,68 @@
+#pragma once
+#include <cJSON.h>
+#include <esp_log.h>
+#include <mqtt_client.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Deferred logging, for hot paths such as the BLE and ESP-NOW callbacks.
+//
+// Instead of formatting the message on the spot, DLOGx records a pointer to
+// the (constant) format and the raw arguments into a RAM ring buffer. The
+// entries are formatted later, on the console by a low-priority task, or
+// on request over MQTT by publishing to `<base>/log/dump`.
+//
+// Arguments are stored as uint32_t, which means only integer arguments are
+// supported, at most DLOG_MAX_ARGS of them.
+//
+// With CONFIG_DLOG_ENABLE unset, these are plain ESP_LOGx calls.
+
+#define DLOG_MAX_ARGS 8
+
+struct dlog_format {
+  esp_log_level_t level;
+  const char *tag;
+  const char *format;
+};
+
+void dlog_write(const struct dlog_format *format, const uint32_t *args,
+                size_t nargs);
+
+#if CONFIG_DLOG_ENABLE
+#define DLOG_LEVEL_LOCAL(level, tag, format, ...)                             \
+  do {                                                                        \
+    if (LOG_LOCAL_LEVEL >= level) {                                           \
+      static const struct dlog_format _dlog_format = {level, tag, format};    \
+      const uint32_t _dlog_args[] = {__VA_ARGS__};                            \
+      _Static_assert(sizeof(_dlog_args) <= DLOG_MAX_ARGS * sizeof(uint32_t), \
+                     "too many deferred log arguments");                      \
+      dlog_write(&_dlog_format, _dlog_args,                                   \
+                 sizeof(_dlog_args) / sizeof(uint32_t));                      \
+    }                                                                         \
+  } while (0)
+#else
+#define DLOG_LEVEL_LOCAL(level, tag, format, ...)                             \
+  ESP_LOG_LEVEL_LOCAL(level, tag, format, ##__VA_ARGS__)
+#endif
+
+#define DLOGE(tag, format, ...)                                               \
+  DLOG_LEVEL_LOCAL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...)                                               \
+  DLOG_LEVEL_LOCAL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...)                                               \
+  DLOG_LEVEL_LOCAL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...)                                               \
+  DLOG_LEVEL_LOCAL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+
+// Time spent in the hot path callbacks, reported in the metrics to compare
+// deferred and immediate logging.
+enum dlog_callback {
+  DLOG_CALLBACK_BLE_SCAN,
+  DLOG_CALLBACK_ESPNOW_RECV,
+  DLOG_CALLBACK_COUNT,
+};
+
+void dlog_callback_time(enum dlog_callback callback, int64_t start);
+
+void dlog_init(esp_mqtt_client_handle_t client, const char *prefix);
+void dlog_add_metrics(cJSON *root);
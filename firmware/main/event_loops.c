@@ -0,0 +1,130 @@
+#include "event_loops.h"
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+
+#define TAG "event_loops"
+
+// esp_event does not expose the state of a loop's queue, so the number of
+// pending events is tracked here instead: it is incremented on post, and
+// decremented by a catch-all handler when the event gets dispatched.
+struct event_loop {
+  const char *name;
+  esp_event_loop_handle_t handle;
+  portMUX_TYPE lock;
+  uint32_t pending;
+  uint32_t high_water;
+  uint32_t dropped;
+  uint32_t dispatched;
+  // Number of dispatched events as of the previous metrics. A loop which had
+  // pending events and dispatched none since is considered stalled.
+  uint32_t last_dispatched;
+};
+
+static struct event_loop control = {
+    .name = "control",
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+static struct event_loop telemetry = {
+    .name = "telemetry",
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+esp_event_loop_handle_t control_loop;
+esp_event_loop_handle_t telemetry_loop;
+
+static void dispatched_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  struct event_loop *loop = arg;
+  portENTER_CRITICAL(&loop->lock);
+  if (loop->pending > 0) {
+    loop->pending -= 1;
+  }
+  loop->dispatched += 1;
+  portEXIT_CRITICAL(&loop->lock);
+}
+
+static esp_err_t loop_post(struct event_loop *loop, esp_event_base_t event_base,
+                           int32_t event_id, const void *event_data,
+                           size_t event_data_size, TickType_t ticks_to_wait) {
+  portENTER_CRITICAL(&loop->lock);
+  loop->pending += 1;
+  if (loop->pending > loop->high_water) {
+    loop->high_water = loop->pending;
+  }
+  portEXIT_CRITICAL(&loop->lock);
+
+  esp_err_t err = esp_event_post_to(loop->handle, event_base, event_id,
+                                    event_data, event_data_size, ticks_to_wait);
+  if (err != ESP_OK) {
+    portENTER_CRITICAL(&loop->lock);
+    loop->pending -= 1;
+    loop->dropped += 1;
+    portEXIT_CRITICAL(&loop->lock);
+  }
+  return err;
+}
+
+esp_err_t control_event_post(esp_event_base_t event_base, int32_t event_id,
+                             const void *event_data, size_t event_data_size,
+                             TickType_t ticks_to_wait) {
+  return loop_post(&control, event_base, event_id, event_data, event_data_size,
+                   ticks_to_wait);
+}
+
+esp_err_t telemetry_event_post(esp_event_base_t event_base, int32_t event_id,
+                               const void *event_data, size_t event_data_size,
+                               TickType_t ticks_to_wait) {
+  return loop_post(&telemetry, event_base, event_id, event_data,
+                   event_data_size, ticks_to_wait);
+}
+
+static void loop_create(struct event_loop *loop, int32_t queue_size,
+                        UBaseType_t priority, uint32_t stack_size) {
+  esp_event_loop_args_t args = {
+      .queue_size = queue_size,
+      .task_name = loop->name,
+      .task_priority = priority,
+      .task_stack_size = stack_size,
+      .task_core_id = tskNO_AFFINITY,
+  };
+  ESP_ERROR_CHECK(esp_event_loop_create(&args, &loop->handle));
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      loop->handle, ESP_EVENT_ANY_BASE, ESP_EVENT_ANY_ID, dispatched_handler,
+      loop));
+}
+
+void event_loops_init() {
+  loop_create(&control, CONFIG_CONTROL_EVENT_LOOP_QUEUE_SIZE,
+              CONFIG_CONTROL_EVENT_LOOP_PRIORITY, 3072);
+  loop_create(&telemetry, CONFIG_TELEMETRY_EVENT_LOOP_QUEUE_SIZE,
+              CONFIG_TELEMETRY_EVENT_LOOP_PRIORITY, 4096);
+  control_loop = control.handle;
+  telemetry_loop = telemetry.handle;
+}
+
+static void add_loop_metrics(cJSON *root, struct event_loop *loop) {
+  portENTER_CRITICAL(&loop->lock);
+  uint32_t pending = loop->pending;
+  uint32_t high_water = loop->high_water;
+  uint32_t dropped = loop->dropped;
+  bool stalled = pending > 0 && loop->dispatched == loop->last_dispatched;
+  loop->last_dispatched = loop->dispatched;
+  portEXIT_CRITICAL(&loop->lock);
+
+  if (stalled) {
+    ESP_LOGW(TAG, "%s loop has not dispatched any event since last metrics",
+             loop->name);
+  }
+
+  cJSON *obj = cJSON_AddObjectToObject(root, loop->name);
+  cJSON_AddNumberToObject(obj, "pending", pending);
+  cJSON_AddNumberToObject(obj, "queue_high_water", high_water);
+  cJSON_AddNumberToObject(obj, "dropped", dropped);
+  cJSON_AddBoolToObject(obj, "stalled", stalled);
+}
+
+void event_loops_add_metrics(cJSON *root) {
+  cJSON *loops = cJSON_AddObjectToObject(root, "event_loops");
+  add_loop_metrics(loops, &control);
+  add_loop_metrics(loops, &telemetry);
+}
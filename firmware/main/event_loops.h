@@ -0,0 +1,23 @@
+#pragma once
+#include <cJSON.h>
+#include <esp_event.h>
+
+// Besides the default event loop, which carries system events (WiFi, IP and
+// OTA), events are split across two dedicated loops:
+// - the control loop, running at high priority, carries button, light and
+//   config events.
+// - the telemetry loop, running at low priority, carries BLE advertisements.
+// This way a flood of advertisements can never delay a light switching.
+extern esp_event_loop_handle_t control_loop;
+extern esp_event_loop_handle_t telemetry_loop;
+
+void event_loops_init();
+
+esp_err_t control_event_post(esp_event_base_t event_base, int32_t event_id,
+                             const void *event_data, size_t event_data_size,
+                             TickType_t ticks_to_wait);
+esp_err_t telemetry_event_post(esp_event_base_t event_base, int32_t event_id,
+                               const void *event_data, size_t event_data_size,
+                               TickType_t ticks_to_wait);
+
+void event_loops_add_metrics(cJSON *root);
@@ -0,0 +1,246 @@
+#include "heap_accounting.h"
+#include <cJSON.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG "heap_accounting"
+
+static char *dump_topic;
+static char *report_topic;
+
+#if CONFIG_HEAP_ACCOUNTING
+static const char *subsystem_names[HEAP_SUBSYSTEM_COUNT] = {
+    [HEAP_SUBSYSTEM_OTHER] = "other",
+    [HEAP_SUBSYSTEM_MAIN] = "main",
+    [HEAP_SUBSYSTEM_CONFIG] = "config",
+    [HEAP_SUBSYSTEM_LOCAL_CONTROL] = "local_control",
+    [HEAP_SUBSYSTEM_BLE] = "ble",
+    [HEAP_SUBSYSTEM_RUUVI] = "ruuvi",
+    [HEAP_SUBSYSTEM_OTA] = "ota",
+    [HEAP_SUBSYSTEM_LOG] = "log",
+};
+
+_Static_assert((CONFIG_HEAP_ACCOUNTING_TABLE_SIZE &
+                (CONFIG_HEAP_ACCOUNTING_TABLE_SIZE - 1)) == 0,
+               "table size must be a power of two");
+
+// The heap hooks only get the pointer when a block is freed, so the size and
+// subsystem of every live block are kept in an open-addressing hash table,
+// with linear probing. Blocks which do not fit in the table are not
+// accounted for. One slot is always left empty, so that probing terminates.
+struct allocation {
+  void *ptr;
+  uint32_t size;
+  enum heap_subsystem subsystem;
+};
+
+struct subsystem_stats {
+  uint32_t live_bytes;
+  uint32_t live_blocks;
+  uint32_t allocations;
+  // Number of allocations as of the previous report, to compute a rate.
+  uint32_t last_allocations;
+};
+
+static struct {
+  portMUX_TYPE lock;
+  bool enabled;
+  struct allocation table[CONFIG_HEAP_ACCOUNTING_TABLE_SIZE];
+  uint32_t used;
+  struct subsystem_stats stats[HEAP_SUBSYSTEM_COUNT];
+  uint32_t untracked;
+  int64_t last_report;
+} accounting = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static __thread enum heap_subsystem current_subsystem;
+
+enum heap_subsystem heap_accounting_enter(enum heap_subsystem subsystem) {
+  enum heap_subsystem previous = current_subsystem;
+  current_subsystem = subsystem;
+  return previous;
+}
+
+void heap_accounting_restore(enum heap_subsystem *previous) {
+  current_subsystem = *previous;
+}
+
+static inline IRAM_ATTR size_t slot_of(const void *ptr) {
+  return ((uintptr_t)ptr >> 3) * 2654435761u &
+         (CONFIG_HEAP_ACCOUNTING_TABLE_SIZE - 1);
+}
+
+static inline IRAM_ATTR size_t next_slot(size_t slot) {
+  return (slot + 1) & (CONFIG_HEAP_ACCOUNTING_TABLE_SIZE - 1);
+}
+
+// Returns the entry for `ptr`, or the empty slot where it would be inserted.
+static IRAM_ATTR struct allocation *find(const void *ptr) {
+  size_t i = slot_of(ptr);
+  while (accounting.table[i].ptr != ptr && accounting.table[i].ptr != NULL) {
+    i = next_slot(i);
+  }
+  return &accounting.table[i];
+}
+
+// Removes an entry without leaving a hole in the probe sequence of the
+// entries that follow it.
+static IRAM_ATTR void remove_entry(struct allocation *entry) {
+  size_t hole = entry - accounting.table;
+  for (size_t i = next_slot(hole); accounting.table[i].ptr != NULL;
+       i = next_slot(i)) {
+    size_t home = slot_of(accounting.table[i].ptr);
+    // Move the entry into the hole unless its home slot lies cyclically in
+    // (hole, i].
+    bool movable = hole <= i ? (home <= hole || home > i)
+                             : (home <= hole && home > i);
+    if (movable) {
+      accounting.table[hole] = accounting.table[i];
+      hole = i;
+    }
+  }
+  accounting.table[hole].ptr = NULL;
+  accounting.used -= 1;
+}
+
+static IRAM_ATTR void release(struct allocation *entry) {
+  struct subsystem_stats *stats = &accounting.stats[entry->subsystem];
+  stats->live_bytes -= entry->size;
+  stats->live_blocks -= 1;
+  remove_entry(entry);
+}
+
+IRAM_ATTR void esp_heap_trace_alloc_hook(void *ptr, size_t size,
+                                         uint32_t caps) {
+  if (!accounting.enabled || ptr == NULL) {
+    return;
+  }
+
+  enum heap_subsystem subsystem = current_subsystem;
+  portENTER_CRITICAL(&accounting.lock);
+  struct allocation *entry = find(ptr);
+  if (entry->ptr == ptr) {
+    // Resized in place by realloc.
+    release(entry);
+    entry = find(ptr);
+  }
+  if (accounting.used < CONFIG_HEAP_ACCOUNTING_TABLE_SIZE - 1) {
+    accounting.used += 1;
+    entry->ptr = ptr;
+    entry->size = size;
+    entry->subsystem = subsystem;
+    accounting.stats[subsystem].live_bytes += size;
+    accounting.stats[subsystem].live_blocks += 1;
+  } else {
+    accounting.untracked += 1;
+  }
+  accounting.stats[subsystem].allocations += 1;
+  portEXIT_CRITICAL(&accounting.lock);
+}
+
+IRAM_ATTR void esp_heap_trace_free_hook(void *ptr) {
+  if (!accounting.enabled || ptr == NULL) {
+    return;
+  }
+
+  portENTER_CRITICAL(&accounting.lock);
+  struct allocation *entry = find(ptr);
+  if (entry->ptr == ptr) {
+    release(entry);
+  }
+  portEXIT_CRITICAL(&accounting.lock);
+}
+
+static void add_subsystems(cJSON *root) {
+  struct subsystem_stats stats[HEAP_SUBSYSTEM_COUNT];
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&accounting.lock);
+  memcpy(stats, accounting.stats, sizeof(stats));
+  for (size_t i = 0; i < HEAP_SUBSYSTEM_COUNT; i++) {
+    accounting.stats[i].last_allocations = accounting.stats[i].allocations;
+  }
+  uint32_t untracked = accounting.untracked;
+  int64_t elapsed = now - accounting.last_report;
+  accounting.last_report = now;
+  portEXIT_CRITICAL(&accounting.lock);
+
+  cJSON *subsystems = cJSON_AddObjectToObject(root, "subsystems");
+  for (size_t i = 0; i < HEAP_SUBSYSTEM_COUNT; i++) {
+    cJSON *obj = cJSON_AddObjectToObject(subsystems, subsystem_names[i]);
+    cJSON_AddNumberToObject(obj, "live_bytes", stats[i].live_bytes);
+    cJSON_AddNumberToObject(obj, "live_blocks", stats[i].live_blocks);
+    cJSON_AddNumberToObject(obj, "allocations", stats[i].allocations);
+    cJSON_AddNumberToObject(
+        obj, "allocations_per_s",
+        elapsed > 0
+            ? (stats[i].allocations - stats[i].last_allocations) * 1e6 / elapsed
+            : 0);
+  }
+  cJSON_AddNumberToObject(root, "untracked", untracked);
+}
+#endif
+
+static void publish_report(esp_mqtt_client_handle_t client) {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "free_bytes", info.total_free_bytes);
+  cJSON_AddNumberToObject(root, "allocated_bytes", info.total_allocated_bytes);
+  cJSON_AddNumberToObject(root, "minimum_free_bytes", info.minimum_free_bytes);
+  cJSON_AddNumberToObject(root, "largest_free_block", info.largest_free_block);
+  cJSON_AddNumberToObject(root, "allocated_blocks", info.allocated_blocks);
+  cJSON_AddNumberToObject(root, "free_blocks", info.free_blocks);
+  // Share of the free memory which is not part of the largest free block, in
+  // thousandths. This is 0 for an unfragmented heap.
+  cJSON_AddNumberToObject(
+      root, "fragmentation",
+      info.total_free_bytes
+          ? 1000 - (uint64_t)info.largest_free_block * 1000 /
+                       info.total_free_bytes
+          : 0);
+
+#if CONFIG_HEAP_ACCOUNTING
+  add_subsystems(root);
+#endif
+
+  char *payload = cJSON_PrintUnformatted(root);
+  esp_mqtt_client_enqueue(client, report_topic, payload, 0, 0, 0, true);
+  free(payload);
+  cJSON_Delete(root);
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  esp_mqtt_event_handle_t event = event_data;
+  if (event_id == MQTT_EVENT_CONNECTED) {
+    esp_mqtt_client_subscribe(event->client, dump_topic, 0);
+  } else if (event_id == MQTT_EVENT_DATA) {
+    if (event->topic_len == strlen(dump_topic) &&
+        strncmp(event->topic, dump_topic, event->topic_len) == 0) {
+      publish_report(event->client);
+    }
+  }
+}
+
+void heap_accounting_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  asprintf(&dump_topic, "%s/heap/dump", prefix);
+  asprintf(&report_topic, "%s/heap", prefix);
+
+#if CONFIG_HEAP_ACCOUNTING
+  // Only blocks allocated from now on are accounted for.
+  portENTER_CRITICAL(&accounting.lock);
+  accounting.enabled = true;
+  accounting.last_report = esp_timer_get_time();
+  portEXIT_CRITICAL(&accounting.lock);
+#endif
+
+  ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
+                                                 mqtt_event_handler, NULL));
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <mqtt_client.h>
+
+// Heap usage report, published on `<base>/heap` whenever a message is sent to
+// `<base>/heap/dump`. It includes the largest free block and fragmentation of
+// the heap.
+//
+// With CONFIG_HEAP_ACCOUNTING, every allocation is additionally attributed to
+// the subsystem of the code that made it, and the report includes the live
+// bytes and allocation rate of each subsystem. Code declares its subsystem
+// with HEAP_SUBSYSTEM(...) at the top of its entry points (event handlers,
+// callbacks, ...); the declaration holds until the end of the enclosing
+// scope. Allocations made outside any such scope, eg. by the WiFi and BT
+// stacks, are attributed to "other".
+
+enum heap_subsystem {
+  HEAP_SUBSYSTEM_OTHER,
+  HEAP_SUBSYSTEM_MAIN,
+  HEAP_SUBSYSTEM_CONFIG,
+  HEAP_SUBSYSTEM_LOCAL_CONTROL,
+  HEAP_SUBSYSTEM_BLE,
+  HEAP_SUBSYSTEM_RUUVI,
+  HEAP_SUBSYSTEM_OTA,
+  HEAP_SUBSYSTEM_LOG,
+  HEAP_SUBSYSTEM_COUNT,
+};
+
+enum heap_subsystem heap_accounting_enter(enum heap_subsystem subsystem);
+void heap_accounting_restore(enum heap_subsystem *previous);
+
+#if CONFIG_HEAP_ACCOUNTING
+#define HEAP_SUBSYSTEM(subsystem)                                             \
+  enum heap_subsystem _heap_previous                                          \
+      __attribute__((cleanup(heap_accounting_restore))) =                     \
+          heap_accounting_enter(HEAP_SUBSYSTEM_##subsystem)
+#else
+#define HEAP_SUBSYSTEM(subsystem)                                             \
+  do {                                                                        \
+  } while (0)
+#endif
+
+void heap_accounting_init(esp_mqtt_client_handle_t client, const char *prefix);
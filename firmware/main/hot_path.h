@@ -0,0 +1,16 @@
+#pragma once
+#include "sdkconfig.h"
+#include <esp_attr.h>
+
+// With CONFIG_HOT_PATH_IN_IRAM, functions marked HOT_PATH run from IRAM, so
+// they never stall on a flash cache miss, which gets much slower while NVS
+// or OTA write to flash. Only mark code which never reads nor writes flash
+// itself: switching uses the light options cached in RAM, and saves its
+// state later from a timer, so the ESP-NOW receive path and light_set_state
+// qualify. The ESP-IDF functions they call, such as LEDC and event posting,
+// stay wherever ESP-IDF places them.
+#if CONFIG_HOT_PATH_IN_IRAM
+#define HOT_PATH IRAM_ATTR
+#else
+#define HOT_PATH
+#endif
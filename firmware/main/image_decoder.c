@@ -0,0 +1,215 @@
+#include "image_decoder.h"
+#include "byteorder.h"
+#include <esp_log.h>
+#include <rom/miniz.h>
+#include <stdlib.h>
+
+#define TAG "image_decoder"
+
+// Delta images are a sequence of operations, each starting with an opcode:
+// - DELTA_OP_COPY, followed by a u32 offset and a u32 length: copy `length`
+//   bytes from the base image, starting at `offset`.
+// - DELTA_OP_INSERT, followed by a u32 length and `length` bytes of data to
+//   insert as-is.
+// All integers are little-endian.
+enum {
+  DELTA_OP_COPY = 0,
+  DELTA_OP_INSERT = 1,
+};
+
+#define DELTA_HEADER_MAX_SIZE 9
+#define DELTA_COPY_BUFFER_SIZE 1024
+
+struct delta_state {
+  const esp_partition_t *base;
+
+  // The header of the current operation, as it gets accumulated.
+  uint8_t header[DELTA_HEADER_MAX_SIZE];
+  size_t header_length;
+
+  // Number of bytes left to insert for an ongoing DELTA_OP_INSERT.
+  uint32_t insert_remaining;
+
+  uint8_t copy_buffer[DELTA_COPY_BUFFER_SIZE];
+};
+
+struct image_decoder {
+  enum image_encoding encoding;
+  image_decoder_write_fn write;
+
+  // Decompressed output is produced into a circular window, the size of
+  // the deflate dictionary. This bounds the memory needed regardless of the
+  // size of the image.
+  tinfl_decompressor inflate;
+  uint8_t dict[TINFL_LZ_DICT_SIZE];
+  size_t dict_offset;
+  bool done;
+
+  struct delta_state delta;
+};
+
+static size_t delta_header_size(uint8_t op) {
+  switch (op) {
+  case DELTA_OP_COPY:
+    return 9;
+  case DELTA_OP_INSERT:
+    return 5;
+  default:
+    return 0;
+  }
+}
+
+static esp_err_t delta_copy(struct image_decoder *decoder, uint32_t offset,
+                            uint32_t length) {
+  struct delta_state *delta = &decoder->delta;
+  if (offset > delta->base->size || length > delta->base->size - offset) {
+    ESP_LOGE(TAG, "delta copy out of bounds");
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  while (length > 0) {
+    size_t n = length < sizeof(delta->copy_buffer) ? length
+                                                   : sizeof(delta->copy_buffer);
+    esp_err_t err =
+        esp_partition_read(delta->base, offset, delta->copy_buffer, n);
+    if (err != ESP_OK) {
+      return err;
+    }
+    err = decoder->write(delta->copy_buffer, n);
+    if (err != ESP_OK) {
+      return err;
+    }
+    offset += n;
+    length -= n;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t delta_write(struct image_decoder *decoder, const uint8_t *data,
+                             size_t length) {
+  struct delta_state *delta = &decoder->delta;
+  while (length > 0) {
+    if (delta->insert_remaining > 0) {
+      size_t n = length < delta->insert_remaining ? length
+                                                  : delta->insert_remaining;
+      esp_err_t err = decoder->write(data, n);
+      if (err != ESP_OK) {
+        return err;
+      }
+      delta->insert_remaining -= n;
+      data += n;
+      length -= n;
+      continue;
+    }
+
+    delta->header[delta->header_length++] = *data++;
+    length--;
+
+    size_t header_size = delta_header_size(delta->header[0]);
+    if (header_size == 0) {
+      ESP_LOGE(TAG, "invalid delta opcode 0x%02x", delta->header[0]);
+      return ESP_ERR_INVALID_ARG;
+    }
+    if (delta->header_length < header_size) {
+      continue;
+    }
+
+    delta->header_length = 0;
+    if (delta->header[0] == DELTA_OP_COPY) {
+      esp_err_t err = delta_copy(decoder, read_32le(delta->header + 1),
+                                 read_32le(delta->header + 5));
+      if (err != ESP_OK) {
+        return err;
+      }
+    } else {
+      delta->insert_remaining = read_32le(delta->header + 1);
+    }
+  }
+  return ESP_OK;
+}
+
+static esp_err_t emit(struct image_decoder *decoder, const uint8_t *data,
+                      size_t length) {
+  if (decoder->encoding == IMAGE_ENCODING_DELTA) {
+    return delta_write(decoder, data, length);
+  } else {
+    return decoder->write(data, length);
+  }
+}
+
+struct image_decoder *image_decoder_create(enum image_encoding encoding,
+                                           const esp_partition_t *base,
+                                           image_decoder_write_fn write) {
+  struct image_decoder *decoder = malloc(sizeof(struct image_decoder));
+  if (decoder == NULL) {
+    return NULL;
+  }
+
+  decoder->encoding = encoding;
+  decoder->write = write;
+  decoder->dict_offset = 0;
+  decoder->done = false;
+  decoder->delta.base = base;
+  decoder->delta.header_length = 0;
+  decoder->delta.insert_remaining = 0;
+  tinfl_init(&decoder->inflate);
+
+  return decoder;
+}
+
+esp_err_t image_decoder_write(struct image_decoder *decoder,
+                              const uint8_t *data, size_t length) {
+  // Even once all input is consumed, tinfl may hold output back until it
+  // gets called again, so only NEEDS_MORE_INPUT or DONE end the loop.
+  while (!decoder->done) {
+    size_t in_size = length;
+    size_t out_size = TINFL_LZ_DICT_SIZE - decoder->dict_offset;
+    tinfl_status status = tinfl_decompress(
+        &decoder->inflate, data, &in_size, decoder->dict,
+        decoder->dict + decoder->dict_offset, &out_size,
+        TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    data += in_size;
+    length -= in_size;
+
+    if (status < TINFL_STATUS_DONE) {
+      ESP_LOGE(TAG, "inflate failed: %d", status);
+      return ESP_ERR_INVALID_ARG;
+    }
+
+    if (out_size > 0) {
+      esp_err_t err = emit(decoder, decoder->dict + decoder->dict_offset,
+                           out_size);
+      if (err != ESP_OK) {
+        return err;
+      }
+      decoder->dict_offset =
+          (decoder->dict_offset + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (status == TINFL_STATUS_DONE) {
+      decoder->done = true;
+    } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+      break;
+    }
+  }
+
+  if (length > 0) {
+    ESP_LOGE(TAG, "trailing data after compressed stream");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
+
+esp_err_t image_decoder_finish(struct image_decoder *decoder) {
+  if (!decoder->done) {
+    ESP_LOGE(TAG, "compressed stream is incomplete");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (decoder->delta.header_length > 0 || decoder->delta.insert_remaining > 0) {
+    ESP_LOGE(TAG, "delta stream is incomplete");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
+
+void image_decoder_free(struct image_decoder *decoder) { free(decoder); }
@@ -0,0 +1,33 @@
+#pragma once
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum image_encoding {
+  // Image is sent as-is.
+  IMAGE_ENCODING_RAW = 0,
+  // Image is zlib-compressed.
+  IMAGE_ENCODING_ZLIB,
+  // Image is a zlib-compressed delta against the running image.
+  IMAGE_ENCODING_DELTA,
+};
+
+typedef esp_err_t (*image_decoder_write_fn)(const uint8_t *data,
+                                            size_t length);
+
+struct image_decoder;
+
+// Creates a streaming decoder for a compressed or delta image. Decoded data
+// is passed on to `write` as it becomes available. For delta images, `base`
+// is the partition the delta was computed against. Raw images need no
+// decoder.
+struct image_decoder *image_decoder_create(enum image_encoding encoding,
+                                           const esp_partition_t *base,
+                                           image_decoder_write_fn write);
+esp_err_t image_decoder_write(struct image_decoder *decoder,
+                              const uint8_t *data, size_t length);
+
+// Checks that the encoded stream was complete.
+esp_err_t image_decoder_finish(struct image_decoder *decoder);
+void image_decoder_free(struct image_decoder *decoder);
@@ -1,6 +1,8 @@
 #include "indicator.h"
 
 #include "ble.h"
+#include "chunked_ota.h"
+#include "event_loops.h"
 #include "light.h"
 #include <esp_log.h>
 #include <esp_wifi.h>
@@ -80,10 +82,17 @@ static void indicator_event_handler(void *arg, esp_event_base_t event_base,
   } else if (event_base == MQTT_OTA_EVENT &&
              event_id == MQTT_OTA_EVENT_STARTED) {
     led_indicator_start(primary_handle, PRIMARY_INDICATOR_OTA);
+  } else if (event_base == CHUNKED_OTA_EVENT &&
+             event_id == CHUNKED_OTA_EVENT_STARTED) {
+    led_indicator_start(primary_handle, PRIMARY_INDICATOR_OTA);
   } else if (event_base == MQTT_OTA_EVENT &&
              (event_id == MQTT_OTA_EVENT_FAILED ||
               event_id == MQTT_OTA_EVENT_FINISHED)) {
     led_indicator_stop(primary_handle, PRIMARY_INDICATOR_OTA);
+  } else if (event_base == CHUNKED_OTA_EVENT &&
+             (event_id == CHUNKED_OTA_EVENT_FAILED ||
+              event_id == CHUNKED_OTA_EVENT_FINISHED)) {
+    led_indicator_stop(primary_handle, PRIMARY_INDICATOR_OTA);
 #if CONFIG_RUUVI_ENABLE
   } else if (event_base == BLE_EVENT &&
              event_id == BLE_EVENT_ADVERTISMENT_MANUFACTURER_DATA) {
@@ -138,9 +147,11 @@ void indicator_init(esp_mqtt_client_handle_t mqtt_handle) {
       WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, indicator_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(MQTT_OTA_EVENT, ESP_EVENT_ANY_ID,
                                              indicator_event_handler, NULL));
-#if CONFIG_RUUVI_ENABLE
   ESP_ERROR_CHECK(esp_event_handler_register(
-      BLE_EVENT, BLE_EVENT_ADVERTISMENT_MANUFACTURER_DATA,
+      CHUNKED_OTA_EVENT, ESP_EVENT_ANY_ID, indicator_event_handler, NULL));
+#if CONFIG_RUUVI_ENABLE
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      telemetry_loop, BLE_EVENT, BLE_EVENT_ADVERTISMENT_MANUFACTURER_DATA,
       indicator_event_handler, NULL));
 #endif
 
@@ -1,9 +1,13 @@
 #include "light.h"
 #include "button.h"
 #include "config.h"
+#include "event_loops.h"
+#include "hot_path.h"
+#include "power.h"
 #include <driver/gpio.h>
 #include <led_indicator.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 
 #define TAG "light"
@@ -18,18 +22,115 @@
 #define DUTY_RESOLUTION (13)
 #define DUTY_MAX_BRIGHTNESS (1 << DUTY_RESOLUTION)
 
+#define CONFIG_KEY_SIZE 16
+
+// Changes of the light state are saved this long after the first one, so
+// that switching never waits for flash, and a burst of switching costs a
+// single NVS write.
+#define STATE_SAVE_DELAY_US (2 * 1000 * 1000)
+
 ESP_EVENT_DEFINE_BASE(LIGHT_EVENT);
 
+// Every channel drives its CONTROL pin through its own LEDC channel, reads
+// back the actual light state on its STATE pin, and follows the wall switch
+// wired to its INPUT pin. LEDC channels 0 and 1 are used by the indicator.
+struct light_channel {
+  gpio_num_t control;
+  gpio_num_t input;
+  gpio_num_t state;
+  ledc_channel_t ledc;
+  char group_key[CONFIG_KEY_SIZE];
+  char brightness_key[CONFIG_KEY_SIZE];
+  // Cached from the config, see load_options.
+  uint8_t group;
+  int32_t brightness;
+};
+
+#if CONFIG_LIGHT_CHANNELS > 2 && (!defined(CONFIG_HW_GPIO_CONTROL_2_NUM) ||   \
+                                  !defined(CONFIG_HW_GPIO_INPUT_2_NUM) ||     \
+                                  !defined(CONFIG_HW_GPIO_STATE_2_NUM))
+#error "Pins of light channel 2 must be configured"
+#endif
+#if CONFIG_LIGHT_CHANNELS > 3 && (!defined(CONFIG_HW_GPIO_CONTROL_3_NUM) ||   \
+                                  !defined(CONFIG_HW_GPIO_INPUT_3_NUM) ||     \
+                                  !defined(CONFIG_HW_GPIO_STATE_3_NUM))
+#error "Pins of light channel 3 must be configured"
+#endif
+
+static struct light_channel channels[CONFIG_LIGHT_CHANNELS] = {
+    {CONFIG_HW_GPIO_CONTROL_NUM, CONFIG_HW_GPIO_INPUT_NUM,
+     CONFIG_HW_GPIO_STATE_NUM, LEDC_CHANNEL_2},
+#if CONFIG_LIGHT_CHANNELS > 1
+    {CONFIG_HW_GPIO_CONTROL_1_NUM, CONFIG_HW_GPIO_INPUT_1_NUM,
+     CONFIG_HW_GPIO_STATE_1_NUM, LEDC_CHANNEL_3},
+#endif
+#if CONFIG_LIGHT_CHANNELS > 2
+    {CONFIG_HW_GPIO_CONTROL_2_NUM, CONFIG_HW_GPIO_INPUT_2_NUM,
+     CONFIG_HW_GPIO_STATE_2_NUM, LEDC_CHANNEL_4},
+#endif
+#if CONFIG_LIGHT_CHANNELS > 3
+    {CONFIG_HW_GPIO_CONTROL_3_NUM, CONFIG_HW_GPIO_INPUT_3_NUM,
+     CONFIG_HW_GPIO_STATE_3_NUM, LEDC_CHANNEL_5},
+#endif
+};
+
 static nvs_handle_t handle;
+// Last level set on every channel, saved as the `state` NVS key.
+static portMUX_TYPE levels_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t levels;
+static esp_timer_handle_t state_save_timer;
+
+// Switching runs on the ESP-NOW receive callback, so the options it uses are
+// cached rather than read from NVS every time, and reloaded when the config
+// changes.
+static struct {
+  bool fade;
+  int32_t fade_time;
+} options;
+
+static void load_options() {
+  options.fade = config_get_bool_or("fade", true);
+  options.fade_time = config_get_i32_or("fade_time", 200);
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    struct light_channel *channel = &channels[i];
+    channel->group = config_get_i32_or(channel->group_key, 0);
+    channel->brightness = config_get_i32_or(channel->brightness_key, 100);
+  }
+}
+
+static void post_state(int32_t event_id, size_t channel, int value) {
+  struct light_event_state event = {
+      .channel = channel,
+      .value = value,
+  };
+  control_event_post(LIGHT_EVENT, event_id, &event, sizeof(event), 0);
+}
 
 static void event_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data) {
   if (event_base == BUTTON_EVENT) {
-    int value = gpio_get_level(CONFIG_HW_GPIO_STATE_NUM);
-    esp_event_post(LIGHT_EVENT, LIGHT_EVENT_INPUT_CHANGED, &value,
-                   sizeof(value), 0);
-    esp_event_post(LIGHT_EVENT, LIGHT_EVENT_STATE_CHANGED, &value,
-                   sizeof(value), 0);
+    uint8_t pin = *(const uint8_t *)event_data;
+    for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+      if (channels[i].input == pin) {
+        power_hold(CONFIG_POWER_HOLD_MS);
+        int value = gpio_get_level(channels[i].state);
+        post_state(LIGHT_EVENT_INPUT_CHANGED, i, value);
+        post_state(LIGHT_EVENT_STATE_CHANGED, i, value);
+      }
+    }
+  } else if (event_base == CONFIG_EVENT) {
+    load_options();
+  }
+}
+
+static void save_state(void *arg) {
+  portENTER_CRITICAL(&levels_lock);
+  uint8_t state = levels;
+  portEXIT_CRITICAL(&levels_lock);
+
+  nvs_set_u8(handle, "state", state);
+  if (nvs_commit(handle) != ESP_OK) {
+    ESP_LOGE(TAG, "cannot commit nvs");
   }
 }
 
@@ -43,21 +144,38 @@ void light_init() {
   };
   ledc_timer_config(&timer_config);
 
-  ledc_channel_config_t control_config = {
-      .gpio_num = CONFIG_HW_GPIO_CONTROL_NUM,
-      .speed_mode = LEDC_LOW_SPEED_MODE,
-      .channel = LEDC_CHANNEL_2,
-      .timer_sel = LEDC_TIMER_1,
-      .intr_type = LEDC_INTR_DISABLE,
-      .duty = 0,
-      .hpoint = 0,
-      .flags.output_invert = 0,
-  };
-  ledc_channel_config(&control_config);
+  uint64_t state_pins = 0;
+  uint64_t input_pins = 0;
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    struct light_channel *channel = &channels[i];
+    ledc_channel_config_t control_config = {
+        .gpio_num = channel->control,
+        .speed_mode = LEDC_LOW_SPEED_MODE,
+        .channel = channel->ledc,
+        .timer_sel = LEDC_TIMER_1,
+        .intr_type = LEDC_INTR_DISABLE,
+        .duty = 0,
+        .hpoint = 0,
+        .flags.output_invert = 0,
+    };
+    ledc_channel_config(&control_config);
+
+    state_pins |= 1ull << channel->state;
+    input_pins |= 1ull << channel->input;
+
+    if (i == 0) {
+      snprintf(channel->group_key, CONFIG_KEY_SIZE, "group");
+      snprintf(channel->brightness_key, CONFIG_KEY_SIZE, "brightness");
+    } else {
+      snprintf(channel->group_key, CONFIG_KEY_SIZE, "group%zu", i);
+      snprintf(channel->brightness_key, CONFIG_KEY_SIZE, "brightness%zu", i);
+    }
+  }
   ledc_fade_func_install(0);
+  load_options();
 
   gpio_config_t gpio_state_cfg = {
-      .pin_bit_mask = (1 << CONFIG_HW_GPIO_STATE_NUM),
+      .pin_bit_mask = state_pins,
       .mode = GPIO_MODE_INPUT,
       .pull_up_en = GPIO_PULLUP_DISABLE,
       .pull_down_en = GPIO_PULLDOWN_DISABLE,
@@ -65,39 +183,104 @@ void light_init() {
   };
   gpio_config(&gpio_state_cfg);
 
-  button_init(1 << CONFIG_HW_GPIO_INPUT_NUM);
-  ESP_ERROR_CHECK(esp_event_handler_register(BUTTON_EVENT, ESP_EVENT_ANY_ID,
-                                             &event_handler, NULL));
+  button_init(input_pins);
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, BUTTON_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
+  // Registered before local control's handler, which reads the new groups.
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &event_handler, NULL));
 
+  // The state is a bit mask of the channels which are on, which reads the
+  // same as the single state of older versions.
   ESP_ERROR_CHECK(nvs_open("light", NVS_READWRITE, &handle));
+  esp_timer_create_args_t state_save_args = {
+      .callback = save_state,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "light_save",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&state_save_args, &state_save_timer));
+
   uint8_t state;
   esp_err_t err = nvs_get_u8(handle, "state", &state);
   if (err == ESP_OK) {
-    light_set_state(state, false);
+    // Restoring the saved state doesn't save it again.
+    levels = state & LIGHT_CHANNELS_ALL;
+    light_set_state(state & LIGHT_CHANNELS_ALL, true, false);
+    light_set_state(~state & LIGHT_CHANNELS_ALL, false, false);
+  }
+}
+
+bool light_get_state(size_t channel) {
+  return gpio_get_level(channels[channel].state);
+}
+
+HOT_PATH uint8_t light_get_group(size_t channel) {
+  return channels[channel].group;
+}
+
+HOT_PATH uint32_t light_group_channels(uint8_t group) {
+  uint32_t mask = 0;
+  if (group == 0) {
+    return mask;
+  }
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    if (light_get_group(i) == group) {
+      mask |= LIGHT_CHANNEL_MASK(i);
+    }
+  }
+  return mask;
+}
+
+HOT_PATH static uint32_t channel_duty(const struct light_channel *channel,
+                                      bool level) {
+  if (!(level ^ gpio_get_level(channel->input))) {
+    return 0;
+  }
+  int32_t brightness = channel->brightness;
+  if (brightness <= 0 || brightness > 100) {
+    return DUTY_MAX_BRIGHTNESS;
   }
+  return DUTY_MAX_BRIGHTNESS * brightness / 100;
 }
 
-bool light_get_state() { return gpio_get_level(CONFIG_HW_GPIO_STATE_NUM); }
+HOT_PATH void light_set_state(uint32_t channels_mask, bool level, bool fade) {
+  uint32_t mask = channels_mask & LIGHT_CHANNELS_ALL;
+  if (mask == 0) {
+    return;
+  }
 
-void light_set_state(bool level, bool fade) {
-  uint32_t duty = level ^ gpio_get_level(CONFIG_HW_GPIO_INPUT_NUM)
-                      ? DUTY_MAX_BRIGHTNESS
-                      : 0;
+  fade = fade && options.fade;
+  int32_t fade_time = options.fade_time;
+  // The LEDC clock follows the APB clock, so the frequency must not change
+  // until the fade is over.
+  power_hold(fade ? fade_time + CONFIG_POWER_HOLD_MS : CONFIG_POWER_HOLD_MS);
 
-  if (fade && config_get_bool_or("fade", true)) {
-    ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_2, duty,
-                            config_get_i32_or("fade_time", 200));
-    ledc_fade_start(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_2, LEDC_FADE_NO_WAIT);
-  } else {
-    ledc_set_duty_and_update(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_2, duty, 0);
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    if (!(mask & LIGHT_CHANNEL_MASK(i))) {
+      continue;
+    }
+    const struct light_channel *channel = &channels[i];
+    uint32_t duty = channel_duty(channel, level);
+    if (fade) {
+      ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, channel->ledc, duty,
+                              fade_time);
+      ledc_fade_start(LEDC_LOW_SPEED_MODE, channel->ledc, LEDC_FADE_NO_WAIT);
+    } else {
+      ledc_set_duty_and_update(LEDC_LOW_SPEED_MODE, channel->ledc, duty, 0);
+    }
+    post_state(LIGHT_EVENT_STATE_CHANGED, i, level);
   }
 
-  int value = level;
-  esp_event_post(LIGHT_EVENT, LIGHT_EVENT_STATE_CHANGED, &value, sizeof(value),
-                 0);
+  portENTER_CRITICAL(&levels_lock);
+  uint8_t previous = levels;
+  levels = level ? levels | mask : levels & ~mask;
+  uint8_t state = levels;
+  portEXIT_CRITICAL(&levels_lock);
 
-  nvs_set_u8(handle, "state", level ? 1 : 0);
-  if (nvs_commit(handle) != ESP_OK) {
-    ESP_LOGE(TAG, "cannot commit nvs");
+  // Group commands and forwarded packets often repeat the current state;
+  // don't spend a flash write on those. The timer is left alone if already
+  // running, as it saves the latest state anyway.
+  if (state != previous) {
+    esp_timer_start_once(state_save_timer, STATE_SAVE_DELAY_US);
   }
 }
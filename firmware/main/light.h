@@ -1,4 +1,8 @@
+#pragma once
+#include "sdkconfig.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <esp_event.h>
 
 ESP_EVENT_DECLARE_BASE(LIGHT_EVENT);
@@ -8,6 +12,22 @@ enum {
   LIGHT_EVENT_STATE_CHANGED,
 };
 
+// Data of both light events.
+struct light_event_state {
+  size_t channel;
+  int value;
+};
+
+// Channels are given as a bit mask to the functions acting on several of them.
+#define LIGHT_CHANNEL_MASK(channel) (1ul << (channel))
+#define LIGHT_CHANNELS_ALL (LIGHT_CHANNEL_MASK(CONFIG_LIGHT_CHANNELS) - 1)
+
 void light_init();
-bool light_get_state();
-void light_set_state(bool level, bool fade);
+bool light_get_state(size_t channel);
+void light_set_state(uint32_t channels_mask, bool level, bool fade);
+
+// Group the channel belongs to, from the `group` config key of the first
+// channel and `group1`, `group2`... for the others. 0 is no group.
+uint8_t light_get_group(size_t channel);
+// Channels belonging to the group.
+uint32_t light_group_channels(uint8_t group);
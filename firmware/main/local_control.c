@@ -1,14 +1,37 @@
+#define LOG_LOCAL_LEVEL CONFIG_LOCAL_CONTROL_LOG_LEVEL
+
 #include "local_control.h"
+#include "byteorder.h"
 #include "light.h"
 #include "config.h"
+#include "deferred_log.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
+#include "hot_path.h"
+#include "payload.h"
+#include "power.h"
+#include "scan_scheduler.h"
 #include <cJSON.h>
 #include <esp_log.h>
 #include <esp_mac.h>
 #include <esp_now.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <nvs_flash.h>
 
 #define TAG "local_control"
 
+// A group command received from the broker is not forwarded over ESP-NOW if
+// the same state was received from a peer this recently: some other member of
+// the group already got it first and forwarded it.
+#define GROUP_FORWARD_SUPPRESS_US (500 * 1000)
+
+// Changes of group states are saved this long after the first one, so that
+// bursts of switching cost a single NVS write.
+#define SYNC_SAVE_DELAY_US (2 * 1000 * 1000)
+
 // TODO: check for self-messages
 // TODO: check if setting peers multiple times removes the old ones
 
@@ -16,42 +39,446 @@ static nvs_handle_t my_handle;
 static char *peers_topic;
 static char *peers_set_topic;
 
-enum {
-  LOCAL_CONTROL_LIGHT_STATE = 0,
+// Command topics of the groups of the light channels, NULL where a channel
+// has no group or shares the group of an earlier channel.
+static SemaphoreHandle_t group_topic_lock;
+static struct {
+  uint8_t group;
+  char *topic;
+} group_topics[CONFIG_LIGHT_CHANNELS];
+
+static portMUX_TYPE last_received_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+  int64_t time;
+  uint8_t group;
+  uint8_t value;
+} last_received;
+
+static local_control_handler_t handlers[LOCAL_CONTROL_PACKET_MAX];
+
+// Light state packets: type, group and value, as understood by every
+// firmware version.
+#define LIGHT_STATE_PACKET_SIZE 3
+// State version and sync packets: type, group, value, the version of the
+// group state, little-endian, and the address of the node which made the
+// change.
+#define STATE_PACKET_SIZE 13
+
+// Last known state of the groups of this node's channels, saved as the
+// `sync` NVS key. A change of the state of a group made by a node gets the
+// highest version that node has seen for the group plus one, and the state
+// with the highest version wins. Concurrent changes can get the same version,
+// and the one made by the node with the highest address wins, so that every
+// node settles on the same state.
+//
+// Nodes ask their peers for the state of their groups whenever they join the
+// network, and peers which hear an older state than theirs answer with it.
+struct group_state {
+  uint8_t group; // 0 for an unused entry
+  uint8_t value;
+  uint32_t version;
+  uint8_t origin[6];
+};
+
+static uint8_t self_mac[6];
+static SemaphoreHandle_t sync_lock;
+static struct group_state sync_groups[CONFIG_LIGHT_CHANNELS];
+// Whether sync_groups changed since it was last saved.
+static bool sync_dirty;
+static esp_timer_handle_t sync_save_timer;
+static struct {
+  uint32_t queries;
+  uint32_t answered;
+  uint32_t corrected;
+  uint32_t diverged;
+} sync_stats;
+
+enum sync_result {
+  SYNC_IGNORE,
+  SYNC_APPLY,
+  SYNC_STALE,
 };
 
-static void recv_callback(const esp_now_recv_info_t *info, const uint8_t *data,
-                          int data_len) {
-  ESP_LOGI(TAG, "got packet from " MACSTR ", %d bytes", MAC2STR(info->src_addr),
-           data_len);
+// Must be called with the sync lock held.
+HOT_PATH static struct group_state *find_group_state(uint8_t group) {
+  if (group == 0 || light_group_channels(group) == 0) {
+    return NULL;
+  }
+
+  struct group_state *unused = NULL;
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    struct group_state *state = &sync_groups[i];
+    if (state->group == group) {
+      return state;
+    }
+    if (unused == NULL &&
+        (state->group == 0 || light_group_channels(state->group) == 0)) {
+      unused = state;
+    }
+  }
+
+  if (unused != NULL) {
+    unused->group = group;
+    unused->value = 0;
+    unused->version = 0;
+    memset(unused->origin, 0, sizeof(unused->origin));
+  }
+  return unused;
+}
+
+// Schedules saving the group states. Must be called with the sync lock held.
+HOT_PATH static void mark_group_states_dirty() {
+  if (!sync_dirty) {
+    sync_dirty = true;
+    esp_timer_start_once(sync_save_timer, SYNC_SAVE_DELAY_US);
+  }
+}
+
+// Saves the group states, on the esp_timer task rather than from the
+// callbacks changing them.
+static void save_group_states(void *arg) {
+  struct group_state groups[CONFIG_LIGHT_CHANNELS];
+  xSemaphoreTake(sync_lock, portMAX_DELAY);
+  bool dirty = sync_dirty;
+  sync_dirty = false;
+  memcpy(groups, sync_groups, sizeof(groups));
+  xSemaphoreGive(sync_lock);
+
+  if (!dirty) {
+    return;
+  }
+  nvs_set_blob(my_handle, "sync", groups, sizeof(groups));
+  if (nvs_commit(my_handle) != ESP_OK) {
+    ESP_LOGE(TAG, "cannot commit nvs");
+  }
+}
+
+static void load_group_states() {
+  size_t size = sizeof(sync_groups);
+  if (nvs_get_blob(my_handle, "sync", sync_groups, &size) != ESP_OK ||
+      size != sizeof(sync_groups)) {
+    memset(sync_groups, 0, sizeof(sync_groups));
+  }
+}
+
+// Compares two states of a group by version, then by origin.
+HOT_PATH static int compare_group_states(const struct group_state *a,
+                                         const struct group_state *b) {
+  if (a->version != b->version) {
+    return a->version > b->version ? 1 : -1;
+  }
+  return memcmp(a->origin, b->origin, sizeof(a->origin));
+}
+
+// Records a change of the state of a group made by this node into `state`,
+// which is then announced. The version is one more than the highest version
+// heard for the group: every state heard with a higher version was applied.
+static void sync_local_change(struct group_state *state) {
+  xSemaphoreTake(sync_lock, portMAX_DELAY);
+  struct group_state *local = find_group_state(state->group);
+  if (local != NULL) {
+    local->version += 1;
+    local->value = state->value;
+    memcpy(local->origin, self_mac, sizeof(local->origin));
+    *state = *local;
+    mark_group_states_dirty();
+  }
+  xSemaphoreGive(sync_lock);
+}
+
+// Merges the state of a group heard from a peer. On SYNC_STALE, `state` is
+// set to the newer state this node knows of.
+HOT_PATH static enum sync_result
+sync_remote_state(struct group_state *state) {
+  enum sync_result result = SYNC_IGNORE;
+  xSemaphoreTake(sync_lock, portMAX_DELAY);
+  struct group_state *local = find_group_state(state->group);
+  if (local != NULL) {
+    int order = compare_group_states(state, local);
+    if (order > 0) {
+      *local = *state;
+      mark_group_states_dirty();
+      result = SYNC_APPLY;
+    } else if (order < 0) {
+      *state = *local;
+      result = SYNC_STALE;
+    }
+  }
+  xSemaphoreGive(sync_lock);
+  return result;
+}
+
+HOT_PATH static void send_group_state(const uint8_t *peer, uint8_t type,
+                                      const struct group_state *state) {
+  uint8_t packet[STATE_PACKET_SIZE] = {type, state->group, state->value};
+  write_32le(packet + 3, state->version);
+  memcpy(packet + 7, state->origin, sizeof(state->origin));
+  esp_now_send(peer, packet, sizeof(packet));
+}
+
+// A change made by a node is announced with a light state packet, which
+// switches the group right away, on older nodes too, followed by a state
+// version packet giving its version, which older nodes ignore.
+HOT_PATH static void on_light_state(const uint8_t *data) {
+  uint8_t group = data[1];
+  uint8_t value = data[2];
+  DLOGI(TAG, "set-state %d", value);
+
+  portENTER_CRITICAL(&last_received_lock);
+  last_received.time = esp_timer_get_time();
+  last_received.group = group;
+  last_received.value = value;
+  portEXIT_CRITICAL(&last_received_lock);
+
+  light_set_state(light_group_channels(group), value, /* fade */ false);
+}
+
+HOT_PATH static void on_versioned_state(const esp_now_recv_info_t *info,
+                                        const uint8_t *data) {
+  struct group_state state = {
+      .group = data[1],
+      .value = data[2],
+      .version = read_32le(data + 3),
+  };
+  memcpy(state.origin, data + 7, sizeof(state.origin));
+
+  switch (sync_remote_state(&state)) {
+  case SYNC_IGNORE:
+    return;
+  case SYNC_STALE:
+    sync_stats.corrected += 1;
+    send_group_state(info->src_addr, LOCAL_CONTROL_STATE_SYNC, &state);
+    if (data[0] == LOCAL_CONTROL_STATE_VERSION) {
+      // The light state packet announcing the change switched the group
+      // already: switch it back.
+      light_set_state(light_group_channels(state.group), state.value,
+                      /* fade */ false);
+    }
+    return;
+  case SYNC_APPLY:
+    break;
+  }
+
+  if (data[0] == LOCAL_CONTROL_STATE_SYNC) {
+    uint32_t channels = light_group_channels(state.group);
+    for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+      if ((channels & LIGHT_CHANNEL_MASK(i)) &&
+          light_get_state(i) != state.value) {
+        sync_stats.diverged += 1;
+        break;
+      }
+    }
+  }
+
+  light_set_state(light_group_channels(state.group), state.value,
+                  /* fade */ false);
+}
+
+HOT_PATH static void on_state_query(const esp_now_recv_info_t *info,
+                                    uint8_t group) {
+  xSemaphoreTake(sync_lock, portMAX_DELAY);
+  struct group_state *local = find_group_state(group);
+  struct group_state state = {0};
+  if (local != NULL) {
+    state = *local;
+  }
+  xSemaphoreGive(sync_lock);
+
+  if (state.version > 0) {
+    sync_stats.answered += 1;
+    send_group_state(info->src_addr, LOCAL_CONTROL_STATE_SYNC, &state);
+  }
+}
+
+static void query_group_states() {
+  uint32_t queried = 0;
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    uint8_t group = light_get_group(i);
+    if (group > 0 && !(light_group_channels(group) & queried)) {
+      uint8_t packet[] = {LOCAL_CONTROL_STATE_QUERY, group};
+      esp_now_send(NULL, packet, sizeof(packet));
+      queried |= LIGHT_CHANNEL_MASK(i);
+      sync_stats.queries += 1;
+    }
+  }
+}
+
+HOT_PATH static void on_packet(const esp_now_recv_info_t *info,
+                               const uint8_t *data, int data_len) {
+  DLOGI(TAG, "got packet from " MACSTR ", %d bytes", MAC2STR(info->src_addr),
+        data_len);
   if (data_len == 0) {
-    ESP_LOGW(TAG, "empty esp-now packet");
+    DLOGW(TAG, "empty esp-now packet");
     return;
   }
 
   switch (data[0]) {
   case LOCAL_CONTROL_LIGHT_STATE:
-    if (data_len == 3) {
-      uint8_t group = data[1];
-      uint8_t value = data[2];
-      ESP_LOGI(TAG, "set-state %d", value);
-      if (group == config_get_i32_or("group", 0)) {
-        light_set_state(value, /* fade */ false);
-      }
+    if (data_len == LIGHT_STATE_PACKET_SIZE) {
+      on_light_state(data);
+    }
+    break;
+
+  case LOCAL_CONTROL_STATE_VERSION:
+  case LOCAL_CONTROL_STATE_SYNC:
+    if (data_len == STATE_PACKET_SIZE) {
+      on_versioned_state(info, data);
+    }
+    break;
+
+  case LOCAL_CONTROL_STATE_QUERY:
+    if (data_len == 2) {
+      on_state_query(info, data[1]);
     }
     break;
+
+  default:
+    if (data[0] < LOCAL_CONTROL_PACKET_MAX && handlers[data[0]] != NULL) {
+      handlers[data[0]](info, data, data_len);
+    }
+    break;
+  }
+}
+
+HOT_PATH static void recv_callback(const esp_now_recv_info_t *info,
+                                   const uint8_t *data, int data_len) {
+  HEAP_SUBSYSTEM(LOCAL_CONTROL);
+  int64_t start = esp_timer_get_time();
+  if (data_len > 0 && data[0] == LOCAL_CONTROL_LIGHT_STATE) {
+    power_hold(CONFIG_POWER_HOLD_MS);
+#if CONFIG_RUUVI_ENABLE
+    scan_scheduler_backoff(CONFIG_BLE_SCAN_BACKOFF_MS);
+#endif
+  }
+  on_packet(info, data, data_len);
+  dlog_callback_time(DLOG_CALLBACK_ESPNOW_RECV, start);
+}
+
+static void send_light_state(uint8_t group, uint8_t value) {
+  struct group_state state = {
+      .group = group,
+      .value = value,
+  };
+  sync_local_change(&state);
+#if CONFIG_RUUVI_ENABLE
+  scan_scheduler_backoff(CONFIG_BLE_SCAN_BACKOFF_MS);
+#endif
+  ESP_LOGI(TAG, "sending %d", value);
+  uint8_t packet[LIGHT_STATE_PACKET_SIZE] = {LOCAL_CONTROL_LIGHT_STATE, group,
+                                             value};
+  esp_now_send(NULL, packet, sizeof(packet));
+  send_group_state(NULL, LOCAL_CONTROL_STATE_VERSION, &state);
+}
+
+#define GROUP_TOPIC_FORMAT CONFIG_MQTT_GROUP_TOPIC_PREFIX "/%" PRIu8 "/command"
+
+// Subscribes to the command topics of the groups of the channels, and
+// unsubscribes from those of groups no channel belongs to anymore.
+//
+// The MQTT task holds the client's API lock while it delivers messages, and
+// then takes the group topic lock in find_group_topic, so the lock is only
+// held to swap the topic lists, never across an esp_mqtt_client_* call.
+static void subscribe_groups(esp_mqtt_client_handle_t client) {
+  uint8_t groups[CONFIG_LIGHT_CHANNELS];
+  char *topics[CONFIG_LIGHT_CHANNELS] = {NULL};
+  uint32_t subscribed = 0;
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    groups[i] = light_get_group(i);
+    if (groups[i] > 0 && !(light_group_channels(groups[i]) & subscribed)) {
+      asprintf(&topics[i], GROUP_TOPIC_FORMAT, groups[i]);
+      subscribed |= LIGHT_CHANNEL_MASK(i);
+    }
+  }
+
+  // Groups with a topic, before and after.
+  uint8_t previous[CONFIG_LIGHT_CHANNELS];
+  uint8_t current[CONFIG_LIGHT_CHANNELS];
+  xSemaphoreTake(group_topic_lock, portMAX_DELAY);
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    previous[i] = group_topics[i].topic != NULL ? group_topics[i].group : 0;
+    current[i] = topics[i] != NULL ? groups[i] : 0;
+    char *topic = group_topics[i].topic;
+    group_topics[i].group = groups[i];
+    group_topics[i].topic = topics[i];
+    // Freed outside of the lock.
+    topics[i] = topic;
   }
+  xSemaphoreGive(group_topic_lock);
+
+  char topic[sizeof(CONFIG_MQTT_GROUP_TOPIC_PREFIX) + 16];
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    free(topics[i]);
+    if (previous[i] == 0 || memchr(current, previous[i], sizeof(current))) {
+      continue;
+    }
+    snprintf(topic, sizeof(topic), GROUP_TOPIC_FORMAT, previous[i]);
+    esp_mqtt_client_unsubscribe(client, topic);
+  }
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    if (current[i] > 0) {
+      snprintf(topic, sizeof(topic), GROUP_TOPIC_FORMAT, current[i]);
+      esp_mqtt_client_subscribe(client, topic, 1);
+    }
+  }
+}
+
+// Returns the group whose command topic this is, or 0.
+static uint8_t find_group_topic(const char *topic, size_t topic_len) {
+  uint8_t group = 0;
+  xSemaphoreTake(group_topic_lock, portMAX_DELAY);
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    const char *group_topic = group_topics[i].topic;
+    if (group_topic != NULL && topic_len == strlen(group_topic) &&
+        strncmp(topic, group_topic, topic_len) == 0) {
+      group = group_topics[i].group;
+      break;
+    }
+  }
+  xSemaphoreGive(group_topic_lock);
+  return group;
+}
+
+// Applies a command sent to the whole group, and forwards it to the rest of
+// the group over ESP-NOW. Every member of the group is subscribed, but the
+// broker delivers the message to each of them at different times; the first
+// one to get it switches everyone else.
+static void on_group_command(uint8_t group, const char *data,
+                             size_t data_len) {
+  uint8_t value;
+  if (data_len == 2 && strncmp(data, "ON", data_len) == 0) {
+    value = 1;
+  } else if (data_len == 3 && strncmp(data, "OFF", data_len) == 0) {
+    value = 0;
+  } else {
+    return;
+  }
+
+  portENTER_CRITICAL(&last_received_lock);
+  bool forwarded = last_received.group == group &&
+                   last_received.value == value &&
+                   esp_timer_get_time() - last_received.time <
+                       GROUP_FORWARD_SUPPRESS_US;
+  portEXIT_CRITICAL(&last_received_lock);
+
+  if (!forwarded) {
+    send_light_state(group, value);
+  }
+  light_set_state(light_group_channels(group), value, /* fade */ false);
 }
 
 static void event_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(LOCAL_CONTROL);
+  esp_mqtt_client_handle_t client = arg;
   if (event_base == LIGHT_EVENT && event_id == LIGHT_EVENT_INPUT_CHANGED) {
-    uint8_t group = config_get_i32_or("group", 0);
+    const struct light_event_state *event = event_data;
+    uint8_t group = light_get_group(event->channel);
     if (group > 0) {
-      uint8_t packet[] = {LOCAL_CONTROL_LIGHT_STATE, group, *(const int *)event_data};
-      ESP_LOGI(TAG, "sending %d", *(const int *)event_data);
-      esp_now_send(NULL, packet, sizeof(packet));
+      send_light_state(group, event->value);
     }
+  } else if (event_base == CONFIG_EVENT &&
+             event_id == CONFIG_EVENT_CHANGED) {
+    subscribe_groups(client);
   }
 }
 
@@ -92,10 +519,12 @@ static void load_peers() {
   uint8_t *data = malloc(size);
   if (nvs_get_blob(my_handle, "peers", data, &size) != ESP_OK) {
     ESP_LOGE(TAG, "bad bad bad");
+    free(data);
     return;
   }
 
   set_peers(data, size);
+  free(data);
 }
 
 static void configure_peers(const char *payload, size_t payload_len) {
@@ -126,6 +555,7 @@ static void configure_peers(const char *payload, size_t payload_len) {
   save_peers(data, p - data);
   set_peers(data, p - data);
 
+  free(data);
   cJSON_Delete(root);
 }
 
@@ -140,6 +570,7 @@ static void publish_peers(esp_mqtt_client_handle_t client) {
   uint8_t *data = malloc(size);
   if (nvs_get_blob(my_handle, "peers", data, &size) != ESP_OK) {
     ESP_LOGE(TAG, "bad bad bad");
+    free(data);
     return;
   }
 
@@ -150,43 +581,99 @@ static void publish_peers(esp_mqtt_client_handle_t client) {
     cJSON_AddItemToArray(root, cJSON_CreateString(s));
     free(s);
   }
+  free(data);
 
-  char *payload = cJSON_PrintUnformatted(root);
-  esp_mqtt_client_enqueue(client, peers_topic, payload, 0,
-                          /* QOS */ 2, /* retain */ 1, true);
+  payload_enqueue(
+      client, peers_topic, root, "cbor_config",
+      /* QOS */ config_get_qos("qos_config", CONFIG_MQTT_QOS_CONFIG),
+      /* retain */ 1);
 
   cJSON_Delete(root);
-  free(payload);
 }
 
 static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(LOCAL_CONTROL);
   esp_mqtt_event_handle_t event = event_data;
   if (event_id == MQTT_EVENT_CONNECTED) {
     esp_mqtt_client_subscribe(event->client, peers_set_topic, 2);
     publish_peers(event->client);
+    subscribe_groups(event->client);
   } else if (event_id == MQTT_EVENT_DATA) {
     if (event->topic_len == strlen(peers_set_topic) &&
         strncmp(event->topic, peers_set_topic, event->topic_len) == 0) {
       configure_peers(event->data, event->data_len);
       publish_peers(event->client);
+    } else {
+      uint8_t group = find_group_topic(event->topic, event->topic_len);
+      if (group > 0) {
+        on_group_command(group, event->data, event->data_len);
+      }
     }
   }
 }
 
+void local_control_switch_group(uint8_t group, bool value) {
+  if (group > 0) {
+    send_light_state(group, value);
+    light_set_state(light_group_channels(group), value, /* fade */ false);
+  } else {
+    light_set_state(LIGHT_CHANNELS_ALL, value, /* fade */ false);
+  }
+}
+
+static void wifi_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(LOCAL_CONTROL);
+  query_group_states();
+}
+
+void local_control_add_metrics(cJSON *root) {
+  cJSON *sync = cJSON_AddObjectToObject(root, "group_sync");
+  cJSON_AddNumberToObject(sync, "queries", sync_stats.queries);
+  cJSON_AddNumberToObject(sync, "answered", sync_stats.answered);
+  cJSON_AddNumberToObject(sync, "corrected", sync_stats.corrected);
+  cJSON_AddNumberToObject(sync, "diverged", sync_stats.diverged);
+}
+
+void local_control_register(enum local_control_packet type,
+                            local_control_handler_t handler) {
+  handlers[type] = handler;
+}
+
 void local_control_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  HEAP_SUBSYSTEM(LOCAL_CONTROL);
   asprintf(&peers_topic, "%s/peers", prefix);
   asprintf(&peers_set_topic, "%s/peers/set", prefix);
 
   ESP_ERROR_CHECK(nvs_open("local_control", NVS_READWRITE, &my_handle));
+  ESP_ERROR_CHECK(esp_read_mac(self_mac, ESP_MAC_WIFI_STA));
+  group_topic_lock = xSemaphoreCreateMutex();
+  sync_lock = xSemaphoreCreateMutex();
+  load_group_states();
+
+  esp_timer_create_args_t sync_save_args = {
+      .callback = save_group_states,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "sync_save",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&sync_save_args, &sync_save_timer));
 
   esp_now_init();
   esp_now_register_recv_cb(recv_callback);
 
   load_peers();
 
-  ESP_ERROR_CHECK(esp_event_handler_register(
-      LIGHT_EVENT, LIGHT_EVENT_INPUT_CHANGED, &event_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, LIGHT_EVENT, LIGHT_EVENT_INPUT_CHANGED, &event_handler,
+      client));
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &event_handler,
+      client));
   ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
                                                  mqtt_event_handler, NULL));
+  // ESP-NOW follows the channel of the access point, so peers can only be
+  // reached once connected to it.
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &wifi_event_handler, NULL));
 }
@@ -1,4 +1,29 @@
 #pragma once
+#include <cJSON.h>
+#include <esp_now.h>
 #include <mqtt_client.h>
 
+// Types of ESP-NOW packets, given by their first byte.
+enum local_control_packet {
+  LOCAL_CONTROL_LIGHT_STATE = 0,
+  LOCAL_CONTROL_RUUVI_FRAME = 1,
+  LOCAL_CONTROL_RUUVI_GATEWAY = 2,
+  LOCAL_CONTROL_STATE_QUERY = 3,
+  LOCAL_CONTROL_STATE_SYNC = 4,
+  LOCAL_CONTROL_STATE_VERSION = 5,
+  LOCAL_CONTROL_PACKET_MAX,
+};
+
+// Handlers are called from the WiFi task, and should return quickly.
+typedef void (*local_control_handler_t)(const esp_now_recv_info_t *info,
+                                        const uint8_t *data, size_t data_len);
+
 void local_control_init(esp_mqtt_client_handle_t client, const char *prefix);
+void local_control_add_metrics(cJSON *root);
+// Switches the channels of a group, here and on its peers, like a press of
+// the switch of a group member would. Group 0 switches all channels of this
+// node only.
+void local_control_switch_group(uint8_t group, bool value);
+// Registers a handler for packets of the given type, other than light state.
+void local_control_register(enum local_control_packet type,
+                            local_control_handler_t handler);
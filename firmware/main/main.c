@@ -1,35 +1,183 @@
 #include "ble.h"
+#include "chunked_ota.h"
 #include "light.h"
 #include "local_control.h"
 #include "config.h"
+#include "deferred_log.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
 #include "indicator.h"
+#include "payload.h"
+#include "power.h"
+#include "rules.h"
 #include "ruuvi.h"
+#include "scan_scheduler.h"
+#include "schedule.h"
+#include "task_stats.h"
 #include <cJSON.h>
 #include <esp_app_desc.h>
 #include <esp_log.h>
+#include <esp_image_format.h>
 #include <esp_mac.h>
+#include <esp_ota_ops.h>
 #include <esp_timer.h>
 #include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <mqtt_ota.h>
 #include <nvs_flash.h>
 #include <stdio.h>
+#include <sys/time.h>
 
 #define TAG "main"
 
 struct mqtt_topics {
   char *base;
   char *status;
-  char *state;
-  char *command;
+  // One state and command topic per light channel.
+  char *state[CONFIG_LIGHT_CHANNELS];
+  char *command[CONFIG_LIGHT_CHANNELS];
   char *metrics;
+  char *firmware;
   char *ota;
 };
 
 static struct mqtt_topics topics;
 esp_mqtt_client_handle_t mqtt_handle;
 
+// State publishes are coalesced: at most one is in flight at any time, and
+// changes that happen while waiting for its acknowledgement only keep the
+// latest value. Every light channel has its own publisher.
+//
+// The MQTT task holds the client's API lock while it runs the event
+// handler, which completes publishes, so the publisher lock is never held
+// across an esp_mqtt_client_* call: the next value is picked under the lock,
+// and enqueued after leaving it.
+#define PUBLISH_NONE -1
+// An enqueue is under way, whose message ID is not known yet.
+#define PUBLISH_ENQUEUEING 0
+
+struct state_publisher {
+  portMUX_TYPE lock;
+  int msg_id;  // In-flight message, PUBLISH_ENQUEUEING or PUBLISH_NONE
+  int pending; // Value to publish once the in-flight message completes, or -1
+  // Message completed while enqueueing, in case the acknowledgement comes
+  // before esp_mqtt_client_enqueue returns.
+  int completed;
+  uint32_t published_count;
+  uint32_t superseded_count;
+};
+
+static struct state_publisher state_publishers[CONFIG_LIGHT_CHANNELS];
+
+// Publishes the value, then whatever value got pending meanwhile. Must be
+// called after setting msg_id to PUBLISH_ENQUEUEING.
+static void publish_state_send(size_t channel, int value) {
+  struct state_publisher *publisher = &state_publishers[channel];
+  while (value >= 0) {
+    int qos = config_get_qos("qos_state", CONFIG_MQTT_QOS_STATE);
+    int msg_id =
+        esp_mqtt_client_enqueue(mqtt_handle, topics.state[channel],
+                                value ? "ON" : "OFF", 0, qos, 1, true);
+
+    value = -1;
+    portENTER_CRITICAL(&publisher->lock);
+    publisher->published_count += 1;
+    // QoS 0 messages are never acknowledged, so there is nothing to wait
+    // for.
+    if (qos > 0 && msg_id > 0 && publisher->completed != msg_id) {
+      publisher->msg_id = msg_id;
+    } else if (publisher->pending >= 0) {
+      value = publisher->pending;
+      publisher->pending = -1;
+    } else {
+      publisher->msg_id = PUBLISH_NONE;
+    }
+    publisher->completed = -1;
+    portEXIT_CRITICAL(&publisher->lock);
+  }
+}
+
+static void publish_state(size_t channel, int value) {
+  struct state_publisher *publisher = &state_publishers[channel];
+  bool send = false;
+  portENTER_CRITICAL(&publisher->lock);
+  if (publisher->msg_id != PUBLISH_NONE) {
+    if (publisher->pending >= 0) {
+      publisher->superseded_count += 1;
+    }
+    publisher->pending = value;
+  } else {
+    publisher->msg_id = PUBLISH_ENQUEUEING;
+    send = true;
+  }
+  portEXIT_CRITICAL(&publisher->lock);
+
+  if (send) {
+    publish_state_send(channel, value);
+  }
+}
+
+static void publish_state_completed(int msg_id) {
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    struct state_publisher *publisher = &state_publishers[i];
+    int value = -1;
+    portENTER_CRITICAL(&publisher->lock);
+    if (publisher->msg_id == PUBLISH_ENQUEUEING) {
+      publisher->completed = msg_id;
+    } else if (publisher->msg_id > 0 && publisher->msg_id == msg_id) {
+      publisher->msg_id = PUBLISH_NONE;
+      if (publisher->pending >= 0) {
+        value = publisher->pending;
+        publisher->pending = -1;
+        publisher->msg_id = PUBLISH_ENQUEUEING;
+      }
+    }
+    portEXIT_CRITICAL(&publisher->lock);
+
+    if (value >= 0) {
+      publish_state_send(i, value);
+    }
+  }
+}
+
+static void publish_state_reset() {
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    struct state_publisher *publisher = &state_publishers[i];
+    portENTER_CRITICAL(&publisher->lock);
+    publisher->msg_id = PUBLISH_ENQUEUEING;
+    publisher->pending = -1;
+    portEXIT_CRITICAL(&publisher->lock);
+
+    publish_state_send(i, light_get_state(i));
+  }
+}
+
+static void state_publishers_init() {
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    portMUX_INITIALIZE(&state_publishers[i].lock);
+    state_publishers[i].msg_id = PUBLISH_NONE;
+    state_publishers[i].pending = -1;
+    state_publishers[i].completed = -1;
+  }
+}
+
+static esp_timer_handle_t restart_timer;
+
+static void restart(void *arg) { esp_restart(); }
+
+static void restart_init() {
+  esp_timer_create_args_t args = {
+      .callback = restart,
+      .name = "restart",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&args, &restart_timer));
+}
+
 static void event_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(MAIN);
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
     esp_wifi_connect();
   } else if (event_base == WIFI_EVENT &&
@@ -39,10 +187,10 @@ static void event_handler(void *arg, esp_event_base_t event_base,
     esp_mqtt_client_reconnect(mqtt_handle);
   } else if (event_base == LIGHT_EVENT &&
              event_id == LIGHT_EVENT_STATE_CHANGED) {
-    int value = *(const int *)event_data;
-    ESP_LOGI(TAG, "got notification %d", value);
-    esp_mqtt_client_publish(mqtt_handle, topics.state, value ? "ON" : "OFF", 0,
-                            2, 1);
+    const struct light_event_state *event = event_data;
+    ESP_LOGI(TAG, "got notification %d on channel %zu", event->value,
+             event->channel);
+    publish_state(event->channel, event->value);
   } else if (event_base == MQTT_OTA_EVENT &&
              event_id == MQTT_OTA_EVENT_STARTED) {
     ESP_LOGI(TAG, "OTA started...");
@@ -50,34 +198,54 @@ static void event_handler(void *arg, esp_event_base_t event_base,
              event_id == MQTT_OTA_EVENT_FINISHED) {
     ESP_LOGI(TAG, "OTA done. Restarting now");
     esp_restart();
+  } else if (event_base == CHUNKED_OTA_EVENT &&
+             event_id == CHUNKED_OTA_EVENT_FINISHED) {
+    // Give the MQTT client a chance to deliver the final progress message,
+    // without holding up the event loop meanwhile.
+    ESP_LOGI(TAG, "OTA done. Restarting shortly");
+    esp_timer_start_once(restart_timer, 1000 * 1000);
   }
 }
 
 static void on_mqtt_message(const char *topic, size_t topic_len,
                             const char *data, size_t data_len) {
-  if (topic_len == strlen(topics.command) && strncmp(topic, topics.command, topic_len) == 0) {
-    if (data_len == 2 && strncmp(data, "ON", data_len) == 0) {
-      light_set_state(true, true);
-    } else if (data_len == 3 && strncmp(data, "OFF", data_len) == 0) {
-      light_set_state(false, true);
-    } else if (data_len == 7 && strncmp(data, "restart", data_len) == 0) {
-      esp_restart();
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    if (topic_len == strlen(topics.command[i]) &&
+        strncmp(topic, topics.command[i], topic_len) == 0) {
+      if (data_len == 2 && strncmp(data, "ON", data_len) == 0) {
+        light_set_state(LIGHT_CHANNEL_MASK(i), true, true);
+      } else if (data_len == 3 && strncmp(data, "OFF", data_len) == 0) {
+        light_set_state(LIGHT_CHANNEL_MASK(i), false, true);
+      } else if (data_len == 7 && strncmp(data, "restart", data_len) == 0) {
+        esp_restart();
+      }
     }
   }
 }
 
+static esp_timer_handle_t metrics_now_timer;
+
 static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(MAIN);
   esp_mqtt_event_handle_t event = event_data;
 
   if (event_id == MQTT_EVENT_CONNECTED) {
-    esp_mqtt_client_subscribe(mqtt_handle, topics.command, 2);
+    for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+      esp_mqtt_client_subscribe(mqtt_handle, topics.command[i], 2);
+    }
     esp_mqtt_client_enqueue(mqtt_handle, topics.status, "Online", 0, 2, 1,
                             true);
+    publish_state_reset();
 
-    int state = light_get_state();
-    esp_mqtt_client_enqueue(mqtt_handle, topics.state,
-                            state ? "ON" : "OFF", 0, 2, 1, true);
+    // Publishing metrics right away lets the management tool confirm the
+    // running firmware version after an update or restart. They are built
+    // on the esp_timer task like the periodic ones, since the reports
+    // cover the time since the previous publication.
+    esp_timer_start_once(metrics_now_timer, 0);
+  } else if (event_id == MQTT_EVENT_PUBLISHED ||
+             event_id == MQTT_EVENT_DELETED) {
+    publish_state_completed(event->msg_id);
   } else if (event_id == MQTT_EVENT_DATA) {
     on_mqtt_message(event->topic, event->topic_len, event->data,
                     event->data_len);
@@ -107,20 +275,30 @@ static void wifi_init() {
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
   ESP_ERROR_CHECK(esp_wifi_start());
+#if CONFIG_POWER_WIFI_MAX_MODEM
+  ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+#endif
 
   ESP_LOGI(TAG, "wifi_init_sta finished.");
 }
 
 extern const uint8_t isrgrootx1_pem_start[] asm("_binary_isrgrootx1_pem_start");
 void mqtt_init() {
+  HEAP_SUBSYSTEM(MAIN);
   uint8_t mac[6];
   esp_read_mac(mac, ESP_MAC_WIFI_STA);
 
   asprintf(&topics.base, "%s/" MACSTR, CONFIG_MQTT_TOPIC_PREFIX, MAC2STR(mac));
   asprintf(&topics.status, "%s/status", topics.base);
-  asprintf(&topics.state, "%s/state", topics.base);
-  asprintf(&topics.command, "%s/command", topics.base);
+  // The first light channel keeps the topics of single-channel boards.
+  asprintf(&topics.state[0], "%s/state", topics.base);
+  asprintf(&topics.command[0], "%s/command", topics.base);
+  for (size_t i = 1; i < CONFIG_LIGHT_CHANNELS; i++) {
+    asprintf(&topics.state[i], "%s/%zu/state", topics.base, i);
+    asprintf(&topics.command[i], "%s/%zu/command", topics.base, i);
+  }
   asprintf(&topics.metrics, "%s/metrics", topics.base);
+  asprintf(&topics.firmware, "%s/firmware", topics.base);
   asprintf(&topics.ota, "%s/ota", topics.base);
 
   const esp_mqtt_client_config_t mqtt_cfg = {
@@ -156,7 +334,47 @@ void mqtt_init() {
   esp_mqtt_client_start(mqtt_handle);
 }
 
+#if CONFIG_RUUVI_ENABLE
+// Heap taken by bringing up the BLE host stack and controller, to compare
+// the scanner backends.
+static size_t ble_heap;
+#endif
+
+// Size of the running image, to compare the footprint of different builds.
+static uint32_t firmware_size() {
+  static uint32_t size = 0;
+  if (size == 0) {
+    const esp_partition_t *partition = esp_ota_get_running_partition();
+    esp_partition_pos_t position = {
+        .offset = partition->address,
+        .size = partition->size,
+    };
+    esp_image_metadata_t metadata;
+    if (esp_image_get_metadata(&position, &metadata) == ESP_OK) {
+      size = metadata.image_len;
+    }
+  }
+  return size;
+}
+
+// The firmware report of the metrics, retained so that the fleet inventory
+// knows what every device runs, offline ones included, and when the device
+// last said so. The time is left out until SNTP has set the clock.
+static void publish_firmware(const cJSON *firmware, int qos) {
+  cJSON *root = cJSON_Duplicate(firmware, /* recurse */ true);
+  cJSON_AddNumberToObject(root, "millis", esp_timer_get_time() / 1000);
+  if (schedule_time_synced()) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    cJSON_AddNumberToObject(root, "time", now.tv_sec);
+  }
+  payload_enqueue(mqtt_handle, topics.firmware, root, "cbor_metrics", qos,
+                  /* retain */ 1);
+  cJSON_Delete(root);
+}
+
 static void publish_metrics(void *arg) {
+  HEAP_SUBSYSTEM(MAIN);
   cJSON *root = cJSON_CreateObject();
   cJSON_AddNumberToObject(root, "millis", esp_timer_get_time() / 1000);
   cJSON_AddNumberToObject(root, "current_free_bytes",
@@ -169,6 +387,16 @@ static void publish_metrics(void *arg) {
     cJSON_AddNumberToObject(root, "wifi_rssi", rssi);
   }
 
+  uint32_t published = 0;
+  uint32_t superseded = 0;
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    published += state_publishers[i].published_count;
+    superseded += state_publishers[i].superseded_count;
+  }
+  cJSON *state = cJSON_AddObjectToObject(root, "state_publishes");
+  cJSON_AddNumberToObject(state, "published", published);
+  cJSON_AddNumberToObject(state, "superseded", superseded);
+
   extern const char project_build_date[];
 
   const esp_app_desc_t* app = esp_app_get_description();
@@ -176,12 +404,35 @@ static void publish_metrics(void *arg) {
   cJSON_AddStringToObject(firmware, "name", app->project_name);
   cJSON_AddStringToObject(firmware, "version", app->version);
   cJSON_AddStringToObject(firmware, "date", project_build_date);
+  cJSON_AddNumberToObject(firmware, "size", firmware_size());
+#if CONFIG_RUUVI_ENABLE
+  cJSON_AddStringToObject(firmware, "ble_backend", ble_backend);
+  cJSON_AddNumberToObject(firmware, "ble_heap", ble_heap);
+#endif
+#if CONFIG_HOT_PATH_OPTIMIZE_SPEED || CONFIG_HOT_PATH_IN_IRAM
+  cJSON_AddStringToObject(firmware, "profile", "performance");
+#else
+  cJSON_AddStringToObject(firmware, "profile", "size");
+#endif
 
-  char *payload = cJSON_PrintUnformatted(root);
-  esp_mqtt_client_enqueue(mqtt_handle, topics.metrics, payload, 0,
-                          /* QOS */ 0, /* retain */ 0, true);
+  event_loops_add_metrics(root);
+  config_add_metrics(root);
+  dlog_add_metrics(root);
+  task_stats_add_metrics(root);
+  power_add_metrics(root);
+  local_control_add_metrics(root);
+  schedule_add_metrics(root);
+#if CONFIG_RUUVI_ENABLE
+  ruuvi_add_metrics(root);
+  rules_add_metrics(root);
+  scan_scheduler_add_metrics(root);
+#endif
+
+  int qos = config_get_qos("qos_metrics", CONFIG_MQTT_QOS_METRICS);
+  payload_enqueue(mqtt_handle, topics.metrics, root, "cbor_metrics",
+                  /* QOS */ qos, /* retain */ 0);
+  publish_firmware(firmware, qos);
 
-  free(payload);
   cJSON_Delete(root);
 }
 
@@ -194,31 +445,48 @@ void metrics_init() {
   esp_timer_handle_t timer;
   ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
   esp_timer_start_periodic(timer, 60 * 1000 * 1000);
+  ESP_ERROR_CHECK(esp_timer_create(&args, &metrics_now_timer));
 }
 
 void app_main(void) {
   ESP_ERROR_CHECK(nvs_flash_init());
   ESP_ERROR_CHECK(esp_netif_init());
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+  event_loops_init();
+  task_stats_init();
+  power_init();
+  state_publishers_init();
+  restart_init();
 
   mqtt_init();
+  dlog_init(mqtt_handle, topics.base);
+  heap_accounting_init(mqtt_handle, topics.base);
   indicator_init(mqtt_handle);
   config_init(mqtt_handle, topics.base);
   metrics_init();
   light_init();
   wifi_init();
   mqtt_ota_init(mqtt_handle, topics.ota);
+  chunked_ota_init(mqtt_handle, topics.base);
   local_control_init(mqtt_handle, topics.base);
+  schedule_init();
 
   ESP_ERROR_CHECK(esp_event_handler_register(MQTT_OTA_EVENT, ESP_EVENT_ANY_ID,
                                              &event_handler, NULL));
-  ESP_ERROR_CHECK(esp_event_handler_register(LIGHT_EVENT, LIGHT_EVENT_STATE_CHANGED,
-                                             &event_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      CHUNKED_OTA_EVENT, CHUNKED_OTA_EVENT_FINISHED, &event_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, LIGHT_EVENT, LIGHT_EVENT_STATE_CHANGED, &event_handler,
+      NULL));
 
-#if RUUVI_ENABLE
+#if CONFIG_RUUVI_ENABLE
+  size_t free_before_ble = heap_caps_get_free_size(MALLOC_CAP_8BIT);
   ble_init();
-  ruuvi_init(mqtt_handle);
+  ble_heap = free_before_ble - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  ruuvi_init(mqtt_handle, topics.base);
+  rules_init();
   ble_filter_set(RUUVI_MANIFACTURER_ID);
   ble_scan_start();
+  scan_scheduler_init();
 #endif
 }
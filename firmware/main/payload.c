@@ -0,0 +1,77 @@
+#include "payload.h"
+#include "config.h"
+#include <esp_log.h>
+#include <math.h>
+#include <stdlib.h>
+
+#define TAG "payload"
+
+void cbor_write_json(struct cbor_writer *w, const cJSON *item) {
+  const cJSON *child;
+  switch (item->type & 0xff) {
+  case cJSON_False:
+    cbor_write_bool(w, false);
+    break;
+  case cJSON_True:
+    cbor_write_bool(w, true);
+    break;
+  case cJSON_NULL:
+    cbor_write_null(w);
+    break;
+  case cJSON_Number:
+    if (item->valuedouble == trunc(item->valuedouble) &&
+        fabs(item->valuedouble) < 9007199254740992.0) {
+      cbor_write_int(w, item->valuedouble);
+    } else {
+      cbor_write_double(w, item->valuedouble);
+    }
+    break;
+  case cJSON_String:
+    cbor_write_text(w, item->valuestring);
+    break;
+  case cJSON_Array:
+    cbor_write_array(w, cJSON_GetArraySize(item));
+    cJSON_ArrayForEach(child, item) { cbor_write_json(w, child); }
+    break;
+  case cJSON_Object:
+    cbor_write_map(w, cJSON_GetArraySize(item));
+    cJSON_ArrayForEach(child, item) {
+      cbor_write_text(w, child->string);
+      cbor_write_json(w, child);
+    }
+    break;
+  default:
+    cbor_write_null(w);
+    break;
+  }
+}
+
+int payload_enqueue(esp_mqtt_client_handle_t client, const char *topic,
+                    const cJSON *root, const char *key, int qos, int retain) {
+  if (config_get_bool_or(key, false)) {
+    // Metrics keep growing with every subsystem reporting into them, so the
+    // tree is measured first and encoded into a buffer of the right size.
+    struct cbor_writer w;
+    cbor_writer_init(&w, NULL, 0);
+    cbor_write_json(&w, root);
+    size_t length = w.length;
+
+    uint8_t *buffer = malloc(length);
+    if (buffer == NULL) {
+      ESP_LOGE(TAG, "cannot allocate %zu bytes for %s", length, topic);
+      return -1;
+    }
+    cbor_writer_init(&w, buffer, length);
+    cbor_write_json(&w, root);
+    int msg_id = esp_mqtt_client_enqueue(client, topic, (const char *)buffer,
+                                         w.length, qos, retain, true);
+    free(buffer);
+    return msg_id;
+  } else {
+    char *payload = cJSON_PrintUnformatted(root);
+    int msg_id =
+        esp_mqtt_client_enqueue(client, topic, payload, 0, qos, retain, true);
+    free(payload);
+    return msg_id;
+  }
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "cbor.h"
+#include <cJSON.h>
+#include <mqtt_client.h>
+
+// Appends a cJSON tree to a CBOR writer. Numbers that are integral are
+// encoded as integers, everything else as double-precision floats.
+void cbor_write_json(struct cbor_writer *w, const cJSON *item);
+
+// Publish a cJSON tree. The encoding is selected by the boolean config entry
+// `key`: when set the payload is CBOR, otherwise it is JSON.
+int payload_enqueue(esp_mqtt_client_handle_t client, const char *topic,
+                    const cJSON *root, const char *key, int qos, int retain);
@@ -0,0 +1,146 @@
+#include "power.h"
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG "power"
+
+#if CONFIG_POWER_MANAGEMENT
+// A single CPU_FREQ_MAX lock is acquired by power_hold and released by a
+// one-shot timer. Overlapping holds simply push the release back, so the lock
+// is never acquired more than once.
+static struct {
+  portMUX_TYPE lock;
+  esp_pm_lock_handle_t pm_lock;
+  esp_timer_handle_t release_timer;
+  int64_t release_at;
+  bool held;
+  uint32_t holds;
+} power = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static void release_timer_callback(void *arg) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&power.lock);
+  int64_t remaining = power.release_at - now;
+  bool release = power.held && remaining <= 0;
+  if (release) {
+    power.held = false;
+  }
+  portEXIT_CRITICAL(&power.lock);
+
+  if (release) {
+    esp_pm_lock_release(power.pm_lock);
+  } else if (remaining > 0) {
+    esp_timer_start_once(power.release_timer, remaining);
+  }
+}
+#endif
+
+void power_hold(uint32_t duration_ms) {
+#if CONFIG_POWER_MANAGEMENT
+  if (power.pm_lock == NULL) {
+    return;
+  }
+
+  int64_t release_at = esp_timer_get_time() + duration_ms * 1000;
+
+  portENTER_CRITICAL(&power.lock);
+  bool acquire = !power.held;
+  power.held = true;
+  if (release_at > power.release_at) {
+    power.release_at = release_at;
+  }
+  power.holds += 1;
+  portEXIT_CRITICAL(&power.lock);
+
+  if (acquire) {
+    esp_pm_lock_acquire(power.pm_lock);
+    esp_timer_start_once(power.release_timer, duration_ms * 1000);
+  }
+#endif
+}
+
+#if CONFIG_POWER_MANAGEMENT && CONFIG_PM_PROFILING
+// The PM component only exposes the time spent in each mode through
+// esp_pm_dump_locks, so its output is captured and parsed. The lines of
+// interest look like:
+//
+//   CPU_MAX   160M        123456      12%
+static void add_mode_metrics(cJSON *power_metrics) {
+  char *dump = NULL;
+  size_t size = 0;
+  FILE *stream = open_memstream(&dump, &size);
+  if (stream == NULL) {
+    return;
+  }
+  esp_pm_dump_locks(stream);
+  fclose(stream);
+
+  cJSON *modes = cJSON_AddObjectToObject(power_metrics, "modes");
+  const char *line = strstr(dump, "Mode stats:");
+  while (line != NULL && (line = strchr(line, '\n')) != NULL) {
+    line += 1;
+    char name[16];
+    uint32_t mhz;
+    uint64_t time_us;
+    if (sscanf(line, "%15s %" SCNu32 "M %" SCNu64, name, &mhz, &time_us) ==
+        3) {
+      cJSON *mode = cJSON_AddObjectToObject(modes, name);
+      cJSON_AddNumberToObject(mode, "mhz", mhz);
+      cJSON_AddNumberToObject(mode, "ms", time_us / 1000);
+    }
+  }
+  free(dump);
+}
+#endif
+
+void power_add_metrics(cJSON *root) {
+  cJSON *power_metrics = cJSON_AddObjectToObject(root, "power");
+#if CONFIG_POWER_MANAGEMENT
+  cJSON_AddBoolToObject(power_metrics, "enabled", true);
+  portENTER_CRITICAL(&power.lock);
+  uint32_t holds = power.holds;
+  portEXIT_CRITICAL(&power.lock);
+  cJSON_AddNumberToObject(power_metrics, "holds", holds);
+#if CONFIG_PM_PROFILING
+  add_mode_metrics(power_metrics);
+#endif
+#else
+  cJSON_AddBoolToObject(power_metrics, "enabled", false);
+#endif
+}
+
+void power_init() {
+#if CONFIG_POWER_MANAGEMENT
+  esp_pm_config_t config = {
+      .max_freq_mhz = CONFIG_POWER_MAX_FREQ_MHZ,
+      .min_freq_mhz = CONFIG_POWER_MIN_FREQ_MHZ,
+      .light_sleep_enable = false,
+  };
+  esp_err_t err = esp_pm_configure(&config);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "cannot configure power management: %s",
+             esp_err_to_name(err));
+    return;
+  }
+
+  esp_timer_create_args_t args = {
+      .callback = release_timer_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "power",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&args, &power.release_timer));
+  ESP_ERROR_CHECK(
+      esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "control", &power.pm_lock));
+  ESP_LOGI(TAG, "frequency scaling between %d and %d MHz",
+           CONFIG_POWER_MIN_FREQ_MHZ, CONFIG_POWER_MAX_FREQ_MHZ);
+#endif
+}
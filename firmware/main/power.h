@@ -0,0 +1,11 @@
+#pragma once
+#include <cJSON.h>
+#include <stdint.h>
+
+// With CONFIG_POWER_MANAGEMENT, the CPU clock is scaled down when idle.
+// Latency-critical paths call power_hold, which runs the CPU at full speed
+// for at least the given duration, so that a toggle is handled as quickly as
+// it would be without power management.
+void power_init();
+void power_hold(uint32_t duration_ms);
+void power_add_metrics(cJSON *root);
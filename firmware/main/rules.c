@@ -0,0 +1,267 @@
+#include "rules.h"
+#include "config.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
+#include "local_control.h"
+#include "ruuvi_tags.h"
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <math.h>
+#include <nvs_flash.h>
+#include <string.h>
+
+#define TAG "rules"
+
+// Thresholds are converted to the integer unit of their field when rules are
+// loaded, so that evaluation only compares integers.
+//
+// Whether a rule matched and its hits are kept across reloads of the config
+// and reboots, as long as it tests the same tag, field, operator and
+// threshold, so that a reload doesn't fire it again. They are saved this
+// long after they change, off the frame path.
+#define STATE_SAVE_DELAY_US (10 * 1000 * 1000)
+
+struct rule {
+  uint8_t mac[6];
+  uint8_t field;
+  bool greater;
+  uint8_t group;
+  bool state;
+  bool matched;
+  int32_t threshold;
+  uint32_t hits;
+};
+
+static SemaphoreHandle_t lock;
+static struct rule rules[CONFIG_RULES_MAX_RULES];
+static size_t rule_count;
+
+static nvs_handle_t handle;
+static esp_timer_handle_t state_save_timer;
+
+static struct {
+  uint32_t frames;
+  uint64_t time_us;
+  uint32_t max_us;
+} stats;
+
+void rules_evaluate(const struct ruuvi_frame *frame) {
+  struct {
+    uint8_t group;
+    bool state;
+  } actions[CONFIG_RULES_MAX_RULES];
+  size_t action_count = 0;
+
+  bool changed = false;
+
+  int64_t start = esp_timer_get_time();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (size_t i = 0; i < rule_count; i++) {
+    struct rule *rule = &rules[i];
+    if (memcmp(rule->mac, frame->mac, 6) != 0 ||
+        !ruuvi_frame_has(frame, rule->field)) {
+      continue;
+    }
+    int32_t value = frame->values[rule->field];
+    bool matched =
+        rule->greater ? value > rule->threshold : value < rule->threshold;
+    if (matched && !rule->matched) {
+      rule->hits += 1;
+      actions[action_count].group = rule->group;
+      actions[action_count].state = rule->state;
+      action_count += 1;
+    }
+    changed = changed || matched != rule->matched;
+    rule->matched = matched;
+  }
+  xSemaphoreGive(lock);
+  int64_t end = esp_timer_get_time();
+
+  // The timer is left alone if already running, as it saves the latest
+  // state anyway.
+  if (changed) {
+    esp_timer_start_once(state_save_timer, STATE_SAVE_DELAY_US);
+  }
+
+  stats.frames += 1;
+  stats.time_us += end - start;
+  if (end - start > stats.max_us) {
+    stats.max_us = end - start;
+  }
+
+  for (size_t i = 0; i < action_count; i++) {
+    ESP_LOGI(TAG, "switching group %d %s", actions[i].group,
+             actions[i].state ? "on" : "off");
+    local_control_switch_group(actions[i].group, actions[i].state);
+  }
+}
+
+static bool parse_tag(uint8_t *mac, const char *tag) {
+  unsigned int bytes[6];
+  if (sscanf(tag, "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2],
+             &bytes[3], &bytes[4], &bytes[5]) == 6) {
+    for (size_t i = 0; i < 6; i++) {
+      mac[i] = bytes[i];
+    }
+    return true;
+  }
+  return ruuvi_tags_find_mac(tag, mac);
+}
+
+static bool compile_rule(struct rule *rule, const cJSON *item) {
+  const char *tag = cJSON_GetStringValue(cJSON_GetObjectItem(item, "tag"));
+  const char *field = cJSON_GetStringValue(cJSON_GetObjectItem(item, "field"));
+  const char *op = cJSON_GetStringValue(cJSON_GetObjectItem(item, "op"));
+  const cJSON *value = cJSON_GetObjectItem(item, "value");
+  const cJSON *group = cJSON_GetObjectItem(item, "group");
+  const cJSON *state = cJSON_GetObjectItem(item, "state");
+
+  if (tag == NULL || field == NULL || op == NULL || !cJSON_IsNumber(value) ||
+      !cJSON_IsNumber(group) || !cJSON_IsBool(state)) {
+    return false;
+  }
+  if (!parse_tag(rule->mac, tag)) {
+    ESP_LOGW(TAG, "unknown tag %s", tag);
+    return false;
+  }
+
+  rule->field = RUUVI_FIELD_MAX;
+  for (size_t i = 0; i < RUUVI_FIELD_MAX; i++) {
+    if (strcmp(field, ruuvi_field_info[i].name) == 0) {
+      rule->field = i;
+    }
+  }
+  if (rule->field == RUUVI_FIELD_MAX) {
+    ESP_LOGW(TAG, "unknown field %s", field);
+    return false;
+  }
+
+  if (strcmp(op, ">") == 0) {
+    rule->greater = true;
+  } else if (strcmp(op, "<") == 0) {
+    rule->greater = false;
+  } else {
+    return false;
+  }
+
+  double threshold = value->valuedouble;
+  for (int8_t e = ruuvi_field_info[rule->field].exponent; e < 0; e++) {
+    threshold *= 10;
+  }
+  rule->threshold = lround(threshold);
+  rule->group = group->valueint;
+  rule->state = cJSON_IsTrue(state);
+  rule->matched = false;
+  rule->hits = 0;
+  return true;
+}
+
+static bool same_condition(const struct rule *a, const struct rule *b) {
+  return memcmp(a->mac, b->mac, sizeof(a->mac)) == 0 &&
+         a->field == b->field && a->greater == b->greater &&
+         a->threshold == b->threshold;
+}
+
+// Takes over the state of the rule testing the same condition, if any.
+static void restore_state(struct rule *rule, const struct rule *previous,
+                          size_t previous_count) {
+  for (size_t i = 0; i < previous_count; i++) {
+    if (same_condition(rule, &previous[i])) {
+      rule->matched = previous[i].matched;
+      rule->hits = previous[i].hits;
+      return;
+    }
+  }
+}
+
+static void save_state(void *arg) {
+  struct rule saved[CONFIG_RULES_MAX_RULES];
+  xSemaphoreTake(lock, portMAX_DELAY);
+  size_t count = rule_count;
+  memcpy(saved, rules, count * sizeof(*rules));
+  xSemaphoreGive(lock);
+
+  nvs_set_blob(handle, "state", saved, count * sizeof(*saved));
+  if (nvs_commit(handle) != ESP_OK) {
+    ESP_LOGE(TAG, "cannot commit nvs");
+  }
+}
+
+// Loads the rules saved with their state, to restore it at boot.
+static void load_state() {
+  size_t size = sizeof(rules);
+  if (nvs_get_blob(handle, "state", rules, &size) != ESP_OK ||
+      size % sizeof(*rules) != 0) {
+    size = 0;
+  }
+  rule_count = size / sizeof(*rules);
+}
+
+static void load_rules() {
+  cJSON *root = config_get_json("rules");
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  struct rule previous[CONFIG_RULES_MAX_RULES];
+  size_t previous_count = rule_count;
+  memcpy(previous, rules, previous_count * sizeof(*rules));
+
+  rule_count = 0;
+  const cJSON *item;
+  cJSON_ArrayForEach(item, root) {
+    if (rule_count == CONFIG_RULES_MAX_RULES) {
+      ESP_LOGW(TAG, "too many rules");
+      break;
+    }
+    struct rule *rule = &rules[rule_count];
+    if (compile_rule(rule, item)) {
+      restore_state(rule, previous, previous_count);
+      rule_count += 1;
+    } else {
+      ESP_LOGW(TAG, "bad rule");
+    }
+  }
+  xSemaphoreGive(lock);
+
+  cJSON_Delete(root);
+}
+
+static void event_handler(void *arg, esp_event_base_t event_base,
+                          int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(RUUVI);
+  load_rules();
+  esp_timer_start_once(state_save_timer, STATE_SAVE_DELAY_US);
+}
+
+void rules_add_metrics(cJSON *root) {
+  cJSON *obj = cJSON_AddObjectToObject(root, "rules");
+  cJSON_AddNumberToObject(obj, "frames", stats.frames);
+  cJSON_AddNumberToObject(obj, "evaluate_us", stats.time_us);
+  cJSON_AddNumberToObject(obj, "max_evaluate_us", stats.max_us);
+
+  cJSON *hits = cJSON_AddArrayToObject(obj, "hits");
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (size_t i = 0; i < rule_count; i++) {
+    cJSON_AddItemToArray(hits, cJSON_CreateNumber(rules[i].hits));
+  }
+  xSemaphoreGive(lock);
+}
+
+void rules_init() {
+  HEAP_SUBSYSTEM(RUUVI);
+  lock = xSemaphoreCreateMutex();
+  ESP_ERROR_CHECK(nvs_open("rules", NVS_READWRITE, &handle));
+  esp_timer_create_args_t state_save_args = {
+      .callback = save_state,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "rules_save",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&state_save_args, &state_save_timer));
+
+  load_state();
+  load_rules();
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &event_handler, NULL));
+}
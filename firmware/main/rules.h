@@ -0,0 +1,26 @@
+#pragma once
+#include "sdkconfig.h"
+
+#if CONFIG_RUUVI_ENABLE
+
+#include "ruuvi.h"
+#include <cJSON.h>
+
+// Switches groups on Ruuvi readings, from the `rules` config key, without
+// going through the broker.
+//
+// The key holds an array of rules such as
+//   {"tag": "Bathroom", "field": "humidity", "op": ">", "value": 70,
+//    "group": 2, "state": true}
+// where the tag is a name or a MAC address and the value is in the units of
+// the published frames. A rule fires when its condition becomes true, not on
+// every frame for which it holds.
+//
+// Rules are evaluated on the frames a node publishes, so with `ruuvi_forward`
+// only the elected gateway acts on them, once per frame; give the rules to
+// every node which may become gateway.
+void rules_init();
+void rules_evaluate(const struct ruuvi_frame *frame);
+void rules_add_metrics(cJSON *root);
+
+#endif // CONFIG_RUUVI_ENABLE
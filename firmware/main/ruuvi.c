@@ -1,86 +1,154 @@
 #include "ruuvi.h"
 #include "ble.h"
-#include "byteorder.h"
-#include "ruuvi_names.h"
+#include "cbor.h"
+#include "config.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
+#include "rules.h"
+#include "ruuvi_encode.h"
+#include "ruuvi_gateway.h"
+#include "ruuvi_tags.h"
+#include "scan_scheduler.h"
 #include <esp_log.h>
 #include <esp_mac.h>
+#include <esp_timer.h>
 #include <cJSON.h>
 #include <string.h>
 
 #define TAG "ruuvi"
 
-#define MACSTR_SIZE (2 * 6 + 5 + 1)
-#define MACSTR_UPPER "%02X:%02X:%02X:%02X:%02X:%02X"
-static inline void mac2str(char *out, const uint8_t *in) {
-  snprintf(out, MACSTR_SIZE, MACSTR_UPPER, MAC2STR(in));
+enum {
+  RUUVI_ENCODING_JSON = 0,
+  RUUVI_ENCODING_CBOR,
+  RUUVI_ENCODING_MAX,
+};
+
+struct ruuvi_encode_stats {
+  uint32_t frames;
+  uint64_t time_us;
+  uint64_t bytes;
+};
+
+static struct ruuvi_encode_stats encode_stats[RUUVI_ENCODING_MAX];
+
+static struct {
+  uint32_t frames;
+  uint32_t malformed;
+  uint64_t time_us;
+} decode_stats;
+
+// Publishing options, cached from the configuration as they apply to every
+// frame.
+static struct {
+  int qos;
+  bool cbor;
+} options;
+
+static void load_options() {
+  options.qos = config_get_qos("qos_ruuvi", CONFIG_MQTT_QOS_RUUVI);
+  options.cbor = config_get_bool_or("cbor_ruuvi", false);
 }
 
-bool ruuvi_decode_frame(struct ruuvi_frame *frame, const uint8_t *data,
-                        size_t length) {
-  if (length != 24 || data[0] != RUUVI_DATA_FORMAT_RAWV2) {
-    return false;
+void ruuvi_publish_frame(esp_mqtt_client_handle_t mqtt_client,
+                         const struct ruuvi_frame *frame,
+                         const struct ruuvi_receiver *receivers,
+                         size_t receiver_count) {
+  // Every frame is published once, by the gateway when frames are forwarded,
+  // so rules act once on it too.
+  rules_evaluate(frame);
+
+  char name_buffer[RUUVI_TAG_NAME_SIZE];
+  char topic[RUUVI_TAG_TOPIC_SIZE];
+  if (!ruuvi_tags_lookup(frame->mac, name_buffer, topic)) {
+    return;
   }
+  const char *name = name_buffer[0] != '\0' ? name_buffer : NULL;
 
-  frame->temperature = read_16be(data + 1);
-  frame->humidity = read_16be(data + 3);
-  frame->pressure = read_16be(data + 5);
-  frame->acceleration_x = read_16be(data + 7);
-  frame->acceleration_y = read_16be(data + 9);
-  frame->acceleration_z = read_16be(data + 11);
-  uint16_t power_info = read_16be(data + 13);
-  frame->battery_voltage = power_info >> 5;
-  frame->tx_power = (power_info & 0x1f);
-  frame->movement_counter = data[15];
-  frame->sequence_number = read_16be(data + 16);
-  memcpy(frame->mac, data + 18, 6);
-
-  return true;
-}
+  char mac[RUUVI_MACSTR_SIZE];
+  ruuvi_mac2str(mac, frame->mac);
+
+  int qos = options.qos;
+
+  if (options.cbor) {
+    uint8_t buffer[RUUVI_CBOR_MAX_SIZE];
+    struct cbor_writer w;
 
-static void publish_ruuvi_frame(esp_mqtt_client_handle_t mqtt_client,
-                                const struct ruuvi_frame *frame) {
-  char mac[MACSTR_SIZE];
-  mac2str(mac, frame->mac);
+    int64_t start = esp_timer_get_time();
+    cbor_writer_init(&w, buffer, sizeof(buffer));
+    ruuvi_encode_cbor(&w, frame, name, mac, receivers, receiver_count);
+    int64_t end = esp_timer_get_time();
 
-  const char *name = ruuvi_find_name(frame->mac);
+    if (cbor_writer_ok(&w)) {
+      esp_mqtt_client_enqueue(mqtt_client, topic, (const char *)buffer,
+                              w.length, qos, /* retain */ 0, true);
+
+      encode_stats[RUUVI_ENCODING_CBOR].frames += 1;
+      encode_stats[RUUVI_ENCODING_CBOR].time_us += end - start;
+      encode_stats[RUUVI_ENCODING_CBOR].bytes += w.length;
+    } else {
+      ESP_LOGE(TAG, "CBOR ruuvi frame too large");
+    }
+  } else {
+    int64_t start = esp_timer_get_time();
+    char *payload =
+        ruuvi_encode_json(frame, name, mac, receivers, receiver_count);
+    int64_t end = esp_timer_get_time();
 
-  cJSON *root = cJSON_CreateObject();
-  if (name != NULL) {
-    cJSON_AddStringToObject(root, "name", name);
+    esp_mqtt_client_enqueue(mqtt_client, topic, payload, 0, qos,
+                            /* retain */ 0, true);
+
+    encode_stats[RUUVI_ENCODING_JSON].frames += 1;
+    encode_stats[RUUVI_ENCODING_JSON].time_us += end - start;
+    encode_stats[RUUVI_ENCODING_JSON].bytes += strlen(payload);
+    free(payload);
   }
-  cJSON_AddNumberToObject(root, "temperature", frame->temperature * 0.005);
-  cJSON_AddNumberToObject(root, "humidity", frame->humidity * 0.0025);
-  cJSON_AddNumberToObject(root, "pressure", frame->pressure + 50000);
-  cJSON_AddNumberToObject(root, "sequence_number", frame->sequence_number);
-  cJSON_AddNumberToObject(root, "acceleration_x", frame->acceleration_x);
-  cJSON_AddNumberToObject(root, "acceleration_y", frame->acceleration_y);
-  cJSON_AddNumberToObject(root, "acceleration_z", frame->acceleration_z);
-  cJSON_AddNumberToObject(root, "battery_voltage",
-                          frame->battery_voltage / 1000.);
-  cJSON_AddStringToObject(root, "mac", mac);
-
-  char *topic;
-  asprintf(&topic, "%s/%s", CONFIG_RUUVI_MQTT_TOPIC_PREFIX, mac);
-  char *payload = cJSON_PrintUnformatted(root);
-
-  esp_mqtt_client_enqueue(mqtt_client, topic, payload, 0,
-                          /* QOS */ 2, /* retain */ 0, true);
-
-  free(topic);
-  free(payload);
-  cJSON_Delete(root);
 }
 
-static void on_manufacturer_data(esp_mqtt_client_handle_t client,
-                                 const uint8_t *payload, size_t length) {
+static void add_encode_stats(cJSON *root, const char *name,
+                             const struct ruuvi_encode_stats *stats) {
+  cJSON *obj = cJSON_AddObjectToObject(root, name);
+  cJSON_AddNumberToObject(obj, "frames", stats->frames);
+  cJSON_AddNumberToObject(obj, "encode_us", stats->time_us);
+  cJSON_AddNumberToObject(obj, "bytes", stats->bytes);
+}
+
+void ruuvi_add_metrics(cJSON *root) {
+  cJSON *ruuvi = cJSON_AddObjectToObject(root, "ruuvi");
+  add_encode_stats(ruuvi, "json", &encode_stats[RUUVI_ENCODING_JSON]);
+  add_encode_stats(ruuvi, "cbor", &encode_stats[RUUVI_ENCODING_CBOR]);
+  cJSON *decode = cJSON_AddObjectToObject(ruuvi, "decode");
+  cJSON_AddNumberToObject(decode, "frames", decode_stats.frames);
+  cJSON_AddNumberToObject(decode, "malformed", decode_stats.malformed);
+  cJSON_AddNumberToObject(decode, "decode_us", decode_stats.time_us);
+  ruuvi_gateway_add_metrics(ruuvi);
+  ruuvi_tags_add_metrics(ruuvi);
+}
+
+static void on_manufacturer_data(
+    esp_mqtt_client_handle_t client,
+    const ble_event_advertisment_manufacturer_data *event) {
   struct ruuvi_frame frame;
-  if (ruuvi_decode_frame(&frame, payload + 2, length - 2)) {
-    ESP_LOGI(TAG, "Ruuvi Tag: " MACSTR_UPPER " (%s)", MAC2STR(frame.mac),
-             ruuvi_find_name(frame.mac) ?: "unknown");
-    // metric_ruuvi_packet_decoded_count += 1;
-    publish_ruuvi_frame(client, &frame);
+  const uint8_t *payload = event->payload;
+  size_t length = event->length;
+
+  int64_t start = esp_timer_get_time();
+  bool decoded =
+      ruuvi_decode_frame(&frame, payload + 2, length - 2, event->address);
+  decode_stats.time_us += esp_timer_get_time() - start;
+  decode_stats.frames += 1;
+
+  if (decoded) {
+    ESP_LOGI(TAG, "Ruuvi Tag: " RUUVI_MACSTR_UPPER, MAC2STR(frame.mac));
+    if (ruuvi_frame_has(&frame, RUUVI_FIELD_SEQUENCE_NUMBER)) {
+      scan_scheduler_frame(frame.mac,
+                           frame.values[RUUVI_FIELD_SEQUENCE_NUMBER]);
+    }
+    if (!ruuvi_gateway_frame(&frame, event->address, payload + 2, length - 2,
+                             event->rssi)) {
+      ruuvi_publish_frame(client, &frame, NULL, 0);
+    }
   } else {
-    // metric_ruuvi_packet_malformed_count += 1;
+    decode_stats.malformed += 1;
     ESP_LOGI(TAG, "bad ruuvi frame");
     ESP_LOG_BUFFER_HEX(TAG, payload, length);
   }
@@ -88,17 +156,31 @@ static void on_manufacturer_data(esp_mqtt_client_handle_t client,
 
 static void ruuvi_event_handler(void *arg, esp_event_base_t event_base,
                                 int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(RUUVI);
   esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)arg;
   if (event_base == BLE_EVENT &&
       event_id == BLE_EVENT_ADVERTISMENT_MANUFACTURER_DATA) {
     ble_event_advertisment_manufacturer_data *event = event_data;
     if (event->manufacturer_id == RUUVI_MANIFACTURER_ID) {
-      on_manufacturer_data(client, event->payload, event->length);
+      on_manufacturer_data(client, event);
     }
   }
 }
 
-void ruuvi_init(esp_mqtt_client_handle_t client) {
-  ESP_ERROR_CHECK(esp_event_handler_register(BLE_EVENT, ESP_EVENT_ANY_ID,
-                                             ruuvi_event_handler, client));
+static void config_event_handler(void *arg, esp_event_base_t event_base,
+                                 int32_t event_id, void *event_data) {
+  load_options();
+}
+
+void ruuvi_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  HEAP_SUBSYSTEM(RUUVI);
+  load_options();
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &config_event_handler,
+      NULL));
+  ruuvi_tags_init(client, prefix);
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      telemetry_loop, BLE_EVENT, ESP_EVENT_ANY_ID, ruuvi_event_handler,
+      client));
+  ruuvi_gateway_init(client);
 }
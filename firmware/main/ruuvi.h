@@ -3,39 +3,80 @@
 
 #if CONFIG_RUUVI_ENABLE
 
+#include <cJSON.h>
 #include <mqtt_client.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define RUUVI_MANIFACTURER_ID 0x0499
-#define RUUVI_DATA_FORMAT_RAWV2 0x05
 
-struct ruuvi_acceleration {
-  uint64_t x;
-  uint64_t y;
-  uint64_t z;
+// Longest manufacturer data payload of any supported format.
+#define RUUVI_FRAME_MAX_LENGTH 40
+
+// Readings a frame can carry. Each has a fixed unit, in which values are
+// kept as integers: the value in the published unit is value * 10^exponent,
+// with the exponent from ruuvi_field_info.
+enum ruuvi_field {
+  RUUVI_FIELD_TEMPERATURE,
+  RUUVI_FIELD_HUMIDITY,
+  RUUVI_FIELD_PRESSURE,
+  RUUVI_FIELD_ACCELERATION_X,
+  RUUVI_FIELD_ACCELERATION_Y,
+  RUUVI_FIELD_ACCELERATION_Z,
+  RUUVI_FIELD_BATTERY_VOLTAGE,
+  RUUVI_FIELD_TX_POWER,
+  RUUVI_FIELD_MOVEMENT_COUNTER,
+  RUUVI_FIELD_SEQUENCE_NUMBER,
+  RUUVI_FIELD_PM1_0,
+  RUUVI_FIELD_PM2_5,
+  RUUVI_FIELD_PM4_0,
+  RUUVI_FIELD_PM10_0,
+  RUUVI_FIELD_CO2,
+  RUUVI_FIELD_VOC_INDEX,
+  RUUVI_FIELD_NOX_INDEX,
+  RUUVI_FIELD_LUMINOSITY,
+  RUUVI_FIELD_MAX,
+};
+
+struct ruuvi_field_info {
+  const char *name;
+  int8_t exponent;
 };
 
+extern const struct ruuvi_field_info ruuvi_field_info[RUUVI_FIELD_MAX];
+
 struct ruuvi_frame {
-  int16_t temperature;
-  uint16_t humidity;
-  uint16_t pressure;
-  int16_t acceleration_x;
-  int16_t acceleration_y;
-  int16_t acceleration_z;
-
-  uint16_t battery_voltage;
-  uint16_t tx_power;
-
-  uint8_t movement_counter;
-  uint16_t sequence_number;
+  uint8_t format;
+  uint8_t mac[6];
+  // Bit mask of the fields with a reading. Fields the format does not have,
+  // or for which the tag sent the "invalid" value, are left out.
+  uint32_t valid;
+  int32_t values[RUUVI_FIELD_MAX];
+};
+
+static inline bool ruuvi_frame_has(const struct ruuvi_frame *frame,
+                                   enum ruuvi_field field) {
+  return frame->valid & (1ul << field);
+}
+
+// A node which heard a frame, and the signal strength it heard it with.
+struct ruuvi_receiver {
   uint8_t mac[6];
+  int8_t rssi;
 };
 
+// Decodes manufacturer data following the manufacturer ID. `address` is the
+// address of the advertiser, used as MAC for formats without one.
 bool ruuvi_decode_frame(struct ruuvi_frame *frame, const uint8_t *data,
-                        size_t length);
+                        size_t length, const uint8_t *address);
+// Evaluates the rules on a frame and publishes it.
+void ruuvi_publish_frame(esp_mqtt_client_handle_t mqtt_client,
+                         const struct ruuvi_frame *frame,
+                         const struct ruuvi_receiver *receivers,
+                         size_t receiver_count);
 
-void ruuvi_init(esp_mqtt_client_handle_t mqtt_handle);
+void ruuvi_init(esp_mqtt_client_handle_t mqtt_handle, const char *prefix);
+void ruuvi_add_metrics(cJSON *root);
 
 #endif // CONFIG_RUUVI_ENABLE
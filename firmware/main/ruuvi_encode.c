@@ -0,0 +1,83 @@
+#include "ruuvi_encode.h"
+#include <string.h>
+
+static double field_value(const struct ruuvi_frame *frame,
+                          enum ruuvi_field field) {
+  double value = frame->values[field];
+  for (int8_t e = ruuvi_field_info[field].exponent; e < 0; e++) {
+    value /= 10;
+  }
+  return value;
+}
+
+char *ruuvi_encode_json(const struct ruuvi_frame *frame, const char *name,
+                        const char *mac, const struct ruuvi_receiver *receivers,
+                        size_t receiver_count) {
+  cJSON *root = cJSON_CreateObject();
+  if (name != NULL) {
+    cJSON_AddStringToObject(root, "name", name);
+  }
+  cJSON_AddNumberToObject(root, "format", frame->format);
+  for (size_t i = 0; i < RUUVI_FIELD_MAX; i++) {
+    if (ruuvi_frame_has(frame, i)) {
+      cJSON_AddNumberToObject(root, ruuvi_field_info[i].name,
+                              field_value(frame, i));
+    }
+  }
+  cJSON_AddStringToObject(root, "mac", mac);
+  if (receiver_count > 0) {
+    cJSON *array = cJSON_AddArrayToObject(root, "receivers");
+    for (size_t i = 0; i < receiver_count; i++) {
+      char node[RUUVI_MACSTR_SIZE];
+      ruuvi_mac2str(node, receivers[i].mac);
+      cJSON *receiver = cJSON_CreateObject();
+      cJSON_AddStringToObject(receiver, "node", node);
+      cJSON_AddNumberToObject(receiver, "rssi", receivers[i].rssi);
+      cJSON_AddItemToArray(array, receiver);
+    }
+  }
+
+  char *payload = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  return payload;
+}
+
+void ruuvi_encode_cbor(struct cbor_writer *w, const struct ruuvi_frame *frame,
+                       const char *name, const char *mac,
+                       const struct ruuvi_receiver *receivers,
+                       size_t receiver_count) {
+  cbor_write_map(w, 2 + __builtin_popcount(frame->valid) + (name != NULL) +
+                        (receiver_count > 0));
+  if (name != NULL) {
+    cbor_write_text(w, "name");
+    cbor_write_text(w, name);
+  }
+  cbor_write_text(w, "format");
+  cbor_write_uint(w, frame->format);
+  for (size_t i = 0; i < RUUVI_FIELD_MAX; i++) {
+    if (!ruuvi_frame_has(frame, i)) {
+      continue;
+    }
+    cbor_write_text(w, ruuvi_field_info[i].name);
+    if (ruuvi_field_info[i].exponent != 0) {
+      cbor_write_decimal(w, ruuvi_field_info[i].exponent, frame->values[i]);
+    } else {
+      cbor_write_int(w, frame->values[i]);
+    }
+  }
+  cbor_write_text(w, "mac");
+  cbor_write_text(w, mac);
+  if (receiver_count > 0) {
+    cbor_write_text(w, "receivers");
+    cbor_write_array(w, receiver_count);
+    for (size_t i = 0; i < receiver_count; i++) {
+      char node[RUUVI_MACSTR_SIZE];
+      ruuvi_mac2str(node, receivers[i].mac);
+      cbor_write_map(w, 2);
+      cbor_write_text(w, "node");
+      cbor_write_text(w, node);
+      cbor_write_text(w, "rssi");
+      cbor_write_int(w, receivers[i].rssi);
+    }
+  }
+}
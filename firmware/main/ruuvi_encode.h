@@ -0,0 +1,30 @@
+#pragma once
+#include "cbor.h"
+#include "ruuvi.h"
+#include <esp_mac.h>
+#include <stdio.h>
+
+// Encodings of the published Ruuvi frames, apart from ruuvi.c so that the
+// host benchmark can compare them.
+
+#define RUUVI_CBOR_MAX_SIZE 384
+
+#define RUUVI_MACSTR_SIZE (2 * 6 + 5 + 1)
+#define RUUVI_MACSTR_UPPER "%02X:%02X:%02X:%02X:%02X:%02X"
+
+static inline void ruuvi_mac2str(char *out, const uint8_t *in) {
+  snprintf(out, RUUVI_MACSTR_SIZE, RUUVI_MACSTR_UPPER, MAC2STR(in));
+}
+
+// Returns the JSON payload of a frame, to be freed by the caller. `name` is
+// NULL for tags without a name.
+char *ruuvi_encode_json(const struct ruuvi_frame *frame, const char *name,
+                        const char *mac, const struct ruuvi_receiver *receivers,
+                        size_t receiver_count);
+
+// Same fields as the JSON encoding, but fixed-point values are sent as exact
+// decimal fractions, avoiding any floating-point arithmetic.
+void ruuvi_encode_cbor(struct cbor_writer *w, const struct ruuvi_frame *frame,
+                       const char *name, const char *mac,
+                       const struct ruuvi_receiver *receivers,
+                       size_t receiver_count);
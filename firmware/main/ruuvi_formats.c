@@ -0,0 +1,235 @@
+#include "ruuvi.h"
+#include <string.h>
+
+// Ruuvi data formats, each described by a table of fields. Adding a format
+// only takes a new table.
+//
+// https://docs.ruuvi.com/communication/bluetooth-advertisements
+
+#define NO_INVALID 0xffffffff
+
+enum field_encoding {
+  ENCODING_UNSIGNED,
+  // Two's complement, over the bits kept.
+  ENCODING_SIGNED,
+  // Top bit is the sign.
+  ENCODING_SIGN_MAGNITUDE,
+  // Unsigned, added to the field with the sign of the value decoded so far.
+  ENCODING_FRACTION,
+};
+
+struct field_descriptor {
+  uint8_t field;
+  uint8_t offset;
+  uint8_t width; // In bytes
+  uint8_t encoding;
+  bool little_endian;
+  uint8_t shift; // Right shift of the raw value
+  uint8_t bits;  // Bits kept after the shift, 0 to keep all
+  // Byte holding one more, lower, bit of the raw value, or 0.
+  uint8_t lsb_offset;
+  uint8_t lsb_bit;
+  // Raw value sent when there is no reading, or NO_INVALID.
+  uint32_t invalid;
+  // value = raw * scale + bias, in the unit of the field.
+  int32_t scale;
+  int32_t bias;
+};
+
+struct format {
+  uint8_t id;
+  uint8_t length;
+  uint8_t mac_offset; // 0 if the advertiser address is the MAC
+  const struct field_descriptor *fields;
+  size_t field_count;
+};
+
+const struct ruuvi_field_info ruuvi_field_info[RUUVI_FIELD_MAX] = {
+    [RUUVI_FIELD_TEMPERATURE] = {"temperature", -3},
+    [RUUVI_FIELD_HUMIDITY] = {"humidity", -4},
+    [RUUVI_FIELD_PRESSURE] = {"pressure", 0},
+    [RUUVI_FIELD_ACCELERATION_X] = {"acceleration_x", 0},
+    [RUUVI_FIELD_ACCELERATION_Y] = {"acceleration_y", 0},
+    [RUUVI_FIELD_ACCELERATION_Z] = {"acceleration_z", 0},
+    [RUUVI_FIELD_BATTERY_VOLTAGE] = {"battery_voltage", -3},
+    [RUUVI_FIELD_TX_POWER] = {"tx_power", 0},
+    [RUUVI_FIELD_MOVEMENT_COUNTER] = {"movement_counter", 0},
+    [RUUVI_FIELD_SEQUENCE_NUMBER] = {"sequence_number", 0},
+    [RUUVI_FIELD_PM1_0] = {"pm1_0", -1},
+    [RUUVI_FIELD_PM2_5] = {"pm2_5", -1},
+    [RUUVI_FIELD_PM4_0] = {"pm4_0", -1},
+    [RUUVI_FIELD_PM10_0] = {"pm10_0", -1},
+    [RUUVI_FIELD_CO2] = {"co2", 0},
+    [RUUVI_FIELD_VOC_INDEX] = {"voc_index", 0},
+    [RUUVI_FIELD_NOX_INDEX] = {"nox_index", 0},
+    [RUUVI_FIELD_LUMINOSITY] = {"luminosity", -2},
+};
+
+// Format 3, RAWv1.
+static const struct field_descriptor format_3[] = {
+    {RUUVI_FIELD_HUMIDITY, 1, 1, ENCODING_UNSIGNED, .invalid = NO_INVALID,
+     .scale = 5000},
+    {RUUVI_FIELD_TEMPERATURE, 2, 1, ENCODING_SIGN_MAGNITUDE,
+     .invalid = NO_INVALID, .scale = 1000},
+    {RUUVI_FIELD_TEMPERATURE, 3, 1, ENCODING_FRACTION, .invalid = NO_INVALID,
+     .scale = 10},
+    {RUUVI_FIELD_PRESSURE, 4, 2, ENCODING_UNSIGNED, .invalid = NO_INVALID,
+     .scale = 1, .bias = 50000},
+    {RUUVI_FIELD_ACCELERATION_X, 6, 2, ENCODING_SIGNED, .invalid = NO_INVALID,
+     .scale = 1},
+    {RUUVI_FIELD_ACCELERATION_Y, 8, 2, ENCODING_SIGNED, .invalid = NO_INVALID,
+     .scale = 1},
+    {RUUVI_FIELD_ACCELERATION_Z, 10, 2, ENCODING_SIGNED, .invalid = NO_INVALID,
+     .scale = 1},
+    {RUUVI_FIELD_BATTERY_VOLTAGE, 12, 2, ENCODING_UNSIGNED,
+     .invalid = NO_INVALID, .scale = 1},
+};
+
+// Format 5, RAWv2.
+static const struct field_descriptor format_5[] = {
+    {RUUVI_FIELD_TEMPERATURE, 1, 2, ENCODING_SIGNED, .invalid = 0x8000,
+     .scale = 5},
+    {RUUVI_FIELD_HUMIDITY, 3, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 25},
+    {RUUVI_FIELD_PRESSURE, 5, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1, .bias = 50000},
+    {RUUVI_FIELD_ACCELERATION_X, 7, 2, ENCODING_SIGNED, .invalid = 0x8000,
+     .scale = 1},
+    {RUUVI_FIELD_ACCELERATION_Y, 9, 2, ENCODING_SIGNED, .invalid = 0x8000,
+     .scale = 1},
+    {RUUVI_FIELD_ACCELERATION_Z, 11, 2, ENCODING_SIGNED, .invalid = 0x8000,
+     .scale = 1},
+    {RUUVI_FIELD_BATTERY_VOLTAGE, 13, 2, ENCODING_UNSIGNED, .shift = 5,
+     .bits = 11, .invalid = 0x7ff, .scale = 1, .bias = 1600},
+    {RUUVI_FIELD_TX_POWER, 13, 2, ENCODING_UNSIGNED, .bits = 5,
+     .invalid = 0x1f, .scale = 2, .bias = -40},
+    {RUUVI_FIELD_MOVEMENT_COUNTER, 15, 1, ENCODING_UNSIGNED, .invalid = 0xff,
+     .scale = 1},
+    {RUUVI_FIELD_SEQUENCE_NUMBER, 16, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1},
+};
+
+// Format E1, extended v1. Only sent in extended advertisements.
+static const struct field_descriptor format_e1[] = {
+    {RUUVI_FIELD_TEMPERATURE, 1, 2, ENCODING_SIGNED, .invalid = 0x8000,
+     .scale = 5},
+    {RUUVI_FIELD_HUMIDITY, 3, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 25},
+    {RUUVI_FIELD_PRESSURE, 5, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1, .bias = 50000},
+    {RUUVI_FIELD_PM1_0, 7, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1},
+    {RUUVI_FIELD_PM2_5, 9, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1},
+    {RUUVI_FIELD_PM4_0, 11, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1},
+    {RUUVI_FIELD_PM10_0, 13, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1},
+    {RUUVI_FIELD_CO2, 15, 2, ENCODING_UNSIGNED, .invalid = 0xffff,
+     .scale = 1},
+    {RUUVI_FIELD_VOC_INDEX, 17, 1, ENCODING_UNSIGNED, .lsb_offset = 28,
+     .lsb_bit = 6, .invalid = 0x1ff, .scale = 1},
+    {RUUVI_FIELD_NOX_INDEX, 18, 1, ENCODING_UNSIGNED, .lsb_offset = 28,
+     .lsb_bit = 7, .invalid = 0x1ff, .scale = 1},
+    {RUUVI_FIELD_LUMINOSITY, 19, 3, ENCODING_UNSIGNED, .invalid = 0xffffff,
+     .scale = 1},
+    {RUUVI_FIELD_SEQUENCE_NUMBER, 25, 3, ENCODING_UNSIGNED,
+     .invalid = 0xffffff, .scale = 1},
+};
+
+#define FORMAT(id, length, mac_offset, fields)                                \
+  {id, length, mac_offset, fields, sizeof(fields) / sizeof(fields[0])}
+
+static const struct format formats[] = {
+    FORMAT(0x03, 14, 0, format_3),
+    FORMAT(0x05, 24, 18, format_5),
+    FORMAT(0xe1, 40, 34, format_e1),
+};
+
+static uint32_t read_raw(const struct field_descriptor *d,
+                         const uint8_t *data) {
+  uint32_t raw = 0;
+  for (size_t i = 0; i < d->width; i++) {
+    size_t byte = d->little_endian ? d->width - 1 - i : i;
+    raw = raw << 8 | data[d->offset + byte];
+  }
+  raw >>= d->shift;
+  if (d->bits != 0) {
+    raw &= (1ul << d->bits) - 1;
+  }
+  if (d->lsb_offset != 0) {
+    raw = raw << 1 | ((data[d->lsb_offset] >> d->lsb_bit) & 1);
+  }
+  return raw;
+}
+
+static unsigned int raw_bits(const struct field_descriptor *d) {
+  unsigned int bits = d->bits != 0 ? d->bits : d->width * 8 - d->shift;
+  return bits + (d->lsb_offset != 0);
+}
+
+bool ruuvi_decode_frame(struct ruuvi_frame *frame, const uint8_t *data,
+                        size_t length, const uint8_t *address) {
+  if (length == 0) {
+    return false;
+  }
+
+  const struct format *format = NULL;
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (formats[i].id == data[0]) {
+      format = &formats[i];
+      break;
+    }
+  }
+  if (format == NULL || length != format->length ||
+      (format->mac_offset == 0 && address == NULL)) {
+    return false;
+  }
+
+  memset(frame, 0, sizeof(*frame));
+  frame->format = format->id;
+  memcpy(frame->mac, format->mac_offset != 0 ? data + format->mac_offset
+                                             : address,
+         6);
+
+  uint32_t invalid = 0;
+  uint32_t negative = 0;
+  for (size_t i = 0; i < format->field_count; i++) {
+    const struct field_descriptor *d = &format->fields[i];
+    uint32_t mask = 1ul << d->field;
+    uint32_t raw = read_raw(d, data);
+    if (raw == d->invalid) {
+      invalid |= mask;
+      continue;
+    }
+
+    unsigned int bits = raw_bits(d);
+    uint32_t sign = 1ul << (bits - 1);
+    int32_t value;
+    switch (d->encoding) {
+    case ENCODING_SIGNED:
+      value = (int32_t)(raw ^ sign) - (int32_t)sign;
+      break;
+    case ENCODING_SIGN_MAGNITUDE:
+      value = raw & (sign - 1);
+      if (raw & sign) {
+        negative |= mask;
+      }
+      break;
+    default:
+      value = raw;
+      break;
+    }
+
+    value = value * d->scale;
+    if ((d->encoding == ENCODING_SIGN_MAGNITUDE ||
+         d->encoding == ENCODING_FRACTION) &&
+        (negative & mask)) {
+      value = -value;
+    }
+    frame->values[d->field] += value + d->bias;
+    frame->valid |= mask;
+  }
+  frame->valid &= ~invalid;
+  return true;
+}
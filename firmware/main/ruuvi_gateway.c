@@ -0,0 +1,507 @@
+#include "ruuvi_gateway.h"
+#include "config.h"
+#include "event_loops.h"
+#include "local_control.h"
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_now.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG "ruuvi_gateway"
+
+#define MAX_RECEIVERS 6
+// Tags advertise about once a second, so with the default collection window
+// about a quarter of them have a frame being collected at any time.
+#define MAX_PENDING ((CONFIG_RUUVI_TAGS_MAX + 1) / 2)
+#define NO_PENDING -1
+#define FLUSH_INTERVAL_MS 100
+// A gateway is forgotten if it misses this many announcements.
+#define GATEWAY_EXPIRY_ANNOUNCES 3
+
+// Copies of a frame arriving this long after it was published are dropped.
+#define DUPLICATE_WINDOW_US (2 * CONFIG_RUUVI_GATEWAY_WINDOW_MS * 1000LL)
+
+// Packet forwarding a frame to the gateway: the packet type, the RSSI the
+// frame was heard with, the address of the tag, and the frame as advertised,
+// up to the end of the packet.
+struct forward_packet {
+  uint8_t type;
+  int8_t rssi;
+  uint8_t address[6];
+  uint8_t data[RUUVI_FRAME_MAX_LENGTH];
+} __attribute__((packed));
+
+// Packet announcing whether the sender can act as gateway.
+struct announce_packet {
+  uint8_t type;
+  uint8_t candidate;
+} __attribute__((packed));
+
+// Per-tag state of the gateway, in an open addressing hash table keyed by
+// MAC, with linear probing, as in ruuvi_tags.c. Its capacity is a power of
+// two at least twice CONFIG_RUUVI_TAGS_MAX. Entries are never emptied, so
+// that probe sequences stay intact; an entry is only taken over by another
+// tag once no copy of its last frame can arrive anymore.
+struct tag_entry {
+  int64_t published_at;
+  // Fingerprint of the last published reading.
+  uint32_t reading;
+  // Index of the frame being collected in the pending pool, or NO_PENDING.
+  int16_t pending;
+  uint8_t mac[6];
+  bool used;
+  bool published;
+};
+
+// A frame whose copies are being collected.
+struct pending_frame {
+  struct tag_entry *entry; // NULL for a free slot
+  int64_t first_seen;
+  struct ruuvi_frame frame;
+  size_t receiver_count;
+  struct ruuvi_receiver receivers[MAX_RECEIVERS];
+};
+
+static struct {
+  portMUX_TYPE lock;
+  esp_mqtt_client_handle_t client;
+  uint8_t self[6];
+  bool connected;
+
+  // The best gateway candidate heard from, other than this node.
+  uint8_t remote[6];
+  int64_t remote_seen;
+
+  // Allocated when forwarding is first enabled.
+  struct tag_entry *tags;
+  size_t capacity;
+  struct pending_frame *pending;
+
+  uint32_t forwarded;
+  uint32_t received;
+  uint32_t duplicates;
+  uint32_t published;
+  uint32_t direct;
+  uint32_t dropped;
+} gateway = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+// Cached from the configuration, as it is checked for every frame.
+static bool forwarding;
+
+static bool forwarding_enabled() { return forwarding; }
+
+// Allocates the tables once, on the control loop, outside of the lock.
+static bool allocate_tables() {
+  if (gateway.tags != NULL) {
+    return true;
+  }
+  size_t capacity = 2;
+  while (capacity < 2 * CONFIG_RUUVI_TAGS_MAX) {
+    capacity *= 2;
+  }
+  struct tag_entry *tags = calloc(capacity, sizeof(*tags));
+  struct pending_frame *pending = calloc(MAX_PENDING, sizeof(*pending));
+  if (tags == NULL || pending == NULL) {
+    ESP_LOGE(TAG, "cannot allocate the gateway tables");
+    free(tags);
+    free(pending);
+    return false;
+  }
+
+  portENTER_CRITICAL(&gateway.lock);
+  gateway.tags = tags;
+  gateway.capacity = capacity;
+  gateway.pending = pending;
+  portEXIT_CRITICAL(&gateway.lock);
+  return true;
+}
+
+static void load_config() {
+  forwarding =
+      config_get_bool_or("ruuvi_forward", false) && allocate_tables();
+}
+
+// Must be called with the lock held.
+static bool remote_fresh(int64_t now) {
+  return gateway.remote_seen != 0 &&
+         now - gateway.remote_seen <
+             GATEWAY_EXPIRY_ANNOUNCES * CONFIG_RUUVI_GATEWAY_ANNOUNCE_MS *
+                 1000LL;
+}
+
+// Must be called with the lock held.
+static bool is_gateway(int64_t now) {
+  return gateway.connected &&
+         (!remote_fresh(now) || memcmp(gateway.self, gateway.remote, 6) < 0);
+}
+
+#define FNV_OFFSET_BASIS 2166136261u
+
+// FNV-1a
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t hash_mac(const uint8_t *mac) {
+  return fnv1a(FNV_OFFSET_BASIS, mac, 6);
+}
+
+// Whether the entry can be taken over by another tag: no copy of its last
+// frame can arrive anymore, so forgetting it publishes nothing twice.
+static bool entry_expired(const struct tag_entry *entry, int64_t now) {
+  return entry->pending == NO_PENDING &&
+         (!entry->published ||
+          now - entry->published_at >= DUPLICATE_WINDOW_US);
+}
+
+// Returns the entry of the tag, adding it if needed, or NULL if the table is
+// full of tags heard within the duplicate window. Must be called with the
+// lock held.
+static struct tag_entry *find_entry(const uint8_t mac[6], int64_t now) {
+  if (gateway.tags == NULL) {
+    return NULL;
+  }
+  size_t mask = gateway.capacity - 1;
+  size_t index = hash_mac(mac) & mask;
+  struct tag_entry *free_entry = NULL;
+  for (size_t i = 0; i < gateway.capacity; i++) {
+    struct tag_entry *entry = &gateway.tags[(index + i) & mask];
+    if (!entry->used) {
+      if (free_entry == NULL) {
+        free_entry = entry;
+      }
+      break;
+    }
+    if (memcmp(entry->mac, mac, 6) == 0) {
+      return entry;
+    }
+    if (free_entry == NULL && entry_expired(entry, now)) {
+      free_entry = entry;
+    }
+  }
+
+  if (free_entry != NULL) {
+    *free_entry = (struct tag_entry){
+        .used = true,
+        .pending = NO_PENDING,
+    };
+    memcpy(free_entry->mac, mac, 6);
+  }
+  return free_entry;
+}
+
+// Must be called with the lock held.
+static struct pending_frame *allocate_pending(struct tag_entry *entry) {
+  for (size_t i = 0; i < MAX_PENDING; i++) {
+    struct pending_frame *pending = &gateway.pending[i];
+    if (pending->entry == NULL) {
+      pending->entry = entry;
+      entry->pending = i;
+      return pending;
+    }
+  }
+  return NULL;
+}
+
+// Not all formats have a sequence number, so copies of a frame are told
+// apart by their readings.
+static bool same_reading(const struct ruuvi_frame *a,
+                         const struct ruuvi_frame *b) {
+  return a->format == b->format && a->valid == b->valid &&
+         memcmp(a->values, b->values, sizeof(a->values)) == 0;
+}
+
+// Published readings are only kept as a fingerprint, which is enough to
+// recognise the late copies of a frame.
+static uint32_t reading_fingerprint(const struct ruuvi_frame *frame) {
+  uint32_t hash =
+      fnv1a(FNV_OFFSET_BASIS, &frame->format, sizeof(frame->format));
+  hash = fnv1a(hash, &frame->valid, sizeof(frame->valid));
+  return fnv1a(hash, frame->values, sizeof(frame->values));
+}
+
+// Must be called with the lock held.
+static void mark_published(struct tag_entry *entry,
+                           const struct ruuvi_frame *frame, int64_t now) {
+  entry->published = true;
+  entry->published_at = now;
+  entry->reading = reading_fingerprint(frame);
+}
+
+// Records that `node` heard the frame. Returns false if the frame could not
+// be collected, as all pending slots are in use: a frame this node heard is
+// then published by it right away, and a forwarded copy is dropped. Must be
+// called with the lock held.
+static bool add_observation(const struct ruuvi_frame *frame,
+                            const uint8_t node[6], int8_t rssi, int64_t now) {
+  struct tag_entry *entry = find_entry(frame->mac, now);
+  struct pending_frame *pending = NULL;
+  if (entry != NULL && entry->pending != NO_PENDING) {
+    pending = &gateway.pending[entry->pending];
+    if (same_reading(&pending->frame, frame)) {
+      if (pending->receiver_count < MAX_RECEIVERS) {
+        struct ruuvi_receiver *receiver =
+            &pending->receivers[pending->receiver_count++];
+        memcpy(receiver->mac, node, 6);
+        receiver->rssi = rssi;
+      }
+      return true;
+    }
+  } else if (entry != NULL && entry->published &&
+             now - entry->published_at < DUPLICATE_WINDOW_US &&
+             entry->reading == reading_fingerprint(frame)) {
+    // Copies arriving after the frame was published.
+    gateway.duplicates += 1;
+    return true;
+  }
+
+  if (entry != NULL && pending == NULL) {
+    pending = allocate_pending(entry);
+  }
+  if (pending == NULL) {
+    if (entry != NULL && memcmp(node, gateway.self, 6) == 0) {
+      mark_published(entry, frame, now);
+    } else {
+      gateway.dropped += 1;
+    }
+    return false;
+  }
+  pending->first_seen = now;
+  pending->frame = *frame;
+  pending->receiver_count = 1;
+  memcpy(pending->receivers[0].mac, node, 6);
+  pending->receivers[0].rssi = rssi;
+  return true;
+}
+
+bool ruuvi_gateway_frame(const struct ruuvi_frame *frame,
+                         const uint8_t *address, const uint8_t *data,
+                         size_t length, int8_t rssi) {
+  if (!forwarding_enabled() || length > RUUVI_FRAME_MAX_LENGTH) {
+    return false;
+  }
+
+  int64_t now = esp_timer_get_time();
+  uint8_t remote[6];
+
+  portENTER_CRITICAL(&gateway.lock);
+  bool local = is_gateway(now);
+  bool forward = !local && remote_fresh(now);
+  bool collected = local && add_observation(frame, gateway.self, rssi, now);
+  memcpy(remote, gateway.remote, 6);
+  portEXIT_CRITICAL(&gateway.lock);
+
+  // A frame this node could not collect is published on its own.
+  if (collected) {
+    return true;
+  }
+
+  if (forward) {
+    struct forward_packet packet = {
+        .type = LOCAL_CONTROL_RUUVI_FRAME,
+        .rssi = rssi,
+    };
+    memcpy(packet.address, address, 6);
+    memcpy(packet.data, data, length);
+    size_t packet_len = offsetof(struct forward_packet, data) + length;
+    if (esp_now_send(remote, (const uint8_t *)&packet, packet_len) ==
+        ESP_OK) {
+      portENTER_CRITICAL(&gateway.lock);
+      gateway.forwarded += 1;
+      portEXIT_CRITICAL(&gateway.lock);
+      return true;
+    }
+  }
+
+  portENTER_CRITICAL(&gateway.lock);
+  gateway.direct += 1;
+  portEXIT_CRITICAL(&gateway.lock);
+  return false;
+}
+
+static void on_forward_packet(const esp_now_recv_info_t *info,
+                              const uint8_t *data, size_t data_len) {
+  size_t header_len = offsetof(struct forward_packet, data);
+  if (data_len <= header_len || data_len > sizeof(struct forward_packet)) {
+    return;
+  }
+  const struct forward_packet *packet = (const struct forward_packet *)data;
+
+  struct ruuvi_frame frame;
+  if (!ruuvi_decode_frame(&frame, packet->data, data_len - header_len,
+                          packet->address)) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&gateway.lock);
+  if (is_gateway(now)) {
+    gateway.received += 1;
+    add_observation(&frame, info->src_addr, packet->rssi, now);
+  }
+  portEXIT_CRITICAL(&gateway.lock);
+}
+
+static void on_announce_packet(const esp_now_recv_info_t *info,
+                               const uint8_t *data, size_t data_len) {
+  if (data_len != sizeof(struct announce_packet)) {
+    return;
+  }
+  const struct announce_packet *packet = (const struct announce_packet *)data;
+
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&gateway.lock);
+  bool current = memcmp(info->src_addr, gateway.remote, 6) == 0;
+  if (packet->candidate) {
+    if (current || !remote_fresh(now) ||
+        memcmp(info->src_addr, gateway.remote, 6) < 0) {
+      memcpy(gateway.remote, info->src_addr, 6);
+      gateway.remote_seen = now;
+    }
+  } else if (current) {
+    gateway.remote_seen = 0;
+  }
+  portEXIT_CRITICAL(&gateway.lock);
+}
+
+static void announce_callback(void *arg) {
+  if (!forwarding_enabled()) {
+    return;
+  }
+
+  portENTER_CRITICAL(&gateway.lock);
+  bool connected = gateway.connected;
+  portEXIT_CRITICAL(&gateway.lock);
+
+  struct announce_packet packet = {
+      .type = LOCAL_CONTROL_RUUVI_GATEWAY,
+      .candidate = connected,
+  };
+  esp_now_send(NULL, (const uint8_t *)&packet, sizeof(packet));
+}
+
+// Publishes the frames whose collection window is over, one at a time.
+static void flush_callback(void *arg) {
+  for (size_t i = 0; i < MAX_PENDING; i++) {
+    struct pending_frame frame;
+    bool found = false;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&gateway.lock);
+    struct pending_frame *pending =
+        gateway.pending != NULL ? &gateway.pending[i] : NULL;
+    if (pending != NULL && pending->entry != NULL &&
+        now - pending->first_seen >= CONFIG_RUUVI_GATEWAY_WINDOW_MS * 1000LL) {
+      pending->entry->pending = NO_PENDING;
+      mark_published(pending->entry, &pending->frame, now);
+      frame = *pending;
+      pending->entry = NULL;
+      found = true;
+      gateway.published += 1;
+    }
+    portEXIT_CRITICAL(&gateway.lock);
+
+    if (found) {
+      ruuvi_publish_frame(gateway.client, &frame.frame, frame.receivers,
+                          frame.receiver_count);
+    }
+  }
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  if (event_id == MQTT_EVENT_CONNECTED || event_id == MQTT_EVENT_DISCONNECTED) {
+    portENTER_CRITICAL(&gateway.lock);
+    gateway.connected = event_id == MQTT_EVENT_CONNECTED;
+    portEXIT_CRITICAL(&gateway.lock);
+    announce_callback(NULL);
+  }
+}
+
+void ruuvi_gateway_add_metrics(cJSON *root) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&gateway.lock);
+  bool local = is_gateway(now);
+  bool fresh = remote_fresh(now);
+  uint8_t remote[6];
+  memcpy(remote, gateway.remote, 6);
+  uint32_t forwarded = gateway.forwarded;
+  uint32_t received = gateway.received;
+  uint32_t duplicates = gateway.duplicates;
+  uint32_t published = gateway.published;
+  uint32_t direct = gateway.direct;
+  uint32_t dropped = gateway.dropped;
+  portEXIT_CRITICAL(&gateway.lock);
+
+  cJSON *obj = cJSON_AddObjectToObject(root, "gateway");
+  if (!forwarding_enabled()) {
+    cJSON_AddStringToObject(obj, "role", "direct");
+  } else if (local) {
+    cJSON_AddStringToObject(obj, "role", "gateway");
+  } else {
+    cJSON_AddStringToObject(obj, "role", "forwarder");
+  }
+  if (fresh) {
+    char mac[18];
+    snprintf(mac, sizeof(mac), MACSTR, MAC2STR(remote));
+    cJSON_AddStringToObject(obj, "remote", mac);
+  }
+  cJSON_AddNumberToObject(obj, "forwarded", forwarded);
+  cJSON_AddNumberToObject(obj, "received", received);
+  cJSON_AddNumberToObject(obj, "duplicates", duplicates);
+  cJSON_AddNumberToObject(obj, "published", published);
+  cJSON_AddNumberToObject(obj, "direct", direct);
+  cJSON_AddNumberToObject(obj, "dropped", dropped);
+}
+
+static void event_handler(void *arg, esp_event_base_t event_base,
+                          int32_t event_id, void *event_data) {
+  load_config();
+}
+
+void ruuvi_gateway_init(esp_mqtt_client_handle_t client) {
+  gateway.client = client;
+  ESP_ERROR_CHECK(esp_read_mac(gateway.self, ESP_MAC_WIFI_STA));
+
+  load_config();
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &event_handler, NULL));
+
+  local_control_register(LOCAL_CONTROL_RUUVI_FRAME, on_forward_packet);
+  local_control_register(LOCAL_CONTROL_RUUVI_GATEWAY, on_announce_packet);
+
+  esp_timer_create_args_t announce_args = {
+      .callback = announce_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "ruuvi_announce",
+      .skip_unhandled_events = true,
+  };
+  esp_timer_handle_t announce_timer;
+  ESP_ERROR_CHECK(esp_timer_create(&announce_args, &announce_timer));
+  esp_timer_start_periodic(announce_timer,
+                           CONFIG_RUUVI_GATEWAY_ANNOUNCE_MS * 1000LL);
+
+  esp_timer_create_args_t flush_args = {
+      .callback = flush_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "ruuvi_flush",
+      .skip_unhandled_events = true,
+  };
+  esp_timer_handle_t flush_timer;
+  ESP_ERROR_CHECK(esp_timer_create(&flush_args, &flush_timer));
+  esp_timer_start_periodic(flush_timer, FLUSH_INTERVAL_MS * 1000);
+
+  ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
+                                                 mqtt_event_handler, NULL));
+}
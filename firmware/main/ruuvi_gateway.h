@@ -0,0 +1,30 @@
+#pragma once
+#include "ruuvi.h"
+#include <cJSON.h>
+#include <mqtt_client.h>
+
+// Forwarding of Ruuvi frames to a single gateway node, enabled by the
+// `ruuvi_forward` config key.
+//
+// Nodes which are connected to the broker announce themselves as gateway
+// candidates over ESP-NOW, and the candidate with the lowest MAC address acts
+// as gateway. Other nodes forward the raw frames they hear to it, along with
+// the RSSI they heard them with. The gateway collects the copies of a frame
+// for CONFIG_RUUVI_GATEWAY_WINDOW_MS, then publishes it once, with the list
+// of nodes which heard it.
+//
+// Frames are only forwarded to gateways in the ESP-NOW peer list. Without a
+// gateway in reach, nodes publish frames themselves as usual.
+//
+// The gateway tracks up to twice CONFIG_RUUVI_TAGS_MAX tags, and collects the
+// frames of up to half of them at once. Its tables take about 130 bytes per
+// tag of CONFIG_RUUVI_TAGS_MAX, allocated when forwarding is first enabled.
+void ruuvi_gateway_init(esp_mqtt_client_handle_t client);
+
+// Hands a frame heard by this node over to the gateway. Returns false if the
+// frame should be published directly instead.
+bool ruuvi_gateway_frame(const struct ruuvi_frame *frame,
+                         const uint8_t *address, const uint8_t *data,
+                         size_t length, int8_t rssi);
+
+void ruuvi_gateway_add_metrics(cJSON *root);
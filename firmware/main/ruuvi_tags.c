@@ -0,0 +1,508 @@
+#include "ruuvi_tags.h"
+#include "byteorder.h"
+#include "config.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <nvs_flash.h>
+#include <string.h>
+
+#define TAG "ruuvi_tags"
+
+#define MACSTR_UPPER "%02X:%02X:%02X:%02X:%02X:%02X"
+
+// Largest binary form of the registry which is saved. The 16K NVS partition
+// has 12K usable, shared with the configuration, and NVS writes the new copy
+// of a blob before erasing the old one, so both must fit at once.
+#define REGISTRY_SAVED_MAX 4096
+// Registries larger than this are not accepted over MQTT. Their JSON takes
+// about four times the size of their binary form.
+#define REGISTRY_PAYLOAD_MAX (4 * REGISTRY_SAVED_MAX)
+
+// The registry is saved to NVS in a compact binary form, as its JSON does not
+// fit the NVS partition: a format byte, then for every tag its address, a
+// flags byte, the interval in seconds, little-endian, and the length of its
+// name followed by the name.
+#define REGISTRY_FORMAT 1
+#define REGISTRY_FLAG_PUBLISH 0x01
+#define RECORD_HEADER_SIZE 10
+
+struct ruuvi_tag {
+  uint8_t mac[6];
+  bool publish;
+  uint16_t interval_s;
+  int64_t last_published;
+  char *name;  // NULL for tags without a name
+  char *topic; // NULL for an empty slot
+};
+
+// Open addressing hash table, with linear probing. The capacity is a power
+// of two at least twice the number of tags, and the table is rebuilt
+// whenever the registry is set.
+struct tag_table {
+  struct ruuvi_tag *slots;
+  size_t capacity;
+  size_t count;
+};
+
+static SemaphoreHandle_t lock;
+static struct tag_table tags;
+static nvs_handle_t handle;
+static char *tags_topic;
+static char *tags_set_topic;
+
+// Registry being received, as the MQTT client delivers large messages in
+// several fragments. Only the first fragment carries the topic.
+static struct {
+  bool receiving;
+  char *data;
+} incoming;
+
+// Cached from the configuration, as it is checked for every unknown frame.
+static bool publish_unknown;
+
+static struct {
+  uint32_t unknown;
+  uint32_t suppressed;
+  uint32_t max_probes;
+} stats;
+
+// FNV-1a
+static uint32_t hash_mac(const uint8_t *mac) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < 6; i++) {
+    hash = (hash ^ mac[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Returns the slot of the tag, or the empty slot where it would go.
+static struct ruuvi_tag *find_slot(const struct tag_table *table,
+                                   const uint8_t *mac, uint32_t *probes) {
+  size_t mask = table->capacity - 1;
+  size_t i = hash_mac(mac) & mask;
+  for (*probes = 1;; i = (i + 1) & mask, *probes += 1) {
+    struct ruuvi_tag *slot = &table->slots[i];
+    if (slot->topic == NULL || memcmp(slot->mac, mac, 6) == 0) {
+      return slot;
+    }
+  }
+}
+
+static void free_table(struct tag_table *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    free(table->slots[i].name);
+    free(table->slots[i].topic);
+  }
+  free(table->slots);
+  *table = (struct tag_table){0};
+}
+
+static bool init_table(struct tag_table *table, size_t count) {
+  size_t capacity = 2;
+  while (capacity < 2 * count) {
+    capacity *= 2;
+  }
+  table->slots = calloc(capacity, sizeof(struct ruuvi_tag));
+  if (table->slots == NULL) {
+    return false;
+  }
+  table->capacity = capacity;
+  table->count = 0;
+  return true;
+}
+
+static void add_tag(struct tag_table *table, const uint8_t *mac,
+                    const char *name, size_t name_len, bool publish,
+                    uint16_t interval_s) {
+  uint32_t probes;
+  struct ruuvi_tag *slot = find_slot(table, mac, &probes);
+  if (slot->topic == NULL) {
+    table->count += 1;
+  }
+  free(slot->name);
+  free(slot->topic);
+  memcpy(slot->mac, mac, 6);
+  slot->publish = publish;
+  slot->interval_s = interval_s;
+  slot->last_published = 0;
+  slot->name = name != NULL ? strndup(name, name_len) : NULL;
+  asprintf(&slot->topic, "%s/" MACSTR_UPPER, CONFIG_RUUVI_MQTT_TOPIC_PREFIX,
+           MAC2STR(mac));
+}
+
+static bool build_table(struct tag_table *table, const cJSON *root) {
+  size_t count = cJSON_GetArraySize(root);
+  if (!cJSON_IsObject(root) || count > CONFIG_RUUVI_TAGS_MAX ||
+      !init_table(table, count)) {
+    return false;
+  }
+
+  const cJSON *item;
+  cJSON_ArrayForEach(item, root) {
+    unsigned int bytes[6];
+    uint8_t mac[6];
+    if (sscanf(item->string, "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1],
+               &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != 6 ||
+        !cJSON_IsObject(item)) {
+      ESP_LOGW(TAG, "bad tag entry %s", item->string);
+      continue;
+    }
+    for (size_t i = 0; i < 6; i++) {
+      mac[i] = bytes[i];
+    }
+
+    const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(item, "name"));
+    const cJSON *publish = cJSON_GetObjectItem(item, "publish");
+    const cJSON *interval = cJSON_GetObjectItem(item, "interval");
+    if (name != NULL && strlen(name) >= RUUVI_TAG_NAME_SIZE) {
+      ESP_LOGW(TAG, "tag name too long: %s", name);
+      name = NULL;
+    }
+    add_tag(table, mac, name, name != NULL ? strlen(name) : 0,
+            !cJSON_IsFalse(publish),
+            cJSON_IsNumber(interval) ? interval->valueint : 0);
+  }
+  return true;
+}
+
+// Builds the table from the binary form of the registry.
+static bool decode_table(struct tag_table *table, const uint8_t *data,
+                         size_t size) {
+  if (size == 0 || data[0] != REGISTRY_FORMAT) {
+    return false;
+  }
+
+  size_t count = 0;
+  for (size_t offset = 1; offset < size; count++) {
+    if (size - offset < RECORD_HEADER_SIZE ||
+        data[offset + 9] >= RUUVI_TAG_NAME_SIZE ||
+        size - offset - RECORD_HEADER_SIZE < data[offset + 9]) {
+      return false;
+    }
+    offset += RECORD_HEADER_SIZE + data[offset + 9];
+  }
+  if (count > CONFIG_RUUVI_TAGS_MAX || !init_table(table, count)) {
+    return false;
+  }
+
+  for (size_t offset = 1; offset < size;) {
+    const uint8_t *record = data + offset;
+    size_t name_len = record[9];
+    add_tag(table, record,
+            name_len > 0 ? (const char *)record + RECORD_HEADER_SIZE : NULL,
+            name_len, record[6] & REGISTRY_FLAG_PUBLISH, read_16le(record + 7));
+    offset += RECORD_HEADER_SIZE + name_len;
+  }
+  return true;
+}
+
+// Returns the binary form of the registry, to be freed by the caller.
+static uint8_t *encode_table(const struct tag_table *table, size_t *size) {
+  *size = 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    const struct ruuvi_tag *tag = &table->slots[i];
+    if (tag->topic != NULL) {
+      *size += RECORD_HEADER_SIZE + (tag->name != NULL ? strlen(tag->name) : 0);
+    }
+  }
+
+  uint8_t *data = malloc(*size);
+  if (data == NULL) {
+    return NULL;
+  }
+  data[0] = REGISTRY_FORMAT;
+  uint8_t *p = data + 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    const struct ruuvi_tag *tag = &table->slots[i];
+    if (tag->topic == NULL) {
+      continue;
+    }
+    size_t name_len = tag->name != NULL ? strlen(tag->name) : 0;
+    memcpy(p, tag->mac, 6);
+    p[6] = tag->publish ? REGISTRY_FLAG_PUBLISH : 0;
+    write_16le(p + 7, tag->interval_s);
+    p[9] = name_len;
+    if (name_len > 0) {
+      memcpy(p + RECORD_HEADER_SIZE, tag->name, name_len);
+    }
+    p += RECORD_HEADER_SIZE + name_len;
+  }
+  return data;
+}
+
+bool ruuvi_tags_lookup(const uint8_t *mac, char *name, char *topic) {
+  int64_t now = esp_timer_get_time();
+  bool publish = true;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  struct ruuvi_tag *tag = NULL;
+  if (tags.count > 0) {
+    uint32_t probes;
+    tag = find_slot(&tags, mac, &probes);
+    if (probes > stats.max_probes) {
+      stats.max_probes = probes;
+    }
+    if (tag->topic == NULL) {
+      tag = NULL;
+    }
+  }
+
+  if (tag != NULL) {
+    if (!tag->publish ||
+        (tag->last_published != 0 &&
+         now - tag->last_published < tag->interval_s * 1000000LL)) {
+      publish = false;
+      stats.suppressed += 1;
+    } else {
+      tag->last_published = now;
+      strcpy(name, tag->name != NULL ? tag->name : "");
+      strcpy(topic, tag->topic);
+    }
+  }
+  xSemaphoreGive(lock);
+
+  if (tag == NULL) {
+    stats.unknown += 1;
+    publish = publish_unknown;
+    name[0] = '\0';
+    snprintf(topic, RUUVI_TAG_TOPIC_SIZE, "%s/" MACSTR_UPPER,
+             CONFIG_RUUVI_MQTT_TOPIC_PREFIX, MAC2STR(mac));
+  }
+  return publish;
+}
+
+bool ruuvi_tags_find_mac(const char *name, uint8_t *mac) {
+  bool found = false;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (size_t i = 0; i < tags.capacity && !found; i++) {
+    const struct ruuvi_tag *tag = &tags.slots[i];
+    if (tag->topic != NULL && tag->name != NULL &&
+        strcmp(tag->name, name) == 0) {
+      memcpy(mac, tag->mac, 6);
+      found = true;
+    }
+  }
+  xSemaphoreGive(lock);
+  return found;
+}
+
+static cJSON *registry_to_json() {
+  cJSON *root = cJSON_CreateObject();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (size_t i = 0; i < tags.capacity; i++) {
+    const struct ruuvi_tag *tag = &tags.slots[i];
+    if (tag->topic == NULL) {
+      continue;
+    }
+    char mac[18];
+    snprintf(mac, sizeof(mac), MACSTR_UPPER, MAC2STR(tag->mac));
+    cJSON *entry = cJSON_AddObjectToObject(root, mac);
+    if (tag->name != NULL) {
+      cJSON_AddStringToObject(entry, "name", tag->name);
+    }
+    if (!tag->publish) {
+      cJSON_AddBoolToObject(entry, "publish", false);
+    }
+    if (tag->interval_s != 0) {
+      cJSON_AddNumberToObject(entry, "interval", tag->interval_s);
+    }
+  }
+  xSemaphoreGive(lock);
+  return root;
+}
+
+// The registry can be too large for a CBOR payload, so it is always
+// published as JSON.
+static void publish_tags(esp_mqtt_client_handle_t client) {
+  cJSON *root = registry_to_json();
+  char *payload = cJSON_PrintUnformatted(root);
+  esp_mqtt_client_enqueue(client, tags_topic, payload, 0,
+                          config_get_qos("qos_config", CONFIG_MQTT_QOS_CONFIG),
+                          /* retain */ 1, true);
+  free(payload);
+  cJSON_Delete(root);
+}
+
+static void install_table(struct tag_table *table) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  struct tag_table old = tags;
+  tags = *table;
+  xSemaphoreGive(lock);
+  free_table(&old);
+
+  ESP_LOGI(TAG, "%zu tags", table->count);
+}
+
+static bool parse_tags(struct tag_table *table, const char *payload,
+                       size_t payload_len) {
+  cJSON *root = cJSON_ParseWithLength(payload, payload_len);
+  bool ok = build_table(table, root);
+  if (!ok) {
+    ESP_LOGE(TAG, "bad tag registry");
+  }
+  cJSON_Delete(root);
+  return ok;
+}
+
+// Saves a table before it is installed. Returns false if it could not be
+// saved, in which case NVS still holds the previous registry.
+static bool save_tags(const struct tag_table *table) {
+  size_t size;
+  uint8_t *data = encode_table(table, &size);
+  if (data == NULL) {
+    ESP_LOGE(TAG, "cannot encode tags");
+    return false;
+  }
+  if (size > REGISTRY_SAVED_MAX) {
+    ESP_LOGE(TAG, "tag registry of %zu bytes is over %d bytes", size,
+             REGISTRY_SAVED_MAX);
+    free(data);
+    return false;
+  }
+
+  esp_err_t err = nvs_set_blob(handle, "tags", data, size);
+  free(data);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "cannot save %zu bytes of tags: %s", size,
+             esp_err_to_name(err));
+    return false;
+  }
+  if (nvs_commit(handle) != ESP_OK) {
+    ESP_LOGE(TAG, "cannot commit nvs");
+    return false;
+  }
+  return true;
+}
+
+static void load_tags() {
+  size_t size;
+  if (nvs_get_blob(handle, "tags", NULL, &size) != ESP_OK) {
+    ESP_LOGW(TAG, "No tags configured");
+    return;
+  }
+
+  uint8_t *data = malloc(size);
+  if (data == NULL || nvs_get_blob(handle, "tags", data, &size) != ESP_OK) {
+    free(data);
+    return;
+  }
+
+  struct tag_table table = {0};
+  if (size > 0 && data[0] == '{') {
+    // Saved as JSON by older firmware, and kept as is if it cannot be
+    // converted.
+    if (parse_tags(&table, (const char *)data, size)) {
+      save_tags(&table);
+      install_table(&table);
+    } else {
+      free_table(&table);
+    }
+  } else if (decode_table(&table, data, size)) {
+    install_table(&table);
+  } else {
+    ESP_LOGE(TAG, "bad saved tag registry");
+    free_table(&table);
+  }
+  free(data);
+}
+
+// Reassembles registries that the MQTT client delivers in several fragments,
+// as chunked_ota.c does for chunks.
+static void on_tags_data(esp_mqtt_event_handle_t event) {
+  if (event->topic_len > 0) {
+    incoming.receiving =
+        event->topic_len == strlen(tags_set_topic) &&
+        strncmp(event->topic, tags_set_topic, event->topic_len) == 0;
+  }
+  if (!incoming.receiving) {
+    return;
+  }
+
+  if (event->current_data_offset == 0) {
+    free(incoming.data);
+    incoming.data = NULL;
+    if (event->total_data_len <= REGISTRY_PAYLOAD_MAX) {
+      incoming.data = malloc(event->total_data_len);
+    }
+    if (incoming.data == NULL) {
+      ESP_LOGE(TAG, "dropping tag registry of %d bytes",
+               event->total_data_len);
+      incoming.receiving = false;
+      publish_tags(event->client);
+      return;
+    }
+  } else if (incoming.data == NULL) {
+    return;
+  }
+
+  memcpy(incoming.data + event->current_data_offset, event->data,
+         event->data_len);
+  if (event->current_data_offset + event->data_len < event->total_data_len) {
+    return;
+  }
+
+  // A registry that cannot be saved is rejected, so that the one in use is
+  // always the one a reboot restores. Either way, the registry in use is
+  // published back.
+  incoming.receiving = false;
+  struct tag_table table = {0};
+  if (parse_tags(&table, incoming.data, event->total_data_len) &&
+      save_tags(&table)) {
+    install_table(&table);
+    // Rules refer to tags by name.
+    control_event_post(CONFIG_EVENT, CONFIG_EVENT_CHANGED, NULL, 0, 0);
+  } else {
+    free_table(&table);
+  }
+  free(incoming.data);
+  incoming.data = NULL;
+  publish_tags(event->client);
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(RUUVI);
+  esp_mqtt_event_handle_t event = event_data;
+  if (event_id == MQTT_EVENT_CONNECTED) {
+    esp_mqtt_client_subscribe(event->client, tags_set_topic, 2);
+    publish_tags(event->client);
+  } else if (event_id == MQTT_EVENT_DATA) {
+    on_tags_data(event);
+  }
+}
+
+static void config_event_handler(void *arg, esp_event_base_t event_base,
+                                 int32_t event_id, void *event_data) {
+  publish_unknown = config_get_bool_or("ruuvi_unknown", true);
+}
+
+void ruuvi_tags_add_metrics(cJSON *root) {
+  cJSON *obj = cJSON_AddObjectToObject(root, "tags");
+  cJSON_AddNumberToObject(obj, "count", tags.count);
+  cJSON_AddNumberToObject(obj, "capacity", tags.capacity);
+  cJSON_AddNumberToObject(obj, "max_probes", stats.max_probes);
+  cJSON_AddNumberToObject(obj, "unknown", stats.unknown);
+  cJSON_AddNumberToObject(obj, "suppressed", stats.suppressed);
+}
+
+void ruuvi_tags_init(esp_mqtt_client_handle_t client, const char *prefix) {
+  HEAP_SUBSYSTEM(RUUVI);
+  asprintf(&tags_topic, "%s/ruuvi/tags", prefix);
+  asprintf(&tags_set_topic, "%s/ruuvi/tags/set", prefix);
+  lock = xSemaphoreCreateMutex();
+
+  ESP_ERROR_CHECK(nvs_open("ruuvi", NVS_READWRITE, &handle));
+  load_tags();
+
+  publish_unknown = config_get_bool_or("ruuvi_unknown", true);
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &config_event_handler,
+      NULL));
+  ESP_ERROR_CHECK(esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
+                                                 mqtt_event_handler, NULL));
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "sdkconfig.h"
+
+#if CONFIG_RUUVI_ENABLE
+
+#include <cJSON.h>
+#include <mqtt_client.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RUUVI_TAG_NAME_SIZE 32
+#define RUUVI_TAG_TOPIC_SIZE 96
+
+// Registry of known Ruuvi tags, set on `<prefix>/ruuvi/tags/set` and saved to
+// NVS. The registry is an object keyed by MAC address:
+//   {"C2:48:C3:40:E6:D0": {"name": "Kitchen", "interval": 60}}
+// where `name` is optional, `publish` (default true) selects whether frames
+// of the tag are published at all, and `interval` is the minimum time between
+// two published frames in seconds. Frames of tags missing from the registry
+// are published unless the `ruuvi_unknown` config key is false.
+void ruuvi_tags_init(esp_mqtt_client_handle_t client, const char *prefix);
+
+// Looks up the name and topic of a tag, applying its publishing policy.
+// Returns false if the frame should not be published. `name` is set to an
+// empty string for tags without a name.
+bool ruuvi_tags_lookup(const uint8_t *mac, char *name, char *topic);
+
+// Looks up the MAC address of a tag by name.
+bool ruuvi_tags_find_mac(const char *name, uint8_t *mac);
+
+void ruuvi_tags_add_metrics(cJSON *root);
+
+#endif // CONFIG_RUUVI_ENABLE
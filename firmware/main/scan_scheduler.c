@@ -0,0 +1,317 @@
+#include "scan_scheduler.h"
+#include "ble.h"
+#include "chunked_ota.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <mqtt_ota.h>
+#include <string.h>
+
+#define TAG "scan_scheduler"
+
+#define MAX_TAGS 16
+// Gaps in sequence numbers larger than this are assumed to be a tag reboot,
+// rather than lost frames.
+#define MAX_SEQUENCE_GAP 256
+// Forget about tags which haven't been heard for this many periods.
+#define TAG_EXPIRY_PERIODS 4
+// Smallest scan window the controller accepts, in units of 0.625ms.
+#define MIN_WINDOW 4
+
+struct tag_stats {
+  uint8_t mac[6];
+  bool valid;
+  uint16_t last_sequence_number;
+  uint8_t idle_periods;
+  // Frames received, and frames sent according to sequence numbers, during
+  // the current period.
+  uint32_t received;
+  uint32_t expected;
+};
+
+static struct {
+  portMUX_TYPE lock;
+  struct tag_stats tags[MAX_TAGS];
+  int64_t backoff_until;
+  bool ota_active;
+  // Whether scanning backed off at any point during the current period.
+  bool disturbed;
+  uint8_t duty;
+
+  // Totals over the previous period, for the metrics.
+  uint32_t last_received;
+  uint32_t last_expected;
+  uint8_t last_duty;
+  uint32_t adjustments;
+} scheduler = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+    .duty = CONFIG_BLE_SCAN_MAX_DUTY,
+};
+
+static esp_timer_handle_t period_timer;
+static esp_timer_handle_t update_timer;
+
+// Changing the window restarts the scan, so it is only done from the
+// scheduler's timers, and only when the window actually changes.
+static SemaphoreHandle_t window_lock;
+static uint32_t applied_window;
+
+static void apply_duty(uint8_t duty) {
+  uint32_t window = CONFIG_BLE_SCAN_INTERVAL * duty / 100;
+  if (window < MIN_WINDOW) {
+    window = MIN_WINDOW;
+  }
+  xSemaphoreTake(window_lock, portMAX_DELAY);
+  if (window != applied_window) {
+    ble_scan_set_window(window);
+    applied_window = window;
+  }
+  xSemaphoreGive(window_lock);
+}
+
+static bool backing_off(int64_t now) {
+  return scheduler.ota_active || now < scheduler.backoff_until;
+}
+
+void scan_scheduler_frame(const uint8_t mac[6], uint16_t sequence_number) {
+  portENTER_CRITICAL(&scheduler.lock);
+  struct tag_stats *tag = NULL;
+  struct tag_stats *free_slot = NULL;
+  for (size_t i = 0; i < MAX_TAGS; i++) {
+    if (scheduler.tags[i].valid &&
+        memcmp(scheduler.tags[i].mac, mac, 6) == 0) {
+      tag = &scheduler.tags[i];
+      break;
+    } else if (!scheduler.tags[i].valid && free_slot == NULL) {
+      free_slot = &scheduler.tags[i];
+    }
+  }
+
+  if (tag == NULL && free_slot != NULL) {
+    tag = free_slot;
+    memset(tag, 0, sizeof(*tag));
+    memcpy(tag->mac, mac, 6);
+    tag->valid = true;
+  } else if (tag != NULL) {
+    uint16_t gap = sequence_number - tag->last_sequence_number;
+    if (gap > 0 && gap <= MAX_SEQUENCE_GAP) {
+      tag->received += 1;
+      tag->expected += gap;
+    }
+  }
+
+  if (tag != NULL) {
+    tag->last_sequence_number = sequence_number;
+    tag->idle_periods = 0;
+  }
+  portEXIT_CRITICAL(&scheduler.lock);
+}
+
+// Picks the duty cycle for the next period, based on the reception of the
+// period that just ended.
+static uint8_t next_duty(uint32_t received, uint32_t expected,
+                         uint32_t min_expected, bool missing) {
+  if (missing) {
+    // A known tag was not heard at all: its advertisement rate is unknown,
+    // so scan more until it shows up again.
+    uint32_t duty = scheduler.duty * 2;
+    return duty > CONFIG_BLE_SCAN_MAX_DUTY ? CONFIG_BLE_SCAN_MAX_DUTY : duty;
+  }
+  if (expected == 0) {
+    return CONFIG_BLE_SCAN_MAX_DUTY;
+  }
+
+  // Fraction of the frames on air which were received while the scanner was
+  // listening. Below 1, the rest was lost to the radio being used elsewhere.
+  float reception = (float)received / expected;
+  float efficiency = reception * 100 / scheduler.duty;
+  if (efficiency > 1) {
+    efficiency = 1;
+  } else if (efficiency < 0.1) {
+    efficiency = 0.1;
+  }
+
+  // The duty cycle needed for the sparsest tag to be heard often enough, with
+  // 50% margin.
+  float duty = 1.5 * 100 * CONFIG_BLE_SCAN_TARGET_FRAMES /
+               (min_expected * efficiency);
+  if (duty > CONFIG_BLE_SCAN_MAX_DUTY) {
+    return CONFIG_BLE_SCAN_MAX_DUTY;
+  } else if (duty < CONFIG_BLE_SCAN_MIN_DUTY) {
+    return CONFIG_BLE_SCAN_MIN_DUTY;
+  }
+  return duty;
+}
+
+static void period_callback(void *arg) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&scheduler.lock);
+  uint32_t received = 0;
+  uint32_t expected = 0;
+  uint32_t min_expected = UINT32_MAX;
+  bool missing = false;
+  for (size_t i = 0; i < MAX_TAGS; i++) {
+    struct tag_stats *tag = &scheduler.tags[i];
+    if (!tag->valid) {
+      continue;
+    }
+    if (tag->received == 0) {
+      tag->idle_periods += 1;
+      if (tag->idle_periods >= TAG_EXPIRY_PERIODS) {
+        tag->valid = false;
+      } else {
+        missing = true;
+      }
+      continue;
+    }
+
+    received += tag->received;
+    expected += tag->expected;
+    if (tag->expected < min_expected) {
+      min_expected = tag->expected;
+    }
+    tag->received = 0;
+    tag->expected = 0;
+  }
+
+  scheduler.last_received = received;
+  scheduler.last_expected = expected;
+  scheduler.last_duty = backing_off(now) ? CONFIG_BLE_SCAN_MIN_DUTY
+                                         : scheduler.duty;
+
+  // Reception while backing off says nothing about the normal duty cycle.
+  bool adjust = !scheduler.disturbed && !backing_off(now);
+  scheduler.disturbed = backing_off(now);
+  uint8_t duty = scheduler.duty;
+  if (adjust) {
+    duty = next_duty(received, expected, min_expected, missing);
+    if (duty != scheduler.duty) {
+      scheduler.adjustments += 1;
+    }
+    scheduler.duty = duty;
+  }
+  bool active = !backing_off(now);
+  portEXIT_CRITICAL(&scheduler.lock);
+
+  if (active) {
+    apply_duty(duty);
+  }
+}
+
+// Applies the window for the current state, and runs again when a backoff
+// is due to end.
+static void update_callback(void *arg) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&scheduler.lock);
+  bool backoff = backing_off(now);
+  int64_t remaining = scheduler.backoff_until - now;
+  uint8_t duty = backoff ? CONFIG_BLE_SCAN_MIN_DUTY : scheduler.duty;
+  portEXIT_CRITICAL(&scheduler.lock);
+
+  apply_duty(duty);
+  if (remaining > 0) {
+    esp_timer_start_once(update_timer, remaining);
+  }
+}
+
+static void schedule_update() {
+  esp_timer_stop(update_timer);
+  esp_timer_start_once(update_timer, 0);
+}
+
+// Called from the ESP-NOW paths, so it only records the deadline. Extending
+// a backoff in progress needs no window change at all.
+void scan_scheduler_backoff(uint32_t duration_ms) {
+  if (update_timer == NULL) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  int64_t until = now + duration_ms * 1000;
+  portENTER_CRITICAL(&scheduler.lock);
+  bool start = !backing_off(now);
+  if (until > scheduler.backoff_until) {
+    scheduler.backoff_until = until;
+  }
+  scheduler.disturbed = true;
+  portEXIT_CRITICAL(&scheduler.lock);
+
+  if (start) {
+    schedule_update();
+  }
+}
+
+static void ota_event_handler(void *arg, esp_event_base_t event_base,
+                              int32_t event_id, void *event_data) {
+  bool started;
+  if (event_base == CHUNKED_OTA_EVENT) {
+    started = event_id == CHUNKED_OTA_EVENT_STARTED;
+  } else {
+    started = event_id == MQTT_OTA_EVENT_STARTED;
+  }
+
+  portENTER_CRITICAL(&scheduler.lock);
+  scheduler.ota_active = started;
+  scheduler.disturbed = true;
+  portEXIT_CRITICAL(&scheduler.lock);
+
+  schedule_update();
+}
+
+void scan_scheduler_add_metrics(cJSON *root) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&scheduler.lock);
+  uint8_t duty = backing_off(now) ? CONFIG_BLE_SCAN_MIN_DUTY : scheduler.duty;
+  bool backoff = backing_off(now);
+  uint32_t received = scheduler.last_received;
+  uint32_t expected = scheduler.last_expected;
+  uint8_t last_duty = scheduler.last_duty;
+  uint32_t adjustments = scheduler.adjustments;
+  size_t tags = 0;
+  for (size_t i = 0; i < MAX_TAGS; i++) {
+    tags += scheduler.tags[i].valid;
+  }
+  portEXIT_CRITICAL(&scheduler.lock);
+
+  cJSON *scan = cJSON_AddObjectToObject(root, "ble_scan");
+  cJSON_AddNumberToObject(scan, "duty", duty);
+  cJSON_AddBoolToObject(scan, "backoff", backoff);
+  cJSON_AddNumberToObject(scan, "adjustments", adjustments);
+  cJSON_AddNumberToObject(scan, "tags", tags);
+  cJSON_AddNumberToObject(scan, "received", received);
+  cJSON_AddNumberToObject(scan, "expected", expected);
+  // Frames lost beyond what the duty cycle of the previous period explains,
+  // in percent.
+  if (expected > 0 && last_duty > 0) {
+    float coex_loss = 100 - (float)received * 100 * 100 / expected / last_duty;
+    cJSON_AddNumberToObject(scan, "coex_loss", coex_loss > 0 ? coex_loss : 0);
+  }
+}
+
+void scan_scheduler_init() {
+  window_lock = xSemaphoreCreateMutex();
+
+  esp_timer_create_args_t period_args = {
+      .callback = period_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "scan_period",
+      .skip_unhandled_events = true,
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&period_args, &period_timer));
+  esp_timer_start_periodic(period_timer, CONFIG_BLE_SCAN_PERIOD_S * 1000000LL);
+
+  esp_timer_create_args_t update_args = {
+      .callback = update_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "scan_update",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&update_args, &update_timer));
+
+  ESP_ERROR_CHECK(esp_event_handler_register(MQTT_OTA_EVENT, ESP_EVENT_ANY_ID,
+                                             ota_event_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      CHUNKED_OTA_EVENT, ESP_EVENT_ANY_ID, ota_event_handler, NULL));
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <cJSON.h>
+#include <stdint.h>
+
+// Adapts the BLE scan duty cycle, so that scanning only takes as much of the
+// shared radio as is needed to hear from the known tags.
+//
+// Reception is estimated from the tags' sequence numbers: the gap between two
+// consecutive frames from a tag tells how many were sent in between. Every
+// CONFIG_BLE_SCAN_PERIOD_S, the duty cycle is set so that each known tag is
+// expected to be heard at least CONFIG_BLE_SCAN_TARGET_FRAMES times per
+// period, given its advertisement rate and the loss observed beyond what the
+// duty cycle explains (ie. coexistence loss).
+//
+// Scanning drops to the minimum duty cycle while an OTA is in progress, and
+// for a short while after ESP-NOW group traffic.
+void scan_scheduler_init();
+void scan_scheduler_frame(const uint8_t mac[6], uint16_t sequence_number);
+void scan_scheduler_backoff(uint32_t duration_ms);
+void scan_scheduler_add_metrics(cJSON *root);
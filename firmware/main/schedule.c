@@ -0,0 +1,231 @@
+#include "schedule.h"
+#include "config.h"
+#include "event_loops.h"
+#include "heap_accounting.h"
+#include "local_control.h"
+#include <esp_log.h>
+#include <esp_netif_sntp.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define TAG "schedule"
+
+#define ALL_DAYS 0x7f
+// The timer is re-armed at least this often, so that it does not drift too
+// far from the wall clock.
+#define MAX_TIMER_DELAY_S 3600
+// Times before this are from a clock which was never set.
+#define MIN_VALID_TIME 1700000000
+
+struct schedule_entry {
+  uint16_t minute; // Minute of the day
+  uint8_t days;
+  uint8_t group;
+  bool state;
+};
+
+static SemaphoreHandle_t lock;
+static struct schedule_entry entries[CONFIG_SCHEDULE_MAX_ENTRIES];
+static size_t entry_count;
+static esp_timer_handle_t timer;
+// Entries due up to this time have been run.
+static time_t last_run;
+
+static struct {
+  uint32_t fired;
+  int64_t last_drift_ms;
+  int64_t max_drift_ms;
+} stats;
+
+static bool time_valid(time_t t) { return t >= MIN_VALID_TIME; }
+
+// First time after `after` at which the entry is due.
+static time_t next_occurrence(const struct schedule_entry *entry,
+                              time_t after) {
+  struct tm today;
+  localtime_r(&after, &today);
+  for (int day = 0; day <= 7; day++) {
+    struct tm tm = {
+        .tm_year = today.tm_year,
+        .tm_mon = today.tm_mon,
+        .tm_mday = today.tm_mday + day,
+        .tm_hour = entry->minute / 60,
+        .tm_min = entry->minute % 60,
+        .tm_isdst = -1,
+    };
+    time_t t = mktime(&tm);
+    if (t > after && (entry->days & (1 << tm.tm_wday))) {
+      return t;
+    }
+  }
+  return 0;
+}
+
+// Must be called with the lock held.
+static void arm_timer() {
+  esp_timer_stop(timer);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (!time_valid(now.tv_sec) || entry_count == 0) {
+    return;
+  }
+  if (!time_valid(last_run)) {
+    last_run = now.tv_sec;
+  }
+
+  time_t next = now.tv_sec + MAX_TIMER_DELAY_S;
+  for (size_t i = 0; i < entry_count; i++) {
+    time_t t = next_occurrence(&entries[i], last_run);
+    if (t != 0 && t < next) {
+      next = t;
+    }
+  }
+
+  int64_t delay_us = (next - now.tv_sec) * 1000000LL - now.tv_usec;
+  esp_timer_start_once(timer, delay_us > 0 ? delay_us : 0);
+}
+
+static void timer_callback(void *arg) {
+  HEAP_SUBSYSTEM(MAIN);
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  struct schedule_entry due[CONFIG_SCHEDULE_MAX_ENTRIES];
+  time_t due_at[CONFIG_SCHEDULE_MAX_ENTRIES];
+  size_t due_count = 0;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (size_t i = 0; i < entry_count; i++) {
+    time_t t = next_occurrence(&entries[i], last_run);
+    if (t != 0 && t <= now.tv_sec) {
+      due[due_count] = entries[i];
+      due_at[due_count] = t;
+      due_count += 1;
+    }
+  }
+  if (now.tv_sec > last_run) {
+    last_run = now.tv_sec;
+  }
+  arm_timer();
+  xSemaphoreGive(lock);
+
+  for (size_t i = 0; i < due_count; i++) {
+    ESP_LOGI(TAG, "switching group %d %s", due[i].group,
+             due[i].state ? "on" : "off");
+    local_control_switch_group(due[i].group, due[i].state);
+
+    int64_t drift_ms =
+        (now.tv_sec - due_at[i]) * 1000LL + now.tv_usec / 1000;
+    stats.fired += 1;
+    stats.last_drift_ms = drift_ms;
+    if (drift_ms > stats.max_drift_ms) {
+      stats.max_drift_ms = drift_ms;
+    }
+  }
+}
+
+static bool parse_entry(struct schedule_entry *entry, const cJSON *item) {
+  const char *time = cJSON_GetStringValue(cJSON_GetObjectItem(item, "time"));
+  const cJSON *group = cJSON_GetObjectItem(item, "group");
+  const cJSON *state = cJSON_GetObjectItem(item, "state");
+  const cJSON *days = cJSON_GetObjectItem(item, "days");
+
+  unsigned int hour, minute;
+  if (time == NULL || sscanf(time, "%u:%u", &hour, &minute) != 2 ||
+      hour > 23 || minute > 59 || !cJSON_IsNumber(group) ||
+      !cJSON_IsBool(state) || (days != NULL && !cJSON_IsNumber(days))) {
+    return false;
+  }
+
+  entry->minute = hour * 60 + minute;
+  entry->group = group->valueint;
+  entry->state = cJSON_IsTrue(state);
+  entry->days = days != NULL ? days->valueint & ALL_DAYS : ALL_DAYS;
+  return true;
+}
+
+static void load_schedule() {
+  cJSON *root = config_get_json("schedule");
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  entry_count = 0;
+  const cJSON *item;
+  cJSON_ArrayForEach(item, root) {
+    if (entry_count == CONFIG_SCHEDULE_MAX_ENTRIES) {
+      ESP_LOGW(TAG, "too many schedule entries");
+      break;
+    }
+    if (parse_entry(&entries[entry_count], item)) {
+      entry_count += 1;
+    } else {
+      ESP_LOGW(TAG, "bad schedule entry");
+    }
+  }
+  arm_timer();
+  xSemaphoreGive(lock);
+
+  cJSON_Delete(root);
+}
+
+static void event_handler(void *arg, esp_event_base_t event_base,
+                          int32_t event_id, void *event_data) {
+  HEAP_SUBSYSTEM(MAIN);
+  load_schedule();
+}
+
+// Called whenever SNTP sets the clock. Entries are only run from the first
+// time the clock is set on, but a later correction does not replay or skip
+// any of them.
+static void time_sync_callback(struct timeval *tv) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (!time_valid(last_run) || tv->tv_sec < last_run) {
+    last_run = tv->tv_sec;
+  }
+  arm_timer();
+  xSemaphoreGive(lock);
+}
+
+bool schedule_time_synced() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return time_valid(now.tv_sec);
+}
+
+void schedule_add_metrics(cJSON *root) {
+  cJSON *obj = cJSON_AddObjectToObject(root, "schedule");
+  cJSON_AddBoolToObject(obj, "time_synced", schedule_time_synced());
+  cJSON_AddNumberToObject(obj, "entries", entry_count);
+  cJSON_AddNumberToObject(obj, "fired", stats.fired);
+  cJSON_AddNumberToObject(obj, "last_drift_ms", stats.last_drift_ms);
+  cJSON_AddNumberToObject(obj, "max_drift_ms", stats.max_drift_ms);
+}
+
+void schedule_init() {
+  HEAP_SUBSYSTEM(MAIN);
+  lock = xSemaphoreCreateMutex();
+
+  setenv("TZ", CONFIG_SCHEDULE_TIMEZONE, 1);
+  tzset();
+
+  esp_timer_create_args_t args = {
+      .callback = timer_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "schedule",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+
+  load_schedule();
+  ESP_ERROR_CHECK(esp_event_handler_register_with(
+      control_loop, CONFIG_EVENT, CONFIG_EVENT_CHANGED, &event_handler, NULL));
+
+  esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_SNTP_SERVER);
+  config.sync_cb = time_sync_callback;
+  config.wait_for_sync = false;
+  ESP_ERROR_CHECK(esp_netif_sntp_init(&config));
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <cJSON.h>
+#include <stdbool.h>
+
+// Switches groups at set times of the day, from the `schedule` config key,
+// with the time kept by SNTP. Schedules keep running while the broker is
+// unreachable.
+//
+// The key holds an array of entries such as
+//   {"time": "07:30", "days": 62, "group": 1, "state": true}
+// where `days` is a bit mask of week days, starting with Sunday as bit 0,
+// and defaults to every day. Group 0 switches this node's channels only.
+void schedule_init();
+void schedule_add_metrics(cJSON *root);
+// Whether SNTP has set the clock.
+bool schedule_time_synced();
@@ -0,0 +1,104 @@
+#include "task_stats.h"
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+
+#define TAG "task_stats"
+
+// Room for tasks created between counting them and taking the snapshot.
+#define EXTRA_TASKS 4
+
+// The run time counters of every task, as of the previous snapshot. CPU usage
+// is computed over the interval between two snapshots, ie. between two
+// metrics publications.
+struct task_sample {
+  UBaseType_t number;
+  configRUN_TIME_COUNTER_TYPE run_time;
+};
+
+static struct {
+  SemaphoreHandle_t lock;
+  struct task_sample *samples;
+  size_t count;
+  configRUN_TIME_COUNTER_TYPE total_run_time;
+} previous;
+
+static const struct task_sample *find_sample(UBaseType_t number) {
+  for (size_t i = 0; i < previous.count; i++) {
+    if (previous.samples[i].number == number) {
+      return &previous.samples[i];
+    }
+  }
+  return NULL;
+}
+
+// Adds a "tasks" object to the metrics, with one entry per task:
+//
+//   "name": [cpu, stack, stalled]
+//
+// - cpu is the share of CPU time used since the previous snapshot, in
+//   thousandths.
+// - stack is the lowest amount of free stack the task ever had, in bytes.
+// - stalled is 1 if the task was ready to run, yet did not get any CPU time
+//   since the previous snapshot, ie. it is being starved by higher priority
+//   tasks.
+void task_stats_add_metrics(cJSON *root) {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+  UBaseType_t capacity = uxTaskGetNumberOfTasks() + EXTRA_TASKS;
+  TaskStatus_t *status = malloc(capacity * sizeof(TaskStatus_t));
+  struct task_sample *samples = malloc(capacity * sizeof(struct task_sample));
+  if (status == NULL || samples == NULL) {
+    ESP_LOGE(TAG, "cannot allocate task snapshot");
+    free(status);
+    free(samples);
+    return;
+  }
+
+  xSemaphoreTake(previous.lock, portMAX_DELAY);
+
+  configRUN_TIME_COUNTER_TYPE total_run_time;
+  UBaseType_t count = uxTaskGetSystemState(status, capacity, &total_run_time);
+  configRUN_TIME_COUNTER_TYPE elapsed = total_run_time - previous.total_run_time;
+
+  cJSON *tasks = cJSON_AddObjectToObject(root, "tasks");
+  int stalled_count = 0;
+  for (UBaseType_t i = 0; i < count; i++) {
+    const struct task_sample *sample = find_sample(status[i].xTaskNumber);
+    configRUN_TIME_COUNTER_TYPE run_time = status[i].ulRunTimeCounter;
+    if (sample != NULL) {
+      run_time -= sample->run_time;
+    }
+
+    bool stalled = sample != NULL && run_time == 0 &&
+                   status[i].eCurrentState == eReady;
+    if (stalled) {
+      ESP_LOGW(TAG, "task %s is starved", status[i].pcTaskName);
+      stalled_count += 1;
+    }
+
+    cJSON *row = cJSON_AddArrayToObject(tasks, status[i].pcTaskName);
+    cJSON_AddItemToArray(
+        row, cJSON_CreateNumber(elapsed ? (uint64_t)run_time * 1000 / elapsed
+                                        : 0));
+    cJSON_AddItemToArray(row,
+                         cJSON_CreateNumber(status[i].usStackHighWaterMark));
+    cJSON_AddItemToArray(row, cJSON_CreateNumber(stalled));
+
+    samples[i].number = status[i].xTaskNumber;
+    samples[i].run_time = status[i].ulRunTimeCounter;
+  }
+  cJSON_AddNumberToObject(root, "stalled_tasks", stalled_count);
+
+  free(previous.samples);
+  previous.samples = samples;
+  previous.count = count;
+  previous.total_run_time = total_run_time;
+
+  xSemaphoreGive(previous.lock);
+  free(status);
+#endif
+}
+
+void task_stats_init() { previous.lock = xSemaphoreCreateMutex(); }
@@ -0,0 +1,5 @@
+#pragma once
+#include <cJSON.h>
+
+void task_stats_init();
+void task_stats_add_metrics(cJSON *root);
@@ -0,0 +1,163 @@
+"""
+Reports the footprint of a firmware build: how much of each memory region
+the image uses, and the headroom left in the OTA slots. The report is saved
+as size.json in the build directory, and compared with the previous build's.
+
+Run after every build by CMake, or by hand:
+
+    python size_report.py build
+"""
+
+import argparse
+import csv
+import json
+import os
+import struct
+from collections import Counter
+
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+
+# Section name prefixes of the ESP32-C3 memory regions.
+REGIONS = {
+    ".iram0.": "iram",
+    ".dram0.": "dram",
+    ".noinit": "dram",
+    ".flash.": "flash",
+    ".rtc.": "rtc",
+}
+
+# Build options the report notes, to tell profiles apart.
+PROFILE_OPTIONS = [
+    "COMPILER_OPTIMIZATION_SIZE",
+    "COMPILER_OPTIMIZATION_PERF",
+    "HOT_PATH_OPTIMIZE_SPEED",
+    "HOT_PATH_IN_IRAM",
+    "BT_NIMBLE_ENABLED",
+    "RUUVI_ENABLE",
+]
+
+
+def elf_sections(path):
+    """Yields the name, flags, type and size of each section of a 32-bit ELF."""
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:4] != b"\x7fELF" or data[4] != 1:
+        raise ValueError(f"{path} is not a 32-bit ELF file")
+    endian = "<" if data[5] == 1 else ">"
+
+    shoff, = struct.unpack_from(endian + "I", data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from(endian + "HHH", data, 0x2E)
+
+    headers = [
+        struct.unpack_from(endian + "IIIIIIIIII", data, shoff + i * shentsize)
+        for i in range(shnum)
+    ]
+    strtab = headers[shstrndx][4]
+
+    for name, type, flags, _, _, size, *_ in headers:
+        end = data.index(b"\0", strtab + name)
+        yield data[strtab + name : end].decode(), flags, type, size
+
+
+def region_sizes(elf):
+    sizes = Counter()
+    for name, flags, type, size in elf_sections(elf):
+        if not flags & SHF_ALLOC:
+            continue
+        for prefix, region in REGIONS.items():
+            if name.startswith(prefix):
+                sizes[region] += size
+                if type == SHT_NOBITS:
+                    sizes[region + "_bss"] += size
+                break
+    return dict(sizes)
+
+
+def parse_size(value):
+    value = value.strip()
+    if value.upper().endswith("K"):
+        return int(value[:-1], 0) * 1024
+    if value.upper().endswith("M"):
+        return int(value[:-1], 0) * 1024 * 1024
+    return int(value, 0)
+
+
+def ota_slot_size(partitions):
+    """Size of the smallest app slot of the partition table."""
+    sizes = []
+    with open(partitions) as f:
+        for row in csv.reader(f):
+            if not row or row[0].lstrip().startswith("#"):
+                continue
+            if row[1].strip() == "app":
+                sizes.append(parse_size(row[4]))
+    return min(sizes)
+
+
+def build_profile(build):
+    path = os.path.join(build, "config", "sdkconfig.json")
+    try:
+        with open(path) as f:
+            sdkconfig = json.load(f)
+    except FileNotFoundError:
+        return {}
+    return {key: sdkconfig.get(key, False) for key in PROFILE_OPTIONS}
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("build", nargs="?", default="build")
+    parser.add_argument("--project", default="light-control")
+    parser.add_argument(
+        "--partitions",
+        default=os.path.join(os.path.dirname(__file__), "partitions.csv"),
+    )
+    args = parser.parse_args()
+
+    elf = os.path.join(args.build, f"{args.project}.elf")
+    binary = os.path.join(args.build, f"{args.project}.bin")
+    slot = ota_slot_size(args.partitions)
+    image = os.path.getsize(binary)
+
+    report = {
+        "profile": build_profile(args.build),
+        "image": image,
+        "ota_slot": slot,
+        "ota_headroom": slot - image,
+        "regions": region_sizes(elf),
+    }
+
+    path = os.path.join(args.build, "size.json")
+    try:
+        with open(path) as f:
+            previous = json.load(f)
+    except (FileNotFoundError, json.JSONDecodeError):
+        previous = None
+
+    def delta(value, old):
+        if old is None or old == value:
+            return ""
+        return f" ({value - old:+d})"
+
+    old_regions = previous["regions"] if previous else {}
+    enabled = [key for key, value in report["profile"].items() if value]
+    print(f"Size report ({', '.join(enabled) or 'default profile'}):")
+    print(
+        f"  image: {image} bytes"
+        + delta(image, previous and previous["image"])
+    )
+    print(
+        f"  OTA slot headroom: {slot - image} of {slot} bytes"
+        f" ({100 * (slot - image) / slot:.1f}% free)"
+    )
+    for region, size in sorted(report["regions"].items()):
+        print(f"  {region}: {size} bytes" + delta(size, old_regions.get(region)))
+
+    with open(path, "w") as f:
+        json.dump(report, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
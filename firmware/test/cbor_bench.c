@@ -0,0 +1,58 @@
+#include "ruuvi_encode.h"
+#include "ruuvi_vectors.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Cost and size of the CBOR and JSON encodings of the published Ruuvi frames,
+// over the frames of the valid test vectors. As for the decoder benchmark,
+// the times are only meaningful compared with each other.
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+  const char *name = "Kitchen";
+
+  for (size_t i = 0; i < RUUVI_VECTOR_COUNT; i++) {
+    uint8_t data[RUUVI_FRAME_MAX_LENGTH];
+    size_t length = ruuvi_vector_bytes(&ruuvi_vectors[i], data, sizeof(data));
+    struct ruuvi_frame frame;
+    if (!ruuvi_decode_frame(&frame, data, length, ruuvi_vector_address)) {
+      continue;
+    }
+    char mac[RUUVI_MACSTR_SIZE];
+    ruuvi_mac2str(mac, frame.mac);
+
+    uint8_t buffer[RUUVI_CBOR_MAX_SIZE];
+    struct cbor_writer w;
+    double start = now();
+    for (unsigned long j = 0; j < iterations; j++) {
+      cbor_writer_init(&w, buffer, sizeof(buffer));
+      ruuvi_encode_cbor(&w, &frame, name, mac, NULL, 0);
+    }
+    double cbor_ns = (now() - start) / iterations * 1e9;
+    if (!cbor_writer_ok(&w)) {
+      printf("%s: CBOR frame too large\n", ruuvi_vectors[i].name);
+      return 1;
+    }
+
+    size_t json_bytes = 0;
+    start = now();
+    for (unsigned long j = 0; j < iterations; j++) {
+      char *payload = ruuvi_encode_json(&frame, name, mac, NULL, 0);
+      json_bytes = strlen(payload);
+      free(payload);
+    }
+    double json_ns = (now() - start) / iterations * 1e9;
+
+    printf("%-20s cbor %8.1f ns/frame %4zu bytes   json %8.1f ns/frame "
+           "%4zu bytes\n",
+           ruuvi_vectors[i].name, cbor_ns, w.length, json_ns, json_bytes);
+  }
+  return 0;
+}
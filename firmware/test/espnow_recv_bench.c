@@ -0,0 +1,56 @@
+#include "config.h"
+#include "event_loops.h"
+#include "fakes.h"
+#include "light.h"
+#include "local_control.h"
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Time the ESP-NOW receive callback takes on the fake clock, built with and
+// without CONFIG_DLOG_ENABLE: the logs of the callback either go to the
+// deferred log or are written out to the console on the spot. See the costs
+// in fakes.h.
+
+#define PREFIX "calan-mai/test"
+
+static const uint8_t peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x20};
+
+int main(int argc, char **argv) {
+  unsigned long packets = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+
+  config_init(NULL, PREFIX);
+  light_init();
+  local_control_init(NULL, PREFIX);
+  fake_mqtt_connect();
+  fake_mqtt_deliver(PREFIX "/config/set", "{\"group\": 1}", 0);
+  fake_events_dispatch();
+
+  int64_t total = 0;
+  int64_t max = 0;
+  uint32_t logs = 0;
+  for (unsigned long i = 0; i < packets; i++) {
+    const uint8_t packet[] = {LOCAL_CONTROL_LIGHT_STATE, 1, i % 2};
+    fake_counters_reset();
+    int64_t start = esp_timer_get_time();
+    fake_espnow_receive(peer, packet, sizeof(packet));
+    int64_t duration = esp_timer_get_time() - start;
+    total += duration;
+    if (duration > max) {
+      max = duration;
+    }
+    logs += fake_counters.logs;
+    fake_events_dispatch();
+    fake_timers_run(100 * 1000);
+  }
+
+  printf("recv_callback, %s logging: %.1f us/packet, max %lld us, "
+         "%.1f console logs/packet\n",
+#if CONFIG_DLOG_ENABLE
+         "deferred",
+#else
+         "immediate",
+#endif
+         (double)total / packets, (long long)max, (double)logs / packets);
+  return 0;
+}
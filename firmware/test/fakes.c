@@ -0,0 +1,800 @@
+#include "fakes.h"
+#include "button.h"
+#include "deferred_log.h"
+#include "event_loops.h"
+#include "power.h"
+#include "scan_scheduler.h"
+#include <driver/ledc.h>
+#include <esp_mac.h>
+#include <esp_now.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <nvs_flash.h>
+#include <stdarg.h>
+#include <string.h>
+
+// The fakes never allocate, so that the allocation counters only see the
+// code under test.
+
+struct fake_counters fake_counters;
+struct fake_world fake_world;
+
+void fake_counters_reset() { memset(&fake_counters, 0, sizeof(fake_counters)); }
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_ERR_NVS_NOT_FOUND:
+    return "ESP_ERR_NVS_NOT_FOUND";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_ESPNOW_FULL:
+    return "ESP_ERR_ESPNOW_FULL";
+  case ESP_ERR_ESPNOW_EXIST:
+    return "ESP_ERR_ESPNOW_EXIST";
+  default:
+    return "ESP_FAIL";
+  }
+}
+
+void fake_log(esp_log_level_t level, const char *tag, const char *format,
+              ...) {
+  fake_counters.logs += 1;
+  fake_advance(FAKE_COST_LOG_US);
+  if (getenv("TEST_LOG") != NULL) {
+    va_list args;
+    va_start(args, format);
+    if (fake_world.arg != NULL) {
+      fprintf(stderr, MACSTR " ", MAC2STR(fake_world.mac));
+    }
+    fprintf(stderr, "%s: ", tag);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+  }
+}
+
+// Allocations, counted through the linker's --wrap.
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  fake_counters.allocations += 1;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  fake_counters.allocations += 1;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  fake_counters.allocations += 1;
+  return __real_realloc(ptr, size);
+}
+
+// Clock and timers
+
+#define MAX_TIMERS 16
+
+struct fake_timer {
+  esp_timer_create_args_t args;
+  bool active;
+  int64_t deadline;
+  uint64_t period;
+};
+
+static int64_t now_us = 1000000;
+static struct fake_timer timers[MAX_TIMERS];
+static size_t timer_count;
+
+void fake_advance(int64_t duration_us) { now_us += duration_us; }
+
+int64_t esp_timer_get_time() { return now_us; }
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle) {
+  if (timer_count == MAX_TIMERS) {
+    return ESP_ERR_NO_MEM;
+  }
+  struct fake_timer *timer = &timers[timer_count++];
+  timer->args = *create_args;
+  *out_handle = timer;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  if (timer->active) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  timer->active = true;
+  timer->deadline = now_us + timeout_us;
+  timer->period = 0;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer,
+                                   uint64_t period) {
+  esp_err_t err = esp_timer_start_once(timer, period);
+  timer->period = period;
+  return err;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  if (!timer->active) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  timer->active = false;
+  return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) { return timer->active; }
+
+void fake_timers_run(int64_t duration_us) {
+  int64_t end = now_us + duration_us;
+  while (true) {
+    struct fake_timer *next = NULL;
+    for (size_t i = 0; i < timer_count; i++) {
+      if (timers[i].active && timers[i].deadline <= end &&
+          (next == NULL || timers[i].deadline < next->deadline)) {
+        next = &timers[i];
+      }
+    }
+    if (next == NULL) {
+      break;
+    }
+    if (next->deadline > now_us) {
+      now_us = next->deadline;
+    }
+    if (next->period > 0) {
+      next->deadline += next->period;
+    } else {
+      next->active = false;
+    }
+    next->args.callback(next->args.arg);
+  }
+  if (end > now_us) {
+    now_us = end;
+  }
+}
+
+int64_t fake_timers_next() {
+  int64_t next = INT64_MAX;
+  for (size_t i = 0; i < timer_count; i++) {
+    if (timers[i].active && timers[i].deadline < next) {
+      next = timers[i].deadline;
+    }
+  }
+  return next;
+}
+
+// Events
+
+#define MAX_HANDLERS 32
+#define MAX_EVENTS 32
+#define MAX_EVENT_DATA 32
+
+struct fake_handler {
+  esp_event_loop_handle_t loop;
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void *arg;
+};
+
+struct fake_event {
+  esp_event_base_t base;
+  int32_t id;
+  // Aligned like the copies esp_event makes on the heap.
+  _Alignas(max_align_t) uint8_t data[MAX_EVENT_DATA];
+};
+
+static struct fake_event_loop {
+  int unused;
+} control_loop_storage;
+
+esp_event_loop_handle_t control_loop = &control_loop_storage;
+esp_event_loop_handle_t telemetry_loop;
+
+ESP_EVENT_DEFINE_BASE(BUTTON_EVENT);
+ESP_EVENT_DEFINE_BASE(WIFI_EVENT);
+
+static struct fake_handler handlers[MAX_HANDLERS];
+static size_t handler_count;
+static struct fake_event events[MAX_EVENTS];
+static size_t event_count;
+
+esp_err_t esp_event_handler_register_with(esp_event_loop_handle_t event_loop,
+                                          esp_event_base_t event_base,
+                                          int32_t event_id,
+                                          esp_event_handler_t event_handler,
+                                          void *event_handler_arg) {
+  if (handler_count == MAX_HANDLERS) {
+    return ESP_ERR_NO_MEM;
+  }
+  handlers[handler_count++] = (struct fake_handler){
+      event_loop, event_base, event_id, event_handler, event_handler_arg,
+  };
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base,
+                                     int32_t event_id,
+                                     esp_event_handler_t event_handler,
+                                     void *event_handler_arg) {
+  return esp_event_handler_register_with(NULL, event_base, event_id,
+                                         event_handler, event_handler_arg);
+}
+
+static void dispatch(esp_event_loop_handle_t loop, esp_event_base_t base,
+                     int32_t id, void *data) {
+  for (size_t i = 0; i < handler_count; i++) {
+    const struct fake_handler *h = &handlers[i];
+    if (h->loop == loop && h->base == base &&
+        (h->id == ESP_EVENT_ANY_ID || h->id == id)) {
+      h->handler(h->arg, base, id, data);
+    }
+  }
+}
+
+esp_err_t control_event_post(esp_event_base_t event_base, int32_t event_id,
+                             const void *event_data, size_t event_data_size,
+                             TickType_t ticks_to_wait) {
+  fake_counters.events_posted += 1;
+  fake_advance(FAKE_COST_EVENT_POST_US);
+  if (event_count == MAX_EVENTS || event_data_size > MAX_EVENT_DATA) {
+    return ESP_FAIL;
+  }
+  struct fake_event *event = &events[event_count++];
+  event->base = event_base;
+  event->id = event_id;
+  if (event_data_size > 0) {
+    memcpy(event->data, event_data, event_data_size);
+  }
+  return ESP_OK;
+}
+
+size_t fake_events_dispatch() {
+  // Handlers may post more events.
+  size_t i;
+  for (i = 0; i < event_count; i++) {
+    struct fake_event event = events[i];
+    dispatch(control_loop, event.base, event.id, event.data);
+  }
+  event_count = 0;
+  return i;
+}
+
+void fake_default_event(const char *base, int32_t event_id) {
+  dispatch(NULL, base, event_id, NULL);
+}
+
+// MQTT
+
+#define MAX_MQTT_HANDLERS 8
+
+static struct {
+  esp_event_handler_t handler;
+  void *arg;
+} mqtt_handlers[MAX_MQTT_HANDLERS];
+static size_t mqtt_handler_count;
+static struct esp_mqtt_client {
+  const char *will_topic;
+  const char *will_msg;
+  int will_qos;
+  int will_retain;
+} client_storage;
+
+esp_mqtt_client_handle_t
+esp_mqtt_client_init(const esp_mqtt_client_config_t *config) {
+  client_storage.will_topic = config->session.last_will.topic;
+  client_storage.will_msg = config->session.last_will.msg;
+  client_storage.will_qos = config->session.last_will.qos;
+  client_storage.will_retain = config->session.last_will.retain;
+  return &client_storage;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client) {
+  if (fake_world.mqtt_start != NULL) {
+    fake_world.mqtt_start(fake_world.arg, client->will_topic,
+                          client->will_msg, client->will_qos,
+                          client->will_retain);
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client) {
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+                                         esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler,
+                                         void *event_handler_arg) {
+  if (mqtt_handler_count == MAX_MQTT_HANDLERS) {
+    return ESP_ERR_NO_MEM;
+  }
+  mqtt_handlers[mqtt_handler_count].handler = event_handler;
+  mqtt_handlers[mqtt_handler_count].arg = event_handler_arg;
+  mqtt_handler_count += 1;
+  return ESP_OK;
+}
+
+static void mqtt_dispatch(esp_mqtt_event_t *event) {
+  for (size_t i = 0; i < mqtt_handler_count; i++) {
+    mqtt_handlers[i].handler(mqtt_handlers[i].arg, "MQTT_EVENTS",
+                             event->event_id, event);
+  }
+}
+
+void fake_mqtt_connect() {
+  esp_mqtt_event_t event = {
+      .event_id = MQTT_EVENT_CONNECTED,
+      .client = &client_storage,
+  };
+  mqtt_dispatch(&event);
+}
+
+void fake_mqtt_disconnect() {
+  esp_mqtt_event_t event = {
+      .event_id = MQTT_EVENT_DISCONNECTED,
+      .client = &client_storage,
+  };
+  mqtt_dispatch(&event);
+}
+
+void fake_mqtt_deliver(const char *topic, const char *data,
+                       size_t fragment_size) {
+  fake_mqtt_deliver_data(topic, data, strlen(data), fragment_size);
+}
+
+void fake_mqtt_deliver_data(const char *topic, const char *data,
+                            size_t length, size_t fragment_size) {
+  if (fragment_size == 0) {
+    fragment_size = length > 0 ? length : 1;
+  }
+  size_t offset = 0;
+  do {
+    size_t fragment = length - offset < fragment_size ? length - offset
+                                                      : fragment_size;
+    // Only the first fragment carries the topic.
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_EVENT_DATA,
+        .client = &client_storage,
+        .data = (char *)data + offset,
+        .data_len = fragment,
+        .total_data_len = length,
+        .current_data_offset = offset,
+        .topic = offset == 0 ? (char *)topic : NULL,
+        .topic_len = offset == 0 ? strlen(topic) : 0,
+    };
+    mqtt_dispatch(&event);
+    offset += fragment;
+  } while (offset < length);
+}
+
+void fake_mqtt_published(int msg_id) {
+  esp_mqtt_event_t event = {
+      .event_id = MQTT_EVENT_PUBLISHED,
+      .client = &client_storage,
+      .msg_id = msg_id,
+  };
+  mqtt_dispatch(&event);
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client,
+                              const char *topic, int qos) {
+  if (fake_world.mqtt_subscribe != NULL) {
+    return fake_world.mqtt_subscribe(fake_world.arg, topic, qos);
+  }
+  return 0;
+}
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client,
+                                const char *topic) {
+  if (fake_world.mqtt_unsubscribe != NULL) {
+    return fake_world.mqtt_unsubscribe(fake_world.arg, topic);
+  }
+  return 0;
+}
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
+                            const char *topic, const char *data, int len,
+                            int qos, int retain, bool store) {
+  fake_counters.mqtt_published += 1;
+  fake_advance(FAKE_COST_MQTT_ENQUEUE_US);
+  if (fake_world.mqtt_publish != NULL) {
+    size_t length = len > 0 ? len : data != NULL ? strlen(data) : 0;
+    return fake_world.mqtt_publish(fake_world.arg, topic, data, length, qos,
+                                   retain);
+  }
+  return 0;
+}
+
+// NVS, as a table of entries per namespace, in the fake flash.
+
+struct fake_nvs_iterator {
+  nvs_handle_t handle;
+  nvs_type_t type;
+  size_t index;
+};
+
+static struct fake_flash private_flash;
+static struct fake_nvs_iterator iterators[4];
+
+static struct fake_flash *flash() {
+  return fake_world.flash != NULL ? fake_world.flash : &private_flash;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+  char(*namespaces)[16] = flash()->namespaces;
+  for (size_t i = 0; i < FAKE_NVS_NAMESPACES; i++) {
+    if (namespaces[i][0] == '\0') {
+      snprintf(namespaces[i], sizeof(namespaces[i]), "%s", name);
+    }
+    if (strcmp(namespaces[i], name) == 0) {
+      *out_handle = i + 1;
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+static struct fake_nvs_entry *find_entry(nvs_handle_t handle,
+                                         const char *key) {
+  struct fake_nvs_entry *entries = flash()->entries;
+  for (size_t i = 0; i < FAKE_NVS_ENTRIES; i++) {
+    if (entries[i].used && entries[i].handle == handle &&
+        strcmp(entries[i].key, key) == 0) {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
+
+static esp_err_t get(nvs_handle_t handle, const char *key, nvs_type_t type,
+                     void *out, size_t *size, bool variable) {
+  fake_counters.nvs_reads += 1;
+  fake_advance(FAKE_COST_NVS_READ_US);
+  struct fake_nvs_entry *entry = find_entry(handle, key);
+  if (entry == NULL || entry->type != type) {
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  if (variable) {
+    if (out != NULL) {
+      if (*size < entry->size) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+      }
+      memcpy(out, entry->data, entry->size);
+    }
+    *size = entry->size;
+  } else {
+    memcpy(out, entry->data, entry->size);
+  }
+  return ESP_OK;
+}
+
+static esp_err_t set(nvs_handle_t handle, const char *key, nvs_type_t type,
+                     const void *value, size_t size) {
+  fake_counters.nvs_writes += 1;
+  fake_advance(FAKE_COST_NVS_WRITE_US);
+  if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE || size > FAKE_NVS_ENTRY_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  struct fake_nvs_entry *entry = find_entry(handle, key);
+  if (entry != NULL && entry->type != type) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  struct fake_nvs_entry *entries = flash()->entries;
+  for (size_t i = 0; i < FAKE_NVS_ENTRIES && entry == NULL; i++) {
+    if (!entries[i].used) {
+      entry = &entries[i];
+    }
+  }
+  if (entry == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  entry->used = true;
+  entry->handle = handle;
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+  entry->type = type;
+  entry->size = size;
+  memcpy(entry->data, value, size);
+  return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  fake_counters.nvs_commits += 1;
+  fake_advance(FAKE_COST_NVS_COMMIT_US);
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  fake_counters.nvs_erases += 1;
+  fake_advance(FAKE_COST_NVS_WRITE_US);
+  struct fake_nvs_entry *entry = find_entry(handle, key);
+  if (entry == NULL) {
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  entry->used = false;
+  return ESP_OK;
+}
+
+esp_err_t nvs_find_key(nvs_handle_t handle, const char *key,
+                       nvs_type_t *out_type) {
+  fake_counters.nvs_reads += 1;
+  fake_advance(FAKE_COST_NVS_READ_US);
+  struct fake_nvs_entry *entry = find_entry(handle, key);
+  if (entry == NULL) {
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  *out_type = entry->type;
+  return ESP_OK;
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out) {
+  return get(handle, key, NVS_TYPE_U8, out, NULL, false);
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *out) {
+  return get(handle, key, NVS_TYPE_I32, out, NULL, false);
+}
+
+esp_err_t nvs_get_i64(nvs_handle_t handle, const char *key, int64_t *out) {
+  return get(handle, key, NVS_TYPE_I64, out, NULL, false);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out,
+                      size_t *length) {
+  return get(handle, key, NVS_TYPE_STR, out, length, true);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out,
+                       size_t *length) {
+  return get(handle, key, NVS_TYPE_BLOB, out, length, true);
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value) {
+  return set(handle, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value) {
+  return set(handle, key, NVS_TYPE_I32, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_i64(nvs_handle_t handle, const char *key, int64_t value) {
+  return set(handle, key, NVS_TYPE_I64, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key,
+                      const char *value) {
+  return set(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key,
+                       const void *value, size_t length) {
+  return set(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+static esp_err_t iterator_seek(nvs_iterator_t *iterator) {
+  struct fake_nvs_iterator *it = *iterator;
+  for (; it->index < FAKE_NVS_ENTRIES; it->index++) {
+    const struct fake_nvs_entry *entry = &flash()->entries[it->index];
+    if (entry->used && entry->handle == it->handle &&
+        (it->type == NVS_TYPE_ANY || it->type == entry->type)) {
+      return ESP_OK;
+    }
+  }
+  nvs_release_iterator(it);
+  *iterator = NULL;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_entry_find_in_handle(nvs_handle_t handle, nvs_type_t type,
+                                   nvs_iterator_t *output_iterator) {
+  for (size_t i = 0; i < sizeof(iterators) / sizeof(iterators[0]); i++) {
+    if (iterators[i].handle == 0) {
+      iterators[i] = (struct fake_nvs_iterator){handle, type, 0};
+      *output_iterator = &iterators[i];
+      return iterator_seek(output_iterator);
+    }
+  }
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t nvs_entry_next(nvs_iterator_t *iterator) {
+  (*iterator)->index += 1;
+  return iterator_seek(iterator);
+}
+
+esp_err_t nvs_entry_info(nvs_iterator_t iterator,
+                         nvs_entry_info_t *out_info) {
+  const struct fake_nvs_entry *entry = &flash()->entries[iterator->index];
+  snprintf(out_info->namespace_name, sizeof(out_info->namespace_name), "%s",
+           flash()->namespaces[entry->handle - 1]);
+  snprintf(out_info->key, sizeof(out_info->key), "%s", entry->key);
+  out_info->type = entry->type;
+  return ESP_OK;
+}
+
+void nvs_release_iterator(nvs_iterator_t iterator) {
+  if (iterator != NULL) {
+    iterator->handle = 0;
+  }
+}
+
+// ESP-NOW
+
+#define ESPNOW_HISTORY 8
+
+struct fake_espnow_packet fake_espnow_last;
+size_t fake_espnow_peers;
+static uint8_t espnow_peers[ESP_NOW_MAX_TOTAL_PEER_NUM][ESP_NOW_ETH_ALEN];
+static struct fake_espnow_packet espnow_history[ESPNOW_HISTORY];
+static esp_now_recv_cb_t recv_cb;
+
+esp_err_t esp_now_init() { return ESP_OK; }
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  recv_cb = cb;
+  return ESP_OK;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data,
+                       size_t len) {
+  fake_advance(FAKE_COST_ESPNOW_SEND_US);
+  memset(fake_espnow_last.dest, 0, 6);
+  if (peer_addr != NULL) {
+    memcpy(fake_espnow_last.dest, peer_addr, 6);
+  }
+  fake_espnow_last.length = len < sizeof(fake_espnow_last.data)
+                                ? len
+                                : sizeof(fake_espnow_last.data);
+  memcpy(fake_espnow_last.data, data, fake_espnow_last.length);
+  espnow_history[fake_counters.espnow_sent % ESPNOW_HISTORY] =
+      fake_espnow_last;
+  fake_counters.espnow_sent += 1;
+
+  // Without an address, the packet goes to every peer in turn.
+  if (fake_world.espnow_send != NULL) {
+    if (peer_addr != NULL) {
+      fake_world.espnow_send(fake_world.arg, peer_addr, data, len);
+    }
+    for (size_t i = 0; peer_addr == NULL && i < fake_espnow_peers; i++) {
+      fake_world.espnow_send(fake_world.arg, espnow_peers[i], data, len);
+    }
+  }
+  return ESP_OK;
+}
+
+const struct fake_espnow_packet *fake_espnow_sent(size_t index) {
+  if (index >= fake_counters.espnow_sent ||
+      fake_counters.espnow_sent - index > ESPNOW_HISTORY) {
+    return NULL;
+  }
+  return &espnow_history[index % ESPNOW_HISTORY];
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+  for (size_t i = 0; i < fake_espnow_peers; i++) {
+    if (memcmp(espnow_peers[i], peer->peer_addr, ESP_NOW_ETH_ALEN) == 0) {
+      return ESP_ERR_ESPNOW_EXIST;
+    }
+  }
+  if (fake_espnow_peers == ESP_NOW_MAX_TOTAL_PEER_NUM) {
+    return ESP_ERR_ESPNOW_FULL;
+  }
+  memcpy(espnow_peers[fake_espnow_peers++], peer->peer_addr,
+         ESP_NOW_ETH_ALEN);
+  return ESP_OK;
+}
+
+void fake_espnow_receive(const uint8_t src[6], const uint8_t *data,
+                         int data_len) {
+  uint8_t src_addr[6];
+  uint8_t des_addr[6] = {0};
+  memcpy(src_addr, src, 6);
+  esp_now_recv_info_t info = {
+      .src_addr = src_addr,
+      .des_addr = des_addr,
+  };
+  recv_cb(&info, data, data_len);
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type) {
+  static const uint8_t self[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x10};
+  memcpy(mac, fake_world.arg != NULL ? fake_world.mac : self, 6);
+  return ESP_OK;
+}
+
+// GPIO and LEDC
+
+#define MAX_GPIO 22
+
+static int gpio_levels[MAX_GPIO];
+static uint32_t ledc_duty[LEDC_CHANNEL_MAX];
+
+void fake_gpio_set_input(int pin, int level) { gpio_levels[pin] = level; }
+
+uint32_t fake_ledc_duty(int channel) { return ledc_duty[channel]; }
+
+esp_err_t gpio_config(const gpio_config_t *config) { return ESP_OK; }
+
+int gpio_get_level(gpio_num_t gpio_num) {
+  fake_advance(FAKE_COST_GPIO_US);
+  return gpio_levels[gpio_num];
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+  fake_advance(FAKE_COST_GPIO_US);
+  gpio_levels[gpio_num] = level;
+  return ESP_OK;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf) {
+  return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf) {
+  ledc_duty[ledc_conf->channel] = ledc_conf->duty;
+  return ESP_OK;
+}
+
+esp_err_t ledc_fade_func_install(int intr_alloc_flags) { return ESP_OK; }
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t speed_mode,
+                                  ledc_channel_t channel, uint32_t target_duty,
+                                  int max_fade_time_ms) {
+  fake_counters.ledc_updates += 1;
+  fake_advance(FAKE_COST_LEDC_US);
+  ledc_duty[channel] = target_duty;
+  return ESP_OK;
+}
+
+esp_err_t ledc_fade_start(ledc_mode_t speed_mode, ledc_channel_t channel,
+                          ledc_fade_mode_t fade_mode) {
+  fake_advance(FAKE_COST_LEDC_US);
+  return ESP_OK;
+}
+
+esp_err_t ledc_set_duty_and_update(ledc_mode_t speed_mode,
+                                   ledc_channel_t channel, uint32_t duty,
+                                   uint32_t hpoint) {
+  fake_counters.ledc_updates += 1;
+  fake_advance(FAKE_COST_LEDC_US);
+  ledc_duty[channel] = duty;
+  return ESP_OK;
+}
+
+// FreeRTOS
+
+static struct fake_semaphore {
+  int unused;
+} semaphore_storage;
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return &semaphore_storage; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { return pdTRUE; }
+
+// Firmware modules
+
+void button_init(unsigned long long pin_select) {}
+
+void power_hold(uint32_t duration_ms) {}
+
+void scan_scheduler_backoff(uint32_t duration_ms) {}
+
+void dlog_write(const struct dlog_format *format, const uint32_t *args,
+                size_t nargs) {
+  fake_advance(FAKE_COST_DLOG_US);
+}
+
+void dlog_callback_time(enum dlog_callback callback, int64_t start) {}
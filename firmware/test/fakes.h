@@ -0,0 +1,148 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fakes of the ESP-IDF APIs and firmware modules that light.c,
+// local_control.c and config.c use, for host tests and the simulator.
+//
+// Time is simulated: esp_timer_get_time() returns a fake clock, which every
+// fake call advances by a rough estimate of what the call costs on the
+// ESP32-C3. Tests measure the duration of a callback as the time the fake
+// clock moved while it ran, which tracks the work it does on the device
+// rather than the speed of the host.
+
+#define FAKE_COST_NVS_READ_US 40
+// Flash program, with a page erase now and then.
+#define FAKE_COST_NVS_WRITE_US 2000
+#define FAKE_COST_NVS_COMMIT_US 10
+#define FAKE_COST_LEDC_US 15
+#define FAKE_COST_GPIO_US 1
+#define FAKE_COST_ESPNOW_SEND_US 100
+#define FAKE_COST_EVENT_POST_US 10
+#define FAKE_COST_MQTT_ENQUEUE_US 50
+// A deferred log entry is only copied to the ring buffer.
+#define FAKE_COST_DLOG_US 2
+// About 60 characters on the console at 115200 baud.
+#define FAKE_COST_LOG_US 5000
+
+struct fake_counters {
+  uint32_t nvs_reads;
+  uint32_t nvs_writes;
+  uint32_t nvs_erases;
+  uint32_t nvs_commits;
+  // Calls to malloc, calloc and realloc made by the code under test. Those
+  // made inside the C library, such as by asprintf, are not seen.
+  uint32_t allocations;
+  uint32_t logs;
+  uint32_t espnow_sent;
+  uint32_t ledc_updates;
+  uint32_t events_posted;
+  uint32_t mqtt_published;
+};
+
+extern struct fake_counters fake_counters;
+
+void fake_counters_reset();
+
+// The fake clock.
+void fake_advance(int64_t duration_us);
+// Advances the fake clock, running the esp_timer callbacks which fall due.
+void fake_timers_run(int64_t duration_us);
+// Time at which the next timer falls due, or INT64_MAX if none is active.
+int64_t fake_timers_next();
+
+// Runs the handlers of the events posted to the control loop, and returns
+// how many there were.
+size_t fake_events_dispatch();
+// Posts an event to the default loop, and runs its handlers.
+void fake_default_event(const char *base, int32_t event_id);
+
+void fake_mqtt_connect();
+void fake_mqtt_disconnect();
+// Delivers a message to the MQTT handlers, in fragments of at most
+// `fragment_size` bytes, or in one piece if 0.
+void fake_mqtt_deliver(const char *topic, const char *data,
+                       size_t fragment_size);
+void fake_mqtt_deliver_data(const char *topic, const char *data,
+                            size_t length, size_t fragment_size);
+// Reports that the broker acknowledged a message.
+void fake_mqtt_published(int msg_id);
+
+void fake_espnow_receive(const uint8_t src[6], const uint8_t *data,
+                         int data_len);
+// Last packet sent over ESP-NOW. The destination is all zeros for a
+// broadcast.
+struct fake_espnow_packet {
+  uint8_t dest[6];
+  uint8_t data[250];
+  size_t length;
+};
+extern struct fake_espnow_packet fake_espnow_last;
+// Packets sent since the counters were reset, by index, or NULL if out of
+// the (short) history.
+const struct fake_espnow_packet *fake_espnow_sent(size_t index);
+// Peers added with esp_now_add_peer.
+extern size_t fake_espnow_peers;
+
+void fake_gpio_set_input(int pin, int level);
+uint32_t fake_ledc_duty(int channel);
+
+// The simulator runs many nodes, each with its own copy of the firmware and
+// of these fakes, and connects them to the outside world through
+// `fake_world`. Tests leave it unset: the MAC address is 02:00:00:00:00:10,
+// the flash is private, publishes are only counted, and ESP-NOW packets only
+// recorded.
+
+#define FAKE_NVS_NAMESPACES 8
+#define FAKE_NVS_ENTRIES 64
+#define FAKE_NVS_ENTRY_SIZE 512
+#define FAKE_OTA_SLOTS 2
+
+struct fake_nvs_entry {
+  bool used;
+  uint32_t handle;
+  char key[16];
+  int type;
+  size_t size;
+  uint8_t data[FAKE_NVS_ENTRY_SIZE];
+};
+
+// What outlives a restart: NVS, and the images in the OTA slots.
+struct fake_flash {
+  char namespaces[FAKE_NVS_NAMESPACES][16];
+  struct fake_nvs_entry entries[FAKE_NVS_ENTRIES];
+  struct {
+    uint8_t *data;
+    size_t size;
+  } slots[FAKE_OTA_SLOTS];
+  // Whether an update was installed, and in which slot. Until then, the node
+  // runs the image it was flashed with.
+  bool updated;
+  size_t boot_slot;
+};
+
+struct fake_world {
+  void *arg;
+  uint8_t mac[6];
+  struct fake_flash *flash;
+
+  // MQTT client, started with its last will. Publishes, subscriptions and
+  // unsubscriptions return a message ID, or -1 while disconnected.
+  void (*mqtt_start)(void *arg, const char *will_topic, const char *will_msg,
+                     int will_qos, int will_retain);
+  int (*mqtt_publish)(void *arg, const char *topic, const char *data,
+                      size_t length, int qos, int retain);
+  int (*mqtt_subscribe)(void *arg, const char *topic, int qos);
+  int (*mqtt_unsubscribe)(void *arg, const char *topic);
+  // A packet to a single peer.
+  void (*espnow_send)(void *arg, const uint8_t dest[6], const uint8_t *data,
+                      size_t length);
+  void (*restart)(void *arg);
+};
+
+extern struct fake_world fake_world;
+
+// Reports the node connected to the access point: ESP-NOW peers become
+// reachable, and the MQTT client reconnects.
+void fake_wifi_connect();
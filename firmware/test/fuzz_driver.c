@@ -0,0 +1,141 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runs a libFuzzer target where libFuzzer is not available, as with GCC:
+// every input of the corpus, then random mutations of them. Takes the same
+// -runs and -seed options as libFuzzer, and is built with the sanitizers to
+// catch what the target does not check itself.
+
+#define MAX_INPUT_SIZE 64
+#define MAX_CORPUS 256
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+struct input {
+  size_t size;
+  uint8_t data[MAX_INPUT_SIZE];
+};
+
+static struct input corpus[MAX_CORPUS];
+static size_t corpus_size;
+static uint64_t rng_state = 1;
+
+// xorshift64
+static uint32_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state >> 32;
+}
+
+// Runs one input, copied to a buffer of its exact size so that the
+// sanitizers catch reads past its end.
+static void run(const uint8_t *data, size_t size) {
+  uint8_t *copy = malloc(size > 0 ? size : 1);
+  memcpy(copy, data, size);
+  LLVMFuzzerTestOneInput(copy, size);
+  free(copy);
+}
+
+static void add_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL || corpus_size == MAX_CORPUS) {
+    if (f != NULL) {
+      fclose(f);
+    }
+    return;
+  }
+  struct input *input = &corpus[corpus_size++];
+  input->size = fread(input->data, 1, MAX_INPUT_SIZE, f);
+  fclose(f);
+}
+
+static void add_path(const char *path) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    add_file(path);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    add_file(file);
+  }
+  closedir(dir);
+}
+
+static void mutate(struct input *input) {
+  static const uint8_t interesting[] = {0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff};
+  switch (rng() % 5) {
+  case 0:
+    if (input->size > 0) {
+      input->data[rng() % input->size] ^= 1 << (rng() % 8);
+    }
+    break;
+  case 1:
+    if (input->size > 0) {
+      input->data[rng() % input->size] = rng();
+    }
+    break;
+  case 2:
+    if (input->size > 0) {
+      input->data[rng() % input->size] =
+          interesting[rng() % sizeof(interesting)];
+    }
+    break;
+  case 3:
+    if (input->size < MAX_INPUT_SIZE) {
+      size_t at = rng() % (input->size + 1);
+      memmove(input->data + at + 1, input->data + at, input->size - at);
+      input->data[at] = rng();
+      input->size += 1;
+    }
+    break;
+  case 4:
+    if (input->size > 0) {
+      size_t at = rng() % input->size;
+      memmove(input->data + at, input->data + at + 1, input->size - at - 1);
+      input->size -= 1;
+    }
+    break;
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned long runs = 100000;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-runs=", 6) == 0) {
+      runs = strtoul(argv[i] + 6, NULL, 0);
+    } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+      rng_state = strtoull(argv[i] + 6, NULL, 0) | 1;
+    } else if (argv[i][0] != '-') {
+      add_path(argv[i]);
+    }
+  }
+
+  for (size_t i = 0; i < corpus_size; i++) {
+    run(corpus[i].data, corpus[i].size);
+  }
+
+  struct input input = {0};
+  for (unsigned long i = 0; i < runs; i++) {
+    if (corpus_size > 0 && rng() % 8 == 0) {
+      input = corpus[rng() % corpus_size];
+    }
+    unsigned int mutations = 1 + rng() % 4;
+    for (unsigned int j = 0; j < mutations; j++) {
+      mutate(&input);
+    }
+    run(input.data, input.size);
+  }
+
+  printf("%zu corpus inputs, %lu runs\n", corpus_size, runs);
+  return 0;
+}
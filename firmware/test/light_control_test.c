@@ -0,0 +1,270 @@
+#include "button.h"
+#include "config.h"
+#include "event_loops.h"
+#include "fakes.h"
+#include "light.h"
+#include "local_control.h"
+#include "test.h"
+#include <driver/ledc.h>
+#include <esp_timer.h>
+#include <string.h>
+
+// Switching budgets. The ESP-NOW receive callback runs on the WiFi task, so
+// it must never wait for flash nor allocate, and runs from IRAM with
+// CONFIG_HOT_PATH_IN_IRAM; the durations are measured on the fake clock, see
+// fakes.h.
+#define ESPNOW_CALLBACK_BUDGET_US 1000
+#define ALLOCATIONS_PER_PACKET 0
+// Whatever the number of toggles in a burst: one commit for the light state
+// and one for the group state.
+#define NVS_COMMITS_PER_TOGGLE 2
+#define SAVE_DELAY_US (3 * 1000 * 1000)
+
+#define PREFIX "calan-mai/test"
+#define GROUP_TOPIC CONFIG_MQTT_GROUP_TOPIC_PREFIX "/1/command"
+#define DUTY_ON (1 << 13)
+// Channel 0 is on LEDC channel 2, channel 1 on LEDC channel 3.
+#define LEDC_0 LEDC_CHANNEL_2
+#define LEDC_1 LEDC_CHANNEL_3
+
+int test_failures;
+
+static const uint8_t self[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x10};
+static const uint8_t peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x20};
+static const uint8_t lower_peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x05};
+static const uint8_t higher_peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x30};
+
+static void state_packet(uint8_t packet[13], uint8_t type, uint8_t value,
+                         uint32_t version, const uint8_t origin[6]) {
+  packet[0] = type;
+  packet[1] = 1;
+  packet[2] = value;
+  packet[3] = version;
+  packet[4] = version >> 8;
+  packet[5] = version >> 16;
+  packet[6] = version >> 24;
+  memcpy(packet + 7, origin, 6);
+}
+
+static uint32_t packet_version(const uint8_t *packet) {
+  return packet[3] | packet[4] << 8 | packet[5] << 16 |
+         (uint32_t)packet[6] << 24;
+}
+
+// Receives a packet, and returns how long the callback took.
+static int64_t receive(const uint8_t src[6], const uint8_t *data,
+                       int data_len) {
+  fake_counters_reset();
+  int64_t start = esp_timer_get_time();
+  fake_espnow_receive(src, data, data_len);
+  return esp_timer_get_time() - start;
+}
+
+static void settle() {
+  fake_events_dispatch();
+  fake_timers_run(SAVE_DELAY_US);
+  fake_events_dispatch();
+}
+
+// Checks that a packet was handled within the budgets.
+static void check_packet_budgets(int64_t duration) {
+  CHECK(duration <= ESPNOW_CALLBACK_BUDGET_US);
+  CHECK_EQ(fake_counters.nvs_reads, 0);
+  CHECK_EQ(fake_counters.nvs_writes, 0);
+  CHECK_EQ(fake_counters.nvs_commits, 0);
+  CHECK(fake_counters.allocations <= ALLOCATIONS_PER_PACKET);
+  CHECK_EQ(fake_counters.logs, 0);
+}
+
+// Checks that a change was announced as every firmware version understands
+// it, then with its version.
+static void check_announced(uint8_t value, uint32_t version) {
+  CHECK_EQ(fake_counters.espnow_sent, 2);
+  const struct fake_espnow_packet *light_state = fake_espnow_sent(0);
+  CHECK_EQ(light_state->length, 3);
+  CHECK_EQ(light_state->data[0], LOCAL_CONTROL_LIGHT_STATE);
+  CHECK_EQ(light_state->data[1], 1);
+  CHECK_EQ(light_state->data[2], value);
+  const struct fake_espnow_packet *state_version = fake_espnow_sent(1);
+  CHECK_EQ(state_version->length, 13);
+  CHECK_EQ(state_version->data[0], LOCAL_CONTROL_STATE_VERSION);
+  CHECK_EQ(state_version->data[2], value);
+  CHECK_EQ(packet_version(state_version->data), version);
+  CHECK(memcmp(state_version->data + 7, self, 6) == 0);
+}
+
+static void test_remote_toggle() {
+  const uint8_t light_state[] = {LOCAL_CONTROL_LIGHT_STATE, 1, 1};
+  check_packet_budgets(receive(peer, light_state, sizeof(light_state)));
+  CHECK_EQ(fake_ledc_duty(LEDC_0), DUTY_ON);
+  CHECK_EQ(fake_ledc_duty(LEDC_1), 0);
+
+  uint8_t packet[13];
+  state_packet(packet, LOCAL_CONTROL_STATE_VERSION, 1, 1, peer);
+  check_packet_budgets(receive(peer, packet, sizeof(packet)));
+  CHECK_EQ(fake_counters.espnow_sent, 0);
+  CHECK_EQ(fake_ledc_duty(LEDC_0), DUTY_ON);
+
+  settle();
+  CHECK_EQ(fake_counters.nvs_commits, NVS_COMMITS_PER_TOGGLE);
+}
+
+static void test_toggle_burst() {
+  fake_counters_reset();
+  for (uint32_t version = 2; version < 12; version++) {
+    const uint8_t light_state[] = {LOCAL_CONTROL_LIGHT_STATE, 1, version % 2};
+    fake_espnow_receive(peer, light_state, sizeof(light_state));
+    uint8_t packet[13];
+    state_packet(packet, LOCAL_CONTROL_STATE_VERSION, version % 2, version,
+                 peer);
+    fake_espnow_receive(peer, packet, sizeof(packet));
+    fake_events_dispatch();
+    fake_timers_run(100 * 1000);
+  }
+  CHECK_EQ(fake_counters.nvs_commits, 0);
+  CHECK_EQ(fake_ledc_duty(LEDC_0), DUTY_ON);
+
+  settle();
+  CHECK_EQ(fake_counters.nvs_commits, NVS_COMMITS_PER_TOGGLE);
+}
+
+static void test_repeated_packet() {
+  uint8_t packet[13];
+  state_packet(packet, LOCAL_CONTROL_STATE_VERSION, 1, 11, peer);
+  check_packet_budgets(receive(peer, packet, sizeof(packet)));
+  settle();
+
+  CHECK_EQ(fake_counters.nvs_writes, 0);
+  CHECK_EQ(fake_counters.espnow_sent, 0);
+}
+
+static void test_stale_packet() {
+  // Same version as the current state, from a node with a lower address.
+  // Its light state packet switches the group, then its version shows the
+  // change lost, and the group is switched back.
+  const uint8_t light_state[] = {LOCAL_CONTROL_LIGHT_STATE, 1, 0};
+  check_packet_budgets(receive(lower_peer, light_state, sizeof(light_state)));
+  CHECK_EQ(fake_ledc_duty(LEDC_0), 0);
+
+  uint8_t packet[13];
+  state_packet(packet, LOCAL_CONTROL_STATE_VERSION, 0, 11, lower_peer);
+  check_packet_budgets(receive(lower_peer, packet, sizeof(packet)));
+  CHECK_EQ(fake_ledc_duty(LEDC_0), DUTY_ON);
+  CHECK_EQ(fake_counters.espnow_sent, 1);
+  CHECK(memcmp(fake_espnow_last.dest, lower_peer, 6) == 0);
+  CHECK_EQ(fake_espnow_last.length, 13);
+  CHECK_EQ(fake_espnow_last.data[0], LOCAL_CONTROL_STATE_SYNC);
+  CHECK_EQ(fake_espnow_last.data[2], 1);
+  CHECK_EQ(packet_version(fake_espnow_last.data), 11);
+  CHECK(memcmp(fake_espnow_last.data + 7, peer, 6) == 0);
+  settle();
+}
+
+static void test_concurrent_change() {
+  // Same version as the current state, from a node with a higher address.
+  uint8_t packet[13];
+  state_packet(packet, LOCAL_CONTROL_STATE_SYNC, 0, 11, higher_peer);
+  check_packet_budgets(receive(higher_peer, packet, sizeof(packet)));
+  CHECK_EQ(fake_counters.espnow_sent, 0);
+  CHECK_EQ(fake_ledc_duty(LEDC_0), 0);
+
+  settle();
+  CHECK_EQ(fake_counters.nvs_commits, NVS_COMMITS_PER_TOGGLE);
+}
+
+static void test_older_node() {
+  // Older nodes send the light state packet alone.
+  const uint8_t packet[] = {LOCAL_CONTROL_LIGHT_STATE, 1, 1};
+  check_packet_budgets(receive(peer, packet, sizeof(packet)));
+  CHECK_EQ(fake_ledc_duty(LEDC_0), DUTY_ON);
+  settle();
+}
+
+static void test_group_command() {
+  // Past the window in which a command the group just heard over ESP-NOW is
+  // not forwarded.
+  fake_timers_run(1000 * 1000);
+  fake_counters_reset();
+  fake_mqtt_deliver(GROUP_TOPIC, "OFF", 0);
+
+  CHECK_EQ(fake_counters.nvs_writes, 0);
+  CHECK_EQ(fake_ledc_duty(LEDC_0), 0);
+  check_announced(0, 12);
+
+  settle();
+  CHECK_EQ(fake_counters.nvs_commits, NVS_COMMITS_PER_TOGGLE);
+}
+
+static void test_button() {
+  const uint8_t pin = CONFIG_HW_GPIO_INPUT_NUM;
+  fake_gpio_set_input(CONFIG_HW_GPIO_STATE_NUM, 1);
+  fake_counters_reset();
+  control_event_post(BUTTON_EVENT, BUTTON_UP, &pin, sizeof(pin), 0);
+  fake_events_dispatch();
+
+  CHECK_EQ(fake_counters.nvs_writes, 0);
+  check_announced(1, 13);
+
+  settle();
+  // Only the group state changed: the light was switched by hand.
+  CHECK_EQ(fake_counters.nvs_commits, 1);
+  fake_gpio_set_input(CONFIG_HW_GPIO_STATE_NUM, 0);
+}
+
+static void test_unchanged_config() {
+  fake_counters_reset();
+  fake_mqtt_deliver(PREFIX "/config/set", "{\"group\": 1}", 0);
+  fake_events_dispatch();
+
+  CHECK_EQ(fake_counters.nvs_writes, 0);
+  CHECK_EQ(fake_counters.nvs_erases, 0);
+  CHECK_EQ(fake_counters.nvs_commits, 0);
+  CHECK_EQ(fake_counters.events_posted, 0);
+}
+
+static void test_brightness() {
+  // The light options are cached, and reloaded when the config changes.
+  fake_mqtt_deliver(PREFIX "/config/set", "{\"group\": 1, \"brightness\": 50}",
+                    0);
+  fake_events_dispatch();
+
+  const uint8_t off[] = {LOCAL_CONTROL_LIGHT_STATE, 1, 0};
+  check_packet_budgets(receive(peer, off, sizeof(off)));
+  const uint8_t on[] = {LOCAL_CONTROL_LIGHT_STATE, 1, 1};
+  check_packet_budgets(receive(peer, on, sizeof(on)));
+  CHECK_EQ(fake_ledc_duty(LEDC_0), DUTY_ON / 2);
+  settle();
+}
+
+static void test_peers() {
+  fake_counters_reset();
+  fake_mqtt_deliver(PREFIX "/peers/set",
+                    "[\"02:00:00:00:00:20\", \"02:00:00:00:00:30\"]", 0);
+
+  CHECK_EQ(fake_espnow_peers, 2);
+  CHECK_EQ(fake_counters.nvs_commits, 1);
+  CHECK_EQ(fake_counters.mqtt_published, 1);
+}
+
+int main() {
+  config_init(NULL, PREFIX);
+  light_init();
+  local_control_init(NULL, PREFIX);
+  fake_mqtt_connect();
+  fake_mqtt_deliver(PREFIX "/config/set", "{\"group\": 1}", 0);
+  fake_events_dispatch();
+
+  test_remote_toggle();
+  test_toggle_burst();
+  test_repeated_packet();
+  test_stale_packet();
+  test_concurrent_change();
+  test_older_node();
+  test_group_command();
+  test_button();
+  test_unchanged_config();
+  test_brightness();
+  test_peers();
+
+  TEST_MAIN_END();
+}
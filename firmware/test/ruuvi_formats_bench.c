@@ -0,0 +1,42 @@
+#include "ruuvi_vectors.h"
+#include <stdlib.h>
+#include <time.h>
+
+// Throughput of the Ruuvi frame decoder over the valid test vectors. The
+// host is much faster than the ESP32-C3, so the numbers are only meaningful
+// compared with each other, between changes of the decoder.
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+  uint8_t data[RUUVI_VECTOR_COUNT][RUUVI_FRAME_MAX_LENGTH];
+  size_t length[RUUVI_VECTOR_COUNT];
+  for (size_t i = 0; i < RUUVI_VECTOR_COUNT; i++) {
+    length[i] = ruuvi_vector_bytes(&ruuvi_vectors[i], data[i], sizeof(data[i]));
+  }
+
+  for (size_t i = 0; i < RUUVI_VECTOR_COUNT; i++) {
+    struct ruuvi_frame frame;
+    uint32_t checksum = 0;
+    double start = now();
+    for (unsigned long j = 0; j < iterations; j++) {
+      if (ruuvi_decode_frame(&frame, data[i], length[i],
+                             ruuvi_vector_address)) {
+        checksum += frame.valid + frame.values[RUUVI_FIELD_TEMPERATURE];
+      }
+    }
+    double elapsed = now() - start;
+
+    // The checksum keeps the decoding from being optimized out.
+    printf("%-20s %8.1f ns/frame %10.0f frames/s (%08x)\n",
+           ruuvi_vectors[i].name, elapsed / iterations * 1e9,
+           iterations / elapsed, checksum);
+  }
+  return 0;
+}
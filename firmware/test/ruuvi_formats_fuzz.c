@@ -0,0 +1,24 @@
+#include "ruuvi.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Fuzz target of the Ruuvi frame decoder: manufacturer data as heard over
+// the air, following the manufacturer ID.
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static const uint8_t address[6] = {0xc2, 0x48, 0xc3, 0x40, 0xe6, 0xd0};
+  struct ruuvi_frame frame;
+
+  if (ruuvi_decode_frame(&frame, data, size, address)) {
+    if (size == 0 || frame.format != data[0] ||
+        frame.valid >> RUUVI_FIELD_MAX != 0) {
+      abort();
+    }
+  }
+  if (ruuvi_decode_frame(&frame, data, size, NULL) &&
+      memcmp(frame.mac, data + size - 6, 6) != 0) {
+    // Only formats carrying their MAC, at the end, decode without address.
+    abort();
+  }
+  return 0;
+}
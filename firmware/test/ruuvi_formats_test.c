@@ -0,0 +1,53 @@
+#include "ruuvi_vectors.h"
+#include "test.h"
+#include <string.h>
+
+int test_failures;
+
+static void test_vector(const struct ruuvi_vector *vector) {
+  uint8_t data[RUUVI_FRAME_MAX_LENGTH];
+  size_t length = ruuvi_vector_bytes(vector, data, sizeof(data));
+
+  struct ruuvi_frame frame;
+  if (!ruuvi_decode_frame(&frame, data, length, ruuvi_vector_address)) {
+    fprintf(stderr, "%s: not decoded\n", vector->name);
+    test_failures += 1;
+    return;
+  }
+
+  CHECK_EQ(frame.format, data[0]);
+  CHECK(memcmp(frame.mac, vector->mac, 6) == 0);
+  CHECK_EQ(frame.valid, vector->valid);
+  for (size_t i = 0; i < RUUVI_FIELD_MAX; i++) {
+    if (ruuvi_frame_has(&frame, i) && frame.values[i] != vector->values[i]) {
+      fprintf(stderr, "%s: %s is %d, expected %d\n", vector->name,
+              ruuvi_field_info[i].name, frame.values[i], vector->values[i]);
+      test_failures += 1;
+    }
+  }
+}
+
+// Frames of the wrong length, or of an unknown format, are rejected.
+static void test_malformed() {
+  uint8_t data[RUUVI_FRAME_MAX_LENGTH];
+  size_t length = ruuvi_vector_bytes(&ruuvi_vectors[3], data, sizeof(data));
+  struct ruuvi_frame frame;
+
+  CHECK(!ruuvi_decode_frame(&frame, data, 0, ruuvi_vector_address));
+  CHECK(!ruuvi_decode_frame(&frame, data, length - 1, ruuvi_vector_address));
+  CHECK(!ruuvi_decode_frame(&frame, data, length + 1, ruuvi_vector_address));
+  data[0] = 0x04;
+  CHECK(!ruuvi_decode_frame(&frame, data, length, ruuvi_vector_address));
+
+  // Format 3 needs the advertiser address.
+  length = ruuvi_vector_bytes(&ruuvi_vectors[0], data, sizeof(data));
+  CHECK(!ruuvi_decode_frame(&frame, data, length, NULL));
+}
+
+int main() {
+  for (size_t i = 0; i < RUUVI_VECTOR_COUNT; i++) {
+    test_vector(&ruuvi_vectors[i]);
+  }
+  test_malformed();
+  TEST_MAIN_END();
+}
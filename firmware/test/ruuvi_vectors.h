@@ -0,0 +1,222 @@
+#pragma once
+#include "ruuvi.h"
+#include <stdio.h>
+
+// Test vectors of the Ruuvi data formats, from
+// https://docs.ruuvi.com/communication/bluetooth-advertisements, as
+// manufacturer data following the manufacturer ID.
+
+// Advertiser address, the MAC of formats without one.
+static const uint8_t ruuvi_vector_address[6] = {0xc2, 0x48, 0xc3,
+                                                0x40, 0xe6, 0xd0};
+
+struct ruuvi_vector {
+  const char *name;
+  const char *hex;
+  uint8_t mac[6];
+  uint32_t valid;
+  int32_t values[RUUVI_FIELD_MAX];
+};
+
+#define FIELD(name) (1ul << RUUVI_FIELD_##name)
+#define FORMAT_3_FIELDS                                                       \
+  (FIELD(TEMPERATURE) | FIELD(HUMIDITY) | FIELD(PRESSURE) |                   \
+   FIELD(ACCELERATION_X) | FIELD(ACCELERATION_Y) | FIELD(ACCELERATION_Z) |    \
+   FIELD(BATTERY_VOLTAGE))
+#define FORMAT_5_FIELDS                                                       \
+  (FORMAT_3_FIELDS | FIELD(TX_POWER) | FIELD(MOVEMENT_COUNTER) |              \
+   FIELD(SEQUENCE_NUMBER))
+#define FORMAT_E1_FIELDS                                                      \
+  (FIELD(TEMPERATURE) | FIELD(HUMIDITY) | FIELD(PRESSURE) | FIELD(PM1_0) |    \
+   FIELD(PM2_5) | FIELD(PM4_0) | FIELD(PM10_0) | FIELD(CO2) |                 \
+   FIELD(VOC_INDEX) | FIELD(NOX_INDEX) | FIELD(LUMINOSITY) |                  \
+   FIELD(SEQUENCE_NUMBER))
+#define MAC_CB_B8 {0xcb, 0xb8, 0x33, 0x4c, 0x88, 0x4f}
+
+static const struct ruuvi_vector ruuvi_vectors[] = {
+    {
+        "format 3 valid",
+        "03291A1ECE1EFC18F94202CA0B53",
+        {0xc2, 0x48, 0xc3, 0x40, 0xe6, 0xd0},
+        FORMAT_3_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = 26300,
+            [RUUVI_FIELD_HUMIDITY] = 205000,
+            [RUUVI_FIELD_PRESSURE] = 102766,
+            [RUUVI_FIELD_ACCELERATION_X] = -1000,
+            [RUUVI_FIELD_ACCELERATION_Y] = -1726,
+            [RUUVI_FIELD_ACCELERATION_Z] = 714,
+            [RUUVI_FIELD_BATTERY_VOLTAGE] = 2899,
+        },
+    },
+    {
+        "format 3 maximum",
+        "03FF7F63FFFF7FFF7FFF7FFFFFFF",
+        {0xc2, 0x48, 0xc3, 0x40, 0xe6, 0xd0},
+        FORMAT_3_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = 127990,
+            [RUUVI_FIELD_HUMIDITY] = 1275000,
+            [RUUVI_FIELD_PRESSURE] = 115535,
+            [RUUVI_FIELD_ACCELERATION_X] = 32767,
+            [RUUVI_FIELD_ACCELERATION_Y] = 32767,
+            [RUUVI_FIELD_ACCELERATION_Z] = 32767,
+            [RUUVI_FIELD_BATTERY_VOLTAGE] = 65535,
+        },
+    },
+    {
+        "format 3 minimum",
+        "03FFFF6300008001800180010000",
+        {0xc2, 0x48, 0xc3, 0x40, 0xe6, 0xd0},
+        FORMAT_3_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = -127990,
+            [RUUVI_FIELD_HUMIDITY] = 1275000,
+            [RUUVI_FIELD_PRESSURE] = 50000,
+            [RUUVI_FIELD_ACCELERATION_X] = -32767,
+            [RUUVI_FIELD_ACCELERATION_Y] = -32767,
+            [RUUVI_FIELD_ACCELERATION_Z] = -32767,
+            [RUUVI_FIELD_BATTERY_VOLTAGE] = 0,
+        },
+    },
+    {
+        "format 5 valid",
+        "0512FC5394C37C0004FFFC040CAC364200CDCBB8334C884F",
+        MAC_CB_B8,
+        FORMAT_5_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = 24300,
+            [RUUVI_FIELD_HUMIDITY] = 534900,
+            [RUUVI_FIELD_PRESSURE] = 100044,
+            [RUUVI_FIELD_ACCELERATION_X] = 4,
+            [RUUVI_FIELD_ACCELERATION_Y] = -4,
+            [RUUVI_FIELD_ACCELERATION_Z] = 1036,
+            [RUUVI_FIELD_BATTERY_VOLTAGE] = 2977,
+            [RUUVI_FIELD_TX_POWER] = 4,
+            [RUUVI_FIELD_MOVEMENT_COUNTER] = 66,
+            [RUUVI_FIELD_SEQUENCE_NUMBER] = 205,
+        },
+    },
+    {
+        "format 5 maximum",
+        "057FFFFFFEFFFE7FFF7FFF7FFFFFDEFEFFFECBB8334C884F",
+        MAC_CB_B8,
+        FORMAT_5_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = 163835,
+            [RUUVI_FIELD_HUMIDITY] = 1638350,
+            [RUUVI_FIELD_PRESSURE] = 115534,
+            [RUUVI_FIELD_ACCELERATION_X] = 32767,
+            [RUUVI_FIELD_ACCELERATION_Y] = 32767,
+            [RUUVI_FIELD_ACCELERATION_Z] = 32767,
+            [RUUVI_FIELD_BATTERY_VOLTAGE] = 3646,
+            [RUUVI_FIELD_TX_POWER] = 20,
+            [RUUVI_FIELD_MOVEMENT_COUNTER] = 254,
+            [RUUVI_FIELD_SEQUENCE_NUMBER] = 65534,
+        },
+    },
+    {
+        "format 5 minimum",
+        "058001000000008001800180010000000000CBB8334C884F",
+        MAC_CB_B8,
+        FORMAT_5_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = -163835,
+            [RUUVI_FIELD_HUMIDITY] = 0,
+            [RUUVI_FIELD_PRESSURE] = 50000,
+            [RUUVI_FIELD_ACCELERATION_X] = -32767,
+            [RUUVI_FIELD_ACCELERATION_Y] = -32767,
+            [RUUVI_FIELD_ACCELERATION_Z] = -32767,
+            [RUUVI_FIELD_BATTERY_VOLTAGE] = 1600,
+            [RUUVI_FIELD_TX_POWER] = -40,
+            [RUUVI_FIELD_MOVEMENT_COUNTER] = 0,
+            [RUUVI_FIELD_SEQUENCE_NUMBER] = 0,
+        },
+    },
+    {
+        // Every field holds its "invalid" value.
+        "format 5 invalid",
+        "058000FFFFFFFF800080008000FFFFFFFFFFFFFFFFFFFFFF",
+        {0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+        0,
+        {0},
+    },
+    {
+        "format E1 valid",
+        "E1170C5668C79E0065007004BD11CA00C90A0213E0AC000000DECDEE10000000"
+        "0000CBB8334C884F",
+        MAC_CB_B8,
+        FORMAT_E1_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = 29500,
+            [RUUVI_FIELD_HUMIDITY] = 553000,
+            [RUUVI_FIELD_PRESSURE] = 101102,
+            [RUUVI_FIELD_PM1_0] = 101,
+            [RUUVI_FIELD_PM2_5] = 112,
+            [RUUVI_FIELD_PM4_0] = 1213,
+            [RUUVI_FIELD_PM10_0] = 4554,
+            [RUUVI_FIELD_CO2] = 201,
+            [RUUVI_FIELD_VOC_INDEX] = 20,
+            [RUUVI_FIELD_NOX_INDEX] = 4,
+            [RUUVI_FIELD_LUMINOSITY] = 1302700,
+            [RUUVI_FIELD_SEQUENCE_NUMBER] = 14601710,
+        },
+    },
+    {
+        "format E1 maximum",
+        "E17FFF9C40FFFE27102710271027109C40FAFADC28F0000000FFFFFE3F000000"
+        "0000CBB8334C884F",
+        MAC_CB_B8,
+        FORMAT_E1_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = 163835,
+            [RUUVI_FIELD_HUMIDITY] = 1000000,
+            [RUUVI_FIELD_PRESSURE] = 115534,
+            [RUUVI_FIELD_PM1_0] = 10000,
+            [RUUVI_FIELD_PM2_5] = 10000,
+            [RUUVI_FIELD_PM4_0] = 10000,
+            [RUUVI_FIELD_PM10_0] = 10000,
+            [RUUVI_FIELD_CO2] = 40000,
+            [RUUVI_FIELD_VOC_INDEX] = 500,
+            [RUUVI_FIELD_NOX_INDEX] = 500,
+            [RUUVI_FIELD_LUMINOSITY] = 14428400,
+            [RUUVI_FIELD_SEQUENCE_NUMBER] = 16777214,
+        },
+    },
+    {
+        "format E1 minimum",
+        "E180010000000000000000000000000000000000000000000000000000000000"
+        "0000CBB8334C884F",
+        MAC_CB_B8,
+        FORMAT_E1_FIELDS,
+        {
+            [RUUVI_FIELD_TEMPERATURE] = -163835,
+            [RUUVI_FIELD_PRESSURE] = 50000,
+        },
+    },
+    {
+        // Every field holds its "invalid" value.
+        "format E1 invalid",
+        "E18000FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF"
+        "FFFFFFFFFFFFFFFF",
+        {0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+        0,
+        {0},
+    },
+};
+
+#define RUUVI_VECTOR_COUNT (sizeof(ruuvi_vectors) / sizeof(ruuvi_vectors[0]))
+
+// Parses the hex string of a vector, returning its length.
+static inline size_t ruuvi_vector_bytes(const struct ruuvi_vector *vector,
+                                        uint8_t *data, size_t size) {
+  size_t length = 0;
+  for (const char *p = vector->hex; p[0] != '\0' && p[1] != '\0' &&
+                                    length < size;
+       p += 2) {
+    unsigned int byte;
+    sscanf(p, "%2x", &byte);
+    data[length++] = byte;
+  }
+  return length;
+}
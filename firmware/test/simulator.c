@@ -0,0 +1,1188 @@
+#include "fakes.h"
+#include <cJSON.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <esp_now.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sdkconfig.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs a fleet of light nodes in one process, against a broker such as a
+// local mosquitto, to load-test fleet behaviour and main.py without boards.
+//
+//     mosquitto -p 1883 &
+//     ./simulator --nodes 100 --write-config sim.toml
+//     python main.py --broker localhost --no-tls on --group 1 --config sim.toml
+//
+// Each node runs the firmware itself: main.c, config.c, light.c,
+// local_control.c and chunked_ota.c, built on the fakes of fakes.c and
+// simulator_fakes.c into a shared library which is loaded once per node. The
+// Ruuvi gateway is left out, as the nodes have no BLE radio. Nodes keep their
+// NVS and OTA slots across restarts, so that config, peers and firmware
+// updates from main.py behave as on the device.
+//
+// The simulator plays the part of the WiFi and MQTT stacks: every node has
+// its own connection to the broker, with the node's last will, and
+// reconnects as esp-mqtt does. ESP-NOW packets go through a simulated medium
+// with configurable loss and latency.
+//
+// Nodes run in real time: whenever the simulator calls into a node, its fake
+// clock first catches up with the time since it booted, running the timers
+// which fell due.
+
+#define RECONNECT_US (10 * 1000 * 1000)
+#define KEEPALIVE_S 120
+// esp-mqtt's buffer, in which messages are received.
+#define FRAGMENT_SIZE 1024
+// A state change reported by members of a group within this window of the
+// first one is counted as a switch of the group.
+#define SWITCH_WINDOW_US (2 * 1000 * 1000)
+#define GROUPS_MAX 256
+
+enum {
+  MQTT_CONNECT = 0x10,
+  MQTT_CONNACK = 0x20,
+  MQTT_PUBLISH = 0x30,
+  MQTT_PUBACK = 0x40,
+  MQTT_PUBREC = 0x50,
+  MQTT_PUBREL = 0x62,
+  MQTT_PUBCOMP = 0x70,
+  MQTT_SUBSCRIBE = 0x82,
+  MQTT_UNSUBSCRIBE = 0xa2,
+  MQTT_PINGREQ = 0xc0,
+};
+
+struct options {
+  const char *broker;
+  const char *port;
+  const char *username;
+  const char *password;
+  size_t nodes;
+  int groups;
+  double loss;
+  double latency_ms;
+  double jitter_ms;
+  double stagger_ms;
+  double boot_time_s;
+  double duration_s;
+  const char *write_config;
+};
+
+static struct options options = {
+    .broker = "localhost",
+    .port = "1883",
+    .nodes = 100,
+    .groups = 4,
+    .latency_ms = 5,
+    .jitter_ms = 2,
+    .boot_time_s = 3,
+};
+
+struct buffer {
+  uint8_t *data;
+  size_t length;
+  size_t capacity;
+};
+
+// Entry points of a node's copy of the firmware.
+struct node_api {
+  void (*app_main)();
+  struct fake_world *world;
+  int64_t (*clock)();
+  void (*timers_run)(int64_t duration_us);
+  int64_t (*timers_next)();
+  size_t (*events_dispatch)();
+  void (*wifi_connect)();
+  void (*mqtt_connect)();
+  void (*mqtt_disconnect)();
+  void (*mqtt_deliver_data)(const char *topic, const char *data,
+                            size_t length, size_t fragment_size);
+  void (*mqtt_published)(int msg_id);
+  void (*espnow_receive)(const uint8_t src[6], const uint8_t *data,
+                         int data_len);
+};
+
+struct node_stats {
+  uint32_t boots;
+  uint32_t connects;
+  uint32_t disconnects;
+  uint32_t published;
+  uint32_t received;
+};
+
+struct node {
+  uint8_t mac[6];
+  char base[64];
+  char path[PATH_MAX];
+  struct fake_flash flash;
+  bool provisioned;
+
+  void *library;
+  struct node_api api;
+  bool up;
+  bool restarting;
+  int64_t boot_at;
+  // Real time at which the node's fake clock was 0.
+  int64_t epoch;
+
+  bool mqtt_started;
+  char *will_topic;
+  char *will_msg;
+  int will_qos;
+  int will_retain;
+  int fd;
+  bool connecting;
+  bool connected;
+  int64_t connect_at;
+  int64_t ping_at;
+  uint16_t last_msg_id;
+  struct buffer in;
+  struct buffer out;
+
+  // Group and last published state of each light channel, as seen on the
+  // broker.
+  int groups[CONFIG_LIGHT_CHANNELS];
+  int states[CONFIG_LIGHT_CHANNELS];
+
+  struct node_stats stats;
+};
+
+struct delivery {
+  int64_t at;
+  uint64_t sequence;
+  size_t to;
+  uint8_t src[6];
+  uint8_t data[250];
+  size_t length;
+};
+
+struct medium_stats {
+  uint32_t sent;
+  uint32_t lost;
+  uint32_t unreachable;
+  uint32_t delivered;
+};
+
+static struct node *nodes;
+static struct addrinfo *broker;
+static volatile sig_atomic_t stopping;
+
+// Packets in flight, as a heap ordered by delivery time.
+static struct delivery *deliveries;
+static size_t deliveries_length;
+static size_t deliveries_capacity;
+static uint64_t deliveries_sequence;
+static struct medium_stats medium_stats;
+
+static struct {
+  int value;
+  int64_t at;
+} switches[GROUPS_MAX];
+static int64_t *latencies;
+static size_t latencies_length;
+static size_t latencies_capacity;
+
+static void fail(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void node_run(struct node *node);
+
+static void fail(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "simulator: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  exit(1);
+}
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void *grow(void *data, size_t *capacity, size_t needed,
+                  size_t element_size) {
+  if (needed <= *capacity) {
+    return data;
+  }
+  size_t capacity_new = *capacity > 0 ? *capacity : 16;
+  while (capacity_new < needed) {
+    capacity_new *= 2;
+  }
+  data = realloc(data, capacity_new * element_size);
+  if (data == NULL) {
+    fail("out of memory");
+  }
+  *capacity = capacity_new;
+  return data;
+}
+
+static void buffer_append(struct buffer *buffer, const void *data,
+                          size_t length) {
+  buffer->data =
+      grow(buffer->data, &buffer->capacity, buffer->length + length, 1);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+static void buffer_consume(struct buffer *buffer, size_t length) {
+  memmove(buffer->data, buffer->data + length, buffer->length - length);
+  buffer->length -= length;
+}
+
+static size_t node_index(const struct node *node) { return node - nodes; }
+
+// Nodes are numbered by their MAC address.
+static void node_mac(uint8_t mac[6], size_t index) {
+  mac[0] = 0x02;
+  mac[1] = 0;
+  mac[2] = 0;
+  mac[3] = index >> 16;
+  mac[4] = index >> 8;
+  mac[5] = index;
+}
+
+static bool node_of_mac(const uint8_t mac[6], size_t *index) {
+  if (mac[0] != 0x02 || mac[1] != 0 || mac[2] != 0) {
+    return false;
+  }
+  *index = mac[3] << 16 | mac[4] << 8 | mac[5];
+  return *index < options.nodes;
+}
+
+static void format_mac(char out[18], const uint8_t mac[6]) {
+  snprintf(out, 18, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2],
+           mac[3], mac[4], mac[5]);
+}
+
+// Group of each light channel the fleet is configured with.
+static int provisioned_group(size_t index, size_t channel) {
+  return options.groups > 0 ? (index + channel) % options.groups + 1 : 0;
+}
+
+static bool shares_group(size_t a, size_t b) {
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    for (size_t j = 0; j < CONFIG_LIGHT_CHANNELS; j++) {
+      if (provisioned_group(a, i) == provisioned_group(b, j)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Config key of the group of a light channel, as in light.c.
+static void group_key(char out[32], size_t channel) {
+  if (channel == 0) {
+    snprintf(out, 32, "group");
+  } else {
+    snprintf(out, 32, "group%zu", channel);
+  }
+}
+
+// MQTT packets, written to the node's output buffer.
+
+static void put_u8(struct node *node, uint8_t value) {
+  buffer_append(&node->out, &value, 1);
+}
+
+static void put_u16(struct node *node, uint16_t value) {
+  uint8_t bytes[] = {value >> 8, value};
+  buffer_append(&node->out, bytes, sizeof(bytes));
+}
+
+static void put_string(struct node *node, const char *data, size_t length) {
+  put_u16(node, length);
+  buffer_append(&node->out, data, length);
+}
+
+static void put_header(struct node *node, uint8_t type, size_t length) {
+  put_u8(node, type);
+  do {
+    uint8_t byte = length % 128;
+    length /= 128;
+    put_u8(node, length > 0 ? byte | 0x80 : byte);
+  } while (length > 0);
+}
+
+static void put_ack(struct node *node, uint8_t type, uint16_t msg_id) {
+  put_header(node, type, 2);
+  put_u16(node, msg_id);
+}
+
+static uint16_t next_msg_id(struct node *node) {
+  node->last_msg_id = node->last_msg_id % UINT16_MAX + 1;
+  return node->last_msg_id;
+}
+
+static void mqtt_flush(struct node *node) {
+  if (node->connecting || node->out.length == 0) {
+    return;
+  }
+  ssize_t sent =
+      send(node->fd, node->out.data, node->out.length, MSG_NOSIGNAL);
+  if (sent > 0) {
+    buffer_consume(&node->out, sent);
+  }
+}
+
+static void mqtt_close(struct node *node) {
+  close(node->fd);
+  node->fd = -1;
+  node->connecting = false;
+  node->connected = false;
+  node->in.length = 0;
+  node->out.length = 0;
+}
+
+// The connection failed or was lost: the client tells the firmware, and
+// tries again later.
+static void mqtt_drop(struct node *node) {
+  bool connected = node->connected;
+  mqtt_close(node);
+  node->connect_at = now_us() + RECONNECT_US;
+  if (connected) {
+    node->stats.disconnects += 1;
+    node_run(node);
+    node->api.mqtt_disconnect();
+    node_run(node);
+  }
+}
+
+static void mqtt_connect(struct node *node) {
+  node->fd = socket(broker->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (node->fd < 0) {
+    fail("socket: %s", strerror(errno));
+  }
+  int one = 1;
+  setsockopt(node->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(node->fd, broker->ai_addr, broker->ai_addrlen) < 0 &&
+      errno != EINPROGRESS) {
+    mqtt_drop(node);
+    return;
+  }
+  node->connecting = true;
+
+  // Client ID and clean session as esp-mqtt sets them by default.
+  char client_id[16];
+  snprintf(client_id, sizeof(client_id), "ESP32_%02x%02X%02X", node->mac[3],
+           node->mac[4], node->mac[5]);
+  uint8_t flags = 0x02;
+  size_t length = 10 + 2 + strlen(client_id);
+  if (node->will_topic != NULL) {
+    flags |= 0x04 | node->will_qos << 3 | node->will_retain << 5;
+    length += 2 + strlen(node->will_topic) + 2 + strlen(node->will_msg);
+  }
+  if (options.username != NULL) {
+    flags |= 0x80;
+    length += 2 + strlen(options.username);
+  }
+  if (options.password != NULL) {
+    flags |= 0x40;
+    length += 2 + strlen(options.password);
+  }
+
+  put_header(node, MQTT_CONNECT, length);
+  put_string(node, "MQTT", 4);
+  put_u8(node, 4);
+  put_u8(node, flags);
+  put_u16(node, KEEPALIVE_S);
+  put_string(node, client_id, strlen(client_id));
+  if (node->will_topic != NULL) {
+    put_string(node, node->will_topic, strlen(node->will_topic));
+    put_string(node, node->will_msg, strlen(node->will_msg));
+  }
+  if (options.username != NULL) {
+    put_string(node, options.username, strlen(options.username));
+  }
+  if (options.password != NULL) {
+    put_string(node, options.password, strlen(options.password));
+  }
+}
+
+// What nodes publish, as main.py sees it.
+
+static void observe_state(struct node *node, size_t channel, int value) {
+  int previous = node->states[channel];
+  node->states[channel] = value;
+  int group = node->groups[channel];
+  if (previous < 0 || previous == value || group <= 0 || group >= GROUPS_MAX) {
+    return;
+  }
+
+  int64_t now = now_us();
+  if (switches[group].value != value ||
+      now - switches[group].at > SWITCH_WINDOW_US) {
+    switches[group].value = value;
+    switches[group].at = now;
+    return;
+  }
+  latencies = grow(latencies, &latencies_capacity, latencies_length + 1,
+                   sizeof(*latencies));
+  latencies[latencies_length++] = now - switches[group].at;
+}
+
+static void observe_config(struct node *node, const char *data,
+                           size_t length) {
+  cJSON *config = cJSON_ParseWithLength(data, length);
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    char key[32];
+    group_key(key, i);
+    cJSON *group = cJSON_GetObjectItemCaseSensitive(config, key);
+    node->groups[i] = cJSON_IsNumber(group) ? group->valueint : 0;
+  }
+  cJSON_Delete(config);
+}
+
+static void observe(struct node *node, const char *topic, const char *data,
+                    size_t length) {
+  size_t base_length = strlen(node->base);
+  if (strncmp(topic, node->base, base_length) != 0 ||
+      topic[base_length] != '/') {
+    return;
+  }
+  topic += base_length + 1;
+
+  size_t channel = 0;
+  char *end;
+  unsigned long number = strtoul(topic, &end, 10);
+  if (end != topic && *end == '/') {
+    channel = number;
+    topic = end + 1;
+  }
+  if (strcmp(topic, "state") == 0 && channel < CONFIG_LIGHT_CHANNELS) {
+    if (length == 2 && memcmp(data, "ON", 2) == 0) {
+      observe_state(node, channel, 1);
+    } else if (length == 3 && memcmp(data, "OFF", 3) == 0) {
+      observe_state(node, channel, 0);
+    }
+  } else if (strcmp(topic, "config") == 0 && end == topic) {
+    observe_config(node, data, length);
+  }
+}
+
+// Hooks of the nodes' fakes. They only queue work, and never call back into
+// the node.
+
+static void on_mqtt_start(void *arg, const char *will_topic,
+                          const char *will_msg, int will_qos,
+                          int will_retain) {
+  struct node *node = arg;
+  node->mqtt_started = true;
+  node->will_topic = will_topic != NULL ? strdup(will_topic) : NULL;
+  node->will_msg = will_msg != NULL ? strdup(will_msg) : strdup("");
+  node->will_qos = will_qos;
+  node->will_retain = will_retain;
+  node->connect_at = now_us();
+}
+
+static int on_mqtt_publish(void *arg, const char *topic, const char *data,
+                           size_t length, int qos, int retain) {
+  struct node *node = arg;
+  if (!node->connected) {
+    return -1;
+  }
+  observe(node, topic, data, length);
+  int msg_id = qos > 0 ? next_msg_id(node) : 0;
+  size_t topic_length = strlen(topic);
+  put_header(node, MQTT_PUBLISH | qos << 1 | (retain ? 1 : 0),
+             2 + topic_length + (qos > 0 ? 2 : 0) + length);
+  put_string(node, topic, topic_length);
+  if (qos > 0) {
+    put_u16(node, msg_id);
+  }
+  buffer_append(&node->out, data, length);
+  mqtt_flush(node);
+  node->stats.published += 1;
+  return msg_id;
+}
+
+static int on_mqtt_subscribe(void *arg, const char *topic, int qos) {
+  struct node *node = arg;
+  if (!node->connected) {
+    return -1;
+  }
+  int msg_id = next_msg_id(node);
+  size_t topic_length = strlen(topic);
+  put_header(node, MQTT_SUBSCRIBE, 2 + 2 + topic_length + 1);
+  put_u16(node, msg_id);
+  put_string(node, topic, topic_length);
+  put_u8(node, qos);
+  mqtt_flush(node);
+  return msg_id;
+}
+
+static int on_mqtt_unsubscribe(void *arg, const char *topic) {
+  struct node *node = arg;
+  if (!node->connected) {
+    return -1;
+  }
+  int msg_id = next_msg_id(node);
+  size_t topic_length = strlen(topic);
+  put_header(node, MQTT_UNSUBSCRIBE, 2 + 2 + topic_length);
+  put_u16(node, msg_id);
+  put_string(node, topic, topic_length);
+  mqtt_flush(node);
+  return msg_id;
+}
+
+static double gauss() {
+  double u = 1 - drand48();
+  double v = drand48();
+  return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static void deliveries_swap(size_t a, size_t b) {
+  struct delivery delivery = deliveries[a];
+  deliveries[a] = deliveries[b];
+  deliveries[b] = delivery;
+}
+
+static bool deliveries_before(size_t a, size_t b) {
+  return deliveries[a].at < deliveries[b].at ||
+         (deliveries[a].at == deliveries[b].at &&
+          deliveries[a].sequence < deliveries[b].sequence);
+}
+
+static void deliveries_push(const struct delivery *delivery) {
+  deliveries = grow(deliveries, &deliveries_capacity, deliveries_length + 1,
+                    sizeof(*deliveries));
+  size_t i = deliveries_length++;
+  deliveries[i] = *delivery;
+  while (i > 0 && deliveries_before(i, (i - 1) / 2)) {
+    deliveries_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static struct delivery deliveries_pop() {
+  struct delivery first = deliveries[0];
+  deliveries[0] = deliveries[--deliveries_length];
+  size_t i = 0;
+  for (;;) {
+    size_t smallest = i;
+    for (size_t child = 2 * i + 1; child <= 2 * i + 2; child++) {
+      if (child < deliveries_length && deliveries_before(child, smallest)) {
+        smallest = child;
+      }
+    }
+    if (smallest == i) {
+      break;
+    }
+    deliveries_swap(i, smallest);
+    i = smallest;
+  }
+  return first;
+}
+
+static void on_espnow_send(void *arg, const uint8_t dest[6],
+                           const uint8_t *data, size_t length) {
+  struct node *node = arg;
+  medium_stats.sent += 1;
+  struct delivery delivery = {.length = length};
+  if (!node_of_mac(dest, &delivery.to) || length > sizeof(delivery.data)) {
+    medium_stats.unreachable += 1;
+    return;
+  }
+  if (drand48() < options.loss) {
+    medium_stats.lost += 1;
+    return;
+  }
+  double latency_ms = options.latency_ms + options.jitter_ms * gauss();
+  delivery.at = now_us() + (latency_ms > 0 ? latency_ms * 1000 : 0);
+  delivery.sequence = deliveries_sequence++;
+  memcpy(delivery.src, node->mac, 6);
+  memcpy(delivery.data, data, length);
+  deliveries_push(&delivery);
+}
+
+static void on_restart(void *arg) {
+  struct node *node = arg;
+  node->restarting = true;
+}
+
+// Node life cycle.
+
+static void *resolve(struct node *node, const char *name) {
+  void *symbol = dlsym(node->library, name);
+  if (symbol == NULL) {
+    fail("%s: %s", node->path, dlerror());
+  }
+  return symbol;
+}
+
+static void node_load(struct node *node) {
+  node->library = dlopen(node->path, RTLD_NOW | RTLD_LOCAL);
+  if (node->library == NULL) {
+    fail("%s", dlerror());
+  }
+  struct node_api *api = &node->api;
+  api->app_main = resolve(node, "app_main");
+  api->world = resolve(node, "fake_world");
+  api->clock = resolve(node, "esp_timer_get_time");
+  api->timers_run = resolve(node, "fake_timers_run");
+  api->timers_next = resolve(node, "fake_timers_next");
+  api->events_dispatch = resolve(node, "fake_events_dispatch");
+  api->wifi_connect = resolve(node, "fake_wifi_connect");
+  api->mqtt_connect = resolve(node, "fake_mqtt_connect");
+  api->mqtt_disconnect = resolve(node, "fake_mqtt_disconnect");
+  api->mqtt_deliver_data = resolve(node, "fake_mqtt_deliver_data");
+  api->mqtt_published = resolve(node, "fake_mqtt_published");
+  api->espnow_receive = resolve(node, "fake_espnow_receive");
+
+  *api->world = (struct fake_world){
+      .arg = node,
+      .flash = &node->flash,
+      .mqtt_start = on_mqtt_start,
+      .mqtt_publish = on_mqtt_publish,
+      .mqtt_subscribe = on_mqtt_subscribe,
+      .mqtt_unsubscribe = on_mqtt_unsubscribe,
+      .espnow_send = on_espnow_send,
+      .restart = on_restart,
+  };
+  memcpy(api->world->mac, node->mac, 6);
+}
+
+// The firmware's memory is left behind, as the node's copy of the C library
+// is the simulator's own.
+static void node_unload(struct node *node) {
+  dlclose(node->library);
+  node->library = NULL;
+  free(node->will_topic);
+  free(node->will_msg);
+  node->will_topic = NULL;
+  node->will_msg = NULL;
+  node->mqtt_started = false;
+}
+
+// Config and peers of a fleet set up with main.py, delivered as the node
+// would receive them on its first connection.
+static void node_provision(struct node *node) {
+  size_t index = node_index(node);
+  cJSON *config = cJSON_CreateObject();
+  for (size_t i = 0; i < CONFIG_LIGHT_CHANNELS; i++) {
+    int group = provisioned_group(index, i);
+    if (group > 0) {
+      char key[32];
+      group_key(key, i);
+      cJSON_AddNumberToObject(config, key, group);
+    }
+  }
+  // The closest nodes sharing a group, within the ESP-NOW peer limit.
+  cJSON *peers = cJSON_CreateArray();
+  for (size_t i = 1; i < options.nodes; i++) {
+    size_t peer = (index + i) % options.nodes;
+    if (cJSON_GetArraySize(peers) == ESP_NOW_MAX_TOTAL_PEER_NUM) {
+      break;
+    }
+    if (options.groups > 0 && shares_group(index, peer)) {
+      uint8_t mac[6];
+      char mac_str[18];
+      node_mac(mac, peer);
+      format_mac(mac_str, mac);
+      cJSON_AddItemToArray(peers, cJSON_CreateString(mac_str));
+    }
+  }
+
+  char topic[96];
+  char *data = cJSON_PrintUnformatted(config);
+  snprintf(topic, sizeof(topic), "%s/config/set", node->base);
+  node->api.mqtt_deliver_data(topic, data, strlen(data), 0);
+  node_run(node);
+  free(data);
+  data = cJSON_PrintUnformatted(peers);
+  snprintf(topic, sizeof(topic), "%s/peers/set", node->base);
+  node->api.mqtt_deliver_data(topic, data, strlen(data), 0);
+  node_run(node);
+  free(data);
+  cJSON_Delete(config);
+  cJSON_Delete(peers);
+}
+
+static void node_boot(struct node *node) {
+  node_load(node);
+  node->up = true;
+  node->stats.boots += 1;
+  node->epoch = now_us() - node->api.clock();
+  node->api.app_main();
+  node_run(node);
+  if (!node->provisioned) {
+    node->provisioned = true;
+    node_provision(node);
+  }
+  node->api.wifi_connect();
+  node_run(node);
+}
+
+// Restarts the node: its connection drops without a word, so that the broker
+// publishes its last will, and it boots again after a while.
+static void node_restart(struct node *node) {
+  if (node->fd >= 0) {
+    mqtt_close(node);
+  }
+  node_unload(node);
+  node->up = false;
+  node->restarting = false;
+  node->boot_at = now_us() + options.boot_time_s * 1e6;
+}
+
+// Catches the node's clock up with real time, and runs what is pending.
+static void node_run(struct node *node) {
+  if (!node->up) {
+    return;
+  }
+  int64_t elapsed = now_us() - node->epoch - node->api.clock();
+  do {
+    node->api.timers_run(elapsed > 0 ? elapsed : 0);
+    elapsed = 0;
+  } while (node->api.events_dispatch() > 0 && !node->restarting);
+  if (node->restarting) {
+    node_restart(node);
+  }
+}
+
+// MQTT packets from the broker.
+
+static void mqtt_handle(struct node *node, uint8_t type, const uint8_t *data,
+                        size_t length) {
+  uint16_t msg_id = length >= 2 ? data[0] << 8 | data[1] : 0;
+  switch (type & 0xf0) {
+  case MQTT_CONNACK:
+    if (length < 2 || data[1] != 0) {
+      fprintf(stderr, "simulator: connection refused: %d\n",
+              length >= 2 ? data[1] : -1);
+      mqtt_drop(node);
+      return;
+    }
+    node->connected = true;
+    node->stats.connects += 1;
+    node->ping_at = now_us() + KEEPALIVE_S * 1000000LL / 2;
+    node_run(node);
+    node->api.mqtt_connect();
+    node_run(node);
+    break;
+  case MQTT_PUBLISH: {
+    int qos = type >> 1 & 3;
+    size_t topic_length = msg_id;
+    size_t header = 2 + topic_length + (qos > 0 ? 2 : 0);
+    if (length < header) {
+      mqtt_drop(node);
+      return;
+    }
+    char *topic = strndup((const char *)data + 2, topic_length);
+    if (qos > 0) {
+      uint16_t id = data[2 + topic_length] << 8 | data[3 + topic_length];
+      put_ack(node, qos == 1 ? MQTT_PUBACK : MQTT_PUBREC, id);
+      mqtt_flush(node);
+    }
+    node->stats.received += 1;
+    node_run(node);
+    if (node->up) {
+      node->api.mqtt_deliver_data(topic, (const char *)data + header,
+                                  length - header, FRAGMENT_SIZE);
+      node_run(node);
+    }
+    free(topic);
+    break;
+  }
+  case MQTT_PUBACK & 0xf0:
+  case MQTT_PUBCOMP & 0xf0:
+    node_run(node);
+    if (node->up) {
+      node->api.mqtt_published(msg_id);
+      node_run(node);
+    }
+    break;
+  case MQTT_PUBREC & 0xf0:
+    put_ack(node, MQTT_PUBREL, msg_id);
+    mqtt_flush(node);
+    break;
+  case MQTT_PUBREL & 0xf0:
+    put_ack(node, MQTT_PUBCOMP, msg_id);
+    mqtt_flush(node);
+    break;
+  default:
+    // Subscription acknowledgements and ping responses.
+    break;
+  }
+}
+
+static void mqtt_receive(struct node *node) {
+  uint8_t chunk[4096];
+  ssize_t received = recv(node->fd, chunk, sizeof(chunk), 0);
+  if (received == 0 || (received < 0 && errno != EAGAIN)) {
+    mqtt_drop(node);
+    return;
+  }
+  if (received < 0) {
+    return;
+  }
+  buffer_append(&node->in, chunk, received);
+
+  int fd = node->fd;
+  while (node->fd == fd && node->in.length >= 2) {
+    size_t length = 0;
+    size_t i = 1;
+    for (size_t shift = 0;; shift += 7, i++) {
+      if (i >= node->in.length) {
+        return;
+      }
+      length |= (size_t)(node->in.data[i] & 0x7f) << shift;
+      if ((node->in.data[i] & 0x80) == 0) {
+        break;
+      }
+    }
+    i++;
+    if (node->in.length < i + length) {
+      return;
+    }
+    // The packet is copied out, as handling it may restart the node.
+    uint8_t *packet = malloc(i + length);
+    memcpy(packet, node->in.data, i + length);
+    buffer_consume(&node->in, i + length);
+    mqtt_handle(node, packet[0], packet + i, length);
+    free(packet);
+  }
+}
+
+static void mqtt_writable(struct node *node) {
+  if (node->connecting) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    getsockopt(node->fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+    if (error != 0) {
+      mqtt_drop(node);
+      return;
+    }
+    node->connecting = false;
+  }
+  mqtt_flush(node);
+}
+
+// Fleet.
+
+static void write_config(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fail("%s: %s", path, strerror(errno));
+  }
+  fprintf(f, "[defaults]\n");
+  for (size_t i = 0; i < options.nodes; i++) {
+    char mac[18];
+    format_mac(mac, nodes[i].mac);
+    fprintf(f, "\n[devices.\"%s\"]\n", mac);
+    for (size_t j = 0; j < CONFIG_LIGHT_CHANNELS; j++) {
+      if (provisioned_group(i, j) > 0) {
+        char key[32];
+        group_key(key, j);
+        fprintf(f, "%s = %d\n", key, provisioned_group(i, j));
+      }
+    }
+  }
+  fclose(f);
+}
+
+// Writes a copy of the node library per node, so that each gets its own
+// statics.
+static void copy_library(const char *directory) {
+  FILE *f = fopen(SIMULATOR_NODE_LIBRARY, "rb");
+  if (f == NULL) {
+    fail("%s: %s", SIMULATOR_NODE_LIBRARY, strerror(errno));
+  }
+  struct buffer image = {0};
+  uint8_t chunk[65536];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    buffer_append(&image, chunk, length);
+  }
+  fclose(f);
+
+  for (size_t i = 0; i < options.nodes; i++) {
+    snprintf(nodes[i].path, sizeof(nodes[i].path), "%s/node-%zu.so",
+             directory, i);
+    f = fopen(nodes[i].path, "wb");
+    if (f == NULL || fwrite(image.data, 1, image.length, f) != image.length) {
+      fail("%s: %s", nodes[i].path, strerror(errno));
+    }
+    fclose(f);
+  }
+  free(image.data);
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(double elapsed_s) {
+  struct node_stats totals = {0};
+  for (size_t i = 0; i < options.nodes; i++) {
+    totals.boots += nodes[i].stats.boots;
+    totals.connects += nodes[i].stats.connects;
+    totals.disconnects += nodes[i].stats.disconnects;
+    totals.published += nodes[i].stats.published;
+    totals.received += nodes[i].stats.received;
+  }
+
+  printf("%zu nodes, %.1fs\n", options.nodes, elapsed_s);
+  printf("  boots: %" PRIu32 "\n", totals.boots);
+  printf("  connects: %" PRIu32 "\n", totals.connects);
+  printf("  disconnects: %" PRIu32 "\n", totals.disconnects);
+  printf("  published: %" PRIu32 "\n", totals.published);
+  printf("  received: %" PRIu32 "\n", totals.received);
+  printf("  espnow: sent %" PRIu32 ", lost %" PRIu32 ", unreachable %" PRIu32
+         ", delivered %" PRIu32 "\n",
+         medium_stats.sent, medium_stats.lost, medium_stats.unreachable,
+         medium_stats.delivered);
+  if (latencies_length > 0) {
+    qsort(latencies, latencies_length, sizeof(*latencies), compare_latencies);
+    printf("  group switch latency: median %.1fms, p99 %.1fms, max %.1fms "
+           "(%zu samples)\n",
+           latencies[latencies_length / 2] / 1000.0,
+           latencies[latencies_length * 99 / 100] / 1000.0,
+           latencies[latencies_length - 1] / 1000.0, latencies_length);
+  }
+}
+
+static void on_signal(int signal) { stopping = 1; }
+
+static void usage() {
+  fprintf(
+      stderr,
+      "usage: simulator [options]\n"
+      "  --broker HOST        broker to connect to (localhost)\n"
+      "  --port PORT          (1883)\n"
+      "  --username USER\n"
+      "  --password PASSWORD\n"
+      "  --nodes N            number of nodes (100)\n"
+      "  --groups N           groups the channels are spread over, 0 for "
+      "none (4)\n"
+      "  --loss RATIO         ESP-NOW packet loss ratio (0)\n"
+      "  --latency MS         ESP-NOW latency (5)\n"
+      "  --jitter MS          ESP-NOW latency deviation (2)\n"
+      "  --stagger MS         delay between node start-ups, 0 for a reconnect "
+      "storm (0)\n"
+      "  --boot-time S        time a node takes to restart (3)\n"
+      "  --duration S         stop after this long\n"
+      "  --write-config PATH  write a config.toml for the fleet, for main.py\n");
+  exit(2);
+}
+
+static void parse_options(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"broker", required_argument, NULL, 'b'},
+      {"port", required_argument, NULL, 'p'},
+      {"username", required_argument, NULL, 'u'},
+      {"password", required_argument, NULL, 'P'},
+      {"nodes", required_argument, NULL, 'n'},
+      {"groups", required_argument, NULL, 'g'},
+      {"loss", required_argument, NULL, 'l'},
+      {"latency", required_argument, NULL, 'L'},
+      {"jitter", required_argument, NULL, 'j'},
+      {"stagger", required_argument, NULL, 's'},
+      {"boot-time", required_argument, NULL, 't'},
+      {"duration", required_argument, NULL, 'd'},
+      {"write-config", required_argument, NULL, 'w'},
+      {NULL, 0, NULL, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (option) {
+    case 'b':
+      options.broker = optarg;
+      break;
+    case 'p':
+      options.port = optarg;
+      break;
+    case 'u':
+      options.username = optarg;
+      break;
+    case 'P':
+      options.password = optarg;
+      break;
+    case 'n':
+      options.nodes = strtoul(optarg, NULL, 0);
+      break;
+    case 'g':
+      options.groups = atoi(optarg);
+      break;
+    case 'l':
+      options.loss = atof(optarg);
+      break;
+    case 'L':
+      options.latency_ms = atof(optarg);
+      break;
+    case 'j':
+      options.jitter_ms = atof(optarg);
+      break;
+    case 's':
+      options.stagger_ms = atof(optarg);
+      break;
+    case 't':
+      options.boot_time_s = atof(optarg);
+      break;
+    case 'd':
+      options.duration_s = atof(optarg);
+      break;
+    case 'w':
+      options.write_config = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind < argc || options.nodes == 0 || options.nodes > 1 << 24 ||
+      options.groups < 0 || options.groups >= GROUPS_MAX) {
+    usage();
+  }
+}
+
+int main(int argc, char **argv) {
+  parse_options(argc, argv);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  const struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+  int error = getaddrinfo(options.broker, options.port, &hints, &broker);
+  if (error != 0) {
+    fail("%s: %s", options.broker, gai_strerror(error));
+  }
+
+  nodes = calloc(options.nodes, sizeof(*nodes));
+  int64_t start = now_us();
+  for (size_t i = 0; i < options.nodes; i++) {
+    struct node *node = &nodes[i];
+    node_mac(node->mac, i);
+    snprintf(node->base, sizeof(node->base),
+             CONFIG_MQTT_TOPIC_PREFIX "/%02x:%02x:%02x:%02x:%02x:%02x",
+             node->mac[0], node->mac[1], node->mac[2], node->mac[3],
+             node->mac[4], node->mac[5]);
+    node->fd = -1;
+    node->boot_at = start + i * options.stagger_ms * 1000;
+    for (size_t j = 0; j < CONFIG_LIGHT_CHANNELS; j++) {
+      node->states[j] = -1;
+    }
+  }
+  if (options.write_config != NULL) {
+    write_config(options.write_config);
+  }
+
+  char directory[] = "/tmp/simulator.XXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fail("mkdtemp: %s", strerror(errno));
+  }
+  copy_library(directory);
+
+  struct pollfd *fds = calloc(options.nodes, sizeof(*fds));
+  size_t *fd_nodes = calloc(options.nodes, sizeof(*fd_nodes));
+  int64_t end =
+      options.duration_s > 0 ? start + options.duration_s * 1e6 : INT64_MAX;
+  while (!stopping && now_us() < end) {
+    int64_t now = now_us();
+    int64_t next = now + 1000 * 1000;
+    if (end < next) {
+      next = end;
+    }
+
+    for (size_t i = 0; i < options.nodes; i++) {
+      struct node *node = &nodes[i];
+      if (!node->up) {
+        if (node->boot_at > now) {
+          next = node->boot_at < next ? node->boot_at : next;
+          continue;
+        }
+        node_boot(node);
+      }
+      if (node->up && node->mqtt_started && node->fd < 0) {
+        if (node->connect_at <= now) {
+          mqtt_connect(node);
+        } else {
+          next = node->connect_at < next ? node->connect_at : next;
+        }
+      }
+      if (node->connected && node->ping_at <= now) {
+        put_header(node, MQTT_PINGREQ, 0);
+        mqtt_flush(node);
+        node->ping_at = now + KEEPALIVE_S * 1000000LL / 2;
+      }
+      if (node->up &&
+          node->epoch + node->api.timers_next() <= now_us()) {
+        node_run(node);
+      }
+      if (node->up) {
+        int64_t timer = node->epoch + node->api.timers_next();
+        next = timer < next ? timer : next;
+      }
+    }
+
+    while (deliveries_length > 0 && deliveries[0].at <= now_us()) {
+      struct delivery delivery = deliveries_pop();
+      struct node *node = &nodes[delivery.to];
+      if (!node->up) {
+        medium_stats.unreachable += 1;
+        continue;
+      }
+      medium_stats.delivered += 1;
+      node_run(node);
+      if (node->up) {
+        node->api.espnow_receive(delivery.src, delivery.data,
+                                 delivery.length);
+        node_run(node);
+      }
+    }
+    if (deliveries_length > 0 && deliveries[0].at < next) {
+      next = deliveries[0].at;
+    }
+
+    size_t fds_length = 0;
+    for (size_t i = 0; i < options.nodes; i++) {
+      if (nodes[i].fd >= 0) {
+        fds[fds_length].fd = nodes[i].fd;
+        fds[fds_length].events = POLLIN;
+        if (nodes[i].connecting || nodes[i].out.length > 0) {
+          fds[fds_length].events |= POLLOUT;
+        }
+        fd_nodes[fds_length++] = i;
+      }
+    }
+    int64_t timeout = next - now_us();
+    poll(fds, fds_length, timeout > 0 ? (timeout + 999) / 1000 : 0);
+
+    for (size_t i = 0; i < fds_length; i++) {
+      struct node *node = &nodes[fd_nodes[i]];
+      if (node->fd != fds[i].fd || fds[i].revents == 0) {
+        continue;
+      }
+      if (fds[i].revents & POLLOUT) {
+        mqtt_writable(node);
+      }
+      if (node->fd == fds[i].fd &&
+          fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        mqtt_receive(node);
+      }
+    }
+  }
+
+  report((now_us() - start) / 1e6);
+  for (size_t i = 0; i < options.nodes; i++) {
+    unlink(nodes[i].path);
+  }
+  rmdir(directory);
+  return 0;
+}
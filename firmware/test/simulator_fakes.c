@@ -0,0 +1,312 @@
+#include "deferred_log.h"
+#include "event_loops.h"
+#include "fakes.h"
+#include "heap_accounting.h"
+#include "indicator.h"
+#include "power.h"
+#include "schedule.h"
+#include "task_stats.h"
+#include <esp_image_format.h>
+#include <esp_ota_ops.h>
+#include <esp_rom_crc.h>
+#include <esp_wifi.h>
+#include <mqtt_ota.h>
+#include <nvs_flash.h>
+#include <rom/miniz.h>
+#include <string.h>
+
+// Fakes of the rest of what main.c and chunked_ota.c use, for the
+// simulator's nodes. Updates are written to the OTA slots of the fake flash,
+// and the node reports the version of the image it booted. The image the
+// node was flashed with has no contents: it has no digest, and cannot be the
+// base of a delta.
+
+ESP_EVENT_DEFINE_BASE(IP_EVENT);
+ESP_EVENT_DEFINE_BASE(MQTT_OTA_EVENT);
+
+const uint8_t isrgrootx1_pem_start[] asm("_binary_isrgrootx1_pem_start") = "";
+
+void esp_restart() {
+  if (fake_world.restart != NULL) {
+    fake_world.restart(fake_world.arg);
+  }
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) { return 0; }
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) { return 0; }
+
+esp_err_t nvs_flash_init() { return ESP_OK; }
+
+// Events
+
+esp_err_t esp_event_loop_create_default() { return ESP_OK; }
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id,
+                         const void *event_data, size_t event_data_size,
+                         TickType_t ticks_to_wait) {
+  // None of the events posted to the default loop carry data.
+  fake_default_event(event_base, event_id);
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(
+    esp_event_base_t event_base, int32_t event_id,
+    esp_event_handler_t event_handler, void *event_handler_arg,
+    esp_event_handler_instance_t *instance) {
+  return esp_event_handler_register(event_base, event_id, event_handler,
+                                    event_handler_arg);
+}
+
+// WiFi, which the simulator reports as connected once the node is up.
+
+esp_err_t esp_netif_init() { return ESP_OK; }
+
+esp_netif_t *esp_netif_create_default_wifi_sta() { return NULL; }
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) { return ESP_OK; }
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) { return ESP_OK; }
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface,
+                              wifi_config_t *conf) {
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) { return ESP_OK; }
+
+esp_err_t esp_wifi_start() { return ESP_OK; }
+
+esp_err_t esp_wifi_connect() { return ESP_OK; }
+
+esp_err_t esp_wifi_sta_get_rssi(int *rssi) { return ESP_FAIL; }
+
+// OTA, into the slots of the fake flash.
+
+static const esp_partition_t partitions[FAKE_OTA_SLOTS] = {
+    {.address = 0x10000, .size = 1536 * 1024, .label = "ota_0"},
+    {.address = 0x190000, .size = 1536 * 1024, .label = "ota_1"},
+};
+
+static struct fake_flash *flash() { return fake_world.flash; }
+
+static size_t slot_of(const esp_partition_t *partition) {
+  return partition - partitions;
+}
+
+// Slot the node booted from, which stays the running one until the next
+// restart whatever gets installed meanwhile.
+static size_t running_slot() {
+  static bool booted;
+  static size_t slot;
+  if (!booted) {
+    booted = true;
+    slot = flash()->updated ? flash()->boot_slot : 0;
+  }
+  return slot;
+}
+
+static void slot_erase(size_t slot) {
+  free(flash()->slots[slot].data);
+  flash()->slots[slot].data = NULL;
+  flash()->slots[slot].size = 0;
+}
+
+const esp_partition_t *esp_ota_get_running_partition() {
+  return &partitions[running_slot()];
+}
+
+const esp_partition_t *
+esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+  return &partitions[(running_slot() + 1) % FAKE_OTA_SLOTS];
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size,
+                        esp_ota_handle_t *out_handle) {
+  if (slot_of(partition) == running_slot()) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  slot_erase(slot_of(partition));
+  *out_handle = slot_of(partition) + 1;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data,
+                        size_t size) {
+  size_t slot = handle - 1;
+  size_t length = flash()->slots[slot].size;
+  if (size > partitions[slot].size - length) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  uint8_t *image = realloc(flash()->slots[slot].data, length + size);
+  if (image == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  memcpy(image + length, data, size);
+  flash()->slots[slot].data = image;
+  flash()->slots[slot].size = length + size;
+  return ESP_OK;
+}
+
+// Checks the image header and the app description, which is all that the
+// simulator reads of an image.
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+  size_t slot = handle - 1;
+  const uint8_t *image = flash()->slots[slot].data;
+  esp_app_desc_t app;
+  if (flash()->slots[slot].size < 32 + sizeof(app) || image[0] != 0xe9) {
+    slot_erase(slot);
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  memcpy(&app, image + 32, sizeof(app));
+  if (app.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+    slot_erase(slot);
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+  slot_erase(handle - 1);
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+  if (flash()->slots[slot_of(partition)].size == 0) {
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  flash()->updated = true;
+  flash()->boot_slot = slot_of(partition);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+                             size_t src_offset, void *dst, size_t size) {
+  size_t slot = slot_of(partition);
+  if (src_offset > flash()->slots[slot].size ||
+      size > flash()->slots[slot].size - src_offset) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(dst, flash()->slots[slot].data + src_offset, size);
+  return ESP_OK;
+}
+
+// The digest esptool appends to the image, as for app partitions on the
+// device.
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition,
+                                   uint8_t *sha_256) {
+  size_t slot = slot_of(partition);
+  if (flash()->slots[slot].size < 32) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  memcpy(sha_256,
+         flash()->slots[slot].data + flash()->slots[slot].size - 32, 32);
+  return ESP_OK;
+}
+
+esp_err_t esp_image_get_metadata(const esp_partition_pos_t *part,
+                                 esp_image_metadata_t *metadata) {
+  size_t slot = running_slot();
+  if (part->offset != partitions[slot].address ||
+      flash()->slots[slot].size == 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  metadata->start_addr = part->offset;
+  metadata->image_len = flash()->slots[slot].size;
+  return ESP_OK;
+}
+
+const esp_app_desc_t *esp_app_get_description() {
+  static esp_app_desc_t app;
+  if (app.magic_word == 0) {
+    const uint8_t *image = flash()->slots[running_slot()].data;
+    if (image != NULL) {
+      memcpy(&app, image + 32, sizeof(app));
+    } else {
+      app.magic_word = ESP_APP_DESC_MAGIC_WORD;
+      snprintf(app.version, sizeof(app.version), "%s", PROJECT_VER);
+      snprintf(app.project_name, sizeof(app.project_name), "light-control");
+      snprintf(app.time, sizeof(app.time), "%s", __TIME__);
+      snprintf(app.date, sizeof(app.date), "%s", __DATE__);
+    }
+  }
+  return &app;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  return crc32(crc, buf, len);
+}
+
+// tinfl, on top of zlib. zlib keeps its own window, so the circular output
+// buffer is only written to. A decoder abandoned mid-stream leaks its zlib
+// state.
+
+void tinfl_init(tinfl_decompressor *r) { r->started = false; }
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r,
+                              const uint8_t *in_buf_next, size_t *in_buf_size,
+                              uint8_t *out_buf_start, uint8_t *out_buf_next,
+                              size_t *out_buf_size, uint32_t decomp_flags) {
+  if (!r->started) {
+    memset(&r->stream, 0, sizeof(r->stream));
+    if (inflateInit(&r->stream) != Z_OK) {
+      return TINFL_STATUS_FAILED;
+    }
+    r->started = true;
+  }
+
+  r->stream.next_in = (Bytef *)in_buf_next;
+  r->stream.avail_in = *in_buf_size;
+  r->stream.next_out = out_buf_next;
+  r->stream.avail_out = *out_buf_size;
+  int ret = inflate(&r->stream, Z_NO_FLUSH);
+  *in_buf_size -= r->stream.avail_in;
+  *out_buf_size -= r->stream.avail_out;
+
+  if (ret == Z_STREAM_END || (ret != Z_OK && ret != Z_BUF_ERROR)) {
+    inflateEnd(&r->stream);
+    r->started = false;
+    return ret == Z_STREAM_END ? TINFL_STATUS_DONE : TINFL_STATUS_FAILED;
+  }
+  return r->stream.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT
+                                  : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+// Firmware modules that are not simulated.
+
+void event_loops_init() {}
+
+void event_loops_add_metrics(cJSON *root) {}
+
+void task_stats_init() {}
+
+void task_stats_add_metrics(cJSON *root) {}
+
+void power_init() {}
+
+void power_add_metrics(cJSON *root) {}
+
+void dlog_init(esp_mqtt_client_handle_t client, const char *prefix) {}
+
+void dlog_add_metrics(cJSON *root) {}
+
+void heap_accounting_init(esp_mqtt_client_handle_t client,
+                          const char *prefix) {}
+
+void indicator_init(esp_mqtt_client_handle_t mqtt_handle) {}
+
+void schedule_init() {}
+
+void schedule_add_metrics(cJSON *root) {}
+
+// Nodes run on the host's clock.
+bool schedule_time_synced() { return true; }
+
+void mqtt_ota_init(esp_mqtt_client_handle_t client, const char *topic) {}
+
+// Reports the node connected to the access point, as the WiFi driver does
+// some time after esp_wifi_connect().
+void fake_wifi_connect() {
+  fake_default_event(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED);
+  fake_default_event(IP_EVENT, IP_EVENT_STA_GOT_IP);
+}
@@ -0,0 +1,45 @@
+#pragma once
+// Fake of the GPIO driver, for host builds. Input levels are set by tests
+// through fake_gpio_set_input().
+#include <esp_err.h>
+#include <stdint.h>
+
+typedef int gpio_num_t;
+
+typedef enum {
+  GPIO_MODE_INPUT = 1,
+  GPIO_MODE_OUTPUT = 2,
+} gpio_mode_t;
+
+typedef enum {
+  GPIO_PULLUP_DISABLE,
+  GPIO_PULLUP_ENABLE,
+} gpio_pullup_t;
+
+typedef enum {
+  GPIO_PULLDOWN_DISABLE,
+  GPIO_PULLDOWN_ENABLE,
+} gpio_pulldown_t;
+
+typedef enum {
+  GPIO_PULLUP_ONLY,
+  GPIO_PULLDOWN_ONLY,
+  GPIO_FLOATING,
+} gpio_pull_mode_t;
+
+typedef enum {
+  GPIO_INTR_DISABLE,
+  GPIO_INTR_ANYEDGE = 3,
+} gpio_int_type_t;
+
+typedef struct {
+  uint64_t pin_bit_mask;
+  gpio_mode_t mode;
+  gpio_pullup_t pull_up_en;
+  gpio_pulldown_t pull_down_en;
+  gpio_int_type_t intr_type;
+} gpio_config_t;
+
+esp_err_t gpio_config(const gpio_config_t *config);
+int gpio_get_level(gpio_num_t gpio_num);
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level);
@@ -0,0 +1,71 @@
+#pragma once
+// Fake of the LEDC driver, for host builds. The duty of every channel is
+// recorded, and read by tests through fake_ledc_duty().
+#include <driver/gpio.h>
+#include <esp_err.h>
+#include <stdint.h>
+
+typedef enum {
+  LEDC_LOW_SPEED_MODE,
+} ledc_mode_t;
+
+typedef enum {
+  LEDC_CHANNEL_0,
+  LEDC_CHANNEL_1,
+  LEDC_CHANNEL_2,
+  LEDC_CHANNEL_3,
+  LEDC_CHANNEL_4,
+  LEDC_CHANNEL_5,
+  LEDC_CHANNEL_MAX,
+} ledc_channel_t;
+
+typedef enum {
+  LEDC_TIMER_0,
+  LEDC_TIMER_1,
+} ledc_timer_t;
+
+typedef enum {
+  LEDC_INTR_DISABLE,
+} ledc_intr_type_t;
+
+typedef enum {
+  LEDC_AUTO_CLK,
+} ledc_clk_cfg_t;
+
+typedef enum {
+  LEDC_FADE_NO_WAIT,
+  LEDC_FADE_WAIT_DONE,
+} ledc_fade_mode_t;
+
+typedef struct {
+  ledc_mode_t speed_mode;
+  uint32_t duty_resolution;
+  ledc_timer_t timer_num;
+  uint32_t freq_hz;
+  ledc_clk_cfg_t clk_cfg;
+} ledc_timer_config_t;
+
+typedef struct {
+  int gpio_num;
+  ledc_mode_t speed_mode;
+  ledc_channel_t channel;
+  ledc_intr_type_t intr_type;
+  ledc_timer_t timer_sel;
+  uint32_t duty;
+  int hpoint;
+  struct {
+    unsigned int output_invert : 1;
+  } flags;
+} ledc_channel_config_t;
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf);
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf);
+esp_err_t ledc_fade_func_install(int intr_alloc_flags);
+esp_err_t ledc_set_fade_with_time(ledc_mode_t speed_mode,
+                                  ledc_channel_t channel, uint32_t target_duty,
+                                  int max_fade_time_ms);
+esp_err_t ledc_fade_start(ledc_mode_t speed_mode, ledc_channel_t channel,
+                          ledc_fade_mode_t fade_mode);
+esp_err_t ledc_set_duty_and_update(ledc_mode_t speed_mode,
+                                   ledc_channel_t channel, uint32_t duty,
+                                   uint32_t hpoint);
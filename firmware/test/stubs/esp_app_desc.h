@@ -0,0 +1,19 @@
+#pragma once
+// Fake of esp_app_desc.h, for host builds.
+#include <stdint.h>
+
+// Same layout as the app description in the image, see image_version() in
+// main.py.
+typedef struct {
+  uint32_t magic_word;
+  uint32_t secure_version;
+  uint32_t reserv1[2];
+  char version[32];
+  char project_name[32];
+  char time[16];
+  char date[16];
+} esp_app_desc_t;
+
+#define ESP_APP_DESC_MAGIC_WORD 0xABCD5432
+
+const esp_app_desc_t *esp_app_get_description();
@@ -0,0 +1,4 @@
+#pragma once
+// Fake of esp_attr.h, for host builds.
+
+#define IRAM_ATTR
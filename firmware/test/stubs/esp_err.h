@@ -0,0 +1,30 @@
+#pragma once
+// Fake of esp_err.h, for host builds. Like the ESP-IDF headers, it brings
+// in the C library headers which firmware modules use without including.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERR_NVS_INVALID_LENGTH 0x110c
+
+const char *esp_err_to_name(esp_err_t code);
+
+#define ESP_ERROR_CHECK(x)                                                    \
+  do {                                                                        \
+    esp_err_t err_ = (x);                                                     \
+    if (err_ != ESP_OK) {                                                     \
+      fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #x,      \
+              esp_err_to_name(err_));                                         \
+      abort();                                                                \
+    }                                                                         \
+  } while (0)
@@ -0,0 +1,37 @@
+#pragma once
+// Fake of esp_event.h, for host builds. Events are queued, and dispatched
+// by fake_events_dispatch().
+#include "freertos/FreeRTOS.h"
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef const char *esp_event_base_t;
+typedef struct fake_event_loop *esp_event_loop_handle_t;
+typedef void (*esp_event_handler_t)(void *arg, esp_event_base_t event_base,
+                                    int32_t event_id, void *event_data);
+
+#define ESP_EVENT_ANY_ID -1
+#define ESP_EVENT_DECLARE_BASE(id) extern esp_event_base_t const id
+#define ESP_EVENT_DEFINE_BASE(id) esp_event_base_t const id = #id
+
+typedef void *esp_event_handler_instance_t;
+
+esp_err_t esp_event_loop_create_default();
+// Runs the handlers of the default loop right away.
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id,
+                         const void *event_data, size_t event_data_size,
+                         TickType_t ticks_to_wait);
+esp_err_t esp_event_handler_instance_register(
+    esp_event_base_t event_base, int32_t event_id,
+    esp_event_handler_t event_handler, void *event_handler_arg,
+    esp_event_handler_instance_t *instance);
+esp_err_t esp_event_handler_register(esp_event_base_t event_base,
+                                     int32_t event_id,
+                                     esp_event_handler_t event_handler,
+                                     void *event_handler_arg);
+esp_err_t esp_event_handler_register_with(esp_event_loop_handle_t event_loop,
+                                          esp_event_base_t event_base,
+                                          int32_t event_id,
+                                          esp_event_handler_t event_handler,
+                                          void *event_handler_arg);
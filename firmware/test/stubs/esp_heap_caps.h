@@ -0,0 +1,9 @@
+#pragma once
+// Fake of esp_heap_caps.h, for host builds.
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
@@ -0,0 +1,38 @@
+#pragma once
+// Fake of esp_log.h, for host builds. Logging costs time on the device, as
+// messages are formatted and written out to the console, so every message
+// logged advances the fake clock.
+#include "sdkconfig.h"
+#include <inttypes.h>
+
+typedef enum {
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL CONFIG_LOG_MAXIMUM_LEVEL
+#endif
+
+void fake_log(esp_log_level_t level, const char *tag, const char *format,
+              ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOG_LEVEL_LOCAL(level, tag, format, ...)                          \
+  do {                                                                        \
+    if (LOG_LOCAL_LEVEL >= level) {                                           \
+      fake_log(level, tag, format, ##__VA_ARGS__);                            \
+    }                                                                         \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...)                                            \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)                                            \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                                            \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)                                            \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
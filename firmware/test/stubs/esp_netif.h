@@ -0,0 +1,15 @@
+#pragma once
+// Fake of esp_netif.h, for host builds.
+#include <esp_err.h>
+#include <esp_event.h>
+
+ESP_EVENT_DECLARE_BASE(IP_EVENT);
+
+enum {
+  IP_EVENT_STA_GOT_IP,
+};
+
+typedef struct esp_netif_obj esp_netif_t;
+
+esp_err_t esp_netif_init();
+esp_netif_t *esp_netif_create_default_wifi_sta();
@@ -0,0 +1,34 @@
+#pragma once
+// Fake of esp_now.h, for host builds. Sent packets are recorded, and
+// received ones are injected through fake_espnow_receive().
+#include <esp_err.h>
+#include <esp_wifi.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_MAX_TOTAL_PEER_NUM 20
+
+#define ESP_ERR_ESPNOW_FULL 0x3068
+#define ESP_ERR_ESPNOW_EXIST 0x306b
+
+typedef struct {
+  uint8_t *src_addr;
+  uint8_t *des_addr;
+} esp_now_recv_info_t;
+
+typedef struct esp_now_peer_info {
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+} esp_now_peer_info_t;
+
+typedef void (*esp_now_recv_cb_t)(const esp_now_recv_info_t *info,
+                                  const uint8_t *data, int data_len);
+
+esp_err_t esp_now_init();
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data,
+                       size_t len);
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer);
@@ -0,0 +1,16 @@
+#pragma once
+// Fake of esp_partition.h, for host builds.
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+                             size_t src_offset, void *dst, size_t size);
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition,
+                                   uint8_t *sha_256);
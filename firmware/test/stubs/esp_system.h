@@ -0,0 +1,6 @@
+#pragma once
+// Fake of esp_system.h, for host builds.
+
+// Returns on the host: the simulator restarts the node once the caller is
+// done.
+void esp_restart();
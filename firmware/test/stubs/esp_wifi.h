@@ -0,0 +1,56 @@
+#pragma once
+// Fake of esp_wifi.h, for host builds.
+#include <esp_event.h>
+#include <esp_netif.h>
+#include <stdint.h>
+
+ESP_EVENT_DECLARE_BASE(WIFI_EVENT);
+
+typedef enum {
+  WIFI_IF_STA,
+} wifi_interface_t;
+
+typedef enum {
+  WIFI_MODE_STA = 1,
+} wifi_mode_t;
+
+typedef enum {
+  WIFI_PS_NONE,
+  WIFI_PS_MIN_MODEM,
+  WIFI_PS_MAX_MODEM,
+} wifi_ps_type_t;
+
+typedef enum {
+  WIFI_AUTH_WPA2_PSK = 3,
+} wifi_auth_mode_t;
+
+enum {
+  WIFI_EVENT_STA_START = 2,
+  WIFI_EVENT_STA_CONNECTED = 4,
+  WIFI_EVENT_STA_DISCONNECTED = 5,
+};
+
+typedef struct {
+  int unused;
+} wifi_init_config_t;
+
+#define WIFI_INIT_CONFIG_DEFAULT() {0}
+
+typedef union {
+  struct {
+    uint8_t ssid[32];
+    uint8_t password[64];
+    struct {
+      wifi_auth_mode_t authmode;
+    } threshold;
+  } sta;
+} wifi_config_t;
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_set_config(wifi_interface_t interface,
+                              wifi_config_t *conf);
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type);
+esp_err_t esp_wifi_start();
+esp_err_t esp_wifi_connect();
+esp_err_t esp_wifi_sta_get_rssi(int *rssi);
@@ -0,0 +1,23 @@
+#pragma once
+// Fake of FreeRTOS, for host builds. Tests are single-threaded, so locks do
+// nothing. Like the ESP-IDF headers, it brings in the system and heap APIs.
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+typedef struct {
+  int locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portMUX_INITIALIZE(mux) ((mux)->locked = 0)
+#define portENTER_CRITICAL(mux) ((mux)->locked += 1)
+#define portEXIT_CRITICAL(mux) ((mux)->locked -= 1)
@@ -0,0 +1,9 @@
+#pragma once
+// Fake of FreeRTOS semaphores, for host builds.
+#include "freertos/FreeRTOS.h"
+
+typedef struct fake_semaphore *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
@@ -0,0 +1,3 @@
+#pragma once
+// Fake of FreeRTOS tasks, for host builds.
+#include "freertos/FreeRTOS.h"
@@ -0,0 +1,4 @@
+#pragma once
+// Fake of the led_indicator component, for host builds. Only its LEDC
+// dependency is used.
+#include <driver/ledc.h>
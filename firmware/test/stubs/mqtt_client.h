@@ -0,0 +1,84 @@
+#pragma once
+// Fake of the ESP-IDF MQTT client, for host builds. Messages are delivered
+// to the registered handlers by fake_mqtt_deliver(), and publishes are
+// recorded, or sent to the broker by the simulator.
+#include <esp_event.h>
+#include <stdbool.h>
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum {
+  MQTT_EVENT_ANY = -1,
+  MQTT_EVENT_ERROR = 0,
+  MQTT_EVENT_CONNECTED,
+  MQTT_EVENT_DISCONNECTED,
+  MQTT_EVENT_SUBSCRIBED,
+  MQTT_EVENT_UNSUBSCRIBED,
+  MQTT_EVENT_PUBLISHED,
+  MQTT_EVENT_DATA,
+  MQTT_EVENT_BEFORE_CONNECT = 8,
+  MQTT_EVENT_DELETED,
+} esp_mqtt_event_id_t;
+
+typedef enum {
+  MQTT_TRANSPORT_UNKNOWN,
+  MQTT_TRANSPORT_OVER_TCP,
+  MQTT_TRANSPORT_OVER_SSL,
+} esp_mqtt_transport_t;
+
+typedef struct {
+  struct {
+    struct {
+      const char *hostname;
+      uint32_t port;
+      esp_mqtt_transport_t transport;
+    } address;
+    struct {
+      const char *certificate;
+    } verification;
+  } broker;
+  struct {
+    const char *username;
+    struct {
+      const char *password;
+    } authentication;
+  } credentials;
+  struct {
+    struct {
+      const char *topic;
+      const char *msg;
+      int qos;
+      int retain;
+    } last_will;
+  } session;
+} esp_mqtt_client_config_t;
+
+typedef struct esp_mqtt_event {
+  esp_mqtt_event_id_t event_id;
+  esp_mqtt_client_handle_t client;
+  char *data;
+  int data_len;
+  int total_data_len;
+  int current_data_offset;
+  char *topic;
+  int topic_len;
+  int msg_id;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+esp_mqtt_client_handle_t
+esp_mqtt_client_init(const esp_mqtt_client_config_t *config);
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+                                         esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler,
+                                         void *event_handler_arg);
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client,
+                              const char *topic, int qos);
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client,
+                                const char *topic);
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
+                            const char *topic, const char *data, int len,
+                            int qos, int retain, bool store);
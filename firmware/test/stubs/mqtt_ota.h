@@ -0,0 +1,14 @@
+#pragma once
+// Fake of the mqtt_ota component, for host builds. Whole-image updates are
+// not simulated.
+#include <esp_event.h>
+#include <mqtt_client.h>
+
+ESP_EVENT_DECLARE_BASE(MQTT_OTA_EVENT);
+
+enum {
+  MQTT_OTA_EVENT_STARTED,
+  MQTT_OTA_EVENT_FINISHED,
+};
+
+void mqtt_ota_init(esp_mqtt_client_handle_t client, const char *topic);
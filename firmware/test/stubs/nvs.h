@@ -0,0 +1,60 @@
+#pragma once
+// Fake of NVS, for host builds: an in-memory store which counts reads and
+// writes, and charges their cost to the fake clock.
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NVS_KEY_NAME_MAX_SIZE 16
+
+typedef uint32_t nvs_handle_t;
+typedef struct fake_nvs_iterator *nvs_iterator_t;
+
+typedef enum {
+  NVS_READONLY,
+  NVS_READWRITE,
+} nvs_open_mode_t;
+
+typedef enum {
+  NVS_TYPE_U8 = 0x01,
+  NVS_TYPE_I32 = 0x14,
+  NVS_TYPE_I64 = 0x18,
+  NVS_TYPE_STR = 0x21,
+  NVS_TYPE_BLOB = 0x42,
+  NVS_TYPE_ANY = 0xff,
+} nvs_type_t;
+
+typedef struct {
+  char namespace_name[16];
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_type_t type;
+} nvs_entry_info_t;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle);
+esp_err_t nvs_commit(nvs_handle_t handle);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t nvs_find_key(nvs_handle_t handle, const char *key,
+                       nvs_type_t *out_type);
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out);
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *out);
+esp_err_t nvs_get_i64(nvs_handle_t handle, const char *key, int64_t *out);
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out,
+                      size_t *length);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out,
+                       size_t *length);
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value);
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value);
+esp_err_t nvs_set_i64(nvs_handle_t handle, const char *key, int64_t value);
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key,
+                      const char *value);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key,
+                       const void *value, size_t length);
+
+esp_err_t nvs_entry_find_in_handle(nvs_handle_t handle, nvs_type_t type,
+                                   nvs_iterator_t *output_iterator);
+esp_err_t nvs_entry_next(nvs_iterator_t *iterator);
+esp_err_t nvs_entry_info(nvs_iterator_t iterator,
+                         nvs_entry_info_t *out_info);
+void nvs_release_iterator(nvs_iterator_t iterator);
@@ -0,0 +1,5 @@
+#pragma once
+// Fake of nvs_flash.h, for host builds.
+#include <nvs.h>
+
+esp_err_t nvs_flash_init();
@@ -0,0 +1,35 @@
+#pragma once
+// Configuration of the host builds of firmware modules.
+
+// The simulator's nodes have no BLE radio.
+#ifndef FAKE_RUUVI_DISABLE
+#define CONFIG_RUUVI_ENABLE 1
+#endif
+#define CONFIG_LIGHT_CHANNELS 2
+#define CONFIG_HW_GPIO_CONTROL_NUM 4
+#define CONFIG_HW_GPIO_INPUT_NUM 5
+#define CONFIG_HW_GPIO_STATE_NUM 7
+#define CONFIG_HW_GPIO_CONTROL_1_NUM 6
+#define CONFIG_HW_GPIO_INPUT_1_NUM 10
+#define CONFIG_HW_GPIO_STATE_1_NUM 1
+#define CONFIG_POWER_HOLD_MS 1000
+#define CONFIG_BLE_SCAN_BACKOFF_MS 2000
+#define CONFIG_LOCAL_CONTROL_LOG_LEVEL 3
+#define CONFIG_LOG_MAXIMUM_LEVEL 3
+#define CONFIG_MQTT_TOPIC_PREFIX "calan-mai/lights"
+#define CONFIG_MQTT_GROUP_TOPIC_PREFIX "calan-mai/groups"
+#define CONFIG_MQTT_QOS_STATE 2
+#define CONFIG_MQTT_QOS_METRICS 0
+#define CONFIG_MQTT_QOS_CONFIG 2
+// The simulator connects to the broker given on its command line.
+#define CONFIG_MQTT_BROKER ""
+#define CONFIG_MQTT_USERNAME ""
+#define CONFIG_MQTT_PASSWORD ""
+#define CONFIG_WIFI_SSID ""
+#define CONFIG_WIFI_PASSWORD ""
+#define CONFIG_CHUNKED_OTA_CHUNK_SIZE 4096
+#define CONFIG_CHUNKED_OTA_WINDOW_MS 500
+// Built without, to compare with immediate logging.
+#ifndef FAKE_DLOG_DISABLE
+#define CONFIG_DLOG_ENABLE 1
+#endif
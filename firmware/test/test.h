@@ -0,0 +1,37 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+// Checks for host tests. A failed check reports its location and fails the
+// test at exit.
+
+extern int test_failures;
+
+#define CHECK(condition)                                                      \
+  do {                                                                        \
+    if (!(condition)) {                                                       \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,       \
+              #condition);                                                    \
+      test_failures += 1;                                                     \
+    }                                                                         \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                            \
+  do {                                                                        \
+    long long actual_ = (actual);                                             \
+    long long expected_ = (expected);                                         \
+    if (actual_ != expected_) {                                               \
+      fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__,        \
+              __LINE__, #actual, actual_, expected_);                         \
+      test_failures += 1;                                                     \
+    }                                                                         \
+  } while (0)
+
+#define TEST_MAIN_END()                                                       \
+  do {                                                                        \
+    if (test_failures > 0) {                                                  \
+      fprintf(stderr, "%d checks failed\n", test_failures);                   \
+      return EXIT_FAILURE;                                                    \
+    }                                                                         \
+    return EXIT_SUCCESS;                                                      \
+  } while (0)
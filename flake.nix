@@ -16,6 +16,7 @@
       devShells.default = pkgs.mkShell {
         buildInputs = [
           (pkgs.python3.withPackages (ps: with ps; [ ps.aiomqtt ps.toml ]))
+          pkgs.mosquitto
 
           (inputs'.esp-dev.packages.esp-idf-full.override {
             toolsToInclude = [ ];